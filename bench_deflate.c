@@ -0,0 +1,435 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libwebsockets.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures what permessage-deflate buys on a typical obs-websocket event
+// stream, for each of a handful of settings, by echoing the stream through
+// a local lws server with that extension offer:
+//
+//   - Bytes on the wire: what the server wrote to the socket (frames,
+//     headers, and the upgrade response), counted by a TCP relay between
+//     the client and the server.  That is the direction OBS sends in.
+//   - CPU time.  Both ends live in this process, so the CPU figure covers
+//     compressing and inflating each message twice.
+//
+// Usage: bench_deflate [port]   (default 7682; the relay uses port + 1)
+
+#define kDefaultPort 7682
+#define kMessageCount 4000
+#define kMaxMessageLength 8192
+
+typedef struct {
+  const char *name;
+  bool enabled;
+  int windowBits;
+  bool noContextTakeover;
+  int compressionLevel;
+  int memoryLevel;
+} DeflateSetting;
+
+static DeflateSetting gSettings[] = {
+  { "off",                 false, 15, false, 6, 8 },
+  { "default",             true,  15, false, 6, 8 },
+  { "level 1",             true,  15, false, 1, 8 },
+  { "window 10",           true,  10, false, 6, 8 },
+  { "window 10, level 1",  true,  10, false, 1, 4 },
+  { "no context takeover", true,  15, true,  6, 8 },
+};
+
+static const DeflateSetting *gCurrentSetting = NULL;
+static char *gMessages[kMessageCount];
+static size_t gMessageLengths[kMessageCount];
+
+// Echo loop state.
+static int gSent = 0;
+static int gReceived = 0;
+static bool gFailed = false;
+static char *gEchoBuffer = NULL;
+static size_t gEchoLength = 0;
+static size_t gEchoCapacity = 0;
+static bool gEchoReady = false;
+
+
+#pragma mark - Sample traffic
+
+// Roughly what a tally client sees while an operator works a show: lots of
+// small scene and item events, the occasional request response, and some
+// bigger scene item lists.
+static void buildMessages(void) {
+  const char *scenes[] = { "Camera 1", "Camera 2", "Camera 3", "Wide Shot",
+                           "Slides", "Picture in Picture", "Interview", "Break" };
+  char buffer[kMaxMessageLength];
+
+  for (int i = 0; i < kMessageCount; i++) {
+    const char *scene = scenes[i % 8];
+    const char *otherScene = scenes[(i * 5 + 3) % 8];
+    int length = 0;
+
+    switch (i % 10) {
+      case 0: case 1: case 2:
+        length = snprintf(buffer, sizeof(buffer),
+            "{\"d\":{\"eventData\":{\"sceneName\":\"%s\",\"sceneUuid\":\"%08x-4e1a-4c1b-9d2e-%012x\"},"
+            "\"eventIntent\":4,\"eventType\":\"CurrentProgramSceneChanged\"},\"op\":5}",
+            scene, i * 2654435761u, i);
+        break;
+      case 3: case 4: case 5:
+        length = snprintf(buffer, sizeof(buffer),
+            "{\"d\":{\"eventData\":{\"sceneName\":\"%s\",\"sceneUuid\":\"%08x-4e1a-4c1b-9d2e-%012x\"},"
+            "\"eventIntent\":4,\"eventType\":\"CurrentPreviewSceneChanged\"},\"op\":5}",
+            otherScene, i * 40503u, i);
+        break;
+      case 6: case 7:
+        length = snprintf(buffer, sizeof(buffer),
+            "{\"d\":{\"eventData\":{\"sceneItemEnabled\":%s,\"sceneItemId\":%d,\"sceneName\":\"%s\","
+            "\"sceneUuid\":\"%08x-4e1a-4c1b-9d2e-%012x\"},\"eventIntent\":128,"
+            "\"eventType\":\"SceneItemEnableStateChanged\"},\"op\":5}",
+            (i & 1) ? "true" : "false", i % 17, scene, i * 7919u, i);
+        break;
+      case 8:
+        length = snprintf(buffer, sizeof(buffer),
+            "{\"d\":{\"requestId\":\"%d\",\"requestStatus\":{\"code\":100,\"result\":true},"
+            "\"requestType\":\"GetCurrentProgramScene\",\"responseData\":{\"currentProgramSceneName\":\"%s\","
+            "\"sceneName\":\"%s\"}},\"op\":7}",
+            i, scene, scene);
+        break;
+      case 9:
+      {
+        length = snprintf(buffer, sizeof(buffer),
+            "{\"d\":{\"requestId\":\"%d\",\"requestStatus\":{\"code\":100,\"result\":true},"
+            "\"requestType\":\"GetSceneItemList\",\"responseData\":{\"sceneItems\":[", i);
+        for (int item = 0; item < 12; item++) {
+          length += snprintf(buffer + length, sizeof(buffer) - length,
+              "%s{\"inputKind\":\"v4l2_input\",\"isGroup\":null,\"sceneItemBlendMode\":\"OBS_BLEND_NORMAL\","
+              "\"sceneItemEnabled\":%s,\"sceneItemId\":%d,\"sceneItemIndex\":%d,\"sceneItemLocked\":false,"
+              "\"sceneItemTransform\":{\"alignment\":5,\"boundsType\":\"OBS_BOUNDS_NONE\",\"cropBottom\":0,"
+              "\"height\":1080.0,\"positionX\":%d.0,\"positionY\":0.0,\"rotation\":0.0,\"scaleX\":1.0,"
+              "\"scaleY\":1.0,\"width\":1920.0},\"sourceName\":\"%s\",\"sourceType\":\"OBS_SOURCE_TYPE_INPUT\"}",
+              item ? "," : "", ((i + item) & 1) ? "true" : "false", item + 1, item, item * 160,
+              scenes[item % 8]);
+        }
+        length += snprintf(buffer + length, sizeof(buffer) - length, "]}},\"op\":7}");
+        break;
+      }
+    }
+
+    gMessages[i] = strdup(buffer);
+    gMessageLengths[i] = (size_t)length;
+  }
+}
+
+static double cpuMilliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static double wallMilliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+#pragma mark - Bytes on the wire
+
+// Relays one connection between the client and the echo server, counting
+// what each side writes.
+typedef struct {
+  int listener;
+  int serverPort;
+  pthread_t thread;
+  uint64_t serverBytes;   // Server to client.
+  uint64_t clientBytes;   // Client to server.
+} CountingRelay;
+
+static bool writeAll(int descriptor, const uint8_t *data, ssize_t length) {
+  while (length > 0) {
+    ssize_t written = write(descriptor, data, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+static void *runRelay(void *data) {
+  CountingRelay *relay = (CountingRelay *)data;
+  int client = accept(relay->listener, NULL, NULL);
+  if (client < 0) {
+    return NULL;
+  }
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(relay->serverPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  if (server < 0 || connect(server, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Relay could not reach the echo server: %s\n", strerror(errno));
+    close(client);
+    if (server >= 0) {
+      close(server);
+    }
+    return NULL;
+  }
+
+  // Until either side closes.
+  uint8_t buffer[16384];
+  struct pollfd descriptors[2] = { { client, POLLIN, 0 }, { server, POLLIN, 0 } };
+  while (poll(descriptors, 2, -1) >= 0) {
+    bool open = true;
+    for (int i = 0; i < 2 && open; i++) {
+      if (descriptors[i].revents == 0) {
+        continue;
+      }
+      ssize_t length = read(descriptors[i].fd, buffer, sizeof(buffer));
+      int destination = (i == 0) ? server : client;
+      if (length <= 0 || !writeAll(destination, buffer, length)) {
+        open = false;
+      } else if (i == 0) {
+        relay->clientBytes += length;
+      } else {
+        relay->serverBytes += length;
+      }
+    }
+    if (!open) {
+      break;
+    }
+  }
+  close(client);
+  close(server);
+  return NULL;
+}
+
+static bool startRelay(CountingRelay *relay, int port, int serverPort) {
+  memset(relay, 0, sizeof(*relay));
+  relay->serverPort = serverPort;
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int yes = 1;
+  relay->listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (relay->listener < 0 ||
+      setsockopt(relay->listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) != 0 ||
+      bind(relay->listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(relay->listener, 1) != 0) {
+    fprintf(stderr, "Could not start the relay on port %d: %s\n", port, strerror(errno));
+    if (relay->listener >= 0) {
+      close(relay->listener);
+    }
+    return false;
+  }
+  pthread_create(&relay->thread, NULL, runRelay, relay);
+  return true;
+}
+
+// Waits for the connection to close; the counts are final after this.
+// Shutting the listener down ends the wait for a client that never came.
+static void finishRelay(CountingRelay *relay) {
+  shutdown(relay->listener, SHUT_RDWR);
+  pthread_join(relay->thread, NULL);
+  close(relay->listener);
+}
+
+
+#pragma mark - Echo round trip
+
+// Same as applyCompressionLevel() in v8_setup.cpp.
+static void applyCompressionLevel(struct lws *wsi) {
+  char value[8];
+  if (!gCurrentSetting->enabled) {
+    return;
+  }
+  snprintf(value, sizeof(value), "%d", gCurrentSetting->compressionLevel);
+  lws_set_extension_option(wsi, "permessage-deflate", "compression_level", value);
+  snprintf(value, sizeof(value), "%d", gCurrentSetting->memoryLevel);
+  lws_set_extension_option(wsi, "permessage-deflate", "mem_level", value);
+}
+
+static int echoCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                        void *user, void *in, size_t length) {
+  switch (reason) {
+    case LWS_CALLBACK_ESTABLISHED:
+      applyCompressionLevel(wsi);
+      break;
+    case LWS_CALLBACK_RECEIVE:
+      // Server side: collect the whole message, then echo it.
+      if (gEchoLength + length > gEchoCapacity) {
+        gEchoCapacity = (gEchoLength + length) * 2;
+        gEchoBuffer = realloc(gEchoBuffer, LWS_PRE + gEchoCapacity);
+      }
+      memcpy(gEchoBuffer + LWS_PRE + gEchoLength, in, length);
+      gEchoLength += length;
+      if (lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0) {
+        gEchoReady = true;
+        lws_callback_on_writable(wsi);
+      }
+      break;
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+      if (gEchoReady) {
+        gEchoReady = false;
+        lws_write(wsi, (unsigned char *)gEchoBuffer + LWS_PRE, gEchoLength, LWS_WRITE_TEXT);
+        gEchoLength = 0;
+      }
+      break;
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      applyCompressionLevel(wsi);
+      lws_callback_on_writable(wsi);
+      break;
+    case LWS_CALLBACK_CLIENT_WRITEABLE:
+    {
+      if (gSent >= kMessageCount || gSent > gReceived) {
+        break;
+      }
+      static uint8_t buffer[LWS_PRE + kMaxMessageLength];
+      memcpy(buffer + LWS_PRE, gMessages[gSent], gMessageLengths[gSent]);
+      if (lws_write(wsi, buffer + LWS_PRE, gMessageLengths[gSent], LWS_WRITE_TEXT) < 0) {
+        gFailed = true;
+        return -1;
+      }
+      gSent++;
+      break;
+    }
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+      if (lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0) {
+        gReceived++;
+        lws_callback_on_writable(wsi);
+      }
+      break;
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      fprintf(stderr, "Could not connect to the echo server: %s\n",
+              in ? (const char *)in : "unknown error");
+      gFailed = true;
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
+
+static struct lws_protocols gEchoProtocols[] = {
+  { "obs-bench-echo", echoCallback, 0, kMaxMessageLength, 0, NULL, 0 },
+  LWS_PROTOCOL_LIST_TERM
+};
+
+static bool runEcho(const DeflateSetting *setting, int port,
+                    double *wallTime, double *cpuTime, uint64_t *wireBytes) {
+  char offer[256];
+  struct lws_extension extensions[2];
+  bzero(extensions, sizeof(extensions));
+
+  if (setting->enabled) {
+    snprintf(offer, sizeof(offer),
+             "permessage-deflate%s; server_max_window_bits=%d; client_max_window_bits=%d",
+             setting->noContextTakeover ?
+                 "; client_no_context_takeover; server_no_context_takeover" : "",
+             setting->windowBits, setting->windowBits);
+    extensions[0].name = "permessage-deflate";
+    extensions[0].callback = lws_extension_callback_pm_deflate;
+    extensions[0].client_offer = offer;
+  }
+
+  struct lws_context_creation_info info;
+  bzero(&info, sizeof(info));
+  info.port = port;
+  info.iface = "127.0.0.1";
+  info.protocols = gEchoProtocols;
+  info.extensions = setting->enabled ? extensions : NULL;
+  info.uid = -1;
+  info.gid = -1;
+
+  struct lws_context *context = lws_create_context(&info);
+  if (context == NULL) {
+    fprintf(stderr, "Could not create the echo server on port %d.\n", port);
+    return false;
+  }
+
+  CountingRelay relay;
+  if (!startRelay(&relay, port + 1, port)) {
+    lws_context_destroy(context);
+    return false;
+  }
+
+  struct lws_client_connect_info connectInfo;
+  bzero(&connectInfo, sizeof(connectInfo));
+  connectInfo.context = context;
+  connectInfo.address = "127.0.0.1";
+  connectInfo.port = port + 1;
+  connectInfo.path = "/";
+  connectInfo.host = connectInfo.address;
+  connectInfo.origin = connectInfo.address;
+  connectInfo.protocol = gEchoProtocols[0].name;
+  connectInfo.ietf_version_or_minus_one = -1;
+
+  gCurrentSetting = setting;
+  gSent = 0;
+  gReceived = 0;
+  gFailed = false;
+  gEchoLength = 0;
+  gEchoReady = false;
+
+  double wallStart = wallMilliseconds();
+  double cpuStart = cpuMilliseconds();
+
+  lws_client_connect_via_info(&connectInfo);
+  while (!gFailed && gReceived < kMessageCount) {
+    lws_service(context, 100);
+  }
+
+  *wallTime = wallMilliseconds() - wallStart;
+  *cpuTime = cpuMilliseconds() - cpuStart;
+
+  lws_context_destroy(context);
+  finishRelay(&relay);
+  *wireBytes = relay.serverBytes;
+  return !gFailed;
+}
+
+
+int main(int argc, char *argv[]) {
+  int port = (argc > 1) ? atoi(argv[1]) : kDefaultPort;
+
+  lws_set_log_level(LLL_ERR, NULL);
+  buildMessages();
+
+  uint64_t uncompressed = 0;
+  for (int i = 0; i < kMessageCount; i++) {
+    uncompressed += gMessageLengths[i];
+  }
+  printf("%d messages, %llu bytes of JSON\n\n", kMessageCount, (unsigned long long)uncompressed);
+  printf("%-22s %12s %8s %12s %14s\n", "setting", "wire bytes", "ratio", "CPU ms", "round trip us");
+
+  for (size_t i = 0; i < sizeof(gSettings) / sizeof(gSettings[0]); i++) {
+    double wallTime = 0, cpuTime = 0;
+    uint64_t wireBytes = 0;
+    if (!runEcho(&gSettings[i], port, &wallTime, &cpuTime, &wireBytes)) {
+      return 1;
+    }
+    printf("%-22s %12llu %7.1f%% %12.1f %14.1f\n", gSettings[i].name,
+           (unsigned long long)wireBytes, 100.0 * wireBytes / uncompressed,
+           cpuTime, wallTime * 1000.0 / kMessageCount);
+  }
+
+  return 0;
+}
@@ -0,0 +1,497 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gettally.h"
+
+// End-to-end tally latency: from the moment bin/mock_obs writes a scene
+// change to a socket to the moment gProgramCallback (or gPreviewCallback)
+// fires in a client, for each combination of event rate, client count, and
+// callback dispatch mode.
+//
+// Each run starts a fresh mock_obs and clientCount client processes, each
+// running runOBSTally() against it.  Both sides stamp events with
+// CLOCK_MONOTONIC, which is shared between processes.  The mock cycles
+// through its scenes, so each callback is matched to the next change of
+// the same scene; changes with no callback count as lost.
+//
+// Results go to stdout (or -o path) as JSON, one entry per run, so they can
+// be compared across releases.  Progress goes to stderr.
+//
+// Usage: bench_latency [-o path] [-n eventsPerRun] [-r rate,...]
+//                      [-c clients,...] [-d inline,thread] [-k kind]
+//                      [-m mockPath] [-p port]
+//
+//   Rates are changes per second; 0 sends each run's changes all at once.
+//   Dispatch "inline" runs the callbacks on the libwebsockets thread and
+//   "thread" on the callback thread (startOBSCallbackThread).  kind is
+//   program (the default) or preview.
+
+#define kDefaultPort 4460
+#define kDefaultEventsPerRun 1000
+#define kSceneCount 8
+#define kStartDelayMilliseconds 500
+#define kIdleTimeoutMicroseconds 2000000
+#define kMaxListLength 16
+
+typedef struct {
+  int32_t scene;
+  uint64_t time;
+} CallbackRecord;
+
+typedef struct {
+  int scene;
+  uint64_t time;  // 0 if the mock never sent it.
+} SentChange;
+
+
+#pragma mark - Global variables
+
+static int gPort = kDefaultPort;
+static const char *gMockPath = "bin/mock_obs";
+static bool gPreviewKind = false;
+
+// Client state.
+static CallbackRecord *gRecords = NULL;
+static long gRecordCapacity = 0;
+static long gRecordCount = 0;  // Written by the callback, read by the watchdog.
+static long gExpectedRecords = 0;
+static int gResultDescriptor = -1;
+
+
+#pragma mark - Support functions
+
+static uint64_t monotonicMicroseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int parseList(const char *argument, long *values) {
+  int count = 0;
+  const char *p = argument;
+
+  while (*p && count < kMaxListLength) {
+    char *end;
+    values[count++] = strtol(p, &end, 10);
+    if (end == p) {
+      return 0;
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return count;
+}
+
+static bool writeAll(int descriptor, const void *data, size_t length) {
+  const char *p = data;
+  while (length > 0) {
+    ssize_t written = write(descriptor, p, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    length -= written;
+  }
+  return true;
+}
+
+static int compareLatencies(const void *a, const void *b) {
+  uint64_t left = *(const uint64_t *)a;
+  uint64_t right = *(const uint64_t *)b;
+  return (left > right) - (left < right);
+}
+
+// Nearest-rank percentile of a sorted array.
+static uint64_t percentile(const uint64_t *sorted, long count, double fraction) {
+  long rank = (long)(fraction * count + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+  return sorted[MIN(rank, count) - 1];
+}
+
+
+#pragma mark - Client
+
+static void recordCallback(const char *sceneName) {
+  int scene;
+  if (sscanf(sceneName, "Scene %d", &scene) != 1) {
+    return;
+  }
+  long index = __atomic_load_n(&gRecordCount, __ATOMIC_RELAXED);
+  if (index == gRecordCapacity) {
+    return;
+  }
+  gRecords[index].scene = scene - 1;
+  gRecords[index].time = monotonicMicroseconds();
+  __atomic_store_n(&gRecordCount, index + 1, __ATOMIC_RELEASE);
+}
+
+static void programCallback(const char *sceneName) {
+  recordCallback(sceneName);
+}
+
+static void previewCallback(const char *sceneName, bool alsoOnProgram) {
+  recordCallback(sceneName);
+}
+
+// runOBSTally() never returns, so this thread decides when the client is
+// done, sends the parent what it saw, and exits the process.
+static void *watchClient(void *timeoutPointer) {
+  uint64_t deadline = monotonicMicroseconds() + *(uint64_t *)timeoutPointer;
+  uint64_t lastChange = monotonicMicroseconds();
+  long lastCount = 0;
+
+  while (true) {
+    usleep(10000);
+    uint64_t now = monotonicMicroseconds();
+    long count = __atomic_load_n(&gRecordCount, __ATOMIC_ACQUIRE);
+    if (count != lastCount) {
+      lastCount = count;
+      lastChange = now;
+    }
+    // One extra callback for the initial state on connecting.
+    if (count >= gExpectedRecords + 1 || now >= deadline ||
+        (count > 1 && now - lastChange > kIdleTimeoutMicroseconds)) {
+      writeAll(gResultDescriptor, &count, sizeof(count));
+      writeAll(gResultDescriptor, gRecords, count * sizeof(CallbackRecord));
+      close(gResultDescriptor);
+      _exit(0);
+    }
+  }
+  return NULL;
+}
+
+static void runClient(int resultDescriptor, bool callbackThread, long events,
+                      uint64_t timeout) {
+  char url[64];
+  pthread_t watchdog;
+
+  gResultDescriptor = resultDescriptor;
+  gExpectedRecords = events;
+  gRecordCapacity = events * 2 + 16;
+  gRecords = calloc(gRecordCapacity, sizeof(CallbackRecord));
+
+  if (gPreviewKind) {
+    registerOBSPreviewCallback(&previewCallback);
+  } else {
+    registerOBSProgramCallback(&programCallback);
+  }
+  if (callbackThread) {
+    startOBSCallbackThread(0);
+  }
+  pthread_create(&watchdog, NULL, watchClient, &timeout);
+
+  snprintf(url, sizeof(url), "ws://127.0.0.1:%d/", gPort);
+  runOBSTally(url, "");
+  _exit(1);
+}
+
+
+#pragma mark - Mock server
+
+static pid_t startMock(double rate, long events, int clients, const char *sendTimesPath) {
+  char port[16], clientCount[16], sceneCount[16], delay[16], phase[64];
+
+  snprintf(port, sizeof(port), "%d", gPort);
+  snprintf(clientCount, sizeof(clientCount), "%d", clients);
+  snprintf(sceneCount, sizeof(sceneCount), "%d", kSceneCount);
+  snprintf(delay, sizeof(delay), "%d", kStartDelayMilliseconds);
+  snprintf(phase, sizeof(phase), "%g,%ld,%s", rate, events, gPreviewKind ? "preview" : "program");
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(gMockPath, "mock_obs", "-p", port, "-c", clientCount, "-s", sceneCount,
+          "-d", delay, "-t", sendTimesPath, "-x", "-e", phase, (char *)NULL);
+    fprintf(stderr, "Could not run %s: %s\n", gMockPath, strerror(errno));
+    _exit(1);
+  }
+  return pid;
+}
+
+static bool waitForMock(void) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(gPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int attempt = 0; attempt < 500; attempt++) {
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    bool connected = connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+    close(probe);
+    if (connected) {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+// Waits up to timeout for the mock to exit on its own, then kills it.
+static void stopMock(pid_t pid, uint64_t timeout) {
+  uint64_t deadline = monotonicMicroseconds() + timeout;
+  while (waitpid(pid, NULL, WNOHANG) == 0) {
+    if (monotonicMicroseconds() >= deadline) {
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      return;
+    }
+    usleep(10000);
+  }
+}
+
+static long readSentChanges(const char *path, SentChange *changes, long capacity) {
+  FILE *file = fopen(path, "r");
+  long sequence, count = 0;
+  int scene;
+  unsigned long long time;
+
+  if (file == NULL) {
+    return 0;
+  }
+  memset(changes, 0, capacity * sizeof(SentChange));
+  while (fscanf(file, "%ld %d %llu", &sequence, &scene, &time) == 3) {
+    if (sequence >= 0 && sequence < capacity) {
+      changes[sequence].scene = scene;
+      changes[sequence].time = time;
+      count = MAX(count, sequence + 1);
+    }
+  }
+  fclose(file);
+  return count;
+}
+
+
+#pragma mark - Runs
+
+// Matches a client's callbacks to the changes that caused them, appending
+// the latencies.  Returns the number matched.
+static long matchCallbacks(const CallbackRecord *records, long recordCount,
+                           const SentChange *changes, long changeCount,
+                           uint64_t *latencies, uint64_t *lastCallback) {
+  long next = 0, matched = 0;
+
+  for (long i = 0; i < recordCount && next < changeCount; i++) {
+    // Skip the initial state, reported before the script started.
+    if (records[i].time < changes[0].time) {
+      continue;
+    }
+    while (next < changeCount &&
+           (changes[next].time == 0 || changes[next].scene != records[i].scene)) {
+      next++;
+    }
+    if (next == changeCount) {
+      break;
+    }
+    latencies[matched++] = records[i].time - changes[next].time;
+    *lastCallback = MAX(*lastCallback, records[i].time);
+    next++;
+  }
+  return matched;
+}
+
+static void runBenchmark(FILE *output, bool first, double rate, int clients,
+                         bool callbackThread, long events) {
+  char sendTimesPath[] = "/tmp/bench_latency.XXXXXX";
+  int pipes[clients];
+  pid_t children[clients];
+  uint64_t timeout = (uint64_t)(rate > 0 ? events / rate * 1000000 : 0) + 15000000;
+  const char *dispatch = callbackThread ? "thread" : "inline";
+
+  fprintf(stderr, "%s, rate %g/s, %d client%s, %s dispatch...\n",
+          gPreviewKind ? "preview" : "program", rate, clients, clients == 1 ? "" : "s",
+          dispatch);
+  close(mkstemp(sendTimesPath));
+
+  pid_t mock = startMock(rate, events, clients, sendTimesPath);
+  if (!waitForMock()) {
+    fprintf(stderr, "Mock server did not start on port %d\n", gPort);
+    kill(mock, SIGTERM);
+    waitpid(mock, NULL, 0);
+    exit(1);
+  }
+
+  for (int i = 0; i < clients; i++) {
+    int descriptors[2];
+    pipe(descriptors);
+    children[i] = fork();
+    if (children[i] == 0) {
+      close(descriptors[0]);
+      runClient(descriptors[1], callbackThread, events, timeout);
+    }
+    close(descriptors[1]);
+    pipes[i] = descriptors[0];
+  }
+
+  // Each client sends its record count, then its records.
+  CallbackRecord *records[clients];
+  long recordCounts[clients];
+  for (int i = 0; i < clients; i++) {
+    records[i] = NULL;
+    recordCounts[i] = 0;
+    if (read(pipes[i], &recordCounts[i], sizeof(long)) == sizeof(long) && recordCounts[i] > 0) {
+      size_t length = recordCounts[i] * sizeof(CallbackRecord);
+      size_t received = 0;
+      records[i] = malloc(length);
+      while (received < length) {
+        ssize_t count = read(pipes[i], (char *)records[i] + received, length - received);
+        if (count <= 0) {
+          break;
+        }
+        received += count;
+      }
+      recordCounts[i] = received / sizeof(CallbackRecord);
+    } else {
+      recordCounts[i] = 0;
+    }
+    close(pipes[i]);
+    waitpid(children[i], NULL, 0);
+  }
+  stopMock(mock, 5000000);
+
+  SentChange *changes = malloc(events * sizeof(SentChange));
+  long changeCount = readSentChanges(sendTimesPath, changes, events);
+  unlink(sendTimesPath);
+
+  uint64_t *latencies = malloc((events * clients + 1) * sizeof(uint64_t));
+  long delivered = 0;
+  uint64_t lastCallback = 0;
+  if (changeCount > 0) {
+    for (int i = 0; i < clients; i++) {
+      delivered += matchCallbacks(records[i], recordCounts[i], changes, changeCount,
+                                  latencies + delivered, &lastCallback);
+    }
+  }
+  for (int i = 0; i < clients; i++) {
+    free(records[i]);
+  }
+
+  long sent = changeCount * clients;
+  fprintf(output, "%s\n    {\"kind\": \"%s\", \"rate\": %g, \"clients\": %d, "
+          "\"dispatch\": \"%s\", \"sent\": %ld, \"delivered\": %ld, \"lost\": %ld",
+          first ? "" : ",", gPreviewKind ? "preview" : "program", rate, clients, dispatch,
+          sent, delivered, sent - delivered);
+  if (delivered > 0) {
+    double total = 0;
+    qsort(latencies, delivered, sizeof(uint64_t), compareLatencies);
+    for (long i = 0; i < delivered; i++) {
+      total += latencies[i];
+    }
+    double seconds = (double)(lastCallback - changes[0].time) / 1000000.0;
+    fprintf(output, ",\n     \"latencyMicroseconds\": {\"p50\": %llu, \"p99\": %llu, "
+            "\"p999\": %llu, \"max\": %llu, \"mean\": %.1f},\n"
+            "     \"throughputPerSecond\": %.1f}",
+            (unsigned long long)percentile(latencies, delivered, 0.50),
+            (unsigned long long)percentile(latencies, delivered, 0.99),
+            (unsigned long long)percentile(latencies, delivered, 0.999),
+            (unsigned long long)latencies[delivered - 1], total / delivered,
+            seconds > 0 ? delivered / seconds : 0.0);
+    fprintf(stderr, "  p50 %llu us, p99 %llu us, p999 %llu us, %ld/%ld delivered\n",
+            (unsigned long long)percentile(latencies, delivered, 0.50),
+            (unsigned long long)percentile(latencies, delivered, 0.99),
+            (unsigned long long)percentile(latencies, delivered, 0.999), delivered, sent);
+  } else {
+    fprintf(output, "}");
+    fprintf(stderr, "  nothing delivered\n");
+  }
+  fflush(output);
+
+  free(latencies);
+  free(changes);
+}
+
+
+#pragma mark - Main
+
+int main(int argc, char *argv[]) {
+  long rates[kMaxListLength] = { 100, 1000, 10000, 0 };
+  long clientCounts[kMaxListLength] = { 1, 4, 16 };
+  int rateCount = 4, clientCountCount = 3;
+  bool dispatchModes[2] = { false, true };
+  int dispatchModeCount = 2;
+  long events = kDefaultEventsPerRun;
+  FILE *output = stdout;
+  int option;
+
+  while ((option = getopt(argc, argv, "o:n:r:c:d:k:m:p:")) != -1) {
+    switch (option) {
+      case 'o':
+        output = fopen(optarg, "w");
+        if (output == NULL) {
+          fprintf(stderr, "Could not open %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        events = atol(optarg);
+        break;
+      case 'r':
+        rateCount = parseList(optarg, rates);
+        break;
+      case 'c':
+        clientCountCount = parseList(optarg, clientCounts);
+        break;
+      case 'd':
+        dispatchModeCount = 0;
+        if (strstr(optarg, "inline")) {
+          dispatchModes[dispatchModeCount++] = false;
+        }
+        if (strstr(optarg, "thread")) {
+          dispatchModes[dispatchModeCount++] = true;
+        }
+        break;
+      case 'k':
+        gPreviewKind = strcmp(optarg, "preview") == 0;
+        break;
+      case 'm':
+        gMockPath = optarg;
+        break;
+      case 'p':
+        gPort = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-o path] [-n eventsPerRun] [-r rate,...] "
+                "[-c clients,...] [-d inline,thread] [-k program|preview] "
+                "[-m mockPath] [-p port]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (events < 1 || rateCount == 0 || clientCountCount == 0 || dispatchModeCount == 0) {
+    fprintf(stderr, "Nothing to run.\n");
+    return 1;
+  }
+
+  fprintf(output, "{\n  \"benchmark\": \"tally_latency\",\n  \"eventsPerRun\": %ld,\n"
+          "  \"scenes\": %d,\n  \"runs\": [", events, kSceneCount);
+  bool first = true;
+  for (int d = 0; d < dispatchModeCount; d++) {
+    for (int c = 0; c < clientCountCount; c++) {
+      for (int r = 0; r < rateCount; r++) {
+        runBenchmark(output, first, (double)rates[r], (int)clientCounts[c], dispatchModes[d],
+                     events);
+        first = false;
+      }
+    }
+  }
+  fprintf(output, "\n  ]\n}\n");
+  if (output != stdout) {
+    fclose(output);
+  }
+  return 0;
+}
@@ -0,0 +1,471 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+#include "gettally.h"
+
+// Memory use of a tally client in each runtime profile: resident set size
+// and V8 heap once connected, and again after an hour of events.
+//
+// Each run starts a fresh mock_obs and one client process running
+// runOBSTally() in the profile under test.  The first sample is taken a
+// second after the initial scene state arrives, while the mock waits out
+// its start delay.  The mock then plays an hour's worth of a show (a cut
+// every five seconds, a preview change every second, and a source shown or
+// hidden every two seconds), in ten-minute blocks, sped up by the speedup
+// factor.  With -r, it replays the server side of a capture instead (see
+// capture_log.h), at its original pace unless -f is given.  The second
+// sample is taken once nothing has arrived for two seconds.
+//
+// Heap figures are V8's own statistics as last sampled by the client, not
+// forced by a collection, so they include garbage not yet collected.
+//
+// Results go to stdout (or -o path) as JSON, one entry per profile.
+// Progress goes to stderr.
+//
+// Usage: bench_memory [-o path] [-P default,lowmemory] [-a speedup]
+//                     [-r capturePath [-f]] [-m mockPath] [-p port]
+
+#define kDefaultPort 4461
+#define kDefaultSpeedup 100
+#define kSceneCount 8
+#define kStartDelayMilliseconds 3000
+#define kSettleMicroseconds 1000000
+#define kIdleTimeoutMicroseconds 2000000
+#define kHeapSampleMilliseconds 100
+#define kHourBlocks 6
+
+typedef struct {
+  const char *kind;
+  long countPerHour;
+} HourPhase;
+
+static const HourPhase kHourOfEvents[] = {
+  { "transition", 720 },
+  { "preview", 3600 },
+  { "items", 1800 }
+};
+
+#define kHourPhaseCount (sizeof(kHourOfEvents) / sizeof(kHourOfEvents[0]))
+
+typedef struct {
+  uint64_t residentBytes;
+  uint64_t peakResidentBytes;
+  OBSHeapMetrics heap;
+  uint64_t framesReceived;
+  uint64_t bytesReceived;
+} MemorySample;
+
+static const char *kProfileNames[] = { "default", "lowmemory" };
+
+
+#pragma mark - Global variables
+
+static int gPort = kDefaultPort;
+static const char *gMockPath = "bin/mock_obs";
+static long gSpeedup = kDefaultSpeedup;
+static const char *gCapturePath = NULL;
+static bool gReplayFast = false;
+
+// Client state.
+static uint64_t gConnectedTime = 0;  // Written by the callback, read by the watchdog.
+static int gResultDescriptor = -1;
+
+
+#pragma mark - Support functions
+
+static uint64_t monotonicMicroseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static bool writeAll(int descriptor, const void *data, size_t length) {
+  const char *p = data;
+  while (length > 0) {
+    ssize_t written = write(descriptor, p, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    length -= written;
+  }
+  return true;
+}
+
+static bool readAll(int descriptor, void *data, size_t length) {
+  char *p = data;
+  while (length > 0) {
+    ssize_t count = read(descriptor, p, length);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    p += count;
+    length -= count;
+  }
+  return true;
+}
+
+static uint64_t residentBytes(void) {
+#ifdef __APPLE__
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) !=
+      KERN_SUCCESS) {
+    return 0;
+  }
+  return info.resident_size;
+#else
+  FILE *file = fopen("/proc/self/statm", "r");
+  unsigned long long size, resident;
+  bool valid;
+
+  if (file == NULL) {
+    return 0;
+  }
+  valid = fscanf(file, "%llu %llu", &size, &resident) == 2;
+  fclose(file);
+  return valid ? resident * (uint64_t)sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
+static uint64_t peakResidentBytes(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // Bytes on macOS, kilobytes elsewhere.
+#ifdef __APPLE__
+  return (uint64_t)usage.ru_maxrss;
+#else
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+
+#pragma mark - Client
+
+static void programCallback(const char *sceneName) {
+  uint64_t expected = 0;
+  __atomic_compare_exchange_n(&gConnectedTime, &expected, monotonicMicroseconds(), false,
+                              __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// Waits for a heap sample newer than now, so that both figures are current.
+static void takeSample(MemorySample *sample) {
+  OBSMetricsSnapshot snapshot;
+  uint64_t requested = monotonicMicroseconds();
+
+  do {
+    usleep(kHeapSampleMilliseconds * 1000);
+    getOBSMetricsSnapshot(&snapshot);
+  } while (snapshot.heap.sampledAt < requested &&
+           monotonicMicroseconds() - requested < kIdleTimeoutMicroseconds);
+
+  sample->residentBytes = residentBytes();
+  sample->peakResidentBytes = peakResidentBytes();
+  sample->heap = snapshot.heap;
+  sample->framesReceived = snapshot.totals.framesReceived;
+  sample->bytesReceived = snapshot.totals.bytesReceived;
+}
+
+static uint64_t framesReceived(void) {
+  OBSMetricsSnapshot snapshot;
+  getOBSMetricsSnapshot(&snapshot);
+  return snapshot.totals.framesReceived;
+}
+
+// runOBSTally() never returns, so this thread takes the samples, sends
+// them to the parent, and exits the process.
+static void *watchClient(void *timeoutPointer) {
+  uint64_t deadline = monotonicMicroseconds() + *(uint64_t *)timeoutPointer;
+  MemorySample samples[2];
+
+  while (__atomic_load_n(&gConnectedTime, __ATOMIC_ACQUIRE) == 0) {
+    if (monotonicMicroseconds() >= deadline) {
+      _exit(1);
+    }
+    usleep(10000);
+  }
+  usleep(kSettleMicroseconds);
+  takeSample(&samples[0]);
+
+  uint64_t lastCount = framesReceived(), lastChange = monotonicMicroseconds();
+  bool eventsArrived = false;
+  while (true) {
+    usleep(100000);
+    uint64_t now = monotonicMicroseconds();
+    uint64_t count = framesReceived();
+    if (count != lastCount) {
+      lastCount = count;
+      lastChange = now;
+      eventsArrived = true;
+    }
+    if (now >= deadline || (eventsArrived && now - lastChange > kIdleTimeoutMicroseconds)) {
+      break;
+    }
+  }
+  takeSample(&samples[1]);
+
+  writeAll(gResultDescriptor, samples, sizeof(samples));
+  close(gResultDescriptor);
+  _exit(0);
+  return NULL;
+}
+
+static void runClient(int resultDescriptor, OBSRuntimeProfile profile, uint64_t timeout) {
+  char url[64];
+  pthread_t watchdog;
+
+  gResultDescriptor = resultDescriptor;
+  setOBSRuntimeProfile(profile);
+  setOBSHeapSampleInterval(kHeapSampleMilliseconds);
+  registerOBSProgramCallback(&programCallback);
+  pthread_create(&watchdog, NULL, watchClient, &timeout);
+
+  snprintf(url, sizeof(url), "ws://127.0.0.1:%d/", gPort);
+  runOBSTally(url, "");
+  _exit(1);
+}
+
+
+#pragma mark - Mock server
+
+// The hour is split into blocks so that the kinds of event interleave; each
+// phase of a block gets an equal share of the block's time.
+static pid_t startMock(void) {
+  char port[16], sceneCount[16], delay[16];
+  char phases[kHourBlocks * kHourPhaseCount][64];
+  const char *arguments[16 + 2 * kHourBlocks * kHourPhaseCount];
+  int count = 0;
+
+  snprintf(port, sizeof(port), "%d", gPort);
+  snprintf(sceneCount, sizeof(sceneCount), "%d", kSceneCount);
+  snprintf(delay, sizeof(delay), "%d", kStartDelayMilliseconds);
+
+  arguments[count++] = "mock_obs";
+  arguments[count++] = "-p";
+  arguments[count++] = port;
+  arguments[count++] = "-x";
+  if (gCapturePath != NULL) {
+    arguments[count++] = "-r";
+    arguments[count++] = gCapturePath;
+    if (gReplayFast) {
+      arguments[count++] = "-f";
+    }
+  } else {
+    double phaseSeconds = 3600.0 / kHourBlocks / kHourPhaseCount / gSpeedup;
+    arguments[count++] = "-s";
+    arguments[count++] = sceneCount;
+    arguments[count++] = "-d";
+    arguments[count++] = delay;
+    for (int block = 0; block < kHourBlocks; block++) {
+      for (size_t i = 0; i < kHourPhaseCount; i++) {
+        char *phase = phases[block * kHourPhaseCount + i];
+        long events = kHourOfEvents[i].countPerHour / kHourBlocks;
+        snprintf(phase, sizeof(phases[0]), "%g,%ld,%s", events / phaseSeconds, events,
+                 kHourOfEvents[i].kind);
+        arguments[count++] = "-e";
+        arguments[count++] = phase;
+      }
+    }
+  }
+  arguments[count] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(gMockPath, (char *const *)arguments);
+    fprintf(stderr, "Could not run %s: %s\n", gMockPath, strerror(errno));
+    _exit(1);
+  }
+  return pid;
+}
+
+static bool waitForMock(void) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(gPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (int attempt = 0; attempt < 500; attempt++) {
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    bool connected = connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+    close(probe);
+    if (connected) {
+      return true;
+    }
+    usleep(10000);
+  }
+  return false;
+}
+
+static void stopMock(pid_t pid) {
+  if (waitpid(pid, NULL, WNOHANG) == 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+
+#pragma mark - Runs
+
+static void printSample(FILE *output, const char *name, const MemorySample *sample) {
+  fprintf(output, "     \"%s\": {\"residentBytes\": %llu, \"peakResidentBytes\": %llu, "
+          "\"heapUsedBytes\": %llu, \"heapTotalBytes\": %llu, \"heapLimitBytes\": %llu, "
+          "\"externalBytes\": %llu, \"mallocedBytes\": %llu, \"framesReceived\": %llu, "
+          "\"bytesReceived\": %llu}",
+          name, (unsigned long long)sample->residentBytes,
+          (unsigned long long)sample->peakResidentBytes,
+          (unsigned long long)sample->heap.usedHeapSize,
+          (unsigned long long)sample->heap.totalHeapSize,
+          (unsigned long long)sample->heap.heapSizeLimit,
+          (unsigned long long)sample->heap.externalMemory,
+          (unsigned long long)sample->heap.mallocedMemory,
+          (unsigned long long)sample->framesReceived,
+          (unsigned long long)sample->bytesReceived);
+}
+
+static void runBenchmark(FILE *output, bool first, OBSRuntimeProfile profile) {
+  // A real-time replay takes as long as the capture; allow a day.
+  uint64_t timeout = (gCapturePath != NULL) ? 24ULL * 3600 * 1000000 :
+                     3600ULL * 1000000 / gSpeedup + 60000000;
+  MemorySample samples[2];
+  int descriptors[2];
+
+  fprintf(stderr, "%s profile...\n", kProfileNames[profile]);
+
+  pid_t mock = startMock();
+  if (!waitForMock()) {
+    fprintf(stderr, "Mock server did not start on port %d\n", gPort);
+    kill(mock, SIGTERM);
+    waitpid(mock, NULL, 0);
+    exit(1);
+  }
+
+  pipe(descriptors);
+  pid_t child = fork();
+  if (child == 0) {
+    close(descriptors[0]);
+    runClient(descriptors[1], profile, timeout);
+  }
+  close(descriptors[1]);
+
+  bool received = readAll(descriptors[0], samples, sizeof(samples));
+  close(descriptors[0]);
+  waitpid(child, NULL, 0);
+  stopMock(mock);
+
+  fprintf(output, "%s\n    {\"profile\": \"%s\"", first ? "" : ",", kProfileNames[profile]);
+  if (received) {
+    fprintf(output, ",\n");
+    printSample(output, "afterConnect", &samples[0]);
+    fprintf(output, ",\n");
+    printSample(output, "afterHour", &samples[1]);
+    fprintf(stderr, "  connected: RSS %llu KB, heap %llu KB; after hour: RSS %llu KB, "
+            "heap %llu KB\n",
+            (unsigned long long)samples[0].residentBytes / 1024,
+            (unsigned long long)samples[0].heap.usedHeapSize / 1024,
+            (unsigned long long)samples[1].residentBytes / 1024,
+            (unsigned long long)samples[1].heap.usedHeapSize / 1024);
+  } else {
+    fprintf(stderr, "  client never connected\n");
+  }
+  fprintf(output, "}");
+  fflush(output);
+}
+
+
+#pragma mark - Main
+
+int main(int argc, char *argv[]) {
+  bool profiles[2] = { true, true };
+  FILE *output = stdout;
+  int option;
+
+  while ((option = getopt(argc, argv, "o:P:a:r:fm:p:")) != -1) {
+    switch (option) {
+      case 'o':
+        output = fopen(optarg, "w");
+        if (output == NULL) {
+          fprintf(stderr, "Could not open %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'P':
+        profiles[kOBSRuntimeProfileDefault] = strstr(optarg, "default") != NULL;
+        profiles[kOBSRuntimeProfileLowMemory] = strstr(optarg, "lowmemory") != NULL;
+        break;
+      case 'a':
+        gSpeedup = atol(optarg);
+        break;
+      case 'r':
+        gCapturePath = optarg;
+        break;
+      case 'f':
+        gReplayFast = true;
+        break;
+      case 'm':
+        gMockPath = optarg;
+        break;
+      case 'p':
+        gPort = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-o path] [-P default,lowmemory] [-a speedup] "
+                "[-r capturePath [-f]] [-m mockPath] [-p port]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (gSpeedup < 1 || !(profiles[0] || profiles[1])) {
+    fprintf(stderr, "Nothing to run.\n");
+    return 1;
+  }
+
+  fprintf(output, "{\n  \"benchmark\": \"tally_memory\",\n");
+  if (gCapturePath != NULL) {
+    fprintf(output, "  \"capture\": \"%s\",\n  \"fast\": %s,\n", gCapturePath,
+            gReplayFast ? "true" : "false");
+  } else {
+    fprintf(output, "  \"speedup\": %ld,\n  \"eventsPerHour\": {", gSpeedup);
+    for (size_t i = 0; i < kHourPhaseCount; i++) {
+      fprintf(output, "%s\"%s\": %ld", i == 0 ? "" : ", ", kHourOfEvents[i].kind,
+              kHourOfEvents[i].countPerHour);
+    }
+    fprintf(output, "},\n");
+  }
+  fprintf(output, "  \"runs\": [");
+  bool first = true;
+  for (int profile = 0; profile < 2; profile++) {
+    if (profiles[profile]) {
+      runBenchmark(output, first, (OBSRuntimeProfile)profile);
+      first = false;
+    }
+  }
+  fprintf(output, "\n  ]\n}\n");
+  if (output != stdout) {
+    fclose(output);
+  }
+  return 0;
+}
@@ -0,0 +1,46 @@
+#include "bin/bench_send.h"
+#include "bin/websocket.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "v8_setup.h"
+
+// Sends 1 MB binary payloads through sendWebSocketData() and reports the
+// cost per payload.  "array" is the old per-element path (one boxed Number
+// per byte); the rest copy straight out of the ArrayBuffer backing store.
+// Keep the iteration count in sync with kSendBenchmarkIterations in
+// bench_send.js.
+
+#define kIterations 16
+#define kPayloadSize (1024 * 1024)
+
+static double nowMilliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+  char *kinds[] = { "array", "uint8array", "arraybuffer", "dataview", "subarray" };
+
+  v8_setup();
+  runScript(websocket_js);
+  runScript(bench_send_js);
+
+  for (int i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    char script[128];
+    snprintf(script, sizeof(script), "runSendBenchmark(\"%s\")", kinds[i]);
+
+    double start = nowMilliseconds();
+    runScript(script);
+    double elapsed = nowMilliseconds() - start;
+
+    printf("%-12s %9.3f ms per 1 MB payload  (%8.1f MB/s)\n", kinds[i],
+           elapsed / kIterations, (kIterations * (kPayloadSize / 1048576.0)) / (elapsed / 1000.0));
+  }
+
+  v8_teardown();
+  return 0;
+}
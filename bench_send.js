@@ -0,0 +1,37 @@
+// Payloads for bench_send.c.  Each run sends kSendBenchmarkIterations
+// copies of a 1 MB payload through one of sendWebSocketData()'s input paths.
+// The socket never connects, so frames just pile up in the outgoing queue;
+// that keeps the network out of the measurement.
+
+const kSendBenchmarkPayloadSize = 1024 * 1024;
+const kSendBenchmarkIterations = 16;
+
+var sendBenchmarkSocket = new WebSocket("ws://127.0.0.1:9/");
+sendBenchmarkSocket.setSendLimits(Number.MAX_SAFE_INTEGER, 0, "queue");
+var sendBenchmarkPayloads = {};
+
+(function() {
+  var byteArray = new Array(kSendBenchmarkPayloadSize);
+  var typedArray = new Uint8Array(kSendBenchmarkPayloadSize);
+  for (var i = 0; i < kSendBenchmarkPayloadSize; i++) {
+    byteArray[i] = i & 0xff;
+    typedArray[i] = i & 0xff;
+  }
+
+  sendBenchmarkPayloads["array"] = byteArray;
+  sendBenchmarkPayloads["uint8array"] = typedArray;
+  sendBenchmarkPayloads["arraybuffer"] = typedArray.buffer;
+  sendBenchmarkPayloads["dataview"] = new DataView(typedArray.buffer);
+  sendBenchmarkPayloads["subarray"] = typedArray.subarray(1, kSendBenchmarkPayloadSize - 1);
+})();
+
+function runSendBenchmark(kind) {
+  const payload = sendBenchmarkPayloads[kind];
+  const connectionID = sendBenchmarkSocket.internal_connection_id;
+  for (var i = 0; i < kSendBenchmarkIterations; i++) {
+    sendWebSocketData(connectionID, payload);
+  }
+  return kind;
+}
+
+"Send benchmark ready"
@@ -0,0 +1,187 @@
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+
+#define kBufferPoolSlabSize (64 * 1024)
+#define kBufferPoolOversized 0xffffffff
+
+#pragma mark - Data types
+
+// Precedes every block.  Sixteen bytes, so the payload keeps malloc's
+// alignment.
+typedef struct {
+  uint32_t sizeClass;  // Index into gBufferPoolClasses, or kBufferPoolOversized.
+  uint32_t reserved;
+  uint64_t reserved2;
+} BufferPoolHeader;
+
+static_assert(sizeof(BufferPoolHeader) == 16, "Pool blocks must stay 16-byte aligned");
+
+// Free blocks are linked through their (unused) payload.
+typedef struct BufferPoolFreeBlock {
+  struct BufferPoolFreeBlock *next;
+} BufferPoolFreeBlock;
+
+typedef struct {
+  std::mutex mutex;
+  BufferPoolFreeBlock *freeList = nullptr;
+  uint64_t allocations = 0;
+  uint64_t blocksInUse = 0;
+  uint64_t blocksFree = 0;
+  uint64_t slabs = 0;
+} BufferPoolClass;
+
+
+#pragma mark - Global variables
+
+// Powers of four: control messages and most obs-websocket events fit in the
+// first two classes; scene lists and screenshots use the larger ones.
+static const size_t kBufferPoolClassSizes[kOBSBufferPoolClassCount] = {
+  64, 256, 1024, 4096, 16384, 65536
+};
+
+static BufferPoolClass gBufferPoolClasses[kOBSBufferPoolClassCount];
+static std::atomic<uint64_t> gBufferPoolHeapAllocations(0);
+static std::atomic<uint64_t> gBufferPoolOversizedAllocations(0);
+static std::atomic<uint64_t> gBufferPoolOversizedInUse(0);
+
+
+#pragma mark - Support functions
+
+static BufferPoolHeader *headerForBuffer(void *buffer) {
+  return (BufferPoolHeader *)((uint8_t *)buffer - sizeof(BufferPoolHeader));
+}
+
+static void *bufferForHeader(BufferPoolHeader *header) {
+  return (uint8_t *)header + sizeof(BufferPoolHeader);
+}
+
+// Carves a new slab into blocks and pushes them onto the free list.  Called
+// with the class mutex held.
+static bool growBufferPoolClass(BufferPoolClass *poolClass, uint32_t sizeClass) {
+  size_t stride = sizeof(BufferPoolHeader) + kBufferPoolClassSizes[sizeClass];
+  size_t blockCount = kBufferPoolSlabSize / stride;
+  if (blockCount == 0) {
+    blockCount = 1;
+  }
+
+  uint8_t *slab = (uint8_t *)malloc(stride * blockCount);
+  if (slab == NULL) {
+    return false;
+  }
+  gBufferPoolHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+
+  for (size_t i = 0; i < blockCount; i++) {
+    BufferPoolHeader *header = (BufferPoolHeader *)(slab + i * stride);
+    header->sizeClass = sizeClass;
+    BufferPoolFreeBlock *block = (BufferPoolFreeBlock *)bufferForHeader(header);
+    block->next = poolClass->freeList;
+    poolClass->freeList = block;
+  }
+  poolClass->blocksFree += blockCount;
+  poolClass->slabs++;
+  return true;
+}
+
+
+#pragma mark - Public API
+
+void *bufferPoolAllocate(size_t length) {
+  uint32_t sizeClass = 0;
+  while (sizeClass < kOBSBufferPoolClassCount && kBufferPoolClassSizes[sizeClass] < length) {
+    sizeClass++;
+  }
+
+  if (sizeClass == kOBSBufferPoolClassCount) {
+    BufferPoolHeader *header = (BufferPoolHeader *)malloc(sizeof(BufferPoolHeader) + length);
+    if (header == NULL) {
+      return NULL;
+    }
+    header->sizeClass = kBufferPoolOversized;
+    gBufferPoolHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+    gBufferPoolOversizedAllocations.fetch_add(1, std::memory_order_relaxed);
+    gBufferPoolOversizedInUse.fetch_add(1, std::memory_order_relaxed);
+    return bufferForHeader(header);
+  }
+
+  BufferPoolClass *poolClass = &gBufferPoolClasses[sizeClass];
+  std::lock_guard<std::mutex> guard(poolClass->mutex);
+
+  if (poolClass->freeList == nullptr && !growBufferPoolClass(poolClass, sizeClass)) {
+    return NULL;
+  }
+  BufferPoolFreeBlock *block = poolClass->freeList;
+  poolClass->freeList = block->next;
+
+  poolClass->allocations++;
+  poolClass->blocksInUse++;
+  poolClass->blocksFree--;
+  return (void *)block;
+}
+
+void bufferPoolFree(void *buffer) {
+  if (buffer == NULL) {
+    return;
+  }
+
+  BufferPoolHeader *header = headerForBuffer(buffer);
+  if (header->sizeClass == kBufferPoolOversized) {
+    gBufferPoolOversizedInUse.fetch_sub(1, std::memory_order_relaxed);
+    free(header);
+    return;
+  }
+
+  BufferPoolClass *poolClass = &gBufferPoolClasses[header->sizeClass];
+  std::lock_guard<std::mutex> guard(poolClass->mutex);
+
+  BufferPoolFreeBlock *block = (BufferPoolFreeBlock *)buffer;
+  block->next = poolClass->freeList;
+  poolClass->freeList = block;
+
+  poolClass->blocksInUse--;
+  poolClass->blocksFree++;
+}
+
+void bufferPoolBackingStoreDeleter(void *data, size_t length, void *deleterData) {
+  bufferPoolFree(data);
+}
+
+void getOBSBufferPoolStatistics(OBSBufferPoolStatistics *statistics) {
+  statistics->heapAllocations = gBufferPoolHeapAllocations.load(std::memory_order_relaxed);
+  statistics->oversizedAllocations = gBufferPoolOversizedAllocations.load(std::memory_order_relaxed);
+  statistics->oversizedInUse = gBufferPoolOversizedInUse.load(std::memory_order_relaxed);
+
+  for (int i = 0; i < kOBSBufferPoolClassCount; i++) {
+    BufferPoolClass *poolClass = &gBufferPoolClasses[i];
+    std::lock_guard<std::mutex> guard(poolClass->mutex);
+
+    statistics->classes[i].blockSize = kBufferPoolClassSizes[i];
+    statistics->classes[i].allocations = poolClass->allocations;
+    statistics->classes[i].blocksInUse = poolClass->blocksInUse;
+    statistics->classes[i].blocksFree = poolClass->blocksFree;
+    statistics->classes[i].slabs = poolClass->slabs;
+  }
+}
+
+
+#pragma mark - PooledArrayBufferAllocator class methods
+
+void *PooledArrayBufferAllocator::Allocate(size_t length) {
+  void *data = bufferPoolAllocate(length);
+  if (data != NULL) {
+    memset(data, 0, length);
+  }
+  return data;
+}
+
+void *PooledArrayBufferAllocator::AllocateUninitialized(size_t length) {
+  return bufferPoolAllocate(length);
+}
+
+void PooledArrayBufferAllocator::Free(void *data, size_t length) {
+  bufferPoolFree(data);
+}
@@ -0,0 +1,42 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stddef.h>
+#include <v8.h>
+
+#include "gettally.h"
+
+// Size-classed pools for the native layer's short-lived buffers: WebSocket
+// frame payloads in both directions, the queue nodes that hold them,
+// tally server frames, and ArrayBuffer backing stores.
+//
+// Each size class keeps a free list of fixed-size blocks carved out of
+// larger slabs.  Slabs are never returned to the heap, so once the pools
+// have grown to fit the working set, steady-state traffic allocates
+// nothing from malloc.  Requests larger than the biggest class go straight
+// to malloc and are counted separately.
+//
+// Every block starts with a small header that records its class, so
+// bufferPoolFree() does not need to be told the size.  Blocks are 16-byte
+// aligned.  The pools are thread-safe.
+
+// Returns an uninitialized block of at least length bytes.  Never returns
+// NULL for a nonzero length unless the heap itself is exhausted.
+void *bufferPoolAllocate(size_t length);
+
+// Returns a block to its pool.  NULL is ignored.
+void bufferPoolFree(void *buffer);
+
+// For use as a v8::BackingStore deleter, so that a pooled buffer can be
+// handed to JavaScript without copying.
+void bufferPoolBackingStoreDeleter(void *data, size_t length, void *deleterData);
+
+// Backs every ArrayBuffer in the isolate with the same pools.
+class PooledArrayBufferAllocator : public v8::ArrayBuffer::Allocator {
+  public:
+    void *Allocate(size_t length) override;
+    void *AllocateUninitialized(size_t length) override;
+    void Free(void *data, size_t length) override;
+};
+
+#endif  // __BUFFER_POOL_H__
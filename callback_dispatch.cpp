@@ -0,0 +1,354 @@
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#include "buffer_pool.h"
+#include "callback_dispatch.h"
+#include "trace.h"
+
+#define kCallbackQueueDefaultDepth 256
+
+#pragma mark - Data types
+
+typedef enum {
+  kCallbackEventProgram,
+  kCallbackEventPreview,
+  kCallbackEventInactive,
+  kCallbackEventSource,
+  kCallbackEventTallyDiff
+} CallbackEventKind;
+
+typedef struct {
+  CallbackEventKind kind;
+  union {
+    void (*sceneCallback)(const char *sceneName);
+    void (*previewCallback)(const char *sceneName, bool alsoOnProgram);
+    void (*sourceCallback)(const char *sourceName, bool onProgram, bool onPreview);
+    void (*diffCallback)(const OBSTallyChange *changes, size_t count);
+  };
+  const char *name;
+  bool onProgram;
+  bool onPreview;
+  const OBSTallyChange *changes;
+  size_t count;
+  void *ownedBuffer;  // Pooled copy of name or changes, if any.
+} CallbackEvent;
+
+// A slot is free for the producer claiming position p when its sequence is
+// p, and full (readable at p) when its sequence is p + 1.  The consumer
+// hands it back for the next lap by setting it to p + depth.
+typedef struct {
+  std::atomic<size_t> sequence;
+  CallbackEvent event;
+} CallbackSlot;
+
+
+#pragma mark - Global variables
+
+static CallbackSlot *gCallbackSlots = nullptr;
+static size_t gCallbackQueueMask = 0;
+static std::atomic<size_t> gCallbackEnqueuePosition(0);
+static std::atomic<size_t> gCallbackDequeuePosition(0);  // Written only by the consumer.
+
+static std::thread *gCallbackThread = nullptr;
+static std::atomic<bool> gCallbackThreadAccepting(false);
+static std::atomic<bool> gCallbackThreadStopping(false);
+static std::atomic<uint32_t> gCallbackWakeups(0);
+
+// Producers currently inside a queue*Callback() call, so that stopping can
+// wait for them before the consumer drains the ring for the last time.
+static std::atomic<int32_t> gCallbackProducers(0);
+
+static std::atomic<uint64_t> gCallbackDispatched(0);
+static std::atomic<uint64_t> gCallbackStalls(0);
+static std::atomic<size_t> gCallbackMaxQueued(0);
+
+
+#pragma mark - Queue
+
+static void wakeCallbackThread(void) {
+  gCallbackWakeups.fetch_add(1, std::memory_order_release);
+  gCallbackWakeups.notify_one();
+}
+
+// Returns false if the ring is full.
+static bool tryEnqueueCallbackEvent(const CallbackEvent *event) {
+  size_t position = gCallbackEnqueuePosition.load(std::memory_order_relaxed);
+  CallbackSlot *slot;
+
+  while (true) {
+    slot = &gCallbackSlots[position & gCallbackQueueMask];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+    if (difference == 0) {
+      if (gCallbackEnqueuePosition.compare_exchange_weak(position, position + 1,
+                                                         std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = gCallbackEnqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->event = *event;
+  slot->sequence.store(position + 1, std::memory_order_release);
+
+  size_t queued = position + 1 - gCallbackDequeuePosition.load(std::memory_order_relaxed);
+  size_t maxQueued = gCallbackMaxQueued.load(std::memory_order_relaxed);
+  while (queued > maxQueued &&
+         !gCallbackMaxQueued.compare_exchange_weak(maxQueued, queued,
+                                                   std::memory_order_relaxed)) {
+  }
+  return true;
+}
+
+static void enqueueCallbackEvent(const CallbackEvent *event) {
+  if (!tryEnqueueCallbackEvent(event)) {
+    gCallbackStalls.fetch_add(1, std::memory_order_relaxed);
+    TraceSpan span("callback queue full");
+    do {
+      std::this_thread::yield();
+    } while (!tryEnqueueCallbackEvent(event));
+  }
+  wakeCallbackThread();
+}
+
+static bool dequeueCallbackEvent(CallbackEvent *event) {
+  size_t position = gCallbackDequeuePosition.load(std::memory_order_relaxed);
+  CallbackSlot *slot = &gCallbackSlots[position & gCallbackQueueMask];
+
+  if (slot->sequence.load(std::memory_order_acquire) != position + 1) {
+    return false;
+  }
+  *event = slot->event;
+  slot->sequence.store(position + gCallbackQueueMask + 1, std::memory_order_release);
+  gCallbackDequeuePosition.store(position + 1, std::memory_order_relaxed);
+  return true;
+}
+
+// Registers the caller as a producer.  Returns false (and registers
+// nothing) if the thread is not accepting events.
+static bool beginProducing(void) {
+  gCallbackProducers.fetch_add(1, std::memory_order_seq_cst);
+  if (!gCallbackThreadAccepting.load(std::memory_order_seq_cst)) {
+    gCallbackProducers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+  return true;
+}
+
+static void endProducing(void) {
+  gCallbackProducers.fetch_sub(1, std::memory_order_release);
+}
+
+
+#pragma mark - Callback thread
+
+static void runCallbackEvent(CallbackEvent *event) {
+  TraceSpan span("callback");
+  switch (event->kind) {
+    case kCallbackEventProgram:
+    case kCallbackEventInactive:
+      event->sceneCallback(event->name);
+      break;
+    case kCallbackEventPreview:
+      event->previewCallback(event->name, event->onProgram);
+      break;
+    case kCallbackEventSource:
+      event->sourceCallback(event->name, event->onProgram, event->onPreview);
+      break;
+    case kCallbackEventTallyDiff:
+      event->diffCallback(event->changes, event->count);
+      break;
+  }
+  bufferPoolFree(event->ownedBuffer);
+  gCallbackDispatched.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void runCallbackThread(void) {
+  setTraceThreadName("Callbacks");
+  while (true) {
+    // Read the wakeup count before looking at the ring, so that an event
+    // queued after an empty check changes it and the wait returns at once.
+    uint32_t wakeups = gCallbackWakeups.load(std::memory_order_acquire);
+
+    CallbackEvent event;
+    if (dequeueCallbackEvent(&event)) {
+      runCallbackEvent(&event);
+      continue;
+    }
+    if (gCallbackThreadStopping.load(std::memory_order_acquire)) {
+      return;
+    }
+    gCallbackWakeups.wait(wakeups, std::memory_order_acquire);
+  }
+}
+
+
+#pragma mark - Public API
+
+static bool callbackThreadRunning(void) {
+  return gCallbackThreadAccepting.load(std::memory_order_acquire);
+}
+
+bool startOBSCallbackThread(size_t queueDepth) {
+  if (gCallbackThread != nullptr) {
+    fprintf(stderr, "Callback thread is already running.\n");
+    return false;
+  }
+  if (queueDepth == 0) {
+    queueDepth = kCallbackQueueDefaultDepth;
+  }
+  size_t depth = 2;
+  while (depth < queueDepth) {
+    depth <<= 1;
+  }
+
+  gCallbackSlots = new (std::nothrow) CallbackSlot[depth];
+  if (gCallbackSlots == nullptr) {
+    fprintf(stderr, "Could not allocate callback queue of depth %zu\n", depth);
+    return false;
+  }
+  for (size_t i = 0; i < depth; i++) {
+    gCallbackSlots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  gCallbackQueueMask = depth - 1;
+  gCallbackEnqueuePosition.store(0, std::memory_order_relaxed);
+  gCallbackDequeuePosition.store(0, std::memory_order_relaxed);
+  gCallbackMaxQueued.store(0, std::memory_order_relaxed);
+  gCallbackThreadStopping.store(false, std::memory_order_relaxed);
+
+  gCallbackThread = new std::thread(runCallbackThread);
+  gCallbackThreadAccepting.store(true, std::memory_order_seq_cst);
+  return true;
+}
+
+void stopOBSCallbackThread(void) {
+  if (gCallbackThread == nullptr) {
+    return;
+  }
+  if (gCallbackThread->get_id() == std::this_thread::get_id()) {
+    fprintf(stderr, "stopOBSCallbackThread called from a tally callback; ignoring.\n");
+    return;
+  }
+
+  // New events run synchronously from here on.  Wait for producers that
+  // got in first, then let the thread drain the ring and exit.
+  gCallbackThreadAccepting.store(false, std::memory_order_seq_cst);
+  while (gCallbackProducers.load(std::memory_order_acquire) != 0) {
+    std::this_thread::yield();
+  }
+  gCallbackThreadStopping.store(true, std::memory_order_release);
+  wakeCallbackThread();
+
+  gCallbackThread->join();
+  delete gCallbackThread;
+  gCallbackThread = nullptr;
+  delete[] gCallbackSlots;
+  gCallbackSlots = nullptr;
+}
+
+void getOBSCallbackDispatchStatistics(OBSCallbackDispatchStatistics *statistics) {
+  statistics->dispatched = gCallbackDispatched.load(std::memory_order_relaxed);
+  statistics->stalls = gCallbackStalls.load(std::memory_order_relaxed);
+  statistics->queueDepth = gCallbackSlots == nullptr ? 0 : gCallbackQueueMask + 1;
+  statistics->maxQueued = gCallbackMaxQueued.load(std::memory_order_relaxed);
+}
+
+// Each of these returns false, without queueing, if the thread is not
+// running; the caller then runs the callback itself.
+static bool queueCallbackEvent(const CallbackEvent *event) {
+  if (!beginProducing()) {
+    return false;
+  }
+  enqueueCallbackEvent(event);
+  endProducing();
+  return true;
+}
+
+bool queueProgramCallback(void (*callback)(const char *sceneName), const char *sceneName) {
+  CallbackEvent event = {};
+  event.kind = kCallbackEventProgram;
+  event.sceneCallback = callback;
+  event.name = sceneName;
+  return queueCallbackEvent(&event);
+}
+
+bool queuePreviewCallback(void (*callback)(const char *sceneName, bool alsoOnProgram),
+                          const char *sceneName, bool alsoOnProgram) {
+  CallbackEvent event = {};
+  event.kind = kCallbackEventPreview;
+  event.previewCallback = callback;
+  event.name = sceneName;
+  event.onProgram = alsoOnProgram;
+  return queueCallbackEvent(&event);
+}
+
+bool queueInactiveCallback(void (*callback)(const char *sceneName), const char *sceneName) {
+  CallbackEvent event = {};
+  event.kind = kCallbackEventInactive;
+  event.sceneCallback = callback;
+  event.name = sceneName;
+  return queueCallbackEvent(&event);
+}
+
+bool queueSourceCallback(void (*callback)(const char *sourceName, bool onProgram,
+                                          bool onPreview),
+                         const char *sourceName, bool onProgram, bool onPreview) {
+  if (!callbackThreadRunning()) {
+    return false;
+  }
+
+  // Source names are not interned, so the event carries its own copy.
+  size_t length = strlen(sourceName) + 1;
+  char *name = (char *)bufferPoolAllocate(length);
+  if (name == NULL) {
+    return false;
+  }
+  memcpy(name, sourceName, length);
+
+  CallbackEvent event = {};
+  event.kind = kCallbackEventSource;
+  event.sourceCallback = callback;
+  event.name = name;
+  event.onProgram = onProgram;
+  event.onPreview = onPreview;
+  event.ownedBuffer = name;
+  if (!queueCallbackEvent(&event)) {
+    bufferPoolFree(name);
+    return false;
+  }
+  return true;
+}
+
+bool queueTallyDiffCallback(void (*callback)(const OBSTallyChange *changes, size_t count),
+                            const OBSTallyChange *changes, size_t count) {
+  if (!callbackThreadRunning()) {
+    return false;
+  }
+
+  // The caller reuses its array, so the event carries a copy.
+  OBSTallyChange *copy = (OBSTallyChange *)bufferPoolAllocate(count * sizeof(OBSTallyChange));
+  if (copy == NULL) {
+    return false;
+  }
+  memcpy(copy, changes, count * sizeof(OBSTallyChange));
+
+  CallbackEvent event = {};
+  event.kind = kCallbackEventTallyDiff;
+  event.diffCallback = callback;
+  event.changes = copy;
+  event.count = count;
+  event.ownedBuffer = copy;
+  if (!queueCallbackEvent(&event)) {
+    bufferPoolFree(copy);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef __CALLBACK_DISPATCH_H__
+#define __CALLBACK_DISPATCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "gettally.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Optional thread that runs the tally callbacks off the V8/libwebsockets
+// thread, so that a callback that blocks on serial or DMX output cannot
+// delay frame processing or pongs.
+//
+// Tally events go into a bounded, lock-free multi-producer/single-consumer
+// ring (one sequence number per slot, so producers only ever contend on a
+// single compare-and-swap).  The one consumer thread runs the callbacks in
+// queue order, so every scene's events arrive in the order they happened.
+// If the ring fills, the producer yields until the callback thread frees a
+// slot rather than dropping or reordering events, and the stall is
+// counted.
+//
+// Scene names are interned and live for the life of the process, so they
+// are queued by pointer.  Source names and diff arrays are copied into
+// pooled buffers and freed once the callback returns.
+
+// Each of these queues a call to callback and returns true, or returns
+// false if the callback thread is not running, in which case the caller
+// should call it directly.
+bool queueProgramCallback(void (*callback)(const char *sceneName), const char *sceneName);
+bool queuePreviewCallback(void (*callback)(const char *sceneName, bool alsoOnProgram),
+                          const char *sceneName, bool alsoOnProgram);
+bool queueInactiveCallback(void (*callback)(const char *sceneName), const char *sceneName);
+bool queueSourceCallback(void (*callback)(const char *sourceName, bool onProgram,
+                                          bool onPreview),
+                         const char *sourceName, bool onProgram, bool onPreview);
+bool queueTallyDiffCallback(void (*callback)(const OBSTallyChange *changes, size_t count),
+                            const OBSTallyChange *changes, size_t count);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif  // __CALLBACK_DISPATCH_H__
@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture_log.h"
+
+#define kCaptureInitialSize (4 * 1024 * 1024)
+
+struct OBSCaptureReader {
+  int descriptor;
+  uint8_t *mapping;
+  uint64_t mappedSize;
+  uint64_t offset;  // Of the next record, after the header.
+
+  // Mappings replaced as a live capture grew, kept so that payload pointers
+  // handed out earlier stay valid.
+  uint8_t **oldMappings;
+  uint64_t *oldMappedSizes;
+  int oldMappingCount;
+};
+
+// Every worker thread appends, so the writer state, including the mapping
+// that growCapture() replaces, is only touched under gCaptureMutex.
+static pthread_mutex_t gCaptureMutex = PTHREAD_MUTEX_INITIALIZER;
+static int gCaptureDescriptor = -1;
+static uint8_t *gCaptureMapping = NULL;
+static uint64_t gCaptureMappedSize = 0;
+static uint64_t gCaptureMaxBytes = 0;
+static uint64_t gCaptureLength = 0;
+
+#pragma mark - Support functions
+
+static uint64_t monotonicNanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t paddedLength(uint64_t length) {
+  return (length + 7) & ~(uint64_t)7;
+}
+
+static OBSCaptureHeader *captureHeader(uint8_t *mapping) {
+  return (OBSCaptureHeader *)mapping;
+}
+
+
+#pragma mark - Writer
+
+// Doubles the file until it holds size bytes.  Returns false if that would
+// pass the limit.
+static bool growCapture(uint64_t size) {
+  if (size > gCaptureMaxBytes) {
+    return false;
+  }
+  uint64_t newSize = gCaptureMappedSize;
+  while (newSize < size) {
+    newSize *= 2;
+  }
+  if (newSize > gCaptureMaxBytes) {
+    newSize = gCaptureMaxBytes;
+  }
+
+  if (ftruncate(gCaptureDescriptor, newSize) != 0) {
+    fprintf(stderr, "Could not grow capture file: %s\n", strerror(errno));
+    return false;
+  }
+  void *address = mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       gCaptureDescriptor, 0);
+  if (address == MAP_FAILED) {
+    fprintf(stderr, "Could not map capture file: %s\n", strerror(errno));
+    return false;
+  }
+  munmap(gCaptureMapping, gCaptureMappedSize);
+  gCaptureMapping = (uint8_t *)address;
+  gCaptureMappedSize = newSize;
+  return true;
+}
+
+static void disableCaptureLocked(void);
+
+bool enableOBSCapture(const char *path, uint64_t maxBytes) {
+  pthread_mutex_lock(&gCaptureMutex);
+  disableCaptureLocked();
+
+  if (maxBytes == 0) {
+    maxBytes = kOBSCaptureDefaultMaxBytes;
+  }
+  if (maxBytes < sizeof(OBSCaptureHeader) + sizeof(OBSCaptureRecord)) {
+    fprintf(stderr, "Capture size limit %llu is too small.\n", (unsigned long long)maxBytes);
+    pthread_mutex_unlock(&gCaptureMutex);
+    return false;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open capture file %s: %s\n", path, strerror(errno));
+    pthread_mutex_unlock(&gCaptureMutex);
+    return false;
+  }
+  uint64_t size = (maxBytes < kCaptureInitialSize) ? maxBytes : kCaptureInitialSize;
+  if (ftruncate(fd, size) != 0) {
+    fprintf(stderr, "Could not size capture file %s: %s\n", path, strerror(errno));
+    close(fd);
+    pthread_mutex_unlock(&gCaptureMutex);
+    return false;
+  }
+  void *address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    fprintf(stderr, "Could not map capture file %s: %s\n", path, strerror(errno));
+    close(fd);
+    pthread_mutex_unlock(&gCaptureMutex);
+    return false;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  OBSCaptureHeader *header = captureHeader((uint8_t *)address);
+  header->version = kOBSCaptureVersion;
+  header->length = 0;
+  header->startTimeNanoseconds = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+  header->droppedRecords = 0;
+  __atomic_store_n(&header->magic, kOBSCaptureMagic, __ATOMIC_RELEASE);
+
+  gCaptureDescriptor = fd;
+  gCaptureMapping = (uint8_t *)address;
+  gCaptureMappedSize = size;
+  gCaptureMaxBytes = maxBytes;
+  gCaptureLength = 0;
+  pthread_mutex_unlock(&gCaptureMutex);
+  return true;
+}
+
+void disableOBSCapture(void) {
+  pthread_mutex_lock(&gCaptureMutex);
+  disableCaptureLocked();
+  pthread_mutex_unlock(&gCaptureMutex);
+}
+
+static void disableCaptureLocked(void) {
+  if (gCaptureMapping == NULL) {
+    return;
+  }
+  munmap(gCaptureMapping, gCaptureMappedSize);
+  if (ftruncate(gCaptureDescriptor, sizeof(OBSCaptureHeader) + gCaptureLength) != 0) {
+    fprintf(stderr, "Could not trim capture file: %s\n", strerror(errno));
+  }
+  close(gCaptureDescriptor);
+  gCaptureDescriptor = -1;
+  gCaptureMapping = NULL;
+  gCaptureMappedSize = 0;
+}
+
+void captureOBSFrame(uint8_t kind, uint32_t connectionID, uint8_t flags,
+                     const void *data, size_t length) {
+  pthread_mutex_lock(&gCaptureMutex);
+  if (gCaptureMapping == NULL) {
+    pthread_mutex_unlock(&gCaptureMutex);
+    return;
+  }
+
+  uint64_t recordSize = sizeof(OBSCaptureRecord) + paddedLength(length);
+  uint64_t end = sizeof(OBSCaptureHeader) + gCaptureLength + recordSize;
+  if (length > UINT32_MAX || (end > gCaptureMappedSize && !growCapture(end))) {
+    captureHeader(gCaptureMapping)->droppedRecords++;
+    pthread_mutex_unlock(&gCaptureMutex);
+    return;
+  }
+
+  // The file was extended with zeros, so the padding is already there.
+  uint8_t *position = gCaptureMapping + sizeof(OBSCaptureHeader) + gCaptureLength;
+  OBSCaptureRecord record;
+  memset(&record, 0, sizeof(record));
+  record.length = (uint32_t)length;
+  record.kind = kind;
+  record.flags = flags;
+  record.connectionID = connectionID;
+  record.timestampNanoseconds = monotonicNanoseconds();
+  memcpy(position, &record, sizeof(record));
+  if (length > 0) {
+    memcpy(position + sizeof(record), data, length);
+  }
+
+  gCaptureLength += recordSize;
+  __atomic_store_n(&captureHeader(gCaptureMapping)->length, gCaptureLength, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&gCaptureMutex);
+}
+
+
+#pragma mark - Reader
+
+// Maps the whole file as it is now, keeping the old mapping alive.
+static bool remapReader(OBSCaptureReader *reader) {
+  struct stat info;
+  if (fstat(reader->descriptor, &info) != 0 || (uint64_t)info.st_size <= reader->mappedSize) {
+    return false;
+  }
+  void *address = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, reader->descriptor, 0);
+  if (address == MAP_FAILED) {
+    return false;
+  }
+
+  if (reader->mapping != NULL) {
+    int count = reader->oldMappingCount + 1;
+    reader->oldMappings = realloc(reader->oldMappings, count * sizeof(uint8_t *));
+    reader->oldMappedSizes = realloc(reader->oldMappedSizes, count * sizeof(uint64_t));
+    reader->oldMappings[count - 1] = reader->mapping;
+    reader->oldMappedSizes[count - 1] = reader->mappedSize;
+    reader->oldMappingCount = count;
+  }
+  reader->mapping = (uint8_t *)address;
+  reader->mappedSize = info.st_size;
+  return true;
+}
+
+OBSCaptureReader *openOBSCaptureReader(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open capture file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  OBSCaptureReader *reader = calloc(1, sizeof(OBSCaptureReader));
+  reader->descriptor = fd;
+  if (!remapReader(reader) || reader->mappedSize < sizeof(OBSCaptureHeader)) {
+    fprintf(stderr, "Capture file %s is empty.\n", path);
+    closeOBSCaptureReader(reader);
+    return NULL;
+  }
+
+  OBSCaptureHeader *header = captureHeader(reader->mapping);
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != kOBSCaptureMagic ||
+      header->version != kOBSCaptureVersion) {
+    fprintf(stderr, "%s is not a capture file this version can read.\n", path);
+    closeOBSCaptureReader(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+void closeOBSCaptureReader(OBSCaptureReader *reader) {
+  if (reader == NULL) {
+    return;
+  }
+  for (int i = 0; i < reader->oldMappingCount; i++) {
+    munmap(reader->oldMappings[i], reader->oldMappedSizes[i]);
+  }
+  if (reader->mapping != NULL) {
+    munmap(reader->mapping, reader->mappedSize);
+  }
+  close(reader->descriptor);
+  free(reader->oldMappings);
+  free(reader->oldMappedSizes);
+  free(reader);
+}
+
+bool nextOBSCaptureRecord(OBSCaptureReader *reader, OBSCaptureRecord *record,
+                          const uint8_t **payload) {
+  uint64_t length = __atomic_load_n(&captureHeader(reader->mapping)->length, __ATOMIC_ACQUIRE);
+  if (reader->offset + sizeof(OBSCaptureRecord) > length) {
+    return false;
+  }
+  if (sizeof(OBSCaptureHeader) + length > reader->mappedSize && !remapReader(reader)) {
+    return false;
+  }
+
+  const uint8_t *position = reader->mapping + sizeof(OBSCaptureHeader) + reader->offset;
+  memcpy(record, position, sizeof(OBSCaptureRecord));
+  uint64_t recordSize = sizeof(OBSCaptureRecord) + paddedLength(record->length);
+  if (reader->offset + recordSize > length) {
+    fprintf(stderr, "Capture record at offset %llu runs past the end.\n",
+            (unsigned long long)reader->offset);
+    return false;
+  }
+  *payload = position + sizeof(OBSCaptureRecord);
+  reader->offset += recordSize;
+  return true;
+}
+
+void rewindOBSCaptureReader(OBSCaptureReader *reader) {
+  reader->offset = 0;
+}
+
+uint64_t getOBSCaptureDroppedRecords(OBSCaptureReader *reader) {
+  return captureHeader(reader->mapping)->droppedRecords;
+}
@@ -0,0 +1,101 @@
+#ifndef __CAPTURE_LOG_H__
+#define __CAPTURE_LOG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Records every WebSocket frame the tally library sends and receives, in
+// order, so that an incident can be reproduced from exactly what OBS sent.
+//
+// The capture is an append-only memory-mapped file: a header, then one
+// record per frame or connection event, each followed by its payload padded
+// to 8 bytes.  Appending is a memcpy into the mapping; the file doubles in
+// size (up to the limit) when it fills.  The header's length is stored last,
+// so a reader following a live capture never sees a partial record.  When
+// capture is disabled, the file is truncated to what was written.
+//
+// bin/mock_obs -r plays a capture back to a client, which sends it through
+// the same receive path.  Reader processes only need this header and
+// capture_log.c.
+
+#define kOBSCaptureMagic 0x4353424f  // "OBSC"
+#define kOBSCaptureVersion 1
+#define kOBSCaptureDefaultMaxBytes (1024ull * 1024 * 1024)
+
+enum {
+  kOBSCaptureReceived = 0,  // A frame (or fragment) from the server.
+  kOBSCaptureSent = 1,      // A message to the server.
+  kOBSCaptureOpened = 2,    // Payload is the negotiated subprotocol.
+  kOBSCaptureClosed = 3     // Payload is a close frame: big-endian code, reason.
+};
+
+enum {
+  kOBSCaptureBinary = 1 << 0,
+  kOBSCaptureFirstFragment = 1 << 1,
+  kOBSCaptureFinalFragment = 1 << 2
+};
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t length;                // Bytes of records after the header.
+  uint64_t startTimeNanoseconds;  // CLOCK_REALTIME when capture began.
+  uint64_t droppedRecords;        // Did not fit under the size limit.
+} OBSCaptureHeader;
+
+typedef struct {
+  uint32_t length;  // Payload bytes, not counting padding.
+  uint8_t kind;     // kOBSCaptureReceived etc.
+  uint8_t flags;    // kOBSCaptureBinary etc.
+  uint16_t reserved;
+  uint32_t connectionID;
+  uint32_t reserved2;
+  uint64_t timestampNanoseconds;  // CLOCK_MONOTONIC.
+} OBSCaptureRecord;
+
+
+#pragma mark - Writer (used by the tally library)
+
+// Creates (or replaces) the capture file at path and starts recording.
+// Records that would take the file past maxBytes (0 for the default of
+// 1 GB) are dropped and counted.  Call before runOBSTally(); the library
+// writes the capture from its V8 thread and every instance's worker
+// thread, one record at a time.
+bool enableOBSCapture(const char *path, uint64_t maxBytes);
+void disableOBSCapture(void);
+
+// Appends a record.  Does nothing if capture is not enabled.
+void captureOBSFrame(uint8_t kind, uint32_t connectionID, uint8_t flags,
+                     const void *data, size_t length);
+
+
+#pragma mark - Reader (used by other processes)
+
+typedef struct OBSCaptureReader OBSCaptureReader;
+
+OBSCaptureReader *openOBSCaptureReader(const char *path);
+void closeOBSCaptureReader(OBSCaptureReader *reader);
+
+// Copies the next record and points payload at its data, which stays valid
+// until the reader is closed.  Returns false at the end of what has been
+// written so far; a capture that is still being written may have more
+// later.
+bool nextOBSCaptureRecord(OBSCaptureReader *reader, OBSCaptureRecord *record,
+                          const uint8_t **payload);
+
+// Starts again from the first record.
+void rewindOBSCaptureReader(OBSCaptureReader *reader);
+
+// Returns the header's dropped record count.
+uint64_t getOBSCaptureDroppedRecords(OBSCaptureReader *reader);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif  // __CAPTURE_LOG_H__
@@ -9,6 +9,9 @@
 #include <uuid/uuid.h>
 
 
+#include "callback_dispatch.h"
+#include "gettally.h"
+#include "logger.h"
 #include "v8_setup.h"
 
 // This supports ONLY the new 5.0 protocol.
@@ -16,6 +19,8 @@
 void (*gProgramCallback)(const char *sceneName);
 void (*gPreviewCallback)(const char *sceneName, bool alsoOnProgram);
 void (*gInactiveCallback)(const char *sceneName);
+void (*gSourceCallback)(const char *sourceName, bool onProgram, bool onPreview);
+void (*gTallyDiffCallback)(const OBSTallyChange *changes, size_t count);
 
 void registerOBSProgramCallback(void (*callbackPointer)(const char *sceneName)) {
   gProgramCallback = callbackPointer;
@@ -30,6 +35,25 @@ void registerOBSInactiveCallback(void (*callbackPointer)(const char *sceneName))
   gInactiveCallback = callbackPointer;
 }
 
+void registerOBSSourceCallback(void (*callbackPointer)(const char *sourceName,
+                                                       bool onProgram,
+                                                       bool onPreview)) {
+  gSourceCallback = callbackPointer;
+}
+
+void registerOBSTallyDiffCallback(void (*callbackPointer)(const OBSTallyChange *changes,
+                                                          size_t count)) {
+  gTallyDiffCallback = callbackPointer;
+}
+
+// Runs the built-in scripts in the current isolate.  Also called by each
+// instance from obsTallyCreate(), on its worker thread.
+void _loadOBSTallyScripts(void) {
+  runStaticScript("websocket.js", websocket_js);
+  runStaticScript("obs-websocket.js", obs_websocket_js);
+  runStaticScript("gettally.js", gettally_js);
+}
+
 void runOBSTally(char *OBSWebSocketURL, char *password) {
   setOBSURL(OBSWebSocketURL);
   setOBSPassword(password);
@@ -37,9 +61,7 @@ void runOBSTally(char *OBSWebSocketURL, char *password) {
 #if 1
   void *isolate = v8_setup();
 #if 1
-  runScript(websocket_js);
-  runScript(obs_websocket_js);
-  runScript(gettally_js);
+  _loadOBSTallyScripts();
 #else
   runScriptAsModule("websocket_js", websocket_js);
   runScriptAsModule("obs_websocket_js", obs_websocket_js);
@@ -53,32 +75,43 @@ void runOBSTally(char *OBSWebSocketURL, char *password) {
 #endif
 }
 
+// With the callback thread running, these queue the call instead of making
+// it, so that a slow callback never holds up the V8 thread.
+
 void _setSceneIsProgram(const char *sceneName) {
-  fprintf(stderr, "Calling program callback.\n");
-  if (gProgramCallback != NULL) {
+  if (gProgramCallback == NULL) {
+    OBSLOG(kOBSLogDebug, "Not setting program (no callback)\n");
+  } else if (!queueProgramCallback(gProgramCallback, sceneName)) {
     gProgramCallback(sceneName);
-  } else {
-    fprintf(stderr, "Not setting program (no callback)\n");
   }
-  fprintf(stderr, "Done.\n");
 }
 
 void _setSceneIsPreview(const char *sceneName, bool alsoOnProgram) {
-  fprintf(stderr, "Calling preview callback.\n");
-  if (gPreviewCallback != NULL) {
+  if (gPreviewCallback == NULL) {
+    OBSLOG(kOBSLogDebug, "Not setting preview (no callback)\n");
+  } else if (!queuePreviewCallback(gPreviewCallback, sceneName, alsoOnProgram)) {
     gPreviewCallback(sceneName, alsoOnProgram);
-  } else {
-    fprintf(stderr, "Not setting preview (no callback)\n");
   }
-  fprintf(stderr, "Done.\n");
 }
 
 void _setSceneIsInactive(const char *sceneName) {
-  fprintf(stderr, "Calling inactive callback.\n");
-  if (gInactiveCallback != NULL) {
+  if (gInactiveCallback == NULL) {
+    OBSLOG(kOBSLogDebug, "Not setting inactive (no callback)\n");
+  } else if (!queueInactiveCallback(gInactiveCallback, sceneName)) {
     gInactiveCallback(sceneName);
-  } else {
-    fprintf(stderr, "Not setting inactive (no callback)\n");
   }
-  fprintf(stderr, "Done.\n");
+}
+
+void _setSourceTally(const char *sourceName, bool onProgram, bool onPreview) {
+  if (gSourceCallback != NULL &&
+      !queueSourceCallback(gSourceCallback, sourceName, onProgram, onPreview)) {
+    gSourceCallback(sourceName, onProgram, onPreview);
+  }
+}
+
+void _reportTallyDiff(const OBSTallyChange *changes, size_t count) {
+  if (gTallyDiffCallback != NULL &&
+      !queueTallyDiffCallback(gTallyDiffCallback, changes, count)) {
+    gTallyDiffCallback(changes, count);
+  }
 }
@@ -0,0 +1,598 @@
+#ifndef __GETTALLY_H__
+#define __GETTALLY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// This supports ONLY the new 5.0 protocol.
+
+#pragma mark - Tally callbacks
+
+void registerOBSProgramCallback(void (*callbackPointer)(const char *sceneName));
+void registerOBSPreviewCallback(void (*callbackPointer)(const char *sceneName,
+                                                        bool alsoOnProgram));
+void registerOBSInactiveCallback(void (*callbackPointer)(const char *sceneName));
+
+// Called whenever an individual source (including a nested scene or group)
+// starts or stops being visible on program or preview, as computed from the
+// cached scene graph.
+void registerOBSSourceCallback(void (*callbackPointer)(const char *sourceName,
+                                                       bool onProgram,
+                                                       bool onPreview));
+
+// Looks up the current tally state of a source in the cached scene graph.
+// Returns false if the source is not visible on either output.
+bool getOBSSourceTally(const char *sourceName, bool *onProgram, bool *onPreview);
+
+// How a scene's tally state changed.  A scene that leaves program and
+// preview at the same time is reported as kOBSTallyWentInactive.
+typedef enum {
+  kOBSTallyEnteredProgram = 0,
+  kOBSTallyLeftProgram = 1,    // Still on preview.
+  kOBSTallyEnteredPreview = 2,
+  kOBSTallyLeftPreview = 3,    // Still on program.
+  kOBSTallyWentInactive = 4
+} OBSTallyChangeKind;
+
+// sceneID is a small integer that identifies the scene for the life of the
+// process.  sceneName is owned by the library and also stays valid for the
+// life of the process.
+typedef struct {
+  uint32_t sceneID;
+  const char *sceneName;
+  OBSTallyChangeKind kind;
+  bool onProgram;
+  bool onPreview;
+} OBSTallyChange;
+
+// Called once per program/preview update with every scene whose state
+// changed.  Scenes whose state did not change are not mentioned, and the
+// callback is not called at all if nothing changed.
+void registerOBSTallyDiffCallback(void (*callbackPointer)(const OBSTallyChange *changes,
+                                                          size_t count));
+
+// Fast cuts and stinger transitions produce several preview and program
+// changes within a few milliseconds.  With a nonzero window, the first
+// change opens the window, later changes replace it, and the callbacks (and
+// the tally server and shared snapshot) see only the net difference when
+// the window closes.  0, the default, reports every change immediately.
+void setOBSTallyCoalescingWindow(uint32_t microseconds);
+
+// How many program/preview states were replaced by a later one before the
+// coalescing window closed, and so never reported.
+uint64_t getOBSTallySuppressedStates(void);
+
+// Returns the name for a sceneID, or NULL if the ID is unknown.
+const char *getOBSSceneName(uint32_t sceneID);
+
+// Starts a WebSocket server on port (bound to interfaceName, or all
+// interfaces if NULL) that sends every tally change to its subscribers as
+// JSON.  New subscribers first receive the full state.  Subscribers that
+// fall more than maxQueuedFrames behind are sent only the latest state.
+// Use the "obs-tally" subprotocol (or none).  Call before runOBSTally().
+bool startOBSTallyServer(int port, const char *interfaceName, int maxQueuedFrames);
+void stopOBSTallyServer(void);
+
+// Connects to OBS and services the connection forever.
+void runOBSTally(char *OBSWebSocketURL, char *password);
+
+
+#pragma mark - Multiple instances
+
+// For a control room with several OBS machines.  Each instance has its own
+// V8 isolate, connection, and tally state, and runs on one of a pool of
+// worker threads; the instances on a worker share its libwebsockets
+// context.  An instance reports only to its own callbacks, which run on its
+// worker thread, one instance at a time, so a slow callback holds up the
+// other instances on that worker.  The register*Callback() functions, the
+// tally server, the shared-memory snapshot, the commands from other
+// threads, and the profiling functions all stay with runOBSTally(), which
+// may run alongside any number of instances.  The settings made before
+// runOBSTally() apply to every instance created after them.
+
+typedef struct OBSTallyInstance OBSTallyInstance;
+
+// Like the register*Callback() functions, plus the instance and context.
+// Any of them may be NULL.  sceneID and sceneName belong to the instance,
+// and stay valid until it is destroyed.
+typedef struct {
+  void (*program)(OBSTallyInstance *instance, const char *sceneName, void *context);
+  void (*preview)(OBSTallyInstance *instance, const char *sceneName, bool alsoOnProgram,
+                  void *context);
+  void (*inactive)(OBSTallyInstance *instance, const char *sceneName, void *context);
+  void (*source)(OBSTallyInstance *instance, const char *sourceName, bool onProgram,
+                 bool onPreview, void *context);
+  void (*tallyDiff)(OBSTallyInstance *instance, const OBSTallyChange *changes, size_t count,
+                    void *context);
+  void *context;
+} OBSTallyCallbacks;
+
+// How many worker threads the instances share; 0, the default, is one per
+// core, up to four.  Each new instance goes to the worker with the fewest.
+// Call before the first obsTallyCreate().
+bool setOBSTallyWorkerThreads(int count);
+
+// Starts connecting to OBS at URL, reconnecting whenever the connection is
+// lost, and returns at once.  The strings and callbacks are copied.
+// Returns NULL if the arguments are invalid.
+OBSTallyInstance *obsTallyCreate(const char *URL, const char *password,
+                                 const OBSTallyCallbacks *callbacks);
+
+// Closes the connection, waits for the worker to let go of the instance,
+// and frees it.  Must not be called from one of the instance's callbacks
+// (or any other callback on the same worker).
+void obsTallyDestroy(OBSTallyInstance *instance);
+
+// getOBSSceneName() for an instance.  Call from the instance's callbacks.
+const char *obsTallyGetSceneName(OBSTallyInstance *instance, uint32_t sceneID);
+
+
+#pragma mark - Callback dispatch
+
+// By default every callback above runs on the thread that services OBS, so
+// a callback that blocks (serial or DMX output, say) delays everything else,
+// including keepalive pongs.  This starts a dedicated thread that runs them
+// instead.  Callbacks still run one at a time and in the order the changes
+// happened.  queueDepth (0 for the default of 256) is rounded up to a power
+// of two; if that many events are waiting, the OBS thread waits for the
+// callback thread to catch up rather than lose or reorder any.  Callbacks
+// must not call stopOBSCallbackThread().
+bool startOBSCallbackThread(size_t queueDepth);
+
+// Runs any queued callbacks, then stops the thread.  Callbacks run directly
+// again afterward.
+void stopOBSCallbackThread(void);
+
+typedef struct {
+  uint64_t dispatched;  // Callbacks run on the callback thread.
+  uint64_t stalls;      // Times the OBS thread found the queue full.
+  size_t queueDepth;    // 0 if the thread is not running.
+  size_t maxQueued;     // Most events ever waiting at once.
+} OBSCallbackDispatchStatistics;
+
+void getOBSCallbackDispatchStatistics(OBSCallbackDispatchStatistics *statistics);
+
+
+#pragma mark - Compression
+
+// permessage-deflate (RFC 7692) settings for connections to OBS.  Window
+// sizes are in bits (9-15; 15 is the zlib default).  Smaller windows and
+// no context takeover save memory and CPU per connection at the cost of
+// compression ratio.  The server may narrow what is offered; the WebSocket
+// extensions property reports what was actually negotiated.
+typedef struct {
+  bool enabled;
+  int clientMaxWindowBits;       // Window we compress with.
+  int serverMaxWindowBits;       // Window we ask OBS to compress with.
+  bool clientNoContextTakeover;  // Reset our compressor after every message.
+  bool serverNoContextTakeover;  // Ask OBS to reset its compressor too.
+  int compressionLevel;          // zlib level, 1 (fastest) to 9 (smallest).
+  int memoryLevel;               // zlib memLevel, 1 to 9.
+} OBSCompressionOptions;
+
+// Fills in the defaults: enabled, 15-bit windows, context takeover, level 6,
+// memory level 8.
+void getDefaultOBSCompressionOptions(OBSCompressionOptions *options);
+
+// Applies to connections opened after the call.  Call before runOBSTally().
+// Returns false (and changes nothing) if a value is out of range, or if
+// compression is requested but libwebsockets was built without extensions.
+bool setOBSCompressionOptions(const OBSCompressionOptions *options);
+
+
+#pragma mark - Outgoing backpressure
+
+// What happens to a send that would take a connection's outgoing queue past
+// its high watermark.  Whatever the policy, once the queue reaches the high
+// watermark the WebSocket fires a "drain" event when it falls back to the
+// low watermark.  A message is always accepted if the queue is empty.
+typedef enum {
+  kOBSSendPolicyQueue = 0,     // Queue it anyway.
+  kOBSSendPolicyReject = 1,    // Refuse it; WebSocket.send() throws.
+  kOBSSendPolicyCoalesce = 2   // Replace the newest queued message with the
+                               // same coalesce key, or refuse it if none.
+} OBSSendPolicy;
+
+// Defaults for connections opened after the call (4 MB, 1 MB, reject).
+// JavaScript can override them per connection with setSendLimits().
+void setOBSSendLimits(size_t highWatermark, size_t lowWatermark, OBSSendPolicy policy);
+
+
+#pragma mark - Incoming overload
+
+// What to do when messages from OBS arrive faster than JavaScript handles
+// them and a connection's incoming queue goes over its limits.
+typedef enum {
+  // Stop reading from the socket (lws_rx_flow_control) until the queue
+  // falls to the resume limits.  Nothing is lost; OBS buffers instead.
+  kOBSReceivePolicyPause = 0,
+  // Discard the oldest queued events.  Request responses are never
+  // discarded; if only responses are left, reading pauses instead.
+  kOBSReceivePolicyDropOldest = 1,
+  // Replace an older queued state-change event (program or preview scene,
+  // transition, studio mode, volume meters) with a newer one of the same
+  // type.  Other messages pause reading instead.
+  kOBSReceivePolicyCoalesce = 2
+} OBSReceivePolicy;
+
+typedef struct {
+  size_t maxBytes;
+  size_t maxMessages;
+  size_t resumeBytes;     // Reading resumes once the queue is at or below
+  size_t resumeMessages;  // both of these.
+  OBSReceivePolicy policy;
+} OBSReceiveLimits;
+
+// Totals across all connections.
+typedef struct {
+  uint64_t droppedMessages;    // Discarded by kOBSReceivePolicyDropOldest.
+  uint64_t coalescedMessages;  // Replaced by kOBSReceivePolicyCoalesce.
+  uint64_t droppedBytes;       // Payload bytes of both of the above.
+  uint64_t pauses;             // Times reading was paused.
+} OBSReceiveStatistics;
+
+// Defaults for connections opened after the call (16 MB, 4096 messages,
+// resume at 4 MB and 1024 messages, pause).  JavaScript can override them
+// per connection with setReceiveLimits().  Returns false if the resume
+// limits exceed the maximums or a maximum is zero.
+bool setOBSReceiveLimits(const OBSReceiveLimits *limits);
+void getOBSReceiveStatistics(OBSReceiveStatistics *statistics);
+
+
+#pragma mark - Keepalive
+
+// Connections to OBS send a WebSocket ping every interval and are dropped
+// (which starts the usual reconnect) once maxMissedPongs pings in a row go
+// unanswered, so a dead network link is noticed in seconds rather than
+// when TCP gives up minutes later.
+//
+// Every pong's round-trip time goes into a histogram.  Bucket i counts
+// round trips shorter than kOBSRoundTripHistogramBase << i microseconds
+// (starting at 250 us); the last bucket counts everything longer.
+
+#define kOBSRoundTripHistogramBuckets 16
+#define kOBSRoundTripHistogramBase 250
+
+// Times are in microseconds.  Totals across all connections; the last,
+// smoothed, minimum, and maximum round trips are meaningless until
+// pongsReceived is nonzero.
+typedef struct {
+  uint64_t pingsSent;
+  uint64_t pongsReceived;
+  uint64_t timeouts;           // Connections dropped for missing pongs.
+  uint64_t lastRoundTrip;
+  uint64_t smoothedRoundTrip;  // Weighted like TCP's SRTT (RFC 6298).
+  uint64_t minRoundTrip;
+  uint64_t maxRoundTrip;
+  uint64_t totalRoundTrip;     // Divide by pongsReceived for the mean.
+  uint64_t histogram[kOBSRoundTripHistogramBuckets];
+} OBSKeepaliveStatistics;
+
+// Defaults for connections opened after the call (2000 ms, 3 missed pongs).
+// An interval of 0 turns pings off.  JavaScript can override them per
+// connection with setKeepalive().  Returns false if pings are on and
+// maxMissedPongs is 0.
+bool setOBSKeepalive(uint32_t intervalMilliseconds, uint32_t maxMissedPongs);
+void getOBSKeepaliveStatistics(OBSKeepaliveStatistics *statistics);
+
+
+#pragma mark - Request batches
+
+// Execution modes for RequestBatch (op 8).  Values match the obs-websocket
+// RequestBatchExecutionType enumeration.
+typedef enum {
+  kOBSBatchExecutionSerialRealtime = 0,
+  kOBSBatchExecutionSerialFrame = 1,
+  kOBSBatchExecutionParallel = 2
+} OBSBatchExecutionType;
+
+// Called once per request in the batch.  responseDataJSON is the request's
+// responseData serialized as JSON (or NULL if the response had none), and is
+// only valid for the duration of the call.  If the batch could not be sent or
+// the connection closed before a response arrived, succeeded is false and
+// statusCode is -1.
+typedef void (*OBSRequestCallback)(const char *requestType, bool succeeded,
+                                   int statusCode, const char *comment,
+                                   const char *responseDataJSON,
+                                   void *context);
+
+typedef struct OBSRequestBatch OBSRequestBatch;
+
+// Batches can be created and filled on any thread, but sendOBSRequestBatch()
+// must be called from the thread that runs the V8 loop (for example, from
+// inside one of the tally callbacks, where it goes to that callback's
+// instance).  Other threads use submitOBSRequestBatch() instead.
+OBSRequestBatch *createOBSRequestBatch(OBSBatchExecutionType executionType,
+                                       bool haltOnFailure);
+
+// requestDataJSON may be NULL for requests that take no parameters.
+bool addOBSBatchRequest(OBSRequestBatch *batch, const char *requestType,
+                        const char *requestDataJSON,
+                        OBSRequestCallback callback, void *context);
+
+// Sends every queued request in one RequestBatch message.  Takes ownership
+// of the batch whether or not it succeeds.
+bool sendOBSRequestBatch(OBSRequestBatch *batch);
+
+// Frees a batch that was never sent.
+void discardOBSRequestBatch(OBSRequestBatch *batch);
+
+
+#pragma mark - Commands from other threads
+
+// These are safe to call from any thread.  Each queues a command for the
+// V8 loop, wakes it if it is waiting for network events, and returns
+// without waiting for the command to run.  The loop runs everything queued
+// since its last pass in one batch, in the order it was submitted, so no
+// lock is shared with the loop.  Request callbacks run on the loop thread.
+
+// Sends text to OBS as a single text frame, exactly as given.  Dropped,
+// with a message on stderr, if OBS is not connected and identified or the
+// send queue refuses it.
+bool submitOBSRawFrame(const char *text, size_t length);
+
+// Equivalent to sendOBSRequestBatch() with a batch of one request.
+bool submitOBSRequest(const char *requestType, const char *requestDataJSON,
+                      OBSRequestCallback callback, void *context);
+
+// Takes ownership of the batch.
+bool submitOBSRequestBatch(OBSRequestBatch *batch);
+
+// Closes the connection to OBS and stops reconnecting.
+bool submitOBSClose(void);
+
+// Closes the connection to OBS (if any) and connects again right away.
+bool submitOBSReconnect(void);
+
+
+#pragma mark - Metrics
+
+// The library keeps counters per connection (frames and bytes each way,
+// queue depths, drops), histograms of how long things take, and a sample
+// of V8's heap statistics.  getOBSMetricsSnapshot() copies them from any
+// thread; startOBSMetricsServer() also serves them, along with the
+// statistics above, in Prometheus text format.
+//
+// Histogram bucket i counts values of at most 1 << i microseconds; the last
+// bucket counts everything longer.
+
+#define kOBSMetricsHistogramBuckets 24
+#define kOBSMetricsMaxConnections 8
+
+typedef struct {
+  uint64_t count;
+  uint64_t sumMicroseconds;
+  uint64_t buckets[kOBSMetricsHistogramBuckets];
+} OBSMetricsHistogram;
+
+// Queue depths are as of the end of the last loop pass.  For the totals,
+// connectionID is 0 and the depths are summed over open connections.
+typedef struct {
+  uint32_t connectionID;
+  uint64_t framesReceived;  // Fragments count separately.
+  uint64_t bytesReceived;
+  uint64_t framesSent;
+  uint64_t bytesSent;
+  uint64_t receiveDrops;    // Dropped or coalesced; see OBSReceivePolicy.
+  uint64_t sendRefusals;    // See OBSSendPolicy.
+  uint64_t incomingQueueMessages;
+  uint64_t incomingQueueBytes;
+  uint64_t outgoingQueueMessages;
+  uint64_t outgoingQueueBytes;
+} OBSConnectionMetrics;
+
+// From v8::HeapStatistics.  sampledAt is CLOCK_MONOTONIC microseconds, or
+// 0 if the heap has not been sampled yet.
+typedef struct {
+  uint64_t totalHeapSize;
+  uint64_t usedHeapSize;
+  uint64_t heapSizeLimit;
+  uint64_t externalMemory;
+  uint64_t mallocedMemory;
+  uint64_t peakMallocedMemory;
+  uint64_t nativeContexts;
+  uint64_t detachedContexts;
+  uint64_t sampledAt;
+} OBSHeapMetrics;
+
+typedef struct {
+  OBSConnectionMetrics totals;     // Every connection, open or closed.
+  uint64_t connectionsOpened;
+  uint64_t connectionsClosed;
+  uint64_t reconnects;
+  OBSMetricsHistogram loopIteration;  // One pass of the run loop.
+  OBSMetricsHistogram jsDispatch;     // One message handed to JavaScript.
+  OBSMetricsHistogram tallyLatency;   // Message received to callbacks run
+                                      // (or queued for the callback thread).
+  OBSHeapMetrics heap;
+  uint32_t connectionCount;        // Open connections, up to the maximum.
+  OBSConnectionMetrics connections[kOBSMetricsMaxConnections];
+} OBSMetricsSnapshot;
+
+void getOBSMetricsSnapshot(OBSMetricsSnapshot *snapshot);
+
+// How often the V8 thread samples heap statistics (default 5000 ms; 0 for
+// never).  A new interval takes effect after the next sample.
+void setOBSHeapSampleInterval(uint32_t milliseconds);
+
+// Serves GET /metrics in Prometheus text format on 127.0.0.1:port.  Call
+// before runOBSTally().
+bool startOBSMetricsServer(int port);
+void stopOBSMetricsServer(void);
+
+
+#pragma mark - Garbage collection
+
+// V8's heap sizes in bytes (0 leaves V8's default).  Call before
+// runOBSTally().  If the heap nears its maximum anyway, queued events are
+// dropped and the connection to OBS is reopened, rather than V8 aborting
+// the process.
+typedef struct {
+  size_t initialOldGenerationBytes;
+  size_t maxOldGenerationBytes;
+  size_t initialYoungGenerationBytes;
+  size_t maxYoungGenerationBytes;
+} OBSHeapLimits;
+
+bool setOBSHeapLimits(const OBSHeapLimits *limits);
+
+// Once nothing has been waiting to be handled for quietMilliseconds
+// (default 20; 0 to turn this off), each pass of the run loop lets V8
+// collect garbage for up to sliceMilliseconds (default 2) until it runs
+// out of work, so that major collections happen between bursts rather
+// than during them.  After memoryPressureMilliseconds of quiet (default
+// 5000; 0 for never), V8 is told memory is under moderate pressure, once
+// per quiet spell, so that it shrinks the heap then.
+void setOBSIdleGC(uint32_t quietMilliseconds, uint32_t sliceMilliseconds,
+                  uint32_t memoryPressureMilliseconds);
+
+// Busy pauses are GC pauses outside the idle work above: the ones that
+// can delay a tally change.
+typedef struct {
+  uint64_t pauses;
+  uint64_t pauseMicroseconds;
+  uint64_t busyPauses;
+  uint64_t busyPauseMicroseconds;
+  uint64_t idleSlices;
+  uint64_t idleMicroseconds;
+  uint64_t memoryPressureNotifications;
+  uint64_t heapLimitEvents;  // Times the heap neared its limit.
+} OBSGCStatistics;
+
+void getOBSGCStatistics(OBSGCStatistics *statistics);
+
+
+#pragma mark - Runtime profile
+
+typedef enum {
+  kOBSRuntimeProfileDefault = 0,
+  // For boards with 256 MB or so.  V8 runs without its JIT compilers
+  // (--jitless, --lite-mode) and with one worker thread, 1 MB semi-spaces
+  // and a 32 MB old generation.  The built-in scripts are read in place
+  // rather than copied into the heap, and each connection reads in 4 KB
+  // pieces, with 1 MB receive queues, 256 KB send queues and 10-bit
+  // compression windows.  Tally latency rises somewhat, since JavaScript
+  // is interpreted.
+  kOBSRuntimeProfileLowMemory = 1
+} OBSRuntimeProfile;
+
+// Call before runOBSTally(), and before any of setOBSHeapLimits(),
+// setOBSIdleGC(), setOBSReceiveLimits(), setOBSSendLimits() and
+// setOBSCompressionOptions() whose settings should override the profile's.
+// Returns false for an unknown profile.
+bool setOBSRuntimeProfile(OBSRuntimeProfile profile);
+
+
+#pragma mark - Tracing
+
+// Records how long each phase of the run loop takes (servicing sockets,
+// handing messages to JavaScript, reporting scene changes, the callbacks,
+// garbage collection, and so on), for loading into chrome://tracing or
+// Perfetto when tally is late and it isn't clear why.  Each thread keeps
+// its last eventsPerThread spans (0 for the default of 65536, rounded up
+// to a power of two; threads that have already recorded keep their size).
+// Tracing is off until started, and costs almost nothing while it is.
+void startOBSTrace(size_t eventsPerThread);
+void stopOBSTrace(void);
+
+// Writes the recorded spans as Chrome trace-event JSON.  Safe to call from
+// any thread while tracing runs.
+bool writeOBSTrace(const char *path);
+
+// Writes the trace to path whenever signalNumber (SIGUSR1, say) arrives.
+// The file is written on a separate thread soon after.
+bool setOBSTraceDumpSignal(int signalNumber, const char *path);
+
+
+#pragma mark - Profiling
+
+// Serves the V8 inspector protocol on 127.0.0.1:port, so that Chrome
+// DevTools (add 127.0.0.1:port under chrome://inspect) can debug and
+// profile the JavaScript.  Anyone who can reach the port can run code in
+// the process, so it only listens locally.  Call before runOBSTally(); it
+// runs for the life of the process.  While the debugger is paused, tally
+// stops.
+bool startOBSInspector(int port);
+
+// These can be called from any thread; like the submit calls above, they
+// return once the command is queued, and errors are logged.
+//
+// A CPU profile samples the JavaScript every samplingIntervalMicroseconds
+// (0 for V8's default of 1000) until stopped, then is written to path as
+// a .cpuprofile for DevTools' Performance panel.
+bool startOBSCPUProfile(uint32_t samplingIntervalMicroseconds);
+bool stopOBSCPUProfile(const char *path);
+
+// Writes a .heapsnapshot for DevTools' Memory panel.  The run loop stops
+// while V8 walks the heap, which can take a while.
+bool writeOBSHeapSnapshot(const char *path);
+
+
+#pragma mark - Logging
+
+// Native diagnostics and JavaScript's console both go through one logger.
+// The thread that logs only copies the message into a ring; a background
+// thread writes it to stderr, so a slow reader (journald under load, say)
+// never delays tally.
+
+typedef enum {
+  kOBSLogDebug = 0,  // Every WebSocket callback and protocol message.
+  kOBSLogInfo,       // The default.
+  kOBSLogWarning,
+  kOBSLogError
+} OBSLogLevel;
+
+// Takes effect immediately, from any thread.
+void setOBSLogLevel(OBSLogLevel level);
+
+// Messages past this many per second are dropped and counted (0 for no
+// limit; the default is 1000).  Errors are never dropped.
+void setOBSLogRateLimit(uint32_t messagesPerSecond);
+
+typedef struct {
+  uint64_t written;
+  uint64_t droppedFull;         // The ring was full.
+  uint64_t droppedRateLimited;
+  uint64_t truncated;           // Written, but cut short.
+} OBSLogStatistics;
+
+void getOBSLogStatistics(OBSLogStatistics *statistics);
+
+// Writes everything logged so far before returning.  Also runs at exit.
+void flushOBSLog(void);
+
+
+#pragma mark - Diagnostics
+
+#define kOBSBufferPoolClassCount 6
+
+typedef struct {
+  size_t blockSize;
+  uint64_t allocations;  // Blocks handed out by this class, ever.
+  uint64_t blocksInUse;
+  uint64_t blocksFree;
+  uint64_t slabs;        // Slabs obtained from the heap.
+} OBSBufferPoolClassStatistics;
+
+// heapAllocations counts every malloc() the pools have made (new slabs plus
+// oversized buffers).  If it stops moving under steady traffic, the native
+// layer has stopped touching the heap for frames and ArrayBuffers.
+typedef struct {
+  uint64_t heapAllocations;
+  uint64_t oversizedAllocations;  // Larger than the biggest class.
+  uint64_t oversizedInUse;
+  OBSBufferPoolClassStatistics classes[kOBSBufferPoolClassCount];
+} OBSBufferPoolStatistics;
+
+void getOBSBufferPoolStatistics(OBSBufferPoolStatistics *statistics);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif  // __GETTALLY_H__
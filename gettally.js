@@ -1,34 +1,215 @@
 var obs = undefined;
 
+// RequestBatchExecutionType from the obs-websocket 5.x protocol.
+const RequestBatchExecutionType = {
+  None: -1,
+  SerialRealtime: 0,
+  SerialFrame: 1,
+  Parallel: 2
+};
+
+const kOpRequestBatch = 8;
+const kOpRequestBatchResponse = 9;
+
+var requestBatchCounter = 0;
+
+// Collects requests and sends them to OBS as a single RequestBatch message,
+// so that N requests cost one round trip instead of N.  Results are matched
+// back to their requests by requestId, so this works in parallel mode, where
+// OBS may answer out of order.
+class OBSRequestBatch {
+  constructor(connection, options = {}) {
+    this.connection = connection;
+    this.executionType = (options.executionType !== undefined) ?
+        options.executionType : RequestBatchExecutionType.SerialRealtime;
+    this.haltOnFailure = options.haltOnFailure ? true : false;
+    this.requests = new Array();
+    this.callbacks = new Map();
+  }
+
+  // callback(error, responseData) is optional.  Returns the batch so that
+  // calls can be chained.
+  add(requestType, requestData, callback) {
+    const requestId = String(this.requests.length);
+    var request = { requestType: requestType, requestId: requestId };
+    if (requestData !== undefined && requestData !== null) {
+      request.requestData = requestData;
+    }
+    this.requests.push(request);
+    if (callback) {
+      this.callbacks.set(requestId, callback);
+    }
+    return this;
+  }
+
+  // Resolves to an array of responseData objects (or errors) in the order
+  // in which the requests were added.
+  send() {
+    const connection = this.connection;
+    const batchId = "batch-" + (requestBatchCounter++);
+    const requests = this.requests;
+    const callbacks = this.callbacks;
+
+    return new Promise((resolve, reject) => {
+      if (requests.length == 0) {
+        resolve(new Array());
+        return;
+      }
+
+      const finish = (response) => {
+        connection.internalListeners.removeListener("op:" + kOpRequestBatchResponse, onResponse);
+        connection.internalListeners.removeListener("ConnectionClosed", onClose);
+
+        var results = new Array(requests.length);
+        var answered = new Set();
+        for (const result of (response ? response.results : [])) {
+          const index = Number(result.requestId);
+          const status = result.requestStatus;
+          let error = null;
+          if (!status.result) {
+            error = new Error(status.comment ? status.comment : ("Request failed: " + status.code));
+            error.code = status.code;
+          }
+          results[index] = error ? error : result.responseData;
+          answered.add(result.requestId);
+          const callback = callbacks.get(result.requestId);
+          if (callback) callback(error, result.responseData);
+        }
+
+        // Requests skipped by haltOnFailure (or lost to a closed
+        // connection) still get exactly one callback.
+        for (const request of requests) {
+          if (answered.has(request.requestId)) continue;
+          let error = new Error("Request not executed");
+          error.code = -1;
+          results[Number(request.requestId)] = error;
+          const callback = callbacks.get(request.requestId);
+          if (callback) callback(error, undefined);
+        }
+        return results;
+      };
+
+      const onResponse = (response) => {
+        if (response.requestId !== batchId) return;
+        resolve(finish(response));
+      };
+      const onClose = (error) => {
+        finish(undefined);
+        reject(error);
+      };
+
+      connection.internalListeners.on("op:" + kOpRequestBatchResponse, onResponse);
+      connection.internalListeners.once("ConnectionClosed", onClose);
+
+      connection.message(kOpRequestBatch, {
+        requestId: batchId,
+        haltOnFailure: this.haltOnFailure,
+        executionType: this.executionType,
+        requests: requests
+      }).catch((error) => {
+        finish(undefined);
+        reject(error);
+      });
+    });
+  }
+}
+
+// Entry point for createOBSRequestBatch() and friends in the C API.  Each
+// result is handed back to native code through completeNativeBatchRequest(),
+// and finishNativeRequestBatch() tells native code to release the batch.
+function sendNativeRequestBatch(nativeBatchId, executionType, haltOnFailure, requests) {
+  if (obs === undefined || !obs.identified) {
+    finishNativeRequestBatch(nativeBatchId);
+    return false;
+  }
+  var batch = new OBSRequestBatch(obs, { executionType: executionType,
+                                         haltOnFailure: haltOnFailure });
+  for (var i = 0; i < requests.length; i++) {
+    const index = i;
+    batch.add(requests[i].requestType, requests[i].requestData, (error, responseData) => {
+      completeNativeBatchRequest(nativeBatchId, index, error ? false : true,
+          error ? error.code : 100, error ? error.message : "",
+          (responseData === undefined) ? undefined : JSON.stringify(responseData));
+    });
+  }
+  batch.send().catch(() => {}).finally(() => {
+    finishNativeRequestBatch(nativeBatchId);
+  });
+  return true;
+}
+
 function connectOBS(obsWebSocketURL) {
   obs = new OBSWebSocket();
 
+  // Tell native code which socket is OBS's, for frames submitted from
+  // other threads.
+  obs.on('ConnectionOpened', () => {
+    setOBSConnection(obs.socket.internal_connection_id, false);
+  });
+
+  obs.on('ConnectionClosed', () => {
+    setOBSConnection(-1, false);
+  });
+
   obs.on('Identified', () => {
     console.log('Connection identified');
+    setOBSConnection(obs.socket.internal_connection_id, true);
     updateInitialScenes();
   });
 
   obs.on('CurrentSceneChanged', () => {
-    console.log('Current scene changed.');
+    console.debug('Current scene changed.');
   });
 
   obs.on('CurrentPreviewSceneChanged', data => {
-    console.log('CurrentPreviewSceneChanged: ' + allKeys(data));
+    console.debug('CurrentPreviewSceneChanged: ' + allKeys(data));
     setPreviewScene(data["sceneName"]);
   });
 
   obs.on('CurrentProgramSceneChanged', data => {
-    console.log('CurrentPreviewSceneChanged: ' + allKeys(data));
+    console.debug('CurrentPreviewSceneChanged: ' + allKeys(data));
     setProgramScene(data["sceneName"]);
   });
 
   obs.on('SceneTransitionStarted', data => {
-    console.log('SceneTransitionStarted: ' + allKeys(data));
+    console.debug('SceneTransitionStarted: ' + allKeys(data));
     setPreviewToProgram();
   });
 
+  obs.on('SceneCreated', data => {
+    setSceneItems(data["sceneName"], []);
+  });
+
+  obs.on('SceneRemoved', data => {
+    removeSceneFromGraph(data["sceneName"]);
+  });
+
+  obs.on('SceneNameChanged', data => {
+    renameSceneInGraph(data["oldSceneName"], data["sceneName"]);
+  });
+
+  obs.on('SceneItemCreated', data => {
+    const sceneName = data["sceneName"];
+    const sceneItemId = data["sceneItemId"];
+    addSceneItem(sceneName, { sceneItemId: sceneItemId, sourceName: data["sourceName"] });
+
+    // New items are normally enabled, but duplicated items keep the state
+    // of the original, so ask.
+    obs.call('GetSceneItemEnabled', { sceneName: sceneName, sceneItemId: sceneItemId })
+        .then((value) => setSceneItemEnabled(sceneName, sceneItemId, value.sceneItemEnabled))
+        .catch(() => {});
+  });
+
+  obs.on('SceneItemRemoved', data => {
+    removeSceneItem(data["sceneName"], data["sceneItemId"]);
+  });
+
+  obs.on('SceneItemEnableStateChanged', data => {
+    setSceneItemEnabled(data["sceneName"], data["sceneItemId"], data["sceneItemEnabled"]);
+  });
+
   obs.connect(obsWebSocketURL, obsPassword, {
-    eventSubscriptions: (1 << 2) | (1 << 4),  /* EventSubcription.Scenes and Transitions */
+    eventSubscriptions: (1 << 2) | (1 << 4) | (1 << 7),  /* EventSubcription.Scenes, Transitions, and SceneItems */
     rpcVersion: 1
   }).then((value) => {
     logMessage("OBS connected: " + allKeys(value));
@@ -60,9 +241,51 @@ function allKeysSub(unknownObject, indent) {
 }
 
 var updateInitialScenes = async function() {
-  const {currentProgramSceneName} = await obs.call('GetCurrentProgramScene');
-  const {currentPreviewSceneName} = await obs.call('GetCurrentPreviewScene');
+  const [program, preview, sceneList, groupList] = await new OBSRequestBatch(obs)
+      .add('GetCurrentProgramScene')
+      .add('GetCurrentPreviewScene')
+      .add('GetSceneList')
+      .add('GetGroupList')
+      .send();
+
+  // GetCurrentPreviewScene fails when studio mode is off.
+  if (!(preview instanceof Error)) {
+    setPreviewScene(preview.currentPreviewSceneName);
+  }
+  if (!(program instanceof Error)) {
+    setProgramScene(program.currentProgramSceneName);
+  }
 
-  setPreviewScene(currentPreviewSceneName);
-  setProgramScene(currentProgramSceneName);
+  await loadSceneItems(sceneList, groupList);
+}
+
+// Fetches the items of every scene and group in one parallel batch and
+// hands them to the native scene graph, which works out source-level tally.
+var loadSceneItems = async function(sceneList, groupList) {
+  clearSceneGraph();
+  try {
+    await fetchSceneItems(sceneList, groupList);
+  } finally {
+    finishSceneGraphLoad();
+  }
+}
+
+var fetchSceneItems = async function(sceneList, groupList) {
+  var batch = new OBSRequestBatch(obs, { executionType: RequestBatchExecutionType.Parallel });
+  if (!(sceneList instanceof Error)) {
+    for (const scene of sceneList.scenes) {
+      const sceneName = scene.sceneName;
+      batch.add('GetSceneItemList', { sceneName: sceneName }, (error, data) => {
+        if (!error) setSceneItems(sceneName, data.sceneItems);
+      });
+    }
+  }
+  if (!(groupList instanceof Error)) {
+    for (const groupName of groupList.groups) {
+      batch.add('GetGroupSceneItemList', { sceneName: groupName }, (error, data) => {
+        if (!error) setSceneItems(groupName, data.sceneItems);
+      });
+    }
+  }
+  await batch.send();
 }
@@ -0,0 +1,218 @@
+#include <atomic>
+#include <sys/param.h>
+
+#include "heap_control.h"
+#include "logger.h"
+#include "trace.h"
+
+#pragma mark - Data types
+
+struct HeapControlState {
+  uint64_t lastBusyTime = 0;
+  bool idleWorkDone = false;         // Until the next busy pass.
+  bool memoryPressureSent = false;   // Likewise.
+  bool inIdleSlice = false;
+  uint64_t GCStartTime = 0;
+
+  size_t initialHeapLimit = 0;
+  bool heapLimitPending = false;
+};
+
+
+#pragma mark - Global variables
+
+static OBSHeapLimits gHeapLimits = { 0, 0, 0, 0 };
+
+// Microseconds.
+static std::atomic<uint64_t> gIdleQuietTime(20000);
+static std::atomic<uint64_t> gIdleSliceTime(2000);
+static std::atomic<uint64_t> gMemoryPressureQuietTime(5000000);
+
+// Written by every isolate's thread.
+static std::atomic<uint64_t> gGCPauses(0);
+static std::atomic<uint64_t> gGCPauseMicroseconds(0);
+static std::atomic<uint64_t> gBusyGCPauses(0);
+static std::atomic<uint64_t> gBusyGCPauseMicroseconds(0);
+static std::atomic<uint64_t> gIdleSlices(0);
+static std::atomic<uint64_t> gIdleMicroseconds(0);
+static std::atomic<uint64_t> gMemoryPressureNotifications(0);
+static std::atomic<uint64_t> gHeapLimitEvents(0);
+
+
+#pragma mark - Callbacks
+
+static uint64_t heapControlMicroseconds(void) {
+  return traceNanoseconds() / 1000;
+}
+
+static void increment(std::atomic<uint64_t> &counter, uint64_t amount) {
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+static void timeGCPrologue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags,
+                           void *data) {
+  HeapControlState *state = (HeapControlState *)data;
+  state->GCStartTime = heapControlMicroseconds();
+}
+
+static void timeGCEpilogue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags,
+                           void *data) {
+  HeapControlState *state = (HeapControlState *)data;
+  if (state->GCStartTime == 0) {
+    return;
+  }
+  uint64_t duration = heapControlMicroseconds() - state->GCStartTime;
+  state->GCStartTime = 0;
+
+  increment(gGCPauses, 1);
+  increment(gGCPauseMicroseconds, duration);
+  if (!state->inIdleSlice) {
+    increment(gBusyGCPauses, 1);
+    increment(gBusyGCPauseMicroseconds, duration);
+  }
+}
+
+// Runs inside a garbage collection, so it only records the event; the run
+// loop does the shedding.  Returning the current limit would make V8 abort.
+static size_t nearHeapLimit(void *data, size_t currentHeapLimit, size_t initialHeapLimit) {
+  HeapControlState *state = (HeapControlState *)data;
+  state->initialHeapLimit = initialHeapLimit;
+  increment(gHeapLimitEvents, 1);
+  state->heapLimitPending = true;
+  return MIN(currentHeapLimit + initialHeapLimit / 4, initialHeapLimit * 2);
+}
+
+
+#pragma mark - Run loop
+
+void applyHeapLimits(v8::ResourceConstraints *constraints) {
+  if (gHeapLimits.initialOldGenerationBytes != 0) {
+    constraints->set_initial_old_generation_size_in_bytes(gHeapLimits.initialOldGenerationBytes);
+  }
+  if (gHeapLimits.maxOldGenerationBytes != 0) {
+    constraints->set_max_old_generation_size_in_bytes(gHeapLimits.maxOldGenerationBytes);
+  }
+  if (gHeapLimits.initialYoungGenerationBytes != 0) {
+    constraints->set_initial_young_generation_size_in_bytes(
+        gHeapLimits.initialYoungGenerationBytes);
+  }
+  if (gHeapLimits.maxYoungGenerationBytes != 0) {
+    constraints->set_max_young_generation_size_in_bytes(gHeapLimits.maxYoungGenerationBytes);
+  }
+}
+
+HeapControlState *installHeapCallbacks(v8::Isolate *isolate) {
+  HeapControlState *state = new HeapControlState();
+  isolate->AddGCPrologueCallback(timeGCPrologue, state);
+  isolate->AddGCEpilogueCallback(timeGCEpilogue, state);
+  isolate->AddNearHeapLimitCallback(nearHeapLimit, state);
+  return state;
+}
+
+void freeHeapControlState(HeapControlState *state) {
+  delete state;
+}
+
+void serviceIdleGC(HeapControlState *state, v8::Platform *platform, v8::Isolate *isolate,
+                   uint64_t now, bool busy) {
+  if (busy || state->lastBusyTime == 0) {
+    state->lastBusyTime = now;
+    state->idleWorkDone = false;
+    state->memoryPressureSent = false;
+    return;
+  }
+  uint64_t quietTime = now - state->lastBusyTime;
+
+  uint64_t idleQuietTime = gIdleQuietTime.load(std::memory_order_relaxed);
+  if (platform != nullptr && idleQuietTime != 0 && quietTime >= idleQuietTime &&
+      !state->idleWorkDone) {
+    TraceSpan span("idle GC");
+    double sliceSeconds = (double)gIdleSliceTime.load(std::memory_order_relaxed) / 1000000.0;
+    state->inIdleSlice = true;
+#if V8_MAJOR_VERSION < 13
+    state->idleWorkDone = isolate->IdleNotificationDeadline(
+        platform->MonotonicallyIncreasingTime() + sliceSeconds);
+#else
+    // Without IdleNotificationDeadline(), only V8's own idle tasks run.
+    state->idleWorkDone = true;
+#endif
+    v8::platform::RunIdleTasks(platform, isolate, sliceSeconds);
+    state->inIdleSlice = false;
+    increment(gIdleSlices, 1);
+    increment(gIdleMicroseconds, heapControlMicroseconds() - now);
+  }
+
+  uint64_t memoryPressureQuietTime = gMemoryPressureQuietTime.load(std::memory_order_relaxed);
+  if (memoryPressureQuietTime != 0 && quietTime >= memoryPressureQuietTime &&
+      !state->memoryPressureSent) {
+    TraceSpan span("memory pressure");
+    state->inIdleSlice = true;
+    isolate->MemoryPressureNotification(v8::MemoryPressureLevel::kModerate);
+    state->inIdleSlice = false;
+    state->memoryPressureSent = true;
+    increment(gMemoryPressureNotifications, 1);
+  }
+}
+
+bool takeHeapLimitEvent(HeapControlState *state) {
+  if (!state->heapLimitPending) {
+    return false;
+  }
+  state->heapLimitPending = false;
+  return true;
+}
+
+void recoverFromHeapLimit(HeapControlState *state, v8::Isolate *isolate) {
+  TraceSpan span("heap limit recovery");
+  isolate->MemoryPressureNotification(v8::MemoryPressureLevel::kCritical);
+
+  // If that freed enough, put the limit back where it started, so that
+  // the next approach is caught early too.  Otherwise keep the headroom.
+  v8::HeapStatistics statistics;
+  isolate->GetHeapStatistics(&statistics);
+  if (state->initialHeapLimit != 0 && statistics.used_heap_size() < state->initialHeapLimit / 2) {
+    isolate->RemoveNearHeapLimitCallback(nearHeapLimit, state->initialHeapLimit);
+    isolate->AddNearHeapLimitCallback(nearHeapLimit, state);
+  } else {
+    OBSLOG(kOBSLogWarning, "V8 heap still at %zu bytes after shedding load.\n",
+           statistics.used_heap_size());
+  }
+}
+
+
+#pragma mark - Public API
+
+bool setOBSHeapLimits(const OBSHeapLimits *limits) {
+  if (limits == NULL) {
+    return false;
+  }
+  if ((limits->maxOldGenerationBytes != 0 &&
+       limits->initialOldGenerationBytes > limits->maxOldGenerationBytes) ||
+      (limits->maxYoungGenerationBytes != 0 &&
+       limits->initialYoungGenerationBytes > limits->maxYoungGenerationBytes)) {
+    OBSLOG(kOBSLogError, "Invalid heap limits.\n");
+    return false;
+  }
+  gHeapLimits = *limits;
+  return true;
+}
+
+void setOBSIdleGC(uint32_t quietMilliseconds, uint32_t sliceMilliseconds,
+                  uint32_t memoryPressureMilliseconds) {
+  gIdleQuietTime.store((uint64_t)quietMilliseconds * 1000, std::memory_order_relaxed);
+  gIdleSliceTime.store((uint64_t)MAX(sliceMilliseconds, 1) * 1000, std::memory_order_relaxed);
+  gMemoryPressureQuietTime.store((uint64_t)memoryPressureMilliseconds * 1000,
+                                 std::memory_order_relaxed);
+}
+
+void getOBSGCStatistics(OBSGCStatistics *statistics) {
+  statistics->pauses = gGCPauses.load(std::memory_order_relaxed);
+  statistics->pauseMicroseconds = gGCPauseMicroseconds.load(std::memory_order_relaxed);
+  statistics->busyPauses = gBusyGCPauses.load(std::memory_order_relaxed);
+  statistics->busyPauseMicroseconds = gBusyGCPauseMicroseconds.load(std::memory_order_relaxed);
+  statistics->idleSlices = gIdleSlices.load(std::memory_order_relaxed);
+  statistics->idleMicroseconds = gIdleMicroseconds.load(std::memory_order_relaxed);
+  statistics->memoryPressureNotifications =
+      gMemoryPressureNotifications.load(std::memory_order_relaxed);
+  statistics->heapLimitEvents = gHeapLimitEvents.load(std::memory_order_relaxed);
+}
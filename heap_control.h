@@ -0,0 +1,50 @@
+#ifndef __HEAP_CONTROL_H__
+#define __HEAP_CONTROL_H__
+
+#include <libplatform/libplatform.h>
+#include <stdint.h>
+#include <v8.h>
+
+#include "gettally.h"
+
+// Keeps V8's garbage collection out of the way of tally.
+//
+// The run loop reports each pass as busy (a message waiting for
+// JavaScript, scenes waiting out the coalescing window) or not.  Once it
+// has been quiet for a while, each pass gives V8 a short, bounded slice
+// for idle-time collection until V8 says there is nothing left, and a
+// longer quiet spell tells V8 memory is under moderate pressure so that it
+// shrinks the heap then.  GC pauses are timed, and those outside an idle
+// slice are counted separately, since those are the ones that can land on
+// a tally change.
+//
+// If the heap nears its limit, the callback raises the limit a little
+// (at most to double the original) instead of letting V8 abort, and the
+// run loop sheds load.
+//
+// Each isolate has its own state, only touched on the thread running that
+// isolate; the statistics are totals over every isolate in the process.
+
+typedef struct HeapControlState HeapControlState;
+
+// Copies the limits set with setOBSHeapLimits() into constraints.
+void applyHeapLimits(v8::ResourceConstraints *constraints);
+
+// Registers the GC timing and near-heap-limit callbacks, and returns the
+// isolate's state for the calls below.
+HeapControlState *installHeapCallbacks(v8::Isolate *isolate);
+
+// Once the isolate has been disposed.
+void freeHeapControlState(HeapControlState *state);
+
+// Called once per loop pass.  now is CLOCK_MONOTONIC microseconds.  With
+// no platform (USE_NODE), only the memory pressure notification is sent.
+void serviceIdleGC(HeapControlState *state, v8::Platform *platform, v8::Isolate *isolate,
+                   uint64_t now, bool busy);
+
+// True once after each time the heap has neared its limit; the caller then
+// sheds load and calls recoverFromHeapLimit().
+bool takeHeapLimitEvent(HeapControlState *state);
+void recoverFromHeapLimit(HeapControlState *state, v8::Isolate *isolate);
+
+#endif  // __HEAP_CONTROL_H__
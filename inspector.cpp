@@ -0,0 +1,635 @@
+#include <deque>
+#include <errno.h>
+#include <libwebsockets.h>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <v8-inspector.h>
+#include <v8-profiler.h>
+#include <v8-version.h>
+#include <vector>
+
+#include "inspector.h"
+#include "logger.h"
+#include "trace.h"
+
+#define kInspectorContextGroupID 1
+#define kInspectorTargetName "gettally"
+#define kCPUProfileTitle "gettally"
+#define kHeapSnapshotChunkBytes 65536
+
+#pragma mark - Data types
+
+// One DevTools connection.  Outgoing messages are UTF-8 with LWS_PRE bytes
+// of headroom in front of them for lws_write().
+class InspectorConnection : public v8_inspector::V8Inspector::Channel {
+  public:
+    explicit InspectorConnection(struct lws *wsi) : wsi(wsi) {}
+
+    void sendResponse(int callID,
+                      std::unique_ptr<v8_inspector::StringBuffer> message) override {
+      this->send(message->string());
+    }
+    void sendNotification(std::unique_ptr<v8_inspector::StringBuffer> message) override {
+      this->send(message->string());
+    }
+    void flushProtocolNotifications(void) override {}
+
+    struct lws *wsi;  // nullptr once the socket has closed.
+    std::unique_ptr<v8_inspector::V8InspectorSession> session;
+    std::string partialMessage;
+    std::deque<std::string> incoming;
+    std::deque<std::string> outgoing;
+
+  private:
+    void send(const v8_inspector::StringView &message);
+};
+
+class InspectorClient : public v8_inspector::V8InspectorClient {
+  public:
+    void runMessageLoopOnPause(int contextGroupID) override;
+    void quitMessageLoopOnPause(void) override;
+    v8::Local<v8::Context> ensureDefaultContextInGroup(int contextGroupID) override;
+};
+
+// lws's per-session data.  HTTP requests use the body, and WebSocket
+// connections the connection.
+typedef struct {
+  uint8_t *body;
+  size_t length;
+  InspectorConnection *connection;
+} InspectorSession;
+
+// Streams a heap snapshot straight to its file.
+class HeapSnapshotFileStream : public v8::OutputStream {
+  public:
+    explicit HeapSnapshotFileStream(FILE *file) : file(file) {}
+
+    void EndOfStream(void) override {}
+    int GetChunkSize(void) override {
+      return kHeapSnapshotChunkBytes;
+    }
+    WriteResult WriteAsciiChunk(char *data, int size) override {
+      if (fwrite(data, 1, size, this->file) != (size_t)size) {
+        this->failed = true;
+        return kAbort;
+      }
+      return kContinue;
+    }
+
+    bool failed = false;
+
+  private:
+    FILE *file;
+};
+
+
+#pragma mark - Global variables
+
+static struct lws_context *gInspectorContext = nullptr;
+static int gInspectorPort = 0;
+
+static v8::Isolate *gInspectorIsolate = nullptr;
+static v8::Global<v8::Context> gInspectorDefaultContext;
+static InspectorClient gInspectorClient;
+static std::unique_ptr<v8_inspector::V8Inspector> gInspector;
+
+// Connections are only deleted from serviceInspector(), never while a
+// session further up the stack may be dispatching a message.
+static std::vector<InspectorConnection *> gInspectorConnections;
+static int gInspectorDispatchDepth = 0;
+static bool gInspectorRunningPauseLoop = false;
+static bool gInspectorPaused = false;
+
+static v8::CpuProfiler *gCPUProfiler = nullptr;
+static bool gCPUProfiling = false;
+
+
+#pragma mark - Function prototypes
+
+int inspectorLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                         void *user, void *in, size_t length);
+
+static struct lws_protocols gInspectorProtocols[] = {
+  { "inspector", inspectorLWSCallback, sizeof(InspectorSession), 0, 0, NULL, 0 },
+  LWS_PROTOCOL_LIST_TERM
+};
+
+
+#pragma mark - Strings
+
+static void appendUTF8(std::string *output, uint32_t codePoint) {
+  if (codePoint < 0x80) {
+    output->push_back((char)codePoint);
+  } else if (codePoint < 0x800) {
+    output->push_back((char)(0xC0 | (codePoint >> 6)));
+    output->push_back((char)(0x80 | (codePoint & 0x3F)));
+  } else if (codePoint < 0x10000) {
+    output->push_back((char)(0xE0 | (codePoint >> 12)));
+    output->push_back((char)(0x80 | ((codePoint >> 6) & 0x3F)));
+    output->push_back((char)(0x80 | (codePoint & 0x3F)));
+  } else {
+    output->push_back((char)(0xF0 | (codePoint >> 18)));
+    output->push_back((char)(0x80 | ((codePoint >> 12) & 0x3F)));
+    output->push_back((char)(0x80 | ((codePoint >> 6) & 0x3F)));
+    output->push_back((char)(0x80 | (codePoint & 0x3F)));
+  }
+}
+
+// The inspector speaks Latin-1 or UTF-16; DevTools speaks UTF-8.
+static std::string UTF8FromStringView(const v8_inspector::StringView &view) {
+  std::string result;
+  result.reserve(view.length());
+  if (view.is8Bit()) {
+    for (size_t i = 0; i < view.length(); i++) {
+      appendUTF8(&result, view.characters8()[i]);
+    }
+    return result;
+  }
+
+  const uint16_t *characters = view.characters16();
+  size_t length = view.length();
+  for (size_t i = 0; i < length; i++) {
+    uint32_t codePoint = characters[i];
+    if (codePoint >= 0xD800 && codePoint <= 0xDBFF && i + 1 < length &&
+        characters[i + 1] >= 0xDC00 && characters[i + 1] <= 0xDFFF) {
+      codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (characters[i + 1] - 0xDC00);
+      i++;
+    } else if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
+      codePoint = 0xFFFD;  // An unpaired surrogate.
+    }
+    appendUTF8(&result, codePoint);
+  }
+  return result;
+}
+
+static std::vector<uint16_t> UTF16FromUTF8(const std::string &text) {
+  std::vector<uint16_t> result;
+  result.reserve(text.length());
+  const uint8_t *bytes = (const uint8_t *)text.data();
+  size_t length = text.length();
+  size_t i = 0;
+  while (i < length) {
+    uint32_t codePoint;
+    size_t continuationCount;
+    if (bytes[i] < 0x80) {
+      codePoint = bytes[i];
+      continuationCount = 0;
+    } else if ((bytes[i] & 0xE0) == 0xC0) {
+      codePoint = bytes[i] & 0x1F;
+      continuationCount = 1;
+    } else if ((bytes[i] & 0xF0) == 0xE0) {
+      codePoint = bytes[i] & 0x0F;
+      continuationCount = 2;
+    } else if ((bytes[i] & 0xF8) == 0xF0) {
+      codePoint = bytes[i] & 0x07;
+      continuationCount = 3;
+    } else {
+      result.push_back(0xFFFD);
+      i++;
+      continue;
+    }
+
+    bool valid = (i + continuationCount < length);
+    for (size_t j = 1; valid && j <= continuationCount; j++) {
+      if ((bytes[i + j] & 0xC0) != 0x80) {
+        valid = false;
+      } else {
+        codePoint = (codePoint << 6) | (bytes[i + j] & 0x3F);
+      }
+    }
+    if (!valid) {
+      result.push_back(0xFFFD);
+      i++;
+      continue;
+    }
+    i += continuationCount + 1;
+
+    if (codePoint >= 0x10000) {
+      codePoint -= 0x10000;
+      result.push_back((uint16_t)(0xD800 + (codePoint >> 10)));
+      result.push_back((uint16_t)(0xDC00 + (codePoint & 0x3FF)));
+    } else {
+      result.push_back((uint16_t)codePoint);
+    }
+  }
+  return result;
+}
+
+// Writes a JSON string, escaping what JSON requires.
+static void writeJSONString(FILE *file, const char *string) {
+  fputc('"', file);
+  for (const char *character = string; *character != '\0'; character++) {
+    unsigned char value = (unsigned char)*character;
+    if (value == '"' || value == '\\') {
+      fputc('\\', file);
+      fputc(value, file);
+    } else if (value < 0x20) {
+      fprintf(file, "\\u%04x", value);
+    } else {
+      fputc(value, file);
+    }
+  }
+  fputc('"', file);
+}
+
+
+#pragma mark - Inspector
+
+void InspectorConnection::send(const v8_inspector::StringView &message) {
+  if (this->wsi == nullptr) {
+    return;
+  }
+  std::string frame(LWS_PRE, '\0');
+  frame += UTF8FromStringView(message);
+  this->outgoing.push_back(std::move(frame));
+  lws_callback_on_writable(this->wsi);
+}
+
+static bool hasOpenInspectorConnection(void) {
+  for (InspectorConnection *connection : gInspectorConnections) {
+    if (connection->wsi != nullptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Hands every queued message to its session.  A message can pause the
+// debugger, which comes back here from the pause loop, so this goes by
+// index and takes each message off its queue before dispatching it.
+static void dispatchInspectorMessages(void) {
+  v8::HandleScope handleScope(gInspectorIsolate);
+  for (size_t i = 0; i < gInspectorConnections.size(); i++) {
+    InspectorConnection *connection = gInspectorConnections[i];
+    while (connection->wsi != nullptr && !connection->incoming.empty()) {
+      std::string message = std::move(connection->incoming.front());
+      connection->incoming.pop_front();
+      std::vector<uint16_t> characters = UTF16FromUTF8(message);
+
+      gInspectorDispatchDepth++;
+      connection->session->dispatchProtocolMessage(
+          v8_inspector::StringView(characters.data(), characters.size()));
+      gInspectorDispatchDepth--;
+    }
+  }
+}
+
+static void deleteClosedInspectorConnections(void) {
+  if (gInspectorDispatchDepth > 0 || gInspectorRunningPauseLoop) {
+    return;
+  }
+  for (auto iterator = gInspectorConnections.begin(); iterator != gInspectorConnections.end();) {
+    if ((*iterator)->wsi == nullptr) {
+      delete *iterator;  // Disconnects the session, resuming if it was paused.
+      iterator = gInspectorConnections.erase(iterator);
+    } else {
+      iterator++;
+    }
+  }
+}
+
+// Called when the debugger pauses.  Nothing else runs until it resumes (or
+// the last DevTools connection goes away), so tally stops too.
+void InspectorClient::runMessageLoopOnPause(int contextGroupID) {
+  gInspectorPaused = true;
+  if (gInspectorRunningPauseLoop) {
+    return;
+  }
+  gInspectorRunningPauseLoop = true;
+  while (gInspectorPaused && hasOpenInspectorConnection()) {
+    lws_service(gInspectorContext, 50);
+    dispatchInspectorMessages();
+  }
+  gInspectorRunningPauseLoop = false;
+  gInspectorPaused = false;
+}
+
+void InspectorClient::quitMessageLoopOnPause(void) {
+  gInspectorPaused = false;
+}
+
+v8::Local<v8::Context> InspectorClient::ensureDefaultContextInGroup(int contextGroupID) {
+  return gInspectorDefaultContext.Get(gInspectorIsolate);
+}
+
+void createInspector(v8::Isolate *isolate, v8::Local<v8::Context> context) {
+  if (gInspectorContext == nullptr || gInspector != nullptr) {
+    return;
+  }
+  gInspectorIsolate = isolate;
+  gInspectorDefaultContext.Reset(isolate, context);
+  gInspector = v8_inspector::V8Inspector::create(isolate, &gInspectorClient);
+
+  static const char name[] = kInspectorTargetName;
+  gInspector->contextCreated(v8_inspector::V8ContextInfo(
+      context, kInspectorContextGroupID,
+      v8_inspector::StringView((const uint8_t *)name, sizeof(name) - 1)));
+}
+
+void serviceInspector(void) {
+  if (gInspectorContext == nullptr) {
+    return;
+  }
+  TraceSpan span("serviceInspector");
+  lws_service(gInspectorContext, -1);
+  if (gInspector != nullptr) {
+    dispatchInspectorMessages();
+    deleteClosedInspectorConnections();
+  }
+}
+
+
+#pragma mark - Profiling
+
+static bool writeCPUProfile(const v8::CpuProfile *profile, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    OBSLOG(kOBSLogError, "Could not open CPU profile %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  // The .cpuprofile format: every node with its children's IDs, then the
+  // node each sample landed in and the time since the previous sample.
+  // Line and column numbers are zero-based there, one-based in V8.
+  fprintf(file, "{\"nodes\":[");
+  std::vector<const v8::CpuProfileNode *> stack;
+  stack.push_back(profile->GetTopDownRoot());
+  bool first = true;
+  while (!stack.empty()) {
+    const v8::CpuProfileNode *node = stack.back();
+    stack.pop_back();
+
+    fprintf(file, "%s\n{\"id\":%u,\"callFrame\":{\"functionName\":", first ? "" : ",",
+            node->GetNodeId());
+    writeJSONString(file, node->GetFunctionNameStr());
+    fprintf(file, ",\"scriptId\":\"%d\",\"url\":", node->GetScriptId());
+    writeJSONString(file, node->GetScriptResourceNameStr());
+    fprintf(file, ",\"lineNumber\":%d,\"columnNumber\":%d},\"hitCount\":%u,\"children\":[",
+            node->GetLineNumber() - 1, node->GetColumnNumber() - 1, node->GetHitCount());
+    int childCount = node->GetChildrenCount();
+    for (int i = 0; i < childCount; i++) {
+      const v8::CpuProfileNode *child = node->GetChild(i);
+      fprintf(file, "%s%u", (i == 0) ? "" : ",", child->GetNodeId());
+      stack.push_back(child);
+    }
+    fprintf(file, "]}");
+    first = false;
+  }
+
+  fprintf(file, "\n],\"startTime\":%lld,\"endTime\":%lld,\"samples\":[",
+          (long long)profile->GetStartTime(), (long long)profile->GetEndTime());
+  int sampleCount = profile->GetSamplesCount();
+  for (int i = 0; i < sampleCount; i++) {
+    fprintf(file, "%s%u", (i == 0) ? "" : ",", profile->GetSample(i)->GetNodeId());
+  }
+  fprintf(file, "],\"timeDeltas\":[");
+  int64_t previousTimestamp = profile->GetStartTime();
+  for (int i = 0; i < sampleCount; i++) {
+    int64_t timestamp = profile->GetSampleTimestamp(i);
+    fprintf(file, "%s%lld", (i == 0) ? "" : ",", (long long)(timestamp - previousTimestamp));
+    previousTimestamp = timestamp;
+  }
+  fprintf(file, "]}\n");
+
+  if (fclose(file) != 0) {
+    OBSLOG(kOBSLogError, "Could not write CPU profile %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void startCPUProfile(v8::Isolate *isolate, uint32_t samplingIntervalMicroseconds) {
+  if (gCPUProfiling) {
+    OBSLOG(kOBSLogWarning, "A CPU profile is already running.\n");
+    return;
+  }
+  if (gCPUProfiler == nullptr) {
+    gCPUProfiler = v8::CpuProfiler::New(isolate);
+  }
+  if (samplingIntervalMicroseconds != 0) {
+    gCPUProfiler->SetSamplingInterval((int)samplingIntervalMicroseconds);
+  }
+
+  v8::HandleScope handleScope(isolate);
+  gCPUProfiler->StartProfiling(v8::String::NewFromUtf8(isolate, kCPUProfileTitle).ToLocalChecked(),
+                               true /* record_samples */);
+  gCPUProfiling = true;
+}
+
+void stopCPUProfile(v8::Isolate *isolate, const char *path) {
+  if (!gCPUProfiling) {
+    OBSLOG(kOBSLogWarning, "No CPU profile is running.\n");
+    return;
+  }
+  gCPUProfiling = false;
+
+  v8::HandleScope handleScope(isolate);
+  v8::CpuProfile *profile = gCPUProfiler->StopProfiling(
+      v8::String::NewFromUtf8(isolate, kCPUProfileTitle).ToLocalChecked());
+  if (profile == nullptr) {
+    return;
+  }
+  TraceSpan span("writeCPUProfile");
+  if (writeCPUProfile(profile, path)) {
+    OBSLOG(kOBSLogInfo, "Wrote CPU profile to %s.\n", path);
+  }
+  profile->Delete();
+}
+
+void writeHeapSnapshot(v8::Isolate *isolate, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    OBSLOG(kOBSLogError, "Could not open heap snapshot %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  TraceSpan span("writeHeapSnapshot");
+  v8::HandleScope handleScope(isolate);
+  const v8::HeapSnapshot *snapshot = isolate->GetHeapProfiler()->TakeHeapSnapshot();
+  HeapSnapshotFileStream stream(file);
+  snapshot->Serialize(&stream, v8::HeapSnapshot::kJSON);
+  const_cast<v8::HeapSnapshot *>(snapshot)->Delete();
+
+  if (fclose(file) != 0 || stream.failed) {
+    OBSLOG(kOBSLogError, "Could not write heap snapshot %s: %s\n", path, strerror(errno));
+    return;
+  }
+  OBSLOG(kOBSLogInfo, "Wrote heap snapshot to %s.\n", path);
+}
+
+
+#pragma mark - Public API
+
+bool startOBSInspector(int port) {
+  if (gInspectorContext != nullptr) {
+    return false;
+  }
+
+  struct lws_context_creation_info info;
+  bzero(&info, sizeof(info));
+
+  info.port = port;
+  info.iface = "127.0.0.1";
+  info.protocols = gInspectorProtocols;
+  info.uid = -1;
+  info.gid = -1;
+
+  gInspectorContext = lws_create_context(&info);
+  if (gInspectorContext == nullptr) {
+    OBSLOG(kOBSLogError, "Could not start inspector on port %d.\n", port);
+    return false;
+  }
+  gInspectorPort = port;
+  return true;
+}
+
+
+#pragma mark - LibWebSockets handling
+
+// DevTools finds targets at /json (or /json/list) and the browser version
+// at /json/version.
+static bool inspectorDiscoveryResponse(const char *path, std::string *body) {
+  char text[1024];
+  if (strcmp(path, "/json") == 0 || strcmp(path, "/json/list") == 0) {
+    snprintf(text, sizeof(text),
+             "[{\"description\":\"" kInspectorTargetName "\","
+             "\"devtoolsFrontendUrl\":\"devtools://devtools/bundled/js_app.html"
+             "?experiments=true&v8only=true&ws=127.0.0.1:%d/" kInspectorTargetName "\","
+             "\"id\":\"" kInspectorTargetName "\",\"title\":\"" kInspectorTargetName "\","
+             "\"type\":\"node\",\"url\":\"file://\","
+             "\"webSocketDebuggerUrl\":\"ws://127.0.0.1:%d/" kInspectorTargetName "\"}]\n",
+             gInspectorPort, gInspectorPort);
+  } else if (strcmp(path, "/json/version") == 0) {
+    snprintf(text, sizeof(text),
+             "{\"Browser\":\"" kInspectorTargetName "/v8 %s\",\"Protocol-Version\":\"1.3\"}\n",
+             v8::V8::GetVersion());
+  } else {
+    return false;
+  }
+  body->assign(text);
+  return true;
+}
+
+int inspectorLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                         void *user, void *in, size_t length) {
+  InspectorSession *session = (InspectorSession *)user;
+
+  switch (reason) {
+    case LWS_CALLBACK_HTTP:
+    {
+      std::string text;
+      if (!inspectorDiscoveryResponse((const char *)in, &text)) {
+        lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+      }
+      free(session->body);
+      session->body = (uint8_t *)malloc(LWS_PRE + text.length());
+      session->length = text.length();
+      memcpy(session->body + LWS_PRE, text.data(), text.length());
+
+      uint8_t headers[LWS_PRE + 512];
+      uint8_t *start = headers + LWS_PRE;
+      uint8_t *position = start;
+      uint8_t *end = headers + sizeof(headers) - 1;
+      if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "application/json",
+                                      session->length, &position, end) ||
+          lws_finalize_write_http_header(wsi, start, &position, end)) {
+        return 1;
+      }
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+    case LWS_CALLBACK_HTTP_WRITEABLE:
+    {
+      if (session == nullptr || session->body == nullptr) {
+        break;
+      }
+      int bytesWritten = lws_write(wsi, session->body + LWS_PRE, session->length,
+                                   LWS_WRITE_HTTP_FINAL);
+      int bodyLength = (int)session->length;
+      free(session->body);
+      session->body = nullptr;
+      if (bytesWritten < bodyLength) {
+        return -1;
+      }
+      return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    case LWS_CALLBACK_CLOSED_HTTP:
+      if (session != nullptr) {
+        free(session->body);
+        session->body = nullptr;
+      }
+      break;
+
+    case LWS_CALLBACK_ESTABLISHED:
+    {
+      if (gInspector == nullptr) {
+        return -1;
+      }
+      InspectorConnection *connection = new InspectorConnection(wsi);
+#if V8_MAJOR_VERSION >= 11
+      connection->session = gInspector->connect(kInspectorContextGroupID, connection,
+                                                v8_inspector::StringView(),
+                                                v8_inspector::V8Inspector::kFullyTrusted);
+#else
+      connection->session = gInspector->connect(kInspectorContextGroupID, connection,
+                                                v8_inspector::StringView());
+#endif
+      session->connection = connection;
+      gInspectorConnections.push_back(connection);
+      OBSLOG(kOBSLogInfo, "Inspector connected.\n");
+      return 0;
+    }
+    case LWS_CALLBACK_RECEIVE:
+    {
+      InspectorConnection *connection = session->connection;
+      if (connection == nullptr) {
+        return -1;
+      }
+      connection->partialMessage.append((const char *)in, length);
+      if (lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0) {
+        connection->incoming.push_back(std::move(connection->partialMessage));
+        connection->partialMessage.clear();
+      }
+      return 0;
+    }
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+    {
+      InspectorConnection *connection = session->connection;
+      if (connection == nullptr || connection->outgoing.empty()) {
+        return 0;
+      }
+      // One message per callback; lws keeps whatever the socket does not
+      // take and calls back again once it has gone.
+      std::string &frame = connection->outgoing.front();
+      size_t frameLength = frame.length() - LWS_PRE;
+      int bytesWritten = lws_write(wsi, (uint8_t *)&frame[LWS_PRE], frameLength, LWS_WRITE_TEXT);
+      connection->outgoing.pop_front();
+      if (bytesWritten < (int)frameLength) {
+        return -1;
+      }
+      if (!connection->outgoing.empty()) {
+        lws_callback_on_writable(wsi);
+      }
+      return 0;
+    }
+    case LWS_CALLBACK_CLOSED:
+    {
+      InspectorConnection *connection = session->connection;
+      if (connection != nullptr) {
+        connection->wsi = nullptr;
+        connection->incoming.clear();
+        connection->outgoing.clear();
+        session->connection = nullptr;
+        OBSLOG(kOBSLogInfo, "Inspector disconnected.\n");
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return lws_callback_http_dummy(wsi, reason, user, in, length);
+}
@@ -0,0 +1,30 @@
+#ifndef __INSPECTOR_H__
+#define __INSPECTOR_H__
+
+#include <stdint.h>
+#include <v8.h>
+
+#include "gettally.h"
+
+// The V8 inspector server behind startOBSInspector(), and the profiling
+// behind the CPU profile and heap snapshot commands.
+//
+// Everything here runs on the V8 loop thread.  The inspector's lws context
+// is serviced once per loop pass, like the metrics server; messages from
+// DevTools are queued by the lws callback and handed to V8 afterward, so
+// that a message which pauses the debugger never does so inside lws.
+
+// Attaches the inspector to the context if startOBSInspector() has been
+// called.  Called once, before any script runs.
+void createInspector(v8::Isolate *isolate, v8::Local<v8::Context> context);
+
+// Services the inspector's lws context without blocking and dispatches
+// whatever arrived.  Does nothing if the server is not running.
+void serviceInspector(void);
+
+// samplingIntervalMicroseconds is 0 for V8's default.
+void startCPUProfile(v8::Isolate *isolate, uint32_t samplingIntervalMicroseconds);
+void stopCPUProfile(v8::Isolate *isolate, const char *path);
+void writeHeapSnapshot(v8::Isolate *isolate, const char *path);
+
+#endif  // __INSPECTOR_H__
@@ -0,0 +1,682 @@
+#include <atomic>
+#include <ctype.h>
+#include <errno.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define kLogSlotCount 4096  // A power of two.
+#define kLogSlotMask (kLogSlotCount - 1)
+#define kLogSlotPayloadBytes 248
+#define kLogMaxSlotsPerRecord 8
+#define kLogMaxRecordBytes (kLogSlotPayloadBytes * kLogMaxSlotsPerRecord)
+#define kLogFlushIntervalMicroseconds 10000
+#define kLogOutputBufferBytes 65536
+#define kLogDefaultRateLimit 1000  // Messages per second.
+
+#pragma mark - Data types
+
+enum {
+  kLogRecordText = 1 << 0,       // The arguments are already-formatted text.
+  kLogRecordTruncated = 1 << 1   // Some of the arguments did not fit.
+};
+
+typedef struct {
+  uint64_t timestamp;  // CLOCK_REALTIME, nanoseconds.
+  const char *format;  // NULL for text records.
+  uint16_t length;     // Bytes of arguments (or text) after the header.
+  uint8_t level;
+  uint8_t flags;
+  uint8_t slotCount;
+} LogRecordHeader;
+
+#define kLogMaxArgumentBytes (kLogMaxRecordBytes - sizeof(LogRecordHeader))
+
+// A record is a header and its arguments, split across one or more
+// consecutive slots.  Sequences work as in the callback queue: a slot is
+// free for position p when its sequence is p, full when it is p + 1, and
+// handed back for the next lap at p + kLogSlotCount.
+typedef struct {
+  std::atomic<size_t> sequence;
+  uint8_t payload[kLogSlotPayloadBytes];
+} LogSlot;
+
+typedef struct {
+  LogRecordHeader header;
+  uint8_t arguments[kLogMaxArgumentBytes];
+} LogRecord;
+
+// One conversion in a format string.
+typedef struct {
+  const char *start;           // The '%'.
+  const char *lengthModifier;  // Just past the precision.
+  const char *end;             // Just past the conversion character.
+  char conversion;
+  char length[3];              // "", "hh", "h", "l", "ll", "z", "j", "t", or "L".
+} LogConversion;
+
+
+#pragma mark - Global variables
+
+int gOBSLogLevel = kOBSLogInfo;
+
+static LogSlot gLogSlots[kLogSlotCount];
+static std::atomic<size_t> gLogEnqueuePosition(0);
+static size_t gLogDequeuePosition = 0;  // Guarded by gLogConsumerMutex.
+
+// The flush thread and flushOBSLog() both consume.
+static std::mutex gLogConsumerMutex;
+static std::once_flag gLogStarted;
+
+static std::atomic<uint32_t> gLogRateLimit(kLogDefaultRateLimit);
+static std::atomic<uint64_t> gLogRateWindow(0);  // The current second.
+static std::atomic<uint32_t> gLogRateCount(0);
+
+static std::atomic<uint64_t> gLogWritten(0);
+static std::atomic<uint64_t> gLogDroppedFull(0);
+static std::atomic<uint64_t> gLogDroppedRateLimited(0);
+static std::atomic<uint64_t> gLogTruncated(0);
+
+static const char *kLogLevelNames[] = { "debug", "info", "warning", "error" };
+
+
+#pragma mark - Function prototypes
+
+static void drainLog(void);
+
+
+#pragma mark - Format strings
+
+// Parses the conversion starting at the '%' at format.  Returns false if
+// the string ends first.
+static bool parseConversion(const char *format, LogConversion *conversion) {
+  const char *position = format + 1;
+  conversion->start = format;
+
+  if (*position != '%') {
+    while (*position != '\0' && strchr("-+ #0'", *position) != NULL) {
+      position++;
+    }
+    if (*position == '*') {
+      position++;
+    } else {
+      while (isdigit((unsigned char)*position)) {
+        position++;
+      }
+    }
+    if (*position == '.') {
+      position++;
+      if (*position == '*') {
+        position++;
+      } else {
+        while (isdigit((unsigned char)*position)) {
+          position++;
+        }
+      }
+    }
+  }
+  conversion->lengthModifier = position;
+
+  bzero(conversion->length, sizeof(conversion->length));
+  if ((position[0] == 'h' && position[1] == 'h') || (position[0] == 'l' && position[1] == 'l')) {
+    memcpy(conversion->length, position, 2);
+    position += 2;
+  } else if (*position != '\0' && strchr("hlzjtL", *position) != NULL) {
+    conversion->length[0] = *position++;
+  }
+
+  if (*position == '\0') {
+    return false;
+  }
+  conversion->conversion = *position;
+  conversion->end = position + 1;
+  return true;
+}
+
+static bool isSignedConversion(char conversion) {
+  return conversion == 'd' || conversion == 'i' || conversion == 'c';
+}
+
+static bool isUnsignedConversion(char conversion) {
+  return conversion == 'u' || conversion == 'o' || conversion == 'x' || conversion == 'X';
+}
+
+static bool isFloatingConversion(char conversion) {
+  return strchr("eEfFgGaA", conversion) != NULL;
+}
+
+static int starCount(const LogConversion *conversion) {
+  int count = 0;
+  for (const char *position = conversion->start + 1; position < conversion->lengthModifier;
+       position++) {
+    if (*position == '*') {
+      count++;
+    }
+  }
+  return count;
+}
+
+
+#pragma mark - Encoding
+
+static bool appendArgument(LogRecord *record, const void *data, size_t length) {
+  if (record->header.length + length > kLogMaxArgumentBytes) {
+    record->header.flags |= kLogRecordTruncated;
+    return false;
+  }
+  memcpy(record->arguments + record->header.length, data, length);
+  record->header.length += length;
+  return true;
+}
+
+static bool appendSigned(LogRecord *record, int64_t value) {
+  return appendArgument(record, &value, sizeof(value));
+}
+
+static bool appendUnsigned(LogRecord *record, uint64_t value) {
+  return appendArgument(record, &value, sizeof(value));
+}
+
+static int64_t signedArgument(const char *length, va_list *arguments) {
+  if (strcmp(length, "l") == 0) {
+    return va_arg(*arguments, long);
+  } else if (strcmp(length, "ll") == 0) {
+    return va_arg(*arguments, long long);
+  } else if (strcmp(length, "z") == 0) {
+    return (ssize_t)va_arg(*arguments, size_t);
+  } else if (strcmp(length, "j") == 0) {
+    return va_arg(*arguments, intmax_t);
+  } else if (strcmp(length, "t") == 0) {
+    return va_arg(*arguments, ptrdiff_t);
+  }
+  return va_arg(*arguments, int);  // Narrower types are promoted to int.
+}
+
+static uint64_t unsignedArgument(const char *length, va_list *arguments) {
+  if (strcmp(length, "l") == 0) {
+    return va_arg(*arguments, unsigned long);
+  } else if (strcmp(length, "ll") == 0) {
+    return va_arg(*arguments, unsigned long long);
+  } else if (strcmp(length, "z") == 0) {
+    return va_arg(*arguments, size_t);
+  } else if (strcmp(length, "j") == 0) {
+    return va_arg(*arguments, uintmax_t);
+  } else if (strcmp(length, "t") == 0) {
+    return (uint64_t)va_arg(*arguments, ptrdiff_t);
+  }
+  return va_arg(*arguments, unsigned int);
+}
+
+// Stores each argument in its raw form: integers as 64 bits, floating
+// point as a double, pointers as their address, and strings as a 16-bit
+// length and the bytes (cut short if the record is full).
+static void encodeArguments(LogRecord *record, const char *format, va_list *arguments) {
+  for (const char *position = strchr(format, '%'); position != NULL;
+       position = strchr(position, '%')) {
+    LogConversion conversion;
+    if (!parseConversion(position, &conversion)) {
+      return;
+    }
+    position = conversion.end;
+    if (conversion.conversion == '%') {
+      continue;
+    }
+
+    for (int i = starCount(&conversion); i > 0; i--) {
+      if (!appendSigned(record, va_arg(*arguments, int))) {
+        return;
+      }
+    }
+
+    bool stored;
+    char type = conversion.conversion;
+    if (isSignedConversion(type)) {
+      stored = appendSigned(record, type == 'c' ? va_arg(*arguments, int)
+                                                : signedArgument(conversion.length, arguments));
+    } else if (isUnsignedConversion(type)) {
+      stored = appendUnsigned(record, unsignedArgument(conversion.length, arguments));
+    } else if (isFloatingConversion(type)) {
+      double value = (conversion.length[0] == 'L') ? (double)va_arg(*arguments, long double)
+                                                   : va_arg(*arguments, double);
+      stored = appendArgument(record, &value, sizeof(value));
+    } else if (type == 'p') {
+      stored = appendUnsigned(record, (uintptr_t)va_arg(*arguments, void *));
+    } else if (type == 's') {
+      const char *string = va_arg(*arguments, const char *);
+      if (string == NULL) {
+        string = "(null)";
+      }
+      size_t length = strlen(string);
+      size_t room = kLogMaxArgumentBytes - record->header.length;
+      if (room <= sizeof(uint16_t)) {
+        record->header.flags |= kLogRecordTruncated;
+        return;
+      }
+      if (length > room - sizeof(uint16_t)) {
+        length = room - sizeof(uint16_t);
+        record->header.flags |= kLogRecordTruncated;
+      }
+      uint16_t storedLength = (uint16_t)length;
+      appendArgument(record, &storedLength, sizeof(storedLength));
+      stored = appendArgument(record, string, length);
+    } else {
+      // %n, or something printf would not understand either.
+      record->header.flags |= kLogRecordTruncated;
+      return;
+    }
+    if (!stored) {
+      return;
+    }
+  }
+}
+
+
+#pragma mark - Decoding
+
+typedef struct {
+  const uint8_t *position;
+  const uint8_t *end;
+} LogArgumentReader;
+
+static bool readArgument(LogArgumentReader *reader, void *value, size_t length) {
+  if (reader->position + length > reader->end) {
+    return false;
+  }
+  memcpy(value, reader->position, length);
+  reader->position += length;
+  return true;
+}
+
+template <typename T>
+static void appendFormatted(std::string *output, const char *specification, T value) {
+  char buffer[256];
+  int length = snprintf(buffer, sizeof(buffer), specification, value);
+  if (length < 0) {
+    return;
+  }
+  if ((size_t)length < sizeof(buffer)) {
+    output->append(buffer, length);
+    return;
+  }
+  size_t oldLength = output->length();
+  output->resize(oldLength + length + 1);
+  snprintf(&(*output)[oldLength], length + 1, specification, value);
+  output->resize(oldLength + length);
+}
+
+// Formats one conversion from its stored arguments.  Returns false if the
+// arguments ran out (because the record was truncated).
+static bool formatConversion(const LogConversion *conversion, LogArgumentReader *reader,
+                             std::string *output) {
+  // Rebuild the specification with * replaced by the stored values and a
+  // length modifier that matches how the value was stored.
+  std::string specification("%");
+  for (const char *position = conversion->start + 1; position < conversion->lengthModifier;
+       position++) {
+    if (*position == '*') {
+      int64_t value;
+      if (!readArgument(reader, &value, sizeof(value))) {
+        return false;
+      }
+      specification += std::to_string(value);
+    } else {
+      specification += *position;
+    }
+  }
+
+  char type = conversion->conversion;
+  if (type == 'c') {
+    int64_t value;
+    if (!readArgument(reader, &value, sizeof(value))) {
+      return false;
+    }
+    appendFormatted(output, (specification + type).c_str(), (int)value);
+  } else if (isSignedConversion(type)) {
+    int64_t value;
+    if (!readArgument(reader, &value, sizeof(value))) {
+      return false;
+    }
+    appendFormatted(output, (specification + "ll" + type).c_str(), (long long)value);
+  } else if (isUnsignedConversion(type)) {
+    uint64_t value;
+    if (!readArgument(reader, &value, sizeof(value))) {
+      return false;
+    }
+    appendFormatted(output, (specification + "ll" + type).c_str(), (unsigned long long)value);
+  } else if (isFloatingConversion(type)) {
+    double value;
+    if (!readArgument(reader, &value, sizeof(value))) {
+      return false;
+    }
+    appendFormatted(output, (specification + type).c_str(), value);
+  } else if (type == 'p') {
+    uint64_t value;
+    if (!readArgument(reader, &value, sizeof(value))) {
+      return false;
+    }
+    appendFormatted(output, (specification + type).c_str(), (void *)(uintptr_t)value);
+  } else if (type == 's') {
+    uint16_t length;
+    if (!readArgument(reader, &length, sizeof(length)) ||
+        reader->position + length > reader->end) {
+      return false;
+    }
+    std::string string((const char *)reader->position, length);
+    reader->position += length;
+    appendFormatted(output, (specification + type).c_str(), string.c_str());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void formatMessage(const LogRecord *record, std::string *output) {
+  if (record->header.flags & kLogRecordText) {
+    output->append((const char *)record->arguments, record->header.length);
+    return;
+  }
+
+  LogArgumentReader reader = { record->arguments, record->arguments + record->header.length };
+  const char *format = record->header.format;
+  while (true) {
+    const char *percent = strchr(format, '%');
+    if (percent == NULL) {
+      output->append(format);
+      return;
+    }
+    output->append(format, percent - format);
+
+    LogConversion conversion;
+    if (!parseConversion(percent, &conversion)) {
+      output->append(percent);
+      return;
+    }
+    if (conversion.conversion == '%') {
+      output->push_back('%');
+    } else if (!formatConversion(&conversion, &reader, output)) {
+      return;
+    }
+    format = conversion.end;
+  }
+}
+
+// Appends the record as a line: local time, level, and message.
+static void formatRecord(const LogRecord *record, std::string *output) {
+  time_t seconds = (time_t)(record->header.timestamp / 1000000000ull);
+  unsigned milliseconds = (unsigned)(record->header.timestamp % 1000000000ull / 1000000);
+  struct tm localTime;
+  localtime_r(&seconds, &localTime);
+
+  char prefix[64];
+  size_t length = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &localTime);
+  snprintf(prefix + length, sizeof(prefix) - length, ".%03u %s: ", milliseconds,
+           kLogLevelNames[record->header.level]);
+  output->append(prefix);
+
+  size_t messageStart = output->length();
+  formatMessage(record, output);
+  // The message's own newline (from fprintf-style callers) is replaced by
+  // ours.
+  if (output->length() > messageStart && output->back() == '\n') {
+    output->pop_back();
+  }
+  if (record->header.flags & kLogRecordTruncated) {
+    output->append("...");
+  }
+  output->push_back('\n');
+}
+
+static void writeLogOutput(const std::string &output) {
+  const char *position = output.data();
+  size_t remaining = output.length();
+  while (remaining > 0) {
+    ssize_t written = write(STDERR_FILENO, position, remaining);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    position += written;
+    remaining -= written;
+  }
+}
+
+
+#pragma mark - Ring
+
+static void runLogThread(void) {
+  while (true) {
+    drainLog();
+    usleep(kLogFlushIntervalMicroseconds);
+  }
+}
+
+static void startLogThread(void) {
+  for (size_t i = 0; i < kLogSlotCount; i++) {
+    gLogSlots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  std::thread(runLogThread).detach();
+  atexit(flushOBSLog);
+}
+
+// Claims count consecutive slots.  The consumer frees slots in order, so
+// if the last one is free for this lap, so are the rest.
+static bool claimLogSlots(size_t count, size_t *claimedPosition) {
+  size_t position = gLogEnqueuePosition.load(std::memory_order_relaxed);
+  while (true) {
+    size_t lastPosition = position + count - 1;
+    LogSlot *last = &gLogSlots[lastPosition & kLogSlotMask];
+    size_t sequence = last->sequence.load(std::memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)lastPosition;
+
+    if (difference == 0) {
+      if (gLogEnqueuePosition.compare_exchange_weak(position, position + count,
+                                                    std::memory_order_relaxed)) {
+        *claimedPosition = position;
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      position = gLogEnqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+static bool enqueueLogRecord(LogRecord *record) {
+  size_t length = sizeof(LogRecordHeader) + record->header.length;
+  size_t count = (length + kLogSlotPayloadBytes - 1) / kLogSlotPayloadBytes;
+  record->header.slotCount = (uint8_t)count;
+
+  size_t position;
+  if (!claimLogSlots(count, &position)) {
+    return false;
+  }
+  const uint8_t *bytes = (const uint8_t *)record;
+  for (size_t i = 0; i < count; i++) {
+    size_t chunk = MIN(length - i * kLogSlotPayloadBytes, (size_t)kLogSlotPayloadBytes);
+    memcpy(gLogSlots[(position + i) & kLogSlotMask].payload, bytes + i * kLogSlotPayloadBytes,
+           chunk);
+  }
+  // Publish the first slot last, so that the consumer sees the whole
+  // record once it sees the first slot.
+  for (size_t i = count - 1; i > 0; i--) {
+    gLogSlots[(position + i) & kLogSlotMask].sequence.store(position + i + 1,
+                                                            std::memory_order_release);
+  }
+  gLogSlots[position & kLogSlotMask].sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+// Called with gLogConsumerMutex held.
+static bool dequeueLogRecord(LogRecord *record) {
+  size_t position = gLogDequeuePosition;
+  LogSlot *first = &gLogSlots[position & kLogSlotMask];
+  if (first->sequence.load(std::memory_order_acquire) != position + 1) {
+    return false;
+  }
+
+  LogRecordHeader header;
+  memcpy(&header, first->payload, sizeof(header));
+  size_t length = sizeof(LogRecordHeader) + header.length;
+  uint8_t *bytes = (uint8_t *)record;
+  for (size_t i = 0; i < header.slotCount; i++) {
+    LogSlot *slot = &gLogSlots[(position + i) & kLogSlotMask];
+    size_t chunk = MIN(length - i * kLogSlotPayloadBytes, (size_t)kLogSlotPayloadBytes);
+    memcpy(bytes + i * kLogSlotPayloadBytes, slot->payload, chunk);
+    slot->sequence.store(position + i + kLogSlotCount, std::memory_order_release);
+  }
+  gLogDequeuePosition = position + header.slotCount;
+  return true;
+}
+
+static void drainLog(void) {
+  std::lock_guard<std::mutex> guard(gLogConsumerMutex);
+  static std::string output;
+  static uint64_t reportedDroppedFull = 0;
+  static uint64_t reportedDroppedRateLimited = 0;
+
+  LogRecord record;
+  while (dequeueLogRecord(&record)) {
+    formatRecord(&record, &output);
+    gLogWritten.fetch_add(1, std::memory_order_relaxed);
+    if (output.length() >= kLogOutputBufferBytes) {
+      writeLogOutput(output);
+      output.clear();
+    }
+  }
+
+  uint64_t droppedFull = gLogDroppedFull.load(std::memory_order_relaxed);
+  uint64_t droppedRateLimited = gLogDroppedRateLimited.load(std::memory_order_relaxed);
+  if (droppedFull != reportedDroppedFull || droppedRateLimited != reportedDroppedRateLimited) {
+    char line[160];
+    snprintf(line, sizeof(line), "Dropped %llu log messages (%llu over the rate limit).\n",
+             (unsigned long long)(droppedFull - reportedDroppedFull +
+                                  droppedRateLimited - reportedDroppedRateLimited),
+             (unsigned long long)(droppedRateLimited - reportedDroppedRateLimited));
+    output.append(line);
+    reportedDroppedFull = droppedFull;
+    reportedDroppedRateLimited = droppedRateLimited;
+  }
+
+  if (output.length() > 0) {
+    writeLogOutput(output);
+    output.clear();
+  }
+}
+
+
+#pragma mark - Logging
+
+static bool withinRateLimit(void) {
+  uint32_t limit = gLogRateLimit.load(std::memory_order_relaxed);
+  if (limit == 0) {
+    return true;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t second = (uint64_t)now.tv_sec;
+  uint64_t window = gLogRateWindow.load(std::memory_order_relaxed);
+  if (second != window &&
+      gLogRateWindow.compare_exchange_strong(window, second, std::memory_order_relaxed)) {
+    gLogRateCount.store(0, std::memory_order_relaxed);
+  }
+  return gLogRateCount.fetch_add(1, std::memory_order_relaxed) < limit;
+}
+
+static void beginLogRecord(LogRecord *record, OBSLogLevel level, const char *format,
+                           uint8_t flags) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  record->header.timestamp = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+  record->header.format = format;
+  record->header.length = 0;
+  record->header.level = (uint8_t)level;
+  record->header.flags = flags;
+  record->header.slotCount = 0;
+}
+
+static void submitLogRecord(LogRecord *record) {
+  if (record->header.flags & kLogRecordTruncated) {
+    gLogTruncated.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (enqueueLogRecord(record)) {
+    return;
+  }
+  if (record->header.level == kOBSLogError) {
+    // Errors are worth the wait.
+    std::string output;
+    formatRecord(record, &output);
+    writeLogOutput(output);
+    gLogWritten.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  gLogDroppedFull.fetch_add(1, std::memory_order_relaxed);
+}
+
+void logOBSMessage(OBSLogLevel level, const char *format, ...) {
+  std::call_once(gLogStarted, startLogThread);
+  if (level != kOBSLogError && !withinRateLimit()) {
+    gLogDroppedRateLimited.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  LogRecord record;
+  beginLogRecord(&record, level, format, 0);
+  va_list arguments;
+  va_start(arguments, format);
+  encodeArguments(&record, format, &arguments);
+  va_end(arguments);
+  submitLogRecord(&record);
+}
+
+void logOBSText(OBSLogLevel level, const char *text, size_t length) {
+  std::call_once(gLogStarted, startLogThread);
+  if (level != kOBSLogError && !withinRateLimit()) {
+    gLogDroppedRateLimited.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  LogRecord record;
+  beginLogRecord(&record, level, NULL, kLogRecordText);
+  if (length > kLogMaxArgumentBytes) {
+    length = kLogMaxArgumentBytes;
+    record.header.flags |= kLogRecordTruncated;
+  }
+  memcpy(record.arguments, text, length);
+  record.header.length = (uint16_t)length;
+  submitLogRecord(&record);
+}
+
+
+#pragma mark - Public API
+
+void setOBSLogLevel(OBSLogLevel level) {
+  __atomic_store_n(&gOBSLogLevel, (int)level, __ATOMIC_RELAXED);
+}
+
+void setOBSLogRateLimit(uint32_t messagesPerSecond) {
+  gLogRateLimit.store(messagesPerSecond, std::memory_order_relaxed);
+}
+
+void getOBSLogStatistics(OBSLogStatistics *statistics) {
+  statistics->written = gLogWritten.load(std::memory_order_relaxed);
+  statistics->droppedFull = gLogDroppedFull.load(std::memory_order_relaxed);
+  statistics->droppedRateLimited = gLogDroppedRateLimited.load(std::memory_order_relaxed);
+  statistics->truncated = gLogTruncated.load(std::memory_order_relaxed);
+}
+
+void flushOBSLog(void) {
+  drainLog();
+}
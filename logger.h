@@ -0,0 +1,49 @@
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "gettally.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Logging that never makes the calling thread wait for stderr.
+//
+// A message is stored as a binary record in a bounded, lock-free ring (the
+// same sequence-numbered design as the callback queue): the format string
+// by pointer and each argument in its raw form, so the caller does no
+// formatting at all.  A background thread formats the records and writes
+// them in batches.  A record that does not fit in the ring, or that goes
+// over the rate limit, is dropped and counted instead; errors are never
+// rate limited, and are written directly if the ring is full.
+//
+// Formats support the usual integer, floating-point, %s, %c, and %p
+// conversions (with flags, width, precision, and * arguments), but not %n.
+// Strings are copied, up to the space left in the record.
+
+extern int gOBSLogLevel;  // Messages below this level are not recorded.
+
+// Logs a message if its level is enabled.  format must be a string literal,
+// since only the pointer is recorded.
+#define OBSLOG(level, format, ...) \
+  do { \
+    if ((int)(level) >= __atomic_load_n(&gOBSLogLevel, __ATOMIC_RELAXED)) { \
+      logOBSMessage((level), "" format, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+void logOBSMessage(OBSLogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Logs text that is already formatted (JavaScript's console, say).  The
+// caller checks the level first.
+void logOBSText(OBSLogLevel level, const char *text, size_t length);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif  // __LOGGER_H__
@@ -1,6 +1,8 @@
 #include <stdio.h>
 
+#include "capture_log.h"
 #include "gettally.h"
+#include "tally_shm.h"
 
 #define OBS_URL "ws://127.0.0.1:4455/"
 
@@ -15,6 +17,14 @@ int main(int argc, char *argv[]) {
   if (argc > 1) {
     password = argv[1];
   }
+  if (argc > 2) {
+    // Optional path for the shared-memory tally snapshot.
+    enableOBSTallySharedMemory(argv[2]);
+  }
+  if (argc > 3) {
+    // Optional path for a capture of all WebSocket traffic.
+    enableOBSCapture(argv[3], 0);
+  }
 
   registerOBSProgramCallback(&setSceneIsProgram);
   registerOBSPreviewCallback(&setSceneIsPreview);
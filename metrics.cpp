@@ -0,0 +1,576 @@
+#include <atomic>
+#include <libwebsockets.h>
+#include <map>
+#include <mutex>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/param.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+#pragma mark - Data types
+
+struct OBSConnectionCounters {
+  uint32_t connectionID = 0;
+  std::atomic<uint64_t> framesReceived{0};
+  std::atomic<uint64_t> bytesReceived{0};
+  std::atomic<uint64_t> framesSent{0};
+  std::atomic<uint64_t> bytesSent{0};
+  std::atomic<uint64_t> receiveDrops{0};
+  std::atomic<uint64_t> sendRefusals{0};
+  std::atomic<uint64_t> incomingQueueMessages{0};
+  std::atomic<uint64_t> incomingQueueBytes{0};
+  std::atomic<uint64_t> outgoingQueueMessages{0};
+  std::atomic<uint64_t> outgoingQueueBytes{0};
+};
+
+typedef struct {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sumMicroseconds;
+  std::atomic<uint64_t> buckets[kOBSMetricsHistogramBuckets];
+} MetricsHistogram;
+
+// The response body for one request, with LWS_PRE bytes of headroom in
+// front of it for lws_write().
+typedef struct {
+  uint8_t *body;
+  size_t length;
+} MetricsSession;
+
+// One per-connection field, for writing every field the same way.
+typedef struct {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;  // Into OBSConnectionMetrics.
+} ConnectionMetricDescription;
+
+
+#pragma mark - Global variables
+
+// Guards the connection map (not the counters in it) and the heap sample.
+static std::mutex gMetricsMutex;
+static std::map<uint32_t, OBSConnectionCounters *> gConnectionCounters;
+static OBSHeapMetrics gHeapMetrics;
+
+static OBSConnectionCounters gTotalCounters;
+static std::atomic<uint64_t> gConnectionsOpened(0);
+static std::atomic<uint64_t> gConnectionsClosed(0);
+static std::atomic<uint64_t> gReconnects(0);
+
+static MetricsHistogram gLoopIteration;
+static MetricsHistogram gJSDispatch;
+static MetricsHistogram gTallyLatency;
+
+static std::atomic<uint64_t> gHeapSampleInterval(5000000);  // Microseconds.
+static uint64_t gNextHeapSample = 0;
+
+static struct lws_context *gMetricsServerContext = nullptr;
+
+static const ConnectionMetricDescription kConnectionMetrics[] = {
+  { "frames_received_total", "counter", "WebSocket frames received from OBS.",
+    offsetof(OBSConnectionMetrics, framesReceived) },
+  { "bytes_received_total", "counter", "Payload bytes received from OBS.",
+    offsetof(OBSConnectionMetrics, bytesReceived) },
+  { "frames_sent_total", "counter", "WebSocket messages sent to OBS.",
+    offsetof(OBSConnectionMetrics, framesSent) },
+  { "bytes_sent_total", "counter", "Payload bytes sent to OBS.",
+    offsetof(OBSConnectionMetrics, bytesSent) },
+  { "receive_drops_total", "counter", "Incoming messages dropped or coalesced under load.",
+    offsetof(OBSConnectionMetrics, receiveDrops) },
+  { "send_refusals_total", "counter", "Outgoing messages refused over the high watermark.",
+    offsetof(OBSConnectionMetrics, sendRefusals) },
+  { "incoming_queue_messages", "gauge", "Messages waiting for JavaScript.",
+    offsetof(OBSConnectionMetrics, incomingQueueMessages) },
+  { "incoming_queue_bytes", "gauge", "Bytes waiting for JavaScript.",
+    offsetof(OBSConnectionMetrics, incomingQueueBytes) },
+  { "outgoing_queue_messages", "gauge", "Messages waiting to be sent.",
+    offsetof(OBSConnectionMetrics, outgoingQueueMessages) },
+  { "outgoing_queue_bytes", "gauge", "Bytes waiting to be sent.",
+    offsetof(OBSConnectionMetrics, outgoingQueueBytes) },
+  { NULL, NULL, NULL, 0 }
+};
+
+
+#pragma mark - Function prototypes
+
+int metricsLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                       void *user, void *in, size_t length);
+
+static struct lws_protocols gMetricsProtocols[] = {
+  { "http", metricsLWSCallback, sizeof(MetricsSession), 0, 0, NULL, 0 },
+  LWS_PROTOCOL_LIST_TERM
+};
+
+
+#pragma mark - Recording
+
+static void increment(std::atomic<uint64_t> &counter, uint64_t amount) {
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+static void recordHistogram(MetricsHistogram *histogram, uint64_t microseconds) {
+  // The smallest i with microseconds <= 1 << i.
+  int bucket = (microseconds <= 1) ? 0 : 64 - __builtin_clzll(microseconds - 1);
+  if (bucket >= kOBSMetricsHistogramBuckets) {
+    bucket = kOBSMetricsHistogramBuckets - 1;
+  }
+  increment(histogram->buckets[bucket], 1);
+  increment(histogram->sumMicroseconds, microseconds);
+  increment(histogram->count, 1);
+}
+
+OBSConnectionCounters *addConnectionMetrics(uint32_t connectionID) {
+  OBSConnectionCounters *counters = new OBSConnectionCounters();
+  counters->connectionID = connectionID;
+
+  std::lock_guard<std::mutex> guard(gMetricsMutex);
+  auto iterator = gConnectionCounters.find(connectionID);
+  if (iterator != gConnectionCounters.end()) {
+    delete iterator->second;
+  }
+  gConnectionCounters[connectionID] = counters;
+  increment(gConnectionsOpened, 1);
+  return counters;
+}
+
+void removeConnectionMetrics(uint32_t connectionID) {
+  std::lock_guard<std::mutex> guard(gMetricsMutex);
+  auto iterator = gConnectionCounters.find(connectionID);
+  if (iterator == gConnectionCounters.end()) {
+    return;
+  }
+  delete iterator->second;
+  gConnectionCounters.erase(iterator);
+  increment(gConnectionsClosed, 1);
+}
+
+void countFrameReceived(OBSConnectionCounters *counters, uint64_t bytes) {
+  if (counters != nullptr) {
+    increment(counters->framesReceived, 1);
+    increment(counters->bytesReceived, bytes);
+  }
+  increment(gTotalCounters.framesReceived, 1);
+  increment(gTotalCounters.bytesReceived, bytes);
+}
+
+void countFrameSent(OBSConnectionCounters *counters, uint64_t bytes) {
+  if (counters != nullptr) {
+    increment(counters->framesSent, 1);
+    increment(counters->bytesSent, bytes);
+  }
+  increment(gTotalCounters.framesSent, 1);
+  increment(gTotalCounters.bytesSent, bytes);
+}
+
+void countReceiveDrop(OBSConnectionCounters *counters) {
+  if (counters != nullptr) {
+    increment(counters->receiveDrops, 1);
+  }
+  increment(gTotalCounters.receiveDrops, 1);
+}
+
+void countSendRefusal(OBSConnectionCounters *counters) {
+  if (counters != nullptr) {
+    increment(counters->sendRefusals, 1);
+  }
+  increment(gTotalCounters.sendRefusals, 1);
+}
+
+void setQueueDepths(OBSConnectionCounters *counters,
+                    uint64_t incomingMessages, uint64_t incomingBytes,
+                    uint64_t outgoingMessages, uint64_t outgoingBytes) {
+  if (counters == nullptr) {
+    return;
+  }
+  counters->incomingQueueMessages.store(incomingMessages, std::memory_order_relaxed);
+  counters->incomingQueueBytes.store(incomingBytes, std::memory_order_relaxed);
+  counters->outgoingQueueMessages.store(outgoingMessages, std::memory_order_relaxed);
+  counters->outgoingQueueBytes.store(outgoingBytes, std::memory_order_relaxed);
+}
+
+void countReconnect(void) {
+  increment(gReconnects, 1);
+}
+
+void recordLoopIteration(uint64_t microseconds) {
+  recordHistogram(&gLoopIteration, microseconds);
+}
+
+void recordJSDispatch(uint64_t microseconds) {
+  recordHistogram(&gJSDispatch, microseconds);
+}
+
+void recordTallyLatency(uint64_t microseconds) {
+  recordHistogram(&gTallyLatency, microseconds);
+}
+
+bool heapSampleDue(uint64_t now) {
+  uint64_t interval = gHeapSampleInterval.load(std::memory_order_relaxed);
+  if (interval == 0 || now < gNextHeapSample) {
+    return false;
+  }
+  gNextHeapSample = now + interval;
+  return true;
+}
+
+void recordOBSHeapMetrics(const OBSHeapMetrics *heap) {
+  std::lock_guard<std::mutex> guard(gMetricsMutex);
+  gHeapMetrics = *heap;
+}
+
+
+#pragma mark - Snapshots
+
+static void copyCounters(const OBSConnectionCounters *counters, OBSConnectionMetrics *metrics) {
+  metrics->connectionID = counters->connectionID;
+  metrics->framesReceived = counters->framesReceived.load(std::memory_order_relaxed);
+  metrics->bytesReceived = counters->bytesReceived.load(std::memory_order_relaxed);
+  metrics->framesSent = counters->framesSent.load(std::memory_order_relaxed);
+  metrics->bytesSent = counters->bytesSent.load(std::memory_order_relaxed);
+  metrics->receiveDrops = counters->receiveDrops.load(std::memory_order_relaxed);
+  metrics->sendRefusals = counters->sendRefusals.load(std::memory_order_relaxed);
+  metrics->incomingQueueMessages = counters->incomingQueueMessages.load(std::memory_order_relaxed);
+  metrics->incomingQueueBytes = counters->incomingQueueBytes.load(std::memory_order_relaxed);
+  metrics->outgoingQueueMessages = counters->outgoingQueueMessages.load(std::memory_order_relaxed);
+  metrics->outgoingQueueBytes = counters->outgoingQueueBytes.load(std::memory_order_relaxed);
+}
+
+static void copyHistogram(const MetricsHistogram *histogram, OBSMetricsHistogram *copy) {
+  copy->count = histogram->count.load(std::memory_order_relaxed);
+  copy->sumMicroseconds = histogram->sumMicroseconds.load(std::memory_order_relaxed);
+  for (int i = 0; i < kOBSMetricsHistogramBuckets; i++) {
+    copy->buckets[i] = histogram->buckets[i].load(std::memory_order_relaxed);
+  }
+}
+
+void getOBSMetricsSnapshot(OBSMetricsSnapshot *snapshot) {
+  bzero(snapshot, sizeof(*snapshot));
+
+  copyCounters(&gTotalCounters, &snapshot->totals);
+  snapshot->connectionsOpened = gConnectionsOpened.load(std::memory_order_relaxed);
+  snapshot->connectionsClosed = gConnectionsClosed.load(std::memory_order_relaxed);
+  snapshot->reconnects = gReconnects.load(std::memory_order_relaxed);
+  copyHistogram(&gLoopIteration, &snapshot->loopIteration);
+  copyHistogram(&gJSDispatch, &snapshot->jsDispatch);
+  copyHistogram(&gTallyLatency, &snapshot->tallyLatency);
+
+  std::lock_guard<std::mutex> guard(gMetricsMutex);
+  snapshot->heap = gHeapMetrics;
+  for (const auto &element : gConnectionCounters) {
+    OBSConnectionMetrics connection;
+    copyCounters(element.second, &connection);
+    snapshot->totals.incomingQueueMessages += connection.incomingQueueMessages;
+    snapshot->totals.incomingQueueBytes += connection.incomingQueueBytes;
+    snapshot->totals.outgoingQueueMessages += connection.outgoingQueueMessages;
+    snapshot->totals.outgoingQueueBytes += connection.outgoingQueueBytes;
+    if (snapshot->connectionCount < kOBSMetricsMaxConnections) {
+      snapshot->connections[snapshot->connectionCount++] = connection;
+    }
+  }
+}
+
+void setOBSHeapSampleInterval(uint32_t milliseconds) {
+  gHeapSampleInterval.store((uint64_t)milliseconds * 1000, std::memory_order_relaxed);
+}
+
+
+#pragma mark - Prometheus text format
+
+static void appendFormat(std::string *output, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void appendFormat(std::string *output, const char *format, ...) {
+  char line[256];
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(line, sizeof(line), format, arguments);
+  va_end(arguments);
+  if (length > 0) {
+    output->append(line, MIN((size_t)length, sizeof(line) - 1));
+  }
+}
+
+static void appendHeader(std::string *output, const char *name, const char *type,
+                         const char *help) {
+  appendFormat(output, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void appendValue(std::string *output, const char *name, const char *type,
+                        const char *help, uint64_t value) {
+  appendHeader(output, name, type, help);
+  appendFormat(output, "%s %llu\n", name, (unsigned long long)value);
+}
+
+// Bucket i holds values of at most base << i microseconds, except the last,
+// which holds the rest.  Prometheus wants cumulative counts in seconds.
+static void appendHistogram(std::string *output, const char *name, const char *help,
+                            const uint64_t *buckets, int bucketCount,
+                            uint64_t baseMicroseconds, uint64_t count,
+                            uint64_t sumMicroseconds) {
+  appendHeader(output, name, "histogram", help);
+  uint64_t cumulative = 0;
+  for (int i = 0; i < bucketCount - 1; i++) {
+    cumulative += buckets[i];
+    appendFormat(output, "%s_bucket{le=\"%.9g\"} %llu\n", name,
+                 (double)(baseMicroseconds << i) / 1000000.0,
+                 (unsigned long long)cumulative);
+  }
+  appendFormat(output, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+  appendFormat(output, "%s_sum %.6f\n", name, (double)sumMicroseconds / 1000000.0);
+  appendFormat(output, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+static void appendMetricsHistogram(std::string *output, const char *name, const char *help,
+                                   const OBSMetricsHistogram *histogram) {
+  appendHistogram(output, name, help, histogram->buckets, kOBSMetricsHistogramBuckets, 1,
+                  histogram->count, histogram->sumMicroseconds);
+}
+
+static void appendConnectionMetrics(std::string *output, const OBSMetricsSnapshot *snapshot) {
+  for (int i = 0; kConnectionMetrics[i].name != NULL; i++) {
+    const ConnectionMetricDescription &description = kConnectionMetrics[i];
+    char name[128];
+
+    snprintf(name, sizeof(name), "obs_tally_%s", description.name);
+    appendValue(output, name, description.type, description.help,
+                *(const uint64_t *)((const uint8_t *)&snapshot->totals + description.offset));
+
+    snprintf(name, sizeof(name), "obs_tally_connection_%s", description.name);
+    appendHeader(output, name, description.type, description.help);
+    for (uint32_t j = 0; j < snapshot->connectionCount; j++) {
+      const OBSConnectionMetrics *connection = &snapshot->connections[j];
+      appendFormat(output, "%s{connection=\"%u\"} %llu\n", name, connection->connectionID,
+                   (unsigned long long)*(const uint64_t *)((const uint8_t *)connection +
+                                                           description.offset));
+    }
+  }
+}
+
+static void appendMetricsText(std::string *output) {
+  OBSMetricsSnapshot snapshot;
+  getOBSMetricsSnapshot(&snapshot);
+
+  appendConnectionMetrics(output, &snapshot);
+  appendValue(output, "obs_tally_connections_opened_total", "counter",
+              "Connections to OBS created.", snapshot.connectionsOpened);
+  appendValue(output, "obs_tally_connections_closed_total", "counter",
+              "Connections to OBS closed.", snapshot.connectionsClosed);
+  appendValue(output, "obs_tally_reconnects_total", "counter",
+              "Attempts to reconnect to OBS.", snapshot.reconnects);
+
+  appendMetricsHistogram(output, "obs_tally_loop_iteration_seconds",
+                         "Time for one pass of the run loop, including waiting for events.",
+                         &snapshot.loopIteration);
+  appendMetricsHistogram(output, "obs_tally_js_dispatch_seconds",
+                         "Time for JavaScript to handle one incoming message.",
+                         &snapshot.jsDispatch);
+  appendMetricsHistogram(output, "obs_tally_latency_seconds",
+                         "Time from receiving a scene change to calling the tally callbacks.",
+                         &snapshot.tallyLatency);
+
+  if (snapshot.heap.sampledAt != 0) {
+    appendValue(output, "obs_tally_v8_heap_total_bytes", "gauge",
+                "V8 heap size.", snapshot.heap.totalHeapSize);
+    appendValue(output, "obs_tally_v8_heap_used_bytes", "gauge",
+                "V8 heap in use.", snapshot.heap.usedHeapSize);
+    appendValue(output, "obs_tally_v8_heap_limit_bytes", "gauge",
+                "V8 heap size limit.", snapshot.heap.heapSizeLimit);
+    appendValue(output, "obs_tally_v8_external_bytes", "gauge",
+                "Memory held by V8 objects outside the heap.", snapshot.heap.externalMemory);
+    appendValue(output, "obs_tally_v8_malloced_bytes", "gauge",
+                "Memory V8 has allocated with malloc.", snapshot.heap.mallocedMemory);
+    appendValue(output, "obs_tally_v8_peak_malloced_bytes", "gauge",
+                "Most memory V8 has had allocated with malloc.",
+                snapshot.heap.peakMallocedMemory);
+    appendValue(output, "obs_tally_v8_native_contexts", "gauge",
+                "V8 native contexts.", snapshot.heap.nativeContexts);
+    appendValue(output, "obs_tally_v8_detached_contexts", "gauge",
+                "V8 contexts detached but not yet collected.", snapshot.heap.detachedContexts);
+  }
+
+  OBSReceiveStatistics receive;
+  getOBSReceiveStatistics(&receive);
+  appendValue(output, "obs_tally_receive_dropped_messages_total", "counter",
+              "Incoming events dropped under kOBSReceivePolicyDropOldest.",
+              receive.droppedMessages);
+  appendValue(output, "obs_tally_receive_coalesced_messages_total", "counter",
+              "Incoming events replaced under kOBSReceivePolicyCoalesce.",
+              receive.coalescedMessages);
+  appendValue(output, "obs_tally_receive_dropped_bytes_total", "counter",
+              "Bytes of incoming events dropped or replaced.", receive.droppedBytes);
+  appendValue(output, "obs_tally_receive_pauses_total", "counter",
+              "Times reading from OBS was paused.", receive.pauses);
+
+  OBSKeepaliveStatistics keepalive;
+  getOBSKeepaliveStatistics(&keepalive);
+  appendValue(output, "obs_tally_pings_sent_total", "counter",
+              "Keepalive pings sent.", keepalive.pingsSent);
+  appendValue(output, "obs_tally_keepalive_timeouts_total", "counter",
+              "Connections dropped for missing pongs.", keepalive.timeouts);
+  // Keepalive buckets count round trips shorter than their bound, which is
+  // close enough to Prometheus's "at most" for whole microseconds.
+  appendHistogram(output, "obs_tally_round_trip_seconds", "Keepalive ping round trips.",
+                  keepalive.histogram, kOBSRoundTripHistogramBuckets,
+                  kOBSRoundTripHistogramBase, keepalive.pongsReceived,
+                  keepalive.totalRoundTrip);
+
+  OBSCallbackDispatchStatistics dispatch;
+  getOBSCallbackDispatchStatistics(&dispatch);
+  appendValue(output, "obs_tally_callbacks_dispatched_total", "counter",
+              "Callbacks run on the callback thread.", dispatch.dispatched);
+  appendValue(output, "obs_tally_callback_stalls_total", "counter",
+              "Times the callback queue was full.", dispatch.stalls);
+  appendValue(output, "obs_tally_callback_queue_max", "gauge",
+              "Most callbacks ever waiting at once.", dispatch.maxQueued);
+
+  appendValue(output, "obs_tally_suppressed_states_total", "counter",
+              "Tally states replaced before the coalescing window closed.",
+              getOBSTallySuppressedStates());
+
+  OBSBufferPoolStatistics pool;
+  getOBSBufferPoolStatistics(&pool);
+  appendValue(output, "obs_tally_buffer_pool_heap_allocations_total", "counter",
+              "Heap allocations made by the buffer pools.", pool.heapAllocations);
+  appendValue(output, "obs_tally_buffer_pool_oversized_in_use", "gauge",
+              "Buffers too large for any pool that are in use.", pool.oversizedInUse);
+  appendHeader(output, "obs_tally_buffer_pool_blocks_in_use", "gauge",
+               "Pooled blocks in use, by block size.");
+  for (int i = 0; i < kOBSBufferPoolClassCount; i++) {
+    appendFormat(output, "obs_tally_buffer_pool_blocks_in_use{size=\"%zu\"} %llu\n",
+                 pool.classes[i].blockSize, (unsigned long long)pool.classes[i].blocksInUse);
+  }
+
+  OBSGCStatistics gc;
+  getOBSGCStatistics(&gc);
+  appendValue(output, "obs_tally_gc_pauses_total", "counter",
+              "V8 garbage collection pauses.", gc.pauses);
+  appendValue(output, "obs_tally_gc_pause_microseconds_total", "counter",
+              "Time spent in V8 garbage collection pauses.", gc.pauseMicroseconds);
+  appendValue(output, "obs_tally_gc_busy_pauses_total", "counter",
+              "V8 garbage collection pauses outside idle time.", gc.busyPauses);
+  appendValue(output, "obs_tally_gc_busy_pause_microseconds_total", "counter",
+              "Time spent in V8 garbage collection pauses outside idle time.",
+              gc.busyPauseMicroseconds);
+  appendValue(output, "obs_tally_gc_idle_microseconds_total", "counter",
+              "Time given to V8 for idle-time garbage collection.", gc.idleMicroseconds);
+  appendValue(output, "obs_tally_heap_limit_events_total", "counter",
+              "Times the V8 heap neared its limit and load was shed.", gc.heapLimitEvents);
+
+  OBSLogStatistics log;
+  getOBSLogStatistics(&log);
+  appendValue(output, "obs_tally_log_messages_written_total", "counter",
+              "Log messages written to stderr.", log.written);
+  appendValue(output, "obs_tally_log_messages_dropped_total", "counter",
+              "Log messages dropped because the log ring was full.", log.droppedFull);
+  appendValue(output, "obs_tally_log_messages_rate_limited_total", "counter",
+              "Log messages dropped over the rate limit.", log.droppedRateLimited);
+}
+
+
+#pragma mark - Public API
+
+bool startOBSMetricsServer(int port) {
+  if (gMetricsServerContext != nullptr) {
+    return false;
+  }
+
+  struct lws_context_creation_info info;
+  bzero(&info, sizeof(info));
+
+  info.port = port;
+  info.iface = "127.0.0.1";
+  info.protocols = gMetricsProtocols;
+  info.uid = -1;
+  info.gid = -1;
+  info.options |= LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE;
+
+  gMetricsServerContext = lws_create_context(&info);
+  if (gMetricsServerContext == nullptr) {
+    fprintf(stderr, "Could not start metrics server on port %d.\n", port);
+    return false;
+  }
+  return true;
+}
+
+void stopOBSMetricsServer(void) {
+  if (gMetricsServerContext == nullptr) {
+    return;
+  }
+  lws_context_destroy(gMetricsServerContext);
+  gMetricsServerContext = nullptr;
+}
+
+void serviceMetricsServer(void) {
+  if (gMetricsServerContext != nullptr) {
+    TraceSpan span("serviceMetricsServer");
+    lws_service(gMetricsServerContext, -1);
+  }
+}
+
+
+#pragma mark - LibWebSockets handling
+
+int metricsLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                       void *user, void *in, size_t length) {
+  MetricsSession *session = (MetricsSession *)user;
+
+  switch (reason) {
+    case LWS_CALLBACK_HTTP:
+    {
+      if (strcmp((const char *)in, "/metrics") != 0) {
+        lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+        return lws_http_transaction_completed(wsi) ? -1 : 0;
+      }
+
+      std::string text;
+      appendMetricsText(&text);
+      free(session->body);
+      session->body = (uint8_t *)malloc(LWS_PRE + text.length());
+      session->length = text.length();
+      memcpy(session->body + LWS_PRE, text.data(), text.length());
+
+      uint8_t headers[LWS_PRE + 512];
+      uint8_t *start = headers + LWS_PRE;
+      uint8_t *position = start;
+      uint8_t *end = headers + sizeof(headers) - 1;
+      if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/plain; version=0.0.4",
+                                      session->length, &position, end) ||
+          lws_finalize_write_http_header(wsi, start, &position, end)) {
+        return 1;
+      }
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+    case LWS_CALLBACK_HTTP_WRITEABLE:
+    {
+      if (session == nullptr || session->body == nullptr) {
+        break;
+      }
+      // lws keeps whatever the socket does not take and sends it later.
+      int bytesWritten = lws_write(wsi, session->body + LWS_PRE, session->length,
+                                   LWS_WRITE_HTTP_FINAL);
+      int bodyLength = (int)session->length;
+      free(session->body);
+      session->body = nullptr;
+      if (bytesWritten < bodyLength) {
+        return -1;
+      }
+      return lws_http_transaction_completed(wsi) ? -1 : 0;
+    }
+    case LWS_CALLBACK_CLOSED_HTTP:
+      if (session != nullptr) {
+        free(session->body);
+        session->body = nullptr;
+      }
+      break;
+    default:
+      break;
+  }
+  return lws_callback_http_dummy(wsi, reason, user, in, length);
+}
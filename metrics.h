@@ -0,0 +1,51 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#include "gettally.h"
+
+// Counters and histograms for getOBSMetricsSnapshot() and the Prometheus
+// endpoint.
+//
+// Every counter is a relaxed atomic that only the V8 loop thread writes,
+// so counting costs one uncontended increment and any thread can take a
+// snapshot.  Each connection gets its own counters when it is created,
+// and they go away when it closes; the totals are counted separately, so
+// they keep everything.  Histograms use power-of-two microsecond
+// buckets, so recording a value is a count-leading-zeros and an increment.
+//
+// The Prometheus server shares the V8 loop thread; v8_runLoopCallback()
+// services it.
+
+typedef struct OBSConnectionCounters OBSConnectionCounters;
+
+// Creates and removes a connection's counters.  The pointer stays valid
+// until removeConnectionMetrics() is called for the same ID.
+OBSConnectionCounters *addConnectionMetrics(uint32_t connectionID);
+void removeConnectionMetrics(uint32_t connectionID);
+
+// Each of these also counts toward the totals.  counters may be NULL.
+void countFrameReceived(OBSConnectionCounters *counters, uint64_t bytes);
+void countFrameSent(OBSConnectionCounters *counters, uint64_t bytes);
+void countReceiveDrop(OBSConnectionCounters *counters);
+void countSendRefusal(OBSConnectionCounters *counters);
+void setQueueDepths(OBSConnectionCounters *counters,
+                    uint64_t incomingMessages, uint64_t incomingBytes,
+                    uint64_t outgoingMessages, uint64_t outgoingBytes);
+void countReconnect(void);
+
+// Times are in microseconds.
+void recordLoopIteration(uint64_t microseconds);
+void recordJSDispatch(uint64_t microseconds);
+void recordTallyLatency(uint64_t microseconds);
+
+// True once the heap sampling interval has passed since the last sample.
+bool heapSampleDue(uint64_t now);
+void recordOBSHeapMetrics(const OBSHeapMetrics *heap);
+
+// Services the Prometheus server's lws context without blocking.  Does
+// nothing if the server is not running.
+void serviceMetricsServer(void);
+
+#endif  // __METRICS_H__
@@ -0,0 +1,1506 @@
+#include <libwebsockets.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture_log.h"
+
+// A stand-in for obs-websocket 5.x, so that runOBSTally() and the WebSocket
+// layer can be exercised and benchmarked without a running copy of OBS.
+//
+// It speaks the obswebsocket.json subprotocol: Hello (with an
+// authentication challenge if a password is set), Identify, single
+// requests (op 6), and request batches (op 8).  It answers the requests
+// gettally.js makes (current program and preview scene, scene and group
+// lists, scene item lists) from a simulated set of scenes kept in studio
+// mode, and changes that state when asked to.
+//
+// Once the first client has identified, it plays a script of event storms,
+// one phase after another.  Each phase sends count changes of one kind at
+// rate changes per second (0 for all at once).  Events only go to clients
+// that subscribed to their category, as obs-websocket does.
+//
+// With -r, it replays what the server sent on one connection of a capture
+// (see capture_log.h) instead: the captured Hello and Identified, then each
+// event at its original offset from Identified, or as fast as the socket
+// takes them with -f.  A client request gets the next unused captured
+// response to the same request type (or the same types, for a batch), with
+// the client's requestIds put in; requests the capture has no answer for
+// get the simulated one.  An event waits until the client has had as many
+// responses as preceded it in the capture.  When the events run out, the
+// connection is closed the way the captured one was.
+//
+// Usage: mock_obs [-p port] [-w password] [-s sceneCount]
+//                 [-c clientCount] [-d startDelayMilliseconds]
+//                 [-t sendTimesPath] [-x] [-e rate,count,kind]...
+//        mock_obs [-p port] [-c clientCount] [-x] -r capturePath [-f]
+//                 [-C connectionID]
+//
+//   kind is program, preview, transition (a studio-mode transition: the
+//   start event, then new program and preview scenes), items (scene item
+//   visibility), or meters (input volume meters, sent only to clients that
+//   ask for them).  The script waits for clientCount clients (default 1) to
+//   identify, then for the start delay.  -t writes one line per change,
+//   "sequence scene microseconds", once the script has finished: the
+//   changed scene's index and the CLOCK_MONOTONIC time its first message
+//   was written to a socket, for bench_latency to match against callbacks.
+//   -x exits once the script has finished and every client has been sent
+//   everything (or, when replaying, every client has been sent the whole
+//   capture).  -C picks the captured connection to replay; the default is
+//   the first one the server sent anything on.  The default port is 4455.
+
+#define kDefaultPort 4455
+#define kDefaultSceneCount 8
+#define kMaxPhases 32
+#define kMaxSceneCount 1000
+#define kMaxEventsPerTick 10000
+#define kTickMicroseconds 1000
+
+// EventSubscription bits from the obs-websocket protocol.
+#define kEventSubscriptionScenes (1 << 2)
+#define kEventSubscriptionTransitions (1 << 4)
+#define kEventSubscriptionSceneItems (1 << 7)
+#define kEventSubscriptionAll 0x3ff
+#define kEventSubscriptionInputVolumeMeters (1 << 16)
+
+// WebSocketCloseCode values from the obs-websocket protocol.
+#define kCloseNotIdentified 4007
+#define kCloseAuthenticationFailed 4009
+
+typedef enum {
+  kStormProgram,
+  kStormPreview,
+  kStormTransition,
+  kStormItems,
+  kStormMeters
+} StormKind;
+
+typedef struct {
+  double rate;  // Changes per second, or 0 for all at once.
+  long count;
+  StormKind kind;
+} StormPhase;
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} MockBuffer;
+
+// An outgoing message, with LWS_PRE bytes of headroom in front of it.
+typedef struct MockFrame {
+  struct MockFrame *next;
+  long stormSequence;  // The change this message belongs to, or -1.
+  size_t length;
+  unsigned char data[];
+} MockFrame;
+
+typedef struct MockSession {
+  struct lws *wsi;
+  bool identified;
+  uint32_t eventSubscriptions;
+  MockFrame *firstFrame;
+  MockFrame *lastFrame;
+  MockBuffer incoming;  // Fragments of the message being received.
+  struct MockSession *nextSession;
+
+  // Replay state.
+  uint64_t identifiedTime;
+  long replayNext;      // Index of the next captured message to consider.
+  long responsesSent;
+  bool *responseUsed;   // Per captured message.
+  bool replayFinished;
+  bool closeAfterFlush;
+} MockSession;
+
+typedef struct {
+  long op;
+  char *text;
+  size_t length;
+  uint64_t time;        // Capture timestamp, in microseconds.
+  uint64_t offset;      // Microseconds after the connection's Identified.
+  long responsesBefore; // Responses earlier in the capture.
+  char *signature;      // Request type(s) answered, for op 7 and 9.
+} ReplayMessage;
+
+
+#pragma mark - Global variables
+
+static const char *gPassword = NULL;
+static char gSalt[64];
+static char gChallenge[64];
+static int gSceneCount = kDefaultSceneCount;
+static int gProgramScene = 0;
+static int gPreviewScene = 1;
+
+static StormPhase gPhases[kMaxPhases];
+static int gPhaseCount = 0;
+static int gCurrentPhase = 0;
+static long gPhaseEventsSent = 0;
+static uint64_t gPhaseStartTime = 0;
+static uint64_t gStartDelay = 0;  // Microseconds.
+static bool gScriptStarted = false;
+static bool gExitWhenDone = false;
+static int gRequiredClients = 1;
+static int gIdentifiedClients = 0;
+
+// Per change in the script: the scene it changed and when it was sent.
+static const char *gSendTimesPath = NULL;
+static bool gSendTimesWritten = false;
+static uint64_t *gSendTimes = NULL;
+static int *gSendScenes = NULL;
+static long gStormSequenceCount = 0;
+static long gStormSequence = -1;  // The change being sent, or -1.
+static long gNextStormSequence = 0;
+
+static MockSession *gSessions = NULL;
+static lws_sorted_usec_list_t gStormTimer;
+static struct lws_context *gContext = NULL;
+
+// Replay (-r).
+static ReplayMessage *gReplayMessages = NULL;
+static long gReplayMessageCount = 0;
+static long gReplayConnection = -1;
+static bool gReplayFast = false;
+static int gReplayCloseCode = 0;
+static char gReplayCloseReason[124];
+
+static uint64_t gEventsSent = 0;    // Messages, counting each recipient.
+static uint64_t gEventBytes = 0;
+static uint64_t gRequestsAnswered = 0;
+
+
+#pragma mark - Support functions
+
+static uint64_t monotonicMicroseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void bufferAppend(MockBuffer *buffer, const char *data, size_t length) {
+  if (buffer->length + length + 1 > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 1024;
+    while (capacity < buffer->length + length + 1) {
+      capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = '\0';
+}
+
+static void bufferAppendFormat(MockBuffer *buffer, const char *format, ...) {
+  char stackBuffer[512];
+  va_list arguments;
+
+  va_start(arguments, format);
+  int length = vsnprintf(stackBuffer, sizeof(stackBuffer), format, arguments);
+  va_end(arguments);
+
+  if (length < (int)sizeof(stackBuffer)) {
+    bufferAppend(buffer, stackBuffer, length);
+    return;
+  }
+  char *heapBuffer = malloc(length + 1);
+  va_start(arguments, format);
+  vsnprintf(heapBuffer, length + 1, format, arguments);
+  va_end(arguments);
+  bufferAppend(buffer, heapBuffer, length);
+  free(heapBuffer);
+}
+
+static void bufferAppendJSONString(MockBuffer *buffer, const char *string) {
+  bufferAppend(buffer, "\"", 1);
+  for (const char *p = string; *p; p++) {
+    unsigned char c = (unsigned char)*p;
+    if (c == '"' || c == '\\') {
+      char escaped[2] = { '\\', (char)c };
+      bufferAppend(buffer, escaped, 2);
+    } else if (c < 0x20) {
+      bufferAppendFormat(buffer, "\\u%04x", c);
+    } else {
+      bufferAppend(buffer, (const char *)&c, 1);
+    }
+  }
+  bufferAppend(buffer, "\"", 1);
+}
+
+static void sceneName(int scene, char *name, size_t size) {
+  snprintf(name, size, "Scene %d", scene + 1);
+}
+
+// Returns the index of a scene named by sceneName(), or -1.
+static int sceneIndex(const char *name) {
+  int scene;
+  char check[32];
+
+  if (sscanf(name, "Scene %d", &scene) != 1 || scene < 1 || scene > gSceneCount) {
+    return -1;
+  }
+  sceneName(scene - 1, check, sizeof(check));
+  return strcmp(check, name) == 0 ? scene - 1 : -1;
+}
+
+
+#pragma mark - JSON scanning
+
+// Just enough JSON to pick fields out of client messages.  Each function
+// takes a pointer to the start of a value and the end of the message.
+
+static const char *skipWhitespace(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+// Returns the character after the closing quote, or NULL.
+static const char *skipString(const char *p, const char *end) {
+  for (p++; p < end; p++) {
+    if (*p == '\\') {
+      p++;
+    } else if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+// Returns the character after the value, or NULL if it is malformed.
+static const char *skipValue(const char *p, const char *end) {
+  p = skipWhitespace(p, end);
+  if (p >= end) {
+    return NULL;
+  }
+  if (*p == '"') {
+    return skipString(p, end);
+  }
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    while (p < end) {
+      if (*p == '"') {
+        p = skipString(p, end);
+        if (p == NULL) {
+          return NULL;
+        }
+        continue;
+      }
+      if (*p == '{' || *p == '[') {
+        depth++;
+      } else if (*p == '}' || *p == ']') {
+        if (--depth == 0) {
+          return p + 1;
+        }
+      }
+      p++;
+    }
+    return NULL;
+  }
+  while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' &&
+         *p != '\n' && *p != '\r' && *p != '\t') {
+    p++;
+  }
+  return p;
+}
+
+// Returns the value of key in the object at p (not in nested objects), or
+// NULL if the object has no such member.
+static const char *findMember(const char *p, const char *end, const char *key) {
+  size_t keyLength = strlen(key);
+
+  p = skipWhitespace(p, end);
+  if (p >= end || *p != '{') {
+    return NULL;
+  }
+  p++;
+  while (true) {
+    p = skipWhitespace(p, end);
+    if (p >= end || *p != '"') {
+      return NULL;
+    }
+    const char *keyStart = p + 1;
+    const char *keyEnd = skipString(p, end);
+    if (keyEnd == NULL) {
+      return NULL;
+    }
+    p = skipWhitespace(keyEnd, end);
+    if (p >= end || *p != ':') {
+      return NULL;
+    }
+    const char *value = skipWhitespace(p + 1, end);
+    if ((size_t)(keyEnd - 1 - keyStart) == keyLength &&
+        memcmp(keyStart, key, keyLength) == 0) {
+      return value;
+    }
+    p = skipWhitespace(skipValue(value, end), end);
+    if (p == NULL || p >= end || *p != ',') {
+      return NULL;
+    }
+    p++;
+  }
+}
+
+// Copies the string at p, undoing simple escapes.  \u escapes become '?'.
+static bool copyString(const char *p, const char *end, char *string, size_t size) {
+  if (p == NULL || p >= end || *p != '"' || size == 0) {
+    return false;
+  }
+  size_t length = 0;
+  for (p++; p < end && *p != '"'; p++) {
+    char c = *p;
+    if (c == '\\' && p + 1 < end) {
+      p++;
+      switch (*p) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'u': c = '?'; p += MIN(4, end - p - 1); break;
+        default: c = *p; break;
+      }
+    }
+    if (length + 1 < size) {
+      string[length++] = c;
+    }
+  }
+  string[length] = '\0';
+  return p < end;
+}
+
+static bool readNumber(const char *p, const char *end, long *number) {
+  if (p == NULL || p >= end || !(*p == '-' || (*p >= '0' && *p <= '9'))) {
+    return false;
+  }
+  *number = strtol(p, NULL, 10);
+  return true;
+}
+
+
+#pragma mark - Authentication
+
+// obs-websocket's scheme: secret = base64(sha256(password + salt)), and the
+// client answers with base64(sha256(secret + challenge)).
+
+static const uint32_t kSHA256RoundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTATE_RIGHT(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block(uint32_t state[8], const uint8_t block[64]) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+           ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTATE_RIGHT(w[i - 15], 7) ^ ROTATE_RIGHT(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTATE_RIGHT(w[i - 2], 17) ^ ROTATE_RIGHT(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t S1 = ROTATE_RIGHT(e, 6) ^ ROTATE_RIGHT(e, 11) ^ ROTATE_RIGHT(e, 25);
+    uint32_t choice = (e & f) ^ (~e & g);
+    uint32_t temp1 = h + S1 + choice + kSHA256RoundConstants[i] + w[i];
+    uint32_t S0 = ROTATE_RIGHT(a, 2) ^ ROTATE_RIGHT(a, 13) ^ ROTATE_RIGHT(a, 22);
+    uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t temp2 = S0 + majority;
+    h = g; g = f; f = e; e = d + temp1;
+    d = c; c = b; b = a; a = temp1 + temp2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256(const uint8_t *data, size_t length, uint8_t digest[32]) {
+  uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  uint8_t block[64];
+  size_t offset = 0;
+
+  for (; offset + 64 <= length; offset += 64) {
+    sha256Block(state, data + offset);
+  }
+  size_t remaining = length - offset;
+  memset(block, 0, sizeof(block));
+  memcpy(block, data + offset, remaining);
+  block[remaining] = 0x80;
+  if (remaining >= 56) {
+    sha256Block(state, block);
+    memset(block, 0, sizeof(block));
+  }
+  uint64_t bitLength = (uint64_t)length * 8;
+  for (int i = 0; i < 8; i++) {
+    block[63 - i] = (uint8_t)(bitLength >> (i * 8));
+  }
+  sha256Block(state, block);
+
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = (uint8_t)(state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)state[i];
+  }
+}
+
+static void base64Encode(const uint8_t *data, size_t length, char *string) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t out = 0;
+
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < length) group |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length) group |= data[i + 2];
+    string[out++] = alphabet[(group >> 18) & 0x3f];
+    string[out++] = alphabet[(group >> 12) & 0x3f];
+    string[out++] = (i + 1 < length) ? alphabet[(group >> 6) & 0x3f] : '=';
+    string[out++] = (i + 2 < length) ? alphabet[group & 0x3f] : '=';
+  }
+  string[out] = '\0';
+}
+
+// string must hold at least 45 bytes.
+static void sha256Base64(const char *first, const char *second, char *string) {
+  size_t firstLength = strlen(first);
+  size_t secondLength = strlen(second);
+  uint8_t *joined = malloc(firstLength + secondLength);
+  uint8_t digest[32];
+
+  memcpy(joined, first, firstLength);
+  memcpy(joined + firstLength, second, secondLength);
+  sha256(joined, firstLength + secondLength, digest);
+  free(joined);
+  base64Encode(digest, sizeof(digest), string);
+}
+
+static void randomBase64(char *string) {
+  uint8_t bytes[32];
+  for (size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = (uint8_t)(rand() >> 7);
+  }
+  base64Encode(bytes, sizeof(bytes), string);
+}
+
+static bool authenticationMatches(const char *authentication) {
+  char secret[64];
+  char expected[64];
+
+  sha256Base64(gPassword, gSalt, secret);
+  sha256Base64(secret, gChallenge, expected);
+  return strcmp(authentication, expected) == 0;
+}
+
+
+#pragma mark - Sending
+
+static void queueFrame(MockSession *session, const char *data, size_t length) {
+  MockFrame *frame = malloc(sizeof(MockFrame) + LWS_PRE + length);
+  frame->next = NULL;
+  frame->stormSequence = gStormSequence;
+  frame->length = length;
+  memcpy(frame->data + LWS_PRE, data, length);
+
+  if (session->lastFrame) {
+    session->lastFrame->next = frame;
+  } else {
+    session->firstFrame = frame;
+  }
+  session->lastFrame = frame;
+  lws_callback_on_writable(session->wsi);
+}
+
+static void sendEvent(uint32_t category, const char *eventType, const char *eventDataJSON) {
+  MockBuffer message = { 0 };
+  bufferAppendFormat(&message, "{\"op\":5,\"d\":{\"eventType\":\"%s\",\"eventIntent\":%u,"
+                     "\"eventData\":%s}}", eventType, category, eventDataJSON);
+
+  for (MockSession *session = gSessions; session; session = session->nextSession) {
+    if (session->identified && (session->eventSubscriptions & category)) {
+      queueFrame(session, message.data, message.length);
+      gEventsSent++;
+      gEventBytes += message.length;
+    }
+  }
+  free(message.data);
+}
+
+static void sendSceneEvent(uint32_t category, const char *eventType, int scene) {
+  char name[32];
+  char eventData[128];
+
+  sceneName(scene, name, sizeof(name));
+  snprintf(eventData, sizeof(eventData),
+           "{\"sceneName\":\"%s\",\"sceneUuid\":\"00000000-0000-4000-8000-%012d\"}",
+           name, scene + 1);
+  sendEvent(category, eventType, eventData);
+}
+
+static void setProgramScene(int scene) {
+  gProgramScene = scene;
+  sendSceneEvent(kEventSubscriptionScenes, "CurrentProgramSceneChanged", scene);
+}
+
+static void setPreviewScene(int scene) {
+  gPreviewScene = scene;
+  sendSceneEvent(kEventSubscriptionScenes, "CurrentPreviewSceneChanged", scene);
+}
+
+static void sendStormEvent(StormKind kind, long sequence) {
+  gStormSequence = gNextStormSequence++;
+
+  switch (kind) {
+    case kStormProgram:
+      setProgramScene((gProgramScene + 1) % gSceneCount);
+      break;
+    case kStormPreview: {
+      int scene = (gPreviewScene + 1) % gSceneCount;
+      if (scene == gProgramScene && gSceneCount > 1) {
+        scene = (scene + 1) % gSceneCount;
+      }
+      setPreviewScene(scene);
+      break;
+    }
+    case kStormTransition: {
+      // What OBS sends when a studio-mode transition starts: the old
+      // program scene becomes the preview.
+      int oldProgramScene = gProgramScene;
+      sendEvent(kEventSubscriptionTransitions, "SceneTransitionStarted",
+                "{\"transitionName\":\"Fade\",\"transitionUuid\":"
+                "\"00000000-0000-4000-8000-000000000001\"}");
+      setProgramScene(gPreviewScene);
+      setPreviewScene(oldProgramScene);
+      break;
+    }
+    case kStormItems: {
+      char name[32];
+      char eventData[128];
+      sceneName(gProgramScene, name, sizeof(name));
+      snprintf(eventData, sizeof(eventData),
+               "{\"sceneName\":\"%s\",\"sceneItemId\":2,\"sceneItemEnabled\":%s}",
+               name, (sequence & 1) ? "false" : "true");
+      sendEvent(kEventSubscriptionSceneItems, "SceneItemEnableStateChanged", eventData);
+      break;
+    }
+    case kStormMeters: {
+      MockBuffer eventData = { 0 };
+      bufferAppendFormat(&eventData, "{\"inputs\":[");
+      for (int i = 0; i < gSceneCount; i++) {
+        double level = (double)((sequence * 7 + i * 13) % 100) / 100.0;
+        bufferAppendFormat(&eventData, "%s{\"inputName\":\"Scene %d Camera\",\"inputLevelsMul\":"
+                           "[[%.4f,%.4f,%.4f],[%.4f,%.4f,%.4f]]}", i ? "," : "", i + 1,
+                           level, level, level, level, level, level);
+      }
+      bufferAppendFormat(&eventData, "]}");
+      sendEvent(kEventSubscriptionInputVolumeMeters, "InputVolumeMeters", eventData.data);
+      free(eventData.data);
+      break;
+    }
+  }
+
+  if (gSendScenes != NULL) {
+    gSendScenes[gStormSequence] = (kind == kStormPreview) ? gPreviewScene : gProgramScene;
+  }
+  gStormSequence = -1;
+}
+
+
+#pragma mark - Replay
+
+// Returns the first element of the array at p, or NULL if it is empty.
+static const char *firstElement(const char *p, const char *end) {
+  p = skipWhitespace(p, end);
+  if (p == NULL || p >= end || *p != '[') {
+    return NULL;
+  }
+  p = skipWhitespace(p + 1, end);
+  return (p < end && *p != ']') ? p : NULL;
+}
+
+// Returns the element after the one at p, or NULL.
+static const char *nextElement(const char *p, const char *end) {
+  p = skipValue(p, end);
+  if (p == NULL) {
+    return NULL;
+  }
+  p = skipWhitespace(p, end);
+  if (p >= end || *p != ',') {
+    return NULL;
+  }
+  return skipWhitespace(p + 1, end);
+}
+
+// Returns the requestTypes of the objects in an array, joined with commas,
+// which identifies a batch (or its response).  The caller frees it.
+static char *joinRequestTypes(const char *array, const char *end) {
+  MockBuffer types = { 0 };
+
+  bufferAppend(&types, "", 0);
+  for (const char *element = firstElement(array, end); element;
+       element = nextElement(element, end)) {
+    const char *elementEnd = skipValue(element, end);
+    char requestType[128];
+    if (elementEnd != NULL &&
+        copyString(findMember(element, elementEnd, "requestType"), elementEnd,
+                   requestType, sizeof(requestType))) {
+      if (types.length > 0) {
+        bufferAppend(&types, ",", 1);
+      }
+      bufferAppend(&types, requestType, strlen(requestType));
+    }
+  }
+  return types.data;
+}
+
+// Appends the object at p with the value of its member key (if it has one)
+// replaced by replacementJSON.
+static void appendReplacingMember(MockBuffer *out, const char *p, const char *end,
+                                  const char *key, const char *replacementJSON) {
+  const char *objectEnd = skipValue(p, end);
+  if (objectEnd == NULL) {
+    objectEnd = end;
+  }
+  const char *value = findMember(p, objectEnd, key);
+  const char *valueEnd = value ? skipValue(value, objectEnd) : NULL;
+  if (valueEnd == NULL) {
+    bufferAppend(out, p, objectEnd - p);
+    return;
+  }
+  bufferAppend(out, p, value - p);
+  bufferAppend(out, replacementJSON, strlen(replacementJSON));
+  bufferAppend(out, valueEnd, objectEnd - valueEnd);
+}
+
+static void addReplayMessage(const char *text, size_t length, uint64_t time,
+                             long responsesBefore) {
+  const char *end = text + length;
+  long op = -1;
+
+  if (!readNumber(findMember(text, end, "op"), end, &op)) {
+    return;
+  }
+  if (gReplayMessageCount % 256 == 0) {
+    gReplayMessages = realloc(gReplayMessages,
+                              (gReplayMessageCount + 256) * sizeof(ReplayMessage));
+  }
+  ReplayMessage *message = &gReplayMessages[gReplayMessageCount++];
+  memset(message, 0, sizeof(*message));
+  message->op = op;
+  message->text = malloc(length);
+  memcpy(message->text, text, length);
+  message->length = length;
+  message->time = time;
+  message->responsesBefore = responsesBefore;
+
+  const char *d = findMember(text, end, "d");
+  if (op == 7) {
+    char requestType[128] = "";
+    copyString(findMember(d, end, "requestType"), end, requestType, sizeof(requestType));
+    message->signature = strdup(requestType);
+  } else if (op == 9) {
+    message->signature = joinRequestTypes(findMember(d, end, "results"), end);
+  }
+}
+
+// Loads what the server sent on one connection of a capture, putting
+// fragmented messages back together.
+static bool loadReplay(const char *path) {
+  OBSCaptureReader *reader = openOBSCaptureReader(path);
+  OBSCaptureRecord record;
+  const uint8_t *payload;
+  MockBuffer message = { 0 };
+  uint64_t messageTime = 0;
+  uint64_t identifiedTime = 0;
+  long responses = 0;
+
+  if (reader == NULL) {
+    return false;
+  }
+  while (nextOBSCaptureRecord(reader, &record, &payload)) {
+    if (gReplayConnection < 0 && record.kind == kOBSCaptureReceived) {
+      gReplayConnection = record.connectionID;
+    }
+    if ((long)record.connectionID != gReplayConnection) {
+      continue;
+    }
+    if (record.kind == kOBSCaptureClosed) {
+      if (record.length >= 2) {
+        size_t reasonLength = MIN(record.length - 2, sizeof(gReplayCloseReason) - 1);
+        gReplayCloseCode = (payload[0] << 8) | payload[1];
+        memcpy(gReplayCloseReason, payload + 2, reasonLength);
+        gReplayCloseReason[reasonLength] = '\0';
+      }
+      break;
+    }
+    if (record.kind != kOBSCaptureReceived || (record.flags & kOBSCaptureBinary)) {
+      continue;
+    }
+
+    if (record.flags & kOBSCaptureFirstFragment) {
+      message.length = 0;
+      messageTime = record.timestampNanoseconds / 1000;
+    }
+    bufferAppend(&message, (const char *)payload, record.length);
+    if (!(record.flags & kOBSCaptureFinalFragment)) {
+      continue;
+    }
+
+    long count = gReplayMessageCount;
+    addReplayMessage(message.data, message.length, messageTime, responses);
+    if (gReplayMessageCount > count) {
+      long op = gReplayMessages[count].op;
+      if (op == 2 && identifiedTime == 0) {
+        identifiedTime = messageTime;
+      } else if (op == 7 || op == 9) {
+        responses++;
+      }
+    }
+  }
+  if (getOBSCaptureDroppedRecords(reader) > 0) {
+    fprintf(stderr, "Warning: the capture dropped %llu records.\n",
+            (unsigned long long)getOBSCaptureDroppedRecords(reader));
+  }
+  closeOBSCaptureReader(reader);
+  free(message.data);
+
+  if (gReplayMessageCount == 0) {
+    fprintf(stderr, "Nothing from the server on connection %ld of %s\n", gReplayConnection, path);
+    return false;
+  }
+  for (long i = 0; i < gReplayMessageCount; i++) {
+    uint64_t time = gReplayMessages[i].time;
+    gReplayMessages[i].offset = (time > identifiedTime) ? time - identifiedTime : 0;
+  }
+  fprintf(stderr, "Loaded %ld messages (%ld responses) from connection %ld of %s.\n",
+          gReplayMessageCount, responses, gReplayConnection, path);
+  return true;
+}
+
+// Returns the first unused captured message with this op and signature.
+static ReplayMessage *findReplayResponse(MockSession *session, long op, const char *signature) {
+  for (long i = 0; i < gReplayMessageCount; i++) {
+    ReplayMessage *message = &gReplayMessages[i];
+    if (message->op == op && !session->responseUsed[i] &&
+        strcmp(message->signature, signature) == 0) {
+      session->responseUsed[i] = true;
+      return message;
+    }
+  }
+  return NULL;
+}
+
+// Queues the captured Hello or Identified, if the capture has one.
+static bool replayHandshake(MockSession *session, long op) {
+  for (long i = 0; i < gReplayMessageCount; i++) {
+    if (gReplayMessages[i].op == op) {
+      queueFrame(session, gReplayMessages[i].text, gReplayMessages[i].length);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Answers a request (op 6) or batch (op 8) from the capture.  Returns false
+// if the capture has no answer for it.
+static bool replayRequest(MockSession *session, long op, const char *d, const char *end) {
+  char requestId[256];
+  MockBuffer requestIdJSON = { 0 };
+  MockBuffer message = { 0 };
+  ReplayMessage *response;
+
+  if (!copyString(findMember(d, end, "requestId"), end, requestId, sizeof(requestId))) {
+    return false;
+  }
+  if (op == 6) {
+    char requestType[128];
+    if (!copyString(findMember(d, end, "requestType"), end, requestType, sizeof(requestType)) ||
+        (response = findReplayResponse(session, 7, requestType)) == NULL) {
+      return false;
+    }
+  } else {
+    char *signature = joinRequestTypes(findMember(d, end, "requests"), end);
+    response = findReplayResponse(session, 9, signature);
+    free(signature);
+    if (response == NULL) {
+      return false;
+    }
+  }
+
+  const char *responseEnd = response->text + response->length;
+  const char *responseD = findMember(response->text, responseEnd, "d");
+  bufferAppendJSONString(&requestIdJSON, requestId);
+  bufferAppendFormat(&message, "{\"op\":%ld,\"d\":", op + 1);
+
+  if (op == 6) {
+    appendReplacingMember(&message, responseD, responseEnd, "requestId", requestIdJSON.data);
+  } else {
+    // Each result gets the requestId of the client's request in the same
+    // position.
+    MockBuffer results = { 0 };
+    MockBuffer renamed = { 0 };
+    const char *request = firstElement(findMember(d, end, "requests"), end);
+
+    bufferAppend(&results, "[", 1);
+    for (const char *result = firstElement(findMember(responseD, responseEnd, "results"),
+                                           responseEnd);
+         result; result = nextElement(result, responseEnd)) {
+      char itemRequestId[256];
+      MockBuffer itemRequestIdJSON = { 0 };
+      if (results.length > 1) {
+        bufferAppend(&results, ",", 1);
+      }
+      const char *requestEnd = request ? skipValue(request, end) : NULL;
+      if (requestEnd != NULL &&
+          copyString(findMember(request, requestEnd, "requestId"), requestEnd,
+                     itemRequestId, sizeof(itemRequestId))) {
+        bufferAppendJSONString(&itemRequestIdJSON, itemRequestId);
+        appendReplacingMember(&results, result, responseEnd, "requestId",
+                              itemRequestIdJSON.data);
+        free(itemRequestIdJSON.data);
+      } else {
+        const char *resultEnd = skipValue(result, responseEnd);
+        bufferAppend(&results, result, (resultEnd ? resultEnd : responseEnd) - result);
+      }
+      request = request ? nextElement(request, end) : NULL;
+    }
+    bufferAppend(&results, "]", 1);
+
+    appendReplacingMember(&renamed, responseD, responseEnd, "requestId", requestIdJSON.data);
+    appendReplacingMember(&message, renamed.data, renamed.data + renamed.length, "results",
+                          results.data);
+    free(results.data);
+    free(renamed.data);
+  }
+  bufferAppend(&message, "}", 1);
+  queueFrame(session, message.data, message.length);
+
+  free(message.data);
+  free(requestIdJSON.data);
+  gRequestsAnswered++;
+  return true;
+}
+
+// Queues the session's due events.  Returns true once it has had them all.
+static bool replayEvents(MockSession *session, uint64_t now) {
+  long budget = kMaxEventsPerTick;
+
+  while (session->replayNext < gReplayMessageCount && budget > 0) {
+    ReplayMessage *message = &gReplayMessages[session->replayNext];
+    if (message->op != 5) {
+      session->replayNext++;
+      continue;
+    }
+    if (session->responsesSent < message->responsesBefore ||
+        (!gReplayFast && now < session->identifiedTime + message->offset)) {
+      return false;
+    }
+    queueFrame(session, message->text, message->length);
+    gEventsSent++;
+    gEventBytes += message->length;
+    session->replayNext++;
+    budget--;
+  }
+  return session->replayNext == gReplayMessageCount;
+}
+
+
+#pragma mark - Requests
+
+// Appends requestType, requestId, requestStatus, and responseData (but not
+// the braces around them), the shape shared by op 7 and op 9 results.
+static void appendRequestResult(MockBuffer *out, const char *requestType,
+                                const char *requestId, const char *requestData,
+                                const char *end) {
+  char name[256];
+  char sceneNameValue[256] = "";
+  MockBuffer response = { 0 };
+  int code = 100;
+  const char *comment = NULL;
+
+  if (requestData != NULL) {
+    copyString(findMember(requestData, end, "sceneName"), end,
+               sceneNameValue, sizeof(sceneNameValue));
+  }
+
+  if (strcmp(requestType, "GetVersion") == 0) {
+    bufferAppendFormat(&response, "{\"obsVersion\":\"30.0.0\",\"obsWebSocketVersion\":\"5.3.0\","
+                       "\"rpcVersion\":1,\"availableRequests\":[],\"supportedImageFormats\":[],"
+                       "\"platform\":\"mock\",\"platformDescription\":\"mock_obs\"}");
+  } else if (strcmp(requestType, "GetStudioModeEnabled") == 0) {
+    bufferAppendFormat(&response, "{\"studioModeEnabled\":true}");
+  } else if (strcmp(requestType, "GetCurrentProgramScene") == 0) {
+    sceneName(gProgramScene, name, sizeof(name));
+    bufferAppendFormat(&response, "{\"currentProgramSceneName\":\"%s\",\"sceneName\":\"%s\"}",
+                       name, name);
+  } else if (strcmp(requestType, "GetCurrentPreviewScene") == 0) {
+    sceneName(gPreviewScene, name, sizeof(name));
+    bufferAppendFormat(&response, "{\"currentPreviewSceneName\":\"%s\",\"sceneName\":\"%s\"}",
+                       name, name);
+  } else if (strcmp(requestType, "GetSceneList") == 0) {
+    char programName[32];
+    char previewName[32];
+    sceneName(gProgramScene, programName, sizeof(programName));
+    sceneName(gPreviewScene, previewName, sizeof(previewName));
+    bufferAppendFormat(&response, "{\"currentProgramSceneName\":\"%s\","
+                       "\"currentPreviewSceneName\":\"%s\",\"scenes\":[", programName, previewName);
+    // obs-websocket lists scenes bottom to top.
+    for (int i = gSceneCount - 1; i >= 0; i--) {
+      sceneName(i, name, sizeof(name));
+      bufferAppendFormat(&response, "%s{\"sceneIndex\":%d,\"sceneName\":\"%s\"}",
+                         (i == gSceneCount - 1) ? "" : ",", gSceneCount - 1 - i, name);
+    }
+    bufferAppendFormat(&response, "]}");
+  } else if (strcmp(requestType, "GetGroupList") == 0) {
+    bufferAppendFormat(&response, "{\"groups\":[]}");
+  } else if (strcmp(requestType, "GetSceneItemList") == 0 ||
+             strcmp(requestType, "GetGroupSceneItemList") == 0) {
+    // Every scene has its own camera and a shared overlay, so source tally
+    // has something to work out.
+    int scene = sceneIndex(sceneNameValue);
+    if (scene < 0) {
+      code = 600;
+      comment = "No source was found by the name of `sceneName`.";
+    } else {
+      bufferAppendFormat(&response, "{\"sceneItems\":["
+                         "{\"sceneItemId\":1,\"sourceName\":\"Scene %d Camera\","
+                         "\"sceneItemEnabled\":true,\"isGroup\":false,\"sceneItemIndex\":0},"
+                         "{\"sceneItemId\":2,\"sourceName\":\"Shared Overlay\","
+                         "\"sceneItemEnabled\":true,\"isGroup\":false,\"sceneItemIndex\":1}]}",
+                         scene + 1);
+    }
+  } else if (strcmp(requestType, "GetSceneItemEnabled") == 0) {
+    bufferAppendFormat(&response, "{\"sceneItemEnabled\":true}");
+  } else if (strcmp(requestType, "SetCurrentProgramScene") == 0 ||
+             strcmp(requestType, "SetCurrentPreviewScene") == 0) {
+    int scene = sceneIndex(sceneNameValue);
+    if (scene < 0) {
+      code = 600;
+      comment = "No source was found by the name of `sceneName`.";
+    } else if (strcmp(requestType, "SetCurrentProgramScene") == 0) {
+      setProgramScene(scene);
+    } else {
+      setPreviewScene(scene);
+    }
+  } else {
+    code = 204;
+    comment = "Your request type is not valid.";
+  }
+
+  bufferAppend(out, "\"requestType\":", 14);
+  bufferAppendJSONString(out, requestType);
+  bufferAppend(out, ",\"requestId\":", 13);
+  bufferAppendJSONString(out, requestId);
+  bufferAppendFormat(out, ",\"requestStatus\":{\"result\":%s,\"code\":%d",
+                     (code == 100) ? "true" : "false", code);
+  if (comment) {
+    bufferAppend(out, ",\"comment\":", 11);
+    bufferAppendJSONString(out, comment);
+  }
+  bufferAppend(out, "}", 1);
+  if (response.length > 0) {
+    bufferAppend(out, ",\"responseData\":", 16);
+    bufferAppend(out, response.data, response.length);
+  }
+  free(response.data);
+  gRequestsAnswered++;
+}
+
+static void handleRequest(MockSession *session, const char *d, const char *end) {
+  char requestType[128];
+  char requestId[256];
+  MockBuffer message = { 0 };
+
+  if (!copyString(findMember(d, end, "requestType"), end, requestType, sizeof(requestType)) ||
+      !copyString(findMember(d, end, "requestId"), end, requestId, sizeof(requestId))) {
+    return;
+  }
+  bufferAppendFormat(&message, "{\"op\":7,\"d\":{");
+  appendRequestResult(&message, requestType, requestId, findMember(d, end, "requestData"), end);
+  bufferAppendFormat(&message, "}}");
+  queueFrame(session, message.data, message.length);
+  free(message.data);
+}
+
+// Runs the requests in order.  With haltOnFailure, the ones after a failure
+// are left out of the results, as obs-websocket does.
+static void handleRequestBatch(MockSession *session, const char *d, const char *end) {
+  char requestId[256];
+  long haltOnFailure = 0;
+  MockBuffer message = { 0 };
+
+  if (!copyString(findMember(d, end, "requestId"), end, requestId, sizeof(requestId))) {
+    return;
+  }
+  const char *halt = findMember(d, end, "haltOnFailure");
+  haltOnFailure = (halt != NULL && end - halt >= 4 && memcmp(halt, "true", 4) == 0);
+
+  bufferAppend(&message, "{\"op\":9,\"d\":{\"requestId\":", 25);
+  bufferAppendJSONString(&message, requestId);
+  bufferAppend(&message, ",\"results\":[", 12);
+
+  const char *p = findMember(d, end, "requests");
+  if (p != NULL && *p == '[') {
+    bool first = true;
+    p = skipWhitespace(p + 1, end);
+    while (p < end && *p == '{') {
+      const char *requestEnd = skipValue(p, end);
+      char requestType[128];
+      char itemRequestId[256] = "";
+      if (requestEnd == NULL) {
+        break;
+      }
+      if (copyString(findMember(p, requestEnd, "requestType"), requestEnd,
+                     requestType, sizeof(requestType))) {
+        copyString(findMember(p, requestEnd, "requestId"), requestEnd,
+                   itemRequestId, sizeof(itemRequestId));
+        size_t resultStart = message.length;
+        bufferAppend(&message, first ? "{" : ",{", first ? 1 : 2);
+        appendRequestResult(&message, requestType, itemRequestId,
+                            findMember(p, requestEnd, "requestData"), requestEnd);
+        bufferAppend(&message, "}", 1);
+        first = false;
+        if (haltOnFailure && strstr(message.data + resultStart, "\"result\":false") != NULL) {
+          break;
+        }
+      }
+      p = skipWhitespace(requestEnd, end);
+      if (p < end && *p == ',') {
+        p = skipWhitespace(p + 1, end);
+      }
+    }
+  }
+  bufferAppend(&message, "]}}", 3);
+  queueFrame(session, message.data, message.length);
+  free(message.data);
+}
+
+static void sendHello(MockSession *session) {
+  if (gReplayMessages != NULL && replayHandshake(session, 0)) {
+    return;
+  }
+
+  MockBuffer message = { 0 };
+  bufferAppendFormat(&message, "{\"op\":0,\"d\":{\"obsWebSocketVersion\":\"5.3.0\","
+                     "\"rpcVersion\":1");
+  if (gPassword != NULL) {
+    bufferAppendFormat(&message, ",\"authentication\":{\"challenge\":\"%s\",\"salt\":\"%s\"}",
+                       gChallenge, gSalt);
+  }
+  bufferAppendFormat(&message, "}}");
+  queueFrame(session, message.data, message.length);
+  free(message.data);
+}
+
+// Returns false if the connection should be closed.
+static bool handleMessage(MockSession *session, const char *text, size_t length) {
+  const char *end = text + length;
+  long op = -1;
+  const char *d = findMember(text, end, "d");
+
+  if (!readNumber(findMember(text, end, "op"), end, &op) || d == NULL) {
+    return true;
+  }
+  if (!session->identified && op != 1) {
+    lws_close_reason(session->wsi, kCloseNotIdentified, (unsigned char *)"Not identified", 14);
+    return false;
+  }
+
+  switch (op) {
+    case 1: {  // Identify
+      // A replayed Hello carries the captured challenge, which the client
+      // cannot have answered for this server, so replays skip the check.
+      if (gPassword != NULL && gReplayMessages == NULL) {
+        char authentication[128];
+        if (!copyString(findMember(d, end, "authentication"), end,
+                        authentication, sizeof(authentication)) ||
+            !authenticationMatches(authentication)) {
+          lws_close_reason(session->wsi, kCloseAuthenticationFailed,
+                           (unsigned char *)"Authentication failed", 21);
+          return false;
+        }
+      }
+      long subscriptions = kEventSubscriptionAll;
+      readNumber(findMember(d, end, "eventSubscriptions"), end, &subscriptions);
+      session->eventSubscriptions = (uint32_t)subscriptions;
+      session->identified = true;
+      session->identifiedTime = monotonicMicroseconds();
+      gIdentifiedClients++;
+
+      if (gReplayMessages == NULL || !replayHandshake(session, 2)) {
+        const char *identified = "{\"op\":2,\"d\":{\"negotiatedRpcVersion\":1}}";
+        queueFrame(session, identified, strlen(identified));
+      }
+
+      if (!gScriptStarted && gIdentifiedClients >= gRequiredClients) {
+        gScriptStarted = true;
+        gPhaseStartTime = monotonicMicroseconds() + gStartDelay;
+      }
+      break;
+    }
+    case 3: {  // Reidentify
+      long subscriptions = session->eventSubscriptions;
+      readNumber(findMember(d, end, "eventSubscriptions"), end, &subscriptions);
+      session->eventSubscriptions = (uint32_t)subscriptions;
+      const char *identified = "{\"op\":2,\"d\":{\"negotiatedRpcVersion\":1}}";
+      queueFrame(session, identified, strlen(identified));
+      break;
+    }
+    case 6:
+    case 8:
+      if (gReplayMessages == NULL || !replayRequest(session, op, d, end)) {
+        if (op == 6) {
+          handleRequest(session, d, end);
+        } else {
+          handleRequestBatch(session, d, end);
+        }
+      }
+      session->responsesSent++;
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+
+#pragma mark - Storm script
+
+static bool allQueuesEmpty(void) {
+  for (MockSession *session = gSessions; session; session = session->nextSession) {
+    if (session->firstFrame != NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void writeSendTimes(void) {
+  FILE *file = fopen(gSendTimesPath, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write send times to %s\n", gSendTimesPath);
+    return;
+  }
+  for (long i = 0; i < gStormSequenceCount; i++) {
+    if (gSendTimes[i] != 0) {
+      fprintf(file, "%ld %d %llu\n", i, gSendScenes[i], (unsigned long long)gSendTimes[i]);
+    }
+  }
+  fclose(file);
+}
+
+static bool replayTick(uint64_t now) {
+  bool finished = true;
+
+  for (MockSession *session = gSessions; session; session = session->nextSession) {
+    if (!session->identified || session->replayFinished) {
+      continue;
+    }
+    if (!replayEvents(session, now)) {
+      finished = false;
+      continue;
+    }
+    session->replayFinished = true;
+    fprintf(stderr, "Replayed the capture to a client in %.3f s.\n",
+            (double)(now - session->identifiedTime) / 1000000.0);
+    if (gReplayCloseCode != 0) {
+      session->closeAfterFlush = true;
+      lws_callback_on_writable(session->wsi);
+    }
+  }
+  return finished;
+}
+
+static void stormTick(lws_sorted_usec_list_t *timer) {
+  uint64_t now = monotonicMicroseconds();
+
+  if (gReplayMessages != NULL) {
+    if (replayTick(now) && gExitWhenDone && gScriptStarted && allQueuesEmpty()) {
+      lws_cancel_service(gContext);
+      gContext = NULL;
+      return;
+    }
+    lws_sul_schedule(lws_get_context_from_sul(timer), 0, timer, stormTick, kTickMicroseconds);
+    return;
+  }
+
+  if (gScriptStarted && gCurrentPhase < gPhaseCount && now >= gPhaseStartTime) {
+    StormPhase *phase = &gPhases[gCurrentPhase];
+    long due = phase->count;
+    if (phase->rate > 0) {
+      due = (long)((double)(now - gPhaseStartTime) * phase->rate / 1000000.0) + 1;
+      due = MIN(due, phase->count);
+    }
+    long budget = kMaxEventsPerTick;
+    while (gPhaseEventsSent < due && budget-- > 0) {
+      sendStormEvent(phase->kind, gPhaseEventsSent++);
+    }
+
+    if (gPhaseEventsSent >= phase->count) {
+      double seconds = (double)(now - gPhaseStartTime) / 1000000.0;
+      fprintf(stderr, "Phase %d done: %ld changes in %.3f s (%.0f/s).\n",
+              gCurrentPhase + 1, phase->count, seconds,
+              seconds > 0 ? phase->count / seconds : 0.0);
+      gCurrentPhase++;
+      gPhaseEventsSent = 0;
+      gPhaseStartTime = now;
+    }
+  }
+
+  if (gScriptStarted && gCurrentPhase >= gPhaseCount && allQueuesEmpty()) {
+    if (gSendTimesPath != NULL && !gSendTimesWritten) {
+      writeSendTimes();
+      gSendTimesWritten = true;
+    }
+    if (gExitWhenDone) {
+      lws_cancel_service(gContext);
+      gContext = NULL;
+      return;
+    }
+  }
+  lws_sul_schedule(lws_get_context_from_sul(timer), 0, timer, stormTick, kTickMicroseconds);
+}
+
+
+#pragma mark - LibWebSockets handling
+
+static int mockCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                        void *user, void *in, size_t length) {
+  MockSession *session = (MockSession *)user;
+
+  switch (reason) {
+    case LWS_CALLBACK_ESTABLISHED:
+      memset(session, 0, sizeof(*session));
+      session->wsi = wsi;
+      session->nextSession = gSessions;
+      gSessions = session;
+      if (gReplayMessages != NULL) {
+        session->responseUsed = calloc(gReplayMessageCount, sizeof(bool));
+      }
+      sendHello(session);
+      break;
+    case LWS_CALLBACK_CLOSED: {
+      if (session->identified) {
+        gIdentifiedClients--;
+      }
+      for (MockSession **link = &gSessions; *link; link = &(*link)->nextSession) {
+        if (*link == session) {
+          *link = session->nextSession;
+          break;
+        }
+      }
+      while (session->firstFrame) {
+        MockFrame *next = session->firstFrame->next;
+        free(session->firstFrame);
+        session->firstFrame = next;
+      }
+      free(session->incoming.data);
+      free(session->responseUsed);
+      break;
+    }
+    case LWS_CALLBACK_RECEIVE:
+      bufferAppend(&session->incoming, (const char *)in, length);
+      if (lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0) {
+        bool keepOpen = handleMessage(session, session->incoming.data, session->incoming.length);
+        session->incoming.length = 0;
+        if (!keepOpen) {
+          return -1;
+        }
+      }
+      break;
+    case LWS_CALLBACK_SERVER_WRITEABLE: {
+      MockFrame *frame = session->firstFrame;
+      if (frame == NULL) {
+        if (session->closeAfterFlush) {
+          // 1005 and 1006 mean no close frame was received, so send none.
+          if (gReplayCloseCode >= 1000 && gReplayCloseCode != 1005 && gReplayCloseCode != 1006) {
+            lws_close_reason(wsi, gReplayCloseCode, (unsigned char *)gReplayCloseReason,
+                             strlen(gReplayCloseReason));
+          }
+          return -1;
+        }
+        break;
+      }
+      if (lws_write(wsi, frame->data + LWS_PRE, frame->length, LWS_WRITE_TEXT) <
+          (int)frame->length) {
+        return -1;
+      }
+      if (frame->stormSequence >= 0 && gSendTimes[frame->stormSequence] == 0) {
+        gSendTimes[frame->stormSequence] = monotonicMicroseconds();
+      }
+      session->firstFrame = frame->next;
+      if (session->firstFrame == NULL) {
+        session->lastFrame = NULL;
+      }
+      free(frame);
+      if (session->firstFrame || session->closeAfterFlush) {
+        lws_callback_on_writable(wsi);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return 0;
+}
+
+static struct lws_protocols gMockProtocols[] = {
+  { "obswebsocket.json", mockCallback, sizeof(MockSession), 0, 0, NULL, 0 },
+  LWS_PROTOCOL_LIST_TERM
+};
+
+
+#pragma mark - Main
+
+static bool parsePhase(const char *argument, StormPhase *phase) {
+  char kind[32];
+  if (sscanf(argument, "%lf,%ld,%31s", &phase->rate, &phase->count, kind) != 3 ||
+      phase->rate < 0 || phase->count < 1) {
+    return false;
+  }
+  if (strcmp(kind, "program") == 0) {
+    phase->kind = kStormProgram;
+  } else if (strcmp(kind, "preview") == 0) {
+    phase->kind = kStormPreview;
+  } else if (strcmp(kind, "transition") == 0) {
+    phase->kind = kStormTransition;
+  } else if (strcmp(kind, "items") == 0) {
+    phase->kind = kStormItems;
+  } else if (strcmp(kind, "meters") == 0) {
+    phase->kind = kStormMeters;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-p port] [-w password] [-s sceneCount] "
+          "[-c clientCount] [-d startDelayMilliseconds] [-t sendTimesPath] [-x] "
+          "[-e rate,count,kind]...\n"
+          "       %s [-p port] [-c clientCount] [-x] -r capturePath [-f] [-C connectionID]\n"
+          "kind is program, preview, transition, items, or meters.\n", name, name);
+}
+
+int main(int argc, char *argv[]) {
+  int port = kDefaultPort;
+  const char *replayPath = NULL;
+  int option;
+
+  while ((option = getopt(argc, argv, "p:w:s:c:d:t:e:xr:fC:")) != -1) {
+    switch (option) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'w':
+        gPassword = optarg;
+        break;
+      case 's':
+        gSceneCount = atoi(optarg);
+        break;
+      case 'c':
+        gRequiredClients = atoi(optarg);
+        break;
+      case 't':
+        gSendTimesPath = optarg;
+        break;
+      case 'd':
+        gStartDelay = (uint64_t)atol(optarg) * 1000;
+        break;
+      case 'x':
+        gExitWhenDone = true;
+        break;
+      case 'r':
+        replayPath = optarg;
+        break;
+      case 'f':
+        gReplayFast = true;
+        break;
+      case 'C':
+        gReplayConnection = atol(optarg);
+        break;
+      case 'e':
+        if (gPhaseCount == kMaxPhases || !parsePhase(optarg, &gPhases[gPhaseCount])) {
+          usage(argv[0]);
+          return 1;
+        }
+        gPhaseCount++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (gSceneCount < 2 || gSceneCount > kMaxSceneCount) {
+    fprintf(stderr, "Scene count must be between 2 and %d.\n", kMaxSceneCount);
+    return 1;
+  }
+  if (replayPath != NULL) {
+    if (gPhaseCount > 0) {
+      fprintf(stderr, "-r and -e cannot be used together.\n");
+      return 1;
+    }
+    if (!loadReplay(replayPath)) {
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < gPhaseCount; i++) {
+    gStormSequenceCount += gPhases[i].count;
+  }
+  gSendTimes = calloc(gStormSequenceCount + 1, sizeof(uint64_t));
+  gSendScenes = calloc(gStormSequenceCount + 1, sizeof(int));
+
+  srand((unsigned)time(NULL) ^ (unsigned)getpid());
+  randomBase64(gSalt);
+  randomBase64(gChallenge);
+  lws_set_log_level(LLL_ERR, NULL);
+
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof(info));
+  info.port = port;
+  info.protocols = gMockProtocols;
+  info.options = LWS_SERVER_OPTION_VALIDATE_UTF8;
+
+  gContext = lws_create_context(&info);
+  if (gContext == NULL) {
+    fprintf(stderr, "Could not start the mock server on port %d.\n", port);
+    return 1;
+  }
+  struct lws_context *context = gContext;
+  fprintf(stderr, "Mock obs-websocket listening on port %d (%d scenes, %d phases%s).\n",
+          port, gSceneCount, gPhaseCount, gPassword ? ", password required" : "");
+
+  lws_sul_schedule(context, 0, &gStormTimer, stormTick, kTickMicroseconds);
+  while (gContext != NULL) {
+    if (lws_service(context, 0) < 0) {
+      break;
+    }
+  }
+
+  fprintf(stderr, "Sent %llu events (%llu bytes); answered %llu requests.\n",
+          (unsigned long long)gEventsSent, (unsigned long long)gEventBytes,
+          (unsigned long long)gRequestsAnswered);
+  lws_context_destroy(context);
+  return 0;
+}
@@ -0,0 +1,237 @@
+#include "scene_graph.h"
+
+// OBS refuses to create recursive scenes, but a stale cache could briefly
+// disagree with it, so cap the walk rather than trusting the graph blindly.
+#define kMaxSceneDepth 32
+
+void SceneGraph::SetSceneItems(const std::string &sceneName,
+                               const std::vector<SceneGraphItem> &items) {
+  Node &scene = this->nodes[sceneName];
+
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    if (scene.isScene && scene.paths[output] != 0) {
+      this->ApplyDeltaToItems(scene, output, -scene.paths[output], 0);
+    }
+  }
+
+  scene.isScene = true;
+  scene.items = items;
+
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    if (scene.paths[output] != 0) {
+      this->ApplyDeltaToItems(scene, output, scene.paths[output], 0);
+    }
+  }
+}
+
+void SceneGraph::RemoveScene(const std::string &sceneName) {
+  auto iterator = this->nodes.find(sceneName);
+  if (iterator == this->nodes.end() || !iterator->second.isScene) {
+    return;
+  }
+  this->SetSceneItems(sceneName, std::vector<SceneGraphItem>());
+  this->nodes[sceneName].isScene = false;
+}
+
+void SceneGraph::RenameScene(const std::string &oldName, const std::string &newName) {
+  auto iterator = this->nodes.find(oldName);
+  if (oldName == newName || iterator == this->nodes.end() || !iterator->second.isScene) {
+    return;
+  }
+  // References into an unordered_map survive rehashing.
+  Node &oldNode = iterator->second;
+  Node &newNode = this->nodes[newName];
+
+  newNode.isScene = true;
+  newNode.items.swap(oldNode.items);
+  oldNode.items.clear();
+  oldNode.isScene = false;
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    if (oldNode.paths[output] == 0) {
+      continue;
+    }
+    newNode.paths[output] += oldNode.paths[output];
+    oldNode.paths[output] = 0;
+    this->dirty.insert(oldName);
+    this->dirty.insert(newName);
+  }
+
+  for (auto &element : this->nodes) {
+    for (SceneGraphItem &item : element.second.items) {
+      if (item.sourceName == oldName) {
+        item.sourceName = newName;
+      }
+    }
+  }
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    for (std::string &sceneName : this->roots[output]) {
+      if (sceneName == oldName) {
+        sceneName = newName;
+      }
+    }
+  }
+}
+
+void SceneGraph::AddSceneItem(const std::string &sceneName, const SceneGraphItem &item) {
+  Node &scene = this->nodes[sceneName];
+  scene.isScene = true;
+  if (this->FindItem(scene, item.sceneItemID) != nullptr) {
+    this->RemoveSceneItem(sceneName, item.sceneItemID);
+  }
+  scene.items.push_back(item);
+
+  if (!item.enabled) {
+    return;
+  }
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    if (scene.paths[output] != 0) {
+      this->ApplyDelta(item.sourceName, output, scene.paths[output], 1);
+    }
+  }
+}
+
+void SceneGraph::RemoveSceneItem(const std::string &sceneName, int64_t sceneItemID) {
+  auto iterator = this->nodes.find(sceneName);
+  if (iterator == this->nodes.end()) {
+    return;
+  }
+  Node &scene = iterator->second;
+
+  for (auto item = scene.items.begin(); item != scene.items.end(); item++) {
+    if (item->sceneItemID != sceneItemID) {
+      continue;
+    }
+    if (item->enabled) {
+      for (int output = 0; output < kSceneGraphOutputCount; output++) {
+        if (scene.paths[output] != 0) {
+          this->ApplyDelta(item->sourceName, output, -scene.paths[output], 1);
+        }
+      }
+    }
+    scene.items.erase(item);
+    return;
+  }
+}
+
+void SceneGraph::SetSceneItemEnabled(const std::string &sceneName, int64_t sceneItemID,
+                                     bool enabled) {
+  auto iterator = this->nodes.find(sceneName);
+  if (iterator == this->nodes.end()) {
+    return;
+  }
+  Node &scene = iterator->second;
+  SceneGraphItem *item = this->FindItem(scene, sceneItemID);
+  if (item == nullptr || item->enabled == enabled) {
+    return;
+  }
+  item->enabled = enabled;
+
+  // Copy the name; the walk below can insert into the node table.
+  std::string sourceName = item->sourceName;
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    int32_t paths = scene.paths[output];
+    if (paths != 0) {
+      this->ApplyDelta(sourceName, output, enabled ? paths : -paths, 1);
+    }
+  }
+}
+
+void SceneGraph::SetRootScenes(int output, const std::vector<std::string> &sceneNames) {
+  // Add the new roots before removing the old ones so that sources shared
+  // between them never drop to zero paths and back.
+  for (const std::string &sceneName : sceneNames) {
+    this->ApplyDelta(sceneName, output, 1, 0);
+  }
+  for (const std::string &sceneName : this->roots[output]) {
+    this->ApplyDelta(sceneName, output, -1, 0);
+  }
+  this->roots[output] = sceneNames;
+}
+
+void SceneGraph::Clear(void) {
+  for (auto &element : this->nodes) {
+    for (int output = 0; output < kSceneGraphOutputCount; output++) {
+      if (element.second.reported[output]) {
+        this->dirty.insert(element.first);
+      }
+    }
+  }
+
+  // Keep only what Flush() needs to report the removals.
+  std::unordered_map<std::string, Node> reportedNodes;
+  for (const std::string &sourceName : this->dirty) {
+    Node node;
+    node.reported[kSceneGraphProgram] = this->nodes[sourceName].reported[kSceneGraphProgram];
+    node.reported[kSceneGraphPreview] = this->nodes[sourceName].reported[kSceneGraphPreview];
+    reportedNodes[sourceName] = node;
+  }
+  this->nodes.swap(reportedNodes);
+
+  for (int output = 0; output < kSceneGraphOutputCount; output++) {
+    this->roots[output].clear();
+  }
+}
+
+bool SceneGraph::IsOnOutput(const std::string &sourceName, int output) {
+  auto iterator = this->nodes.find(sourceName);
+  if (iterator == this->nodes.end()) {
+    return false;
+  }
+  return iterator->second.paths[output] > 0;
+}
+
+void SceneGraph::Flush(ChangeHandler handler) {
+  std::set<std::string> changed;
+  changed.swap(this->dirty);
+
+  for (const std::string &sourceName : changed) {
+    Node &node = this->nodes[sourceName];
+    bool onProgram = node.paths[kSceneGraphProgram] > 0;
+    bool onPreview = node.paths[kSceneGraphPreview] > 0;
+
+    if (onProgram == node.reported[kSceneGraphProgram] &&
+        onPreview == node.reported[kSceneGraphPreview]) {
+      // Toggled away and back again before anyone looked.
+      continue;
+    }
+    node.reported[kSceneGraphProgram] = onProgram;
+    node.reported[kSceneGraphPreview] = onPreview;
+    handler(sourceName, onProgram, onPreview);
+  }
+}
+
+void SceneGraph::ApplyDelta(const std::string &sourceName, int output, int32_t delta,
+                            int depth) {
+  if (depth > kMaxSceneDepth) {
+    return;
+  }
+  Node &node = this->nodes[sourceName];
+
+  bool wasActive = node.paths[output] > 0;
+  node.paths[output] += delta;
+  bool isActive = node.paths[output] > 0;
+  if (wasActive != isActive) {
+    this->dirty.insert(sourceName);
+  }
+
+  if (node.isScene) {
+    this->ApplyDeltaToItems(node, output, delta, depth);
+  }
+}
+
+void SceneGraph::ApplyDeltaToItems(Node &scene, int output, int32_t delta, int depth) {
+  for (const SceneGraphItem &item : scene.items) {
+    if (item.enabled) {
+      this->ApplyDelta(item.sourceName, output, delta, depth + 1);
+    }
+  }
+}
+
+SceneGraphItem *SceneGraph::FindItem(Node &scene, int64_t sceneItemID) {
+  for (SceneGraphItem &item : scene.items) {
+    if (item.sceneItemID == sceneItemID) {
+      return &item;
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,90 @@
+#ifndef __SCENE_GRAPH_H__
+#define __SCENE_GRAPH_H__
+
+#include <functional>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Which output a scene or source is being tallied for.
+enum {
+  kSceneGraphProgram = 0,
+  kSceneGraphPreview = 1,
+  kSceneGraphOutputCount = 2
+};
+
+typedef struct {
+  int64_t sceneItemID;
+  std::string sourceName;
+  bool enabled;
+} SceneGraphItem;
+
+// A cache of the OBS scene graph (scenes, their scene items, and which of
+// those items are enabled), used to work out which individual sources are
+// visible on program and preview, including sources inside nested scenes
+// and groups.
+//
+// For each node, the graph tracks the number of enabled paths that lead to
+// it from the program and preview root scenes.  A source is on an output
+// when that count is nonzero.  When an item is toggled, only the subtree
+// below that item is walked, adjusting each count by the number of paths
+// that reach the item's parent scene, so the cost of an event is
+// proportional to the size of the affected subtree rather than the size
+// of the whole graph.
+class SceneGraph {
+  public:
+    typedef std::function<void(const std::string &sourceName, bool onProgram,
+                               bool onPreview)> ChangeHandler;
+
+    // Replaces the contents of a scene (or group).  Also marks the name as
+    // a scene, so that items in other scenes that reference it are treated
+    // as nested scenes.
+    void SetSceneItems(const std::string &sceneName,
+                       const std::vector<SceneGraphItem> &items);
+    void RemoveScene(const std::string &sceneName);
+
+    // Moves a scene to its new name, along with every item and root that
+    // refers to it, so that nothing inside it changes state.
+    void RenameScene(const std::string &oldName, const std::string &newName);
+
+    void AddSceneItem(const std::string &sceneName, const SceneGraphItem &item);
+    void RemoveSceneItem(const std::string &sceneName, int64_t sceneItemID);
+    void SetSceneItemEnabled(const std::string &sceneName, int64_t sceneItemID,
+                             bool enabled);
+
+    // Sets the root scenes for kSceneGraphProgram or kSceneGraphPreview.
+    void SetRootScenes(int output, const std::vector<std::string> &sceneNames);
+
+    // Forgets everything (for example, after reconnecting).  What was last
+    // reported is kept, so a Flush() after the graph has been loaded again
+    // only reports the sources whose state actually changed; a Flush()
+    // before then reports every active source as inactive.
+    void Clear(void);
+
+    bool IsOnOutput(const std::string &sourceName, int output);
+
+    // Calls handler once for each source whose program or preview membership
+    // changed since the last call.
+    void Flush(ChangeHandler handler);
+
+  private:
+    typedef struct {
+      bool isScene = false;
+      std::vector<SceneGraphItem> items;
+      int32_t paths[kSceneGraphOutputCount] = { 0, 0 };
+      bool reported[kSceneGraphOutputCount] = { false, false };
+    } Node;
+
+    void ApplyDelta(const std::string &sourceName, int output, int32_t delta,
+                    int depth);
+    void ApplyDeltaToItems(Node &scene, int output, int32_t delta, int depth);
+    SceneGraphItem *FindItem(Node &scene, int64_t sceneItemID);
+
+    std::unordered_map<std::string, Node> nodes;
+    std::vector<std::string> roots[kSceneGraphOutputCount];
+    std::set<std::string> dirty;
+};
+
+#endif  // __SCENE_GRAPH_H__
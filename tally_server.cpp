@@ -0,0 +1,340 @@
+#include <atomic>
+#include <deque>
+#include <libwebsockets.h>
+#include <map>
+#include <new>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "buffer_pool.h"
+#include "tally_server.h"
+#include "trace.h"
+
+#pragma mark - Data types
+
+// A serialized frame shared by every client queue that holds it.  The
+// payload starts LWS_PRE bytes into data so that lws_write() can put the
+// WebSocket header in front of it without copying.  Server frames are not
+// masked, so the header is the same for every client and writing it into
+// the shared headroom once per client is harmless.
+typedef struct {
+  std::atomic<int32_t> referenceCount;
+  size_t length;
+  uint8_t data[];
+} TallyFrame;
+
+typedef struct {
+  std::string sceneName;
+  bool onProgram;
+  bool onPreview;
+} TallyServerScene;
+
+class TallyServerClient {
+  public:
+    struct lws *wsi = nullptr;
+    std::deque<TallyFrame *> queue;
+    bool needsSnapshot = true;  // New clients start with the full state.
+};
+
+typedef struct {
+  TallyServerClient *client;
+} TallyServerSession;
+
+
+#pragma mark - Global variables
+
+static struct lws_context *gTallyServerContext = nullptr;
+static std::set<TallyServerClient *> gTallyServerClients;
+static size_t gTallyServerMaxQueuedFrames = 4;
+static uint64_t gTallyServerGeneration = 0;
+
+// Mirror of the tally state, used to build full-state frames.
+static std::map<uint32_t, TallyServerScene> gTallyServerScenes;
+
+// The full-state frame for gTallyServerGeneration, built lazily the first
+// time a client needs it and shared by every client that does.
+static TallyFrame *gTallyServerSnapshot = nullptr;
+
+
+#pragma mark - Function prototypes
+
+int tallyServerLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                           void *user, void *in, size_t length);
+
+static struct lws_protocols gTallyServerProtocols[] = {
+  { "obs-tally", tallyServerLWSCallback, sizeof(TallyServerSession), 4096, 0, NULL, 0 },
+  LWS_PROTOCOL_LIST_TERM
+};
+
+
+#pragma mark - Frames
+
+// Returns NULL if the frame could not be allocated.
+static TallyFrame *createTallyFrame(const std::string &payload) {
+  TallyFrame *frame = (TallyFrame *)bufferPoolAllocate(sizeof(TallyFrame) + LWS_PRE +
+                                                        payload.length());
+  if (frame == nullptr) {
+    fprintf(stderr, "Could not allocate a %zu-byte tally frame.\n", payload.length());
+    return nullptr;
+  }
+  new (&frame->referenceCount) std::atomic<int32_t>(1);
+  frame->length = payload.length();
+  memcpy(frame->data + LWS_PRE, payload.data(), payload.length());
+  return frame;
+}
+
+static void retainTallyFrame(TallyFrame *frame) {
+  frame->referenceCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void releaseTallyFrame(TallyFrame *frame) {
+  if (frame->referenceCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    frame->referenceCount.~atomic();
+    bufferPoolFree(frame);
+  }
+}
+
+static void appendJSONString(std::string *output, const char *string) {
+  output->push_back('"');
+  for (const char *position = string; *position; position++) {
+    unsigned char character = (unsigned char)*position;
+    switch (character) {
+      case '"': output->append("\\\""); break;
+      case '\\': output->append("\\\\"); break;
+      case '\n': output->append("\\n"); break;
+      case '\r': output->append("\\r"); break;
+      case '\t': output->append("\\t"); break;
+      default:
+        if (character < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", character);
+          output->append(escaped);
+        } else {
+          output->push_back((char)character);
+        }
+    }
+  }
+  output->push_back('"');
+}
+
+static void appendScene(std::string *output, uint32_t sceneID, const char *sceneName,
+                        bool onProgram, bool onPreview) {
+  output->append("{\"id\":");
+  output->append(std::to_string(sceneID));
+  output->append(",\"scene\":");
+  appendJSONString(output, sceneName);
+  output->append(onProgram ? ",\"program\":true" : ",\"program\":false");
+  output->append(onPreview ? ",\"preview\":true}" : ",\"preview\":false}");
+}
+
+static TallyFrame *currentSnapshotFrame(void) {
+  if (gTallyServerSnapshot != nullptr) {
+    return gTallyServerSnapshot;
+  }
+
+  std::string payload("{\"type\":\"state\",\"generation\":");
+  payload.append(std::to_string(gTallyServerGeneration));
+  payload.append(",\"scenes\":[");
+  bool first = true;
+  for (auto &element : gTallyServerScenes) {
+    if (!first) payload.push_back(',');
+    first = false;
+    appendScene(&payload, element.first, element.second.sceneName.c_str(),
+                element.second.onProgram, element.second.onPreview);
+  }
+  payload.append("]}");
+
+  gTallyServerSnapshot = createTallyFrame(payload);
+  return gTallyServerSnapshot;
+}
+
+static void discardClientQueue(TallyServerClient *client) {
+  for (TallyFrame *frame : client->queue) {
+    releaseTallyFrame(frame);
+  }
+  client->queue.clear();
+}
+
+
+#pragma mark - Public API
+
+bool startOBSTallyServer(int port, const char *interfaceName, int maxQueuedFrames) {
+  if (gTallyServerContext != nullptr) {
+    return false;
+  }
+
+  struct lws_context_creation_info info;
+  bzero(&info, sizeof(info));
+
+  info.port = port;
+  info.iface = interfaceName;
+  info.protocols = gTallyServerProtocols;
+  info.uid = -1;
+  info.gid = -1;
+  info.options |= LWS_SERVER_OPTION_HTTP_HEADERS_SECURITY_BEST_PRACTICES_ENFORCE;
+
+  gTallyServerContext = lws_create_context(&info);
+  if (gTallyServerContext == nullptr) {
+    fprintf(stderr, "Could not start tally server on port %d.\n", port);
+    return false;
+  }
+  gTallyServerMaxQueuedFrames = (maxQueuedFrames > 0) ? (size_t)maxQueuedFrames : 1;
+  return true;
+}
+
+void stopOBSTallyServer(void) {
+  if (gTallyServerContext == nullptr) {
+    return;
+  }
+  // Destroying the context closes every client, which frees their queues.
+  lws_context_destroy(gTallyServerContext);
+  gTallyServerContext = nullptr;
+
+  if (gTallyServerSnapshot != nullptr) {
+    releaseTallyFrame(gTallyServerSnapshot);
+    gTallyServerSnapshot = nullptr;
+  }
+}
+
+void serviceTallyServer(void) {
+  if (gTallyServerContext != nullptr) {
+    TraceSpan span("serviceTallyServer");
+    // A negative timeout services whatever is ready and returns at once,
+    // so the server never delays the OBS connection.
+    lws_service(gTallyServerContext, -1);
+  }
+}
+
+void broadcastTallyChanges(const OBSTallyChange *changes, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  TraceSpan span("broadcastTallyChanges");
+
+  // Keep the mirror up to date even with no clients, so that the first
+  // client to connect gets the right state.
+  gTallyServerGeneration++;
+  for (size_t i = 0; i < count; i++) {
+    TallyServerScene &scene = gTallyServerScenes[changes[i].sceneID];
+    scene.sceneName = changes[i].sceneName;
+    scene.onProgram = changes[i].onProgram;
+    scene.onPreview = changes[i].onPreview;
+  }
+  if (gTallyServerSnapshot != nullptr) {
+    releaseTallyFrame(gTallyServerSnapshot);
+    gTallyServerSnapshot = nullptr;
+  }
+
+  if (gTallyServerContext == nullptr || gTallyServerClients.size() == 0) {
+    return;
+  }
+
+  std::string payload("{\"type\":\"diff\",\"generation\":");
+  payload.append(std::to_string(gTallyServerGeneration));
+  payload.append(",\"changes\":[");
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) payload.push_back(',');
+    appendScene(&payload, changes[i].sceneID, changes[i].sceneName,
+                changes[i].onProgram, changes[i].onPreview);
+  }
+  payload.append("]}");
+
+  TallyFrame *frame = createTallyFrame(payload);
+  if (frame == nullptr) {
+    // Skip the diff; every client catches up from a snapshot instead.
+    for (TallyServerClient *client : gTallyServerClients) {
+      discardClientQueue(client);
+      client->needsSnapshot = true;
+    }
+    lws_callback_on_writable_all_protocol(gTallyServerContext, &gTallyServerProtocols[0]);
+    return;
+  }
+  for (TallyServerClient *client : gTallyServerClients) {
+    if (client->needsSnapshot) {
+      // Already waiting for the full state, which will include this change.
+      continue;
+    }
+    if (client->queue.size() >= gTallyServerMaxQueuedFrames) {
+      // Slow consumer.  Replace its backlog with the latest state.
+      discardClientQueue(client);
+      client->needsSnapshot = true;
+      continue;
+    }
+    retainTallyFrame(frame);
+    client->queue.push_back(frame);
+  }
+  releaseTallyFrame(frame);
+
+  lws_callback_on_writable_all_protocol(gTallyServerContext, &gTallyServerProtocols[0]);
+}
+
+
+#pragma mark - LibWebSockets handling
+
+int tallyServerLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                           void *user, void *in, size_t length) {
+  TallyServerSession *session = (TallyServerSession *)user;
+
+  switch (reason) {
+    case LWS_CALLBACK_ESTABLISHED:
+    {
+      TallyServerClient *client = new TallyServerClient();
+      client->wsi = wsi;
+      session->client = client;
+      gTallyServerClients.insert(client);
+      lws_callback_on_writable(wsi);
+      break;
+    }
+    case LWS_CALLBACK_CLOSED:
+      if (session != nullptr && session->client != nullptr) {
+        discardClientQueue(session->client);
+        gTallyServerClients.erase(session->client);
+        delete session->client;
+        session->client = nullptr;
+      }
+      break;
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+    {
+      if (session == nullptr || session->client == nullptr) {
+        break;
+      }
+      TallyServerClient *client = session->client;
+
+      TallyFrame *frame = nullptr;
+      if (client->needsSnapshot) {
+        frame = currentSnapshotFrame();
+        if (frame == nullptr) {
+          break;  // Tried again on the next broadcast.
+        }
+        client->needsSnapshot = false;
+        retainTallyFrame(frame);
+      } else if (client->queue.size() > 0) {
+        frame = client->queue.front();
+        client->queue.pop_front();
+      } else {
+        break;
+      }
+
+      int frameLength = (int)frame->length;
+      int bytesWritten = lws_write(wsi, frame->data + LWS_PRE, frameLength, LWS_WRITE_TEXT);
+      releaseTallyFrame(frame);
+      if (bytesWritten < frameLength) {
+        return -1;
+      }
+
+      if (client->needsSnapshot || client->queue.size() > 0) {
+        lws_callback_on_writable(wsi);
+      }
+      break;
+    }
+    case LWS_CALLBACK_RECEIVE:
+      // Subscribers have nothing to say; ignore anything they send.
+      break;
+    default:
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __TALLY_SERVER_H__
+#define __TALLY_SERVER_H__
+
+#include <stddef.h>
+
+#include "gettally.h"
+
+// Built-in WebSocket server that re-broadcasts tally changes to any number
+// of subscribers (camera-back displays and the like).
+//
+// Each change is serialized to JSON exactly once, into a reference-counted
+// buffer with LWS_PRE bytes of headroom, and that same buffer is queued to
+// every client.  A client that falls more than maxQueuedFrames behind has
+// its queue thrown away and is sent a single full-state frame instead, so
+// a slow display only ever catches up to the latest state.
+//
+// The server shares the V8 loop thread; v8_runLoopCallback() services it.
+
+// Serializes changes once and queues the frame to every subscriber.
+void broadcastTallyChanges(const OBSTallyChange *changes, size_t count);
+
+// Services the server's lws context without blocking.  Does nothing if the
+// server is not running.
+void serviceTallyServer(void);
+
+#endif  // __TALLY_SERVER_H__
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "tally_shm.h"
+
+struct OBSTallyReader {
+  OBSTallySharedRegion *region;
+};
+
+static OBSTallySharedRegion *gSharedRegion = NULL;
+
+#pragma mark - Support functions
+
+static uint64_t monotonicNanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Both sides map the file read-write: the writer owns the snapshot, and
+// readers need to update the waiters count before sleeping.
+static OBSTallySharedRegion *mapRegion(const char *path, bool create) {
+  int fd = open(path, create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open tally snapshot file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (info.st_size < (off_t)sizeof(OBSTallySharedRegion)) {
+    if (!create || ftruncate(fd, sizeof(OBSTallySharedRegion)) != 0) {
+      fprintf(stderr, "Tally snapshot file %s has the wrong size.\n", path);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  void *address = mmap(NULL, sizeof(OBSTallySharedRegion), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (address == MAP_FAILED) {
+    fprintf(stderr, "Could not map tally snapshot file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  return (OBSTallySharedRegion *)address;
+}
+
+static void wakeWaiters(OBSTallySharedRegion *region) {
+#ifdef __linux__
+  // Skip the system call when nobody is asleep, which is the common case.
+  // The fence keeps the load below from moving ahead of the release store
+  // of the sequence number; otherwise a reader could register as a waiter,
+  // see the old sequence, and sleep through this publish.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&region->waiters, __ATOMIC_SEQ_CST) != 0) {
+    syscall(SYS_futex, &region->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+#endif
+}
+
+
+#pragma mark - Writer
+
+bool enableOBSTallySharedMemory(const char *path) {
+  OBSTallySharedRegion *region = mapRegion(path, true);
+  if (region == NULL) {
+    return false;
+  }
+
+  // A leftover file from an earlier run may have been abandoned in the
+  // middle of a write.  Start from an even sequence number, and keep the
+  // generation moving forward so that readers notice the restart.
+  uint32_t sequence = __atomic_load_n(&region->sequence, __ATOMIC_RELAXED);
+  if (sequence & 1) {
+    sequence++;
+  }
+  __atomic_store_n(&region->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  region->version = kOBSTallySharedVersion;
+  region->snapshot.generation++;
+  region->snapshot.timestampNanoseconds = monotonicNanoseconds();
+  region->snapshot.sceneCount = 0;
+  region->snapshot.truncated = 0;
+  __atomic_store_n(&region->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&region->magic, kOBSTallySharedMagic, __ATOMIC_RELEASE);
+
+  disableOBSTallySharedMemory();
+  gSharedRegion = region;
+  wakeWaiters(region);
+  return true;
+}
+
+void disableOBSTallySharedMemory(void) {
+  if (gSharedRegion != NULL) {
+    munmap(gSharedRegion, sizeof(OBSTallySharedRegion));
+    gSharedRegion = NULL;
+  }
+}
+
+void publishOBSTallySnapshot(const OBSTallySharedScene *scenes, size_t count) {
+  OBSTallySharedRegion *region = gSharedRegion;
+  if (region == NULL) {
+    return;
+  }
+
+  uint32_t sequence = __atomic_load_n(&region->sequence, __ATOMIC_RELAXED);
+  __atomic_store_n(&region->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  size_t storedCount = count;
+  if (storedCount > kOBSTallySharedMaxScenes) {
+    storedCount = kOBSTallySharedMaxScenes;
+  }
+  memcpy(region->snapshot.scenes, scenes, storedCount * sizeof(OBSTallySharedScene));
+  region->snapshot.sceneCount = (uint32_t)storedCount;
+  region->snapshot.truncated = (storedCount < count);
+  region->snapshot.timestampNanoseconds = monotonicNanoseconds();
+  region->snapshot.generation++;
+
+  __atomic_store_n(&region->sequence, sequence + 2, __ATOMIC_RELEASE);
+  wakeWaiters(region);
+}
+
+
+#pragma mark - Reader
+
+// Called while the writer is mid-update: a few pauses, then give up the CPU
+// in case the writer has been preempted.
+static void backOff(unsigned *spins) {
+  if (++*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+OBSTallyReader *openOBSTallyReader(const char *path) {
+  OBSTallySharedRegion *region = mapRegion(path, false);
+  if (region == NULL) {
+    return NULL;
+  }
+  OBSTallyReader *reader = (OBSTallyReader *)malloc(sizeof(OBSTallyReader));
+  reader->region = region;
+  return reader;
+}
+
+void closeOBSTallyReader(OBSTallyReader *reader) {
+  if (reader == NULL) {
+    return;
+  }
+  munmap(reader->region, sizeof(OBSTallySharedRegion));
+  free(reader);
+}
+
+bool readOBSTallySnapshot(OBSTallyReader *reader, OBSTallySnapshot *snapshot) {
+  OBSTallySharedRegion *region = reader->region;
+  if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != kOBSTallySharedMagic ||
+      region->version != kOBSTallySharedVersion) {
+    return false;
+  }
+
+  unsigned spins = 0;
+  while (true) {
+    uint32_t before = __atomic_load_n(&region->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      backOff(&spins);  // Writer is mid-update; it finishes in well under a microsecond.
+      continue;
+    }
+
+    snapshot->generation = region->snapshot.generation;
+    snapshot->timestampNanoseconds = region->snapshot.timestampNanoseconds;
+    snapshot->truncated = region->snapshot.truncated;
+    uint32_t sceneCount = region->snapshot.sceneCount;
+    if (sceneCount > kOBSTallySharedMaxScenes) {
+      sceneCount = kOBSTallySharedMaxScenes;  // Torn read; retried below.
+    }
+    snapshot->sceneCount = sceneCount;
+    memcpy(snapshot->scenes, region->snapshot.scenes, sceneCount * sizeof(OBSTallySharedScene));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t after = __atomic_load_n(&region->sequence, __ATOMIC_RELAXED);
+    if (before == after) {
+      return true;
+    }
+  }
+}
+
+uint64_t getOBSTallyGeneration(OBSTallyReader *reader) {
+  OBSTallySharedRegion *region = reader->region;
+  unsigned spins = 0;
+  while (true) {
+    uint32_t before = __atomic_load_n(&region->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      backOff(&spins);
+      continue;
+    }
+    uint64_t generation = region->snapshot.generation;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&region->sequence, __ATOMIC_RELAXED) == before) {
+      return generation;
+    }
+  }
+}
+
+bool waitForOBSTallyChange(OBSTallyReader *reader, uint64_t lastGeneration,
+                           int timeoutMilliseconds) {
+  OBSTallySharedRegion *region = reader->region;
+  uint64_t deadline = monotonicNanoseconds() + (uint64_t)timeoutMilliseconds * 1000000ull;
+
+  while (true) {
+    uint32_t sequence = __atomic_load_n(&region->sequence, __ATOMIC_ACQUIRE);
+    if (getOBSTallyGeneration(reader) != lastGeneration) {
+      return true;
+    }
+
+    uint64_t now = monotonicNanoseconds();
+    if (timeoutMilliseconds >= 0 && now >= deadline) {
+      return false;
+    }
+
+#ifdef __linux__
+    struct timespec timeout;
+    struct timespec *timeoutPointer = NULL;
+    if (timeoutMilliseconds >= 0) {
+      uint64_t remaining = deadline - now;
+      timeout.tv_sec = remaining / 1000000000ull;
+      timeout.tv_nsec = remaining % 1000000000ull;
+      timeoutPointer = &timeout;
+    }
+
+    // The kernel only puts us to sleep if the sequence number is still the
+    // value we saw, so a publish between the check above and this call
+    // can't be missed.
+    __atomic_add_fetch(&region->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &region->sequence, FUTEX_WAIT, sequence, timeoutPointer, NULL, 0);
+    __atomic_sub_fetch(&region->waiters, 1, __ATOMIC_SEQ_CST);
+#else
+    usleep(1000);
+#endif
+  }
+}
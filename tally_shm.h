@@ -0,0 +1,97 @@
+#ifndef __TALLY_SHM_H__
+#define __TALLY_SHM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Publishes the current program/preview/inactive scene state into a
+// memory-mapped file so that other processes (tally drivers, overlays,
+// loggers) can follow OBS without opening their own connection.
+//
+// The file holds one fixed-layout snapshot protected by a seqlock.  The
+// writer makes the sequence number odd, updates the snapshot, then makes it
+// even again.  Readers copy the snapshot and retry if the sequence number
+// was odd or changed underneath them, so reading never blocks the writer
+// and never makes a system call.  Readers that would rather sleep than poll
+// can wait on the sequence number with a futex (on Linux).
+//
+// Reader processes only need this header and tally_shm.c; they do not need
+// to link against V8 or libwebsockets.
+
+#define kOBSTallySharedMagic 0x5453424f  // "OBST"
+#define kOBSTallySharedVersion 1
+#define kOBSTallySharedMaxScenes 256
+#define kOBSTallySharedNameLength 64
+
+enum {
+  kOBSTallySharedInactive = 0,
+  kOBSTallySharedProgram = 1 << 0,
+  kOBSTallySharedPreview = 1 << 1
+};
+
+typedef struct {
+  uint32_t sceneID;
+  uint8_t state;  // kOBSTallySharedProgram | kOBSTallySharedPreview
+  uint8_t reserved[3];
+  char name[kOBSTallySharedNameLength];  // NUL-terminated; may be truncated.
+} OBSTallySharedScene;
+
+typedef struct {
+  uint64_t generation;            // Incremented on every publish.
+  uint64_t timestampNanoseconds;  // CLOCK_MONOTONIC at publish time.
+  uint32_t sceneCount;
+  uint32_t truncated;             // Nonzero if some scenes did not fit.
+  OBSTallySharedScene scenes[kOBSTallySharedMaxScenes];
+} OBSTallySnapshot;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;  // Seqlock counter; odd while a write is in progress.
+  uint32_t waiters;   // Readers sleeping in waitForOBSTallyChange().
+  OBSTallySnapshot snapshot;
+} OBSTallySharedRegion;
+
+
+#pragma mark - Writer (used by the tally library)
+
+// Creates (or reuses) the file at path and starts publishing to it.  Call
+// before runOBSTally().
+bool enableOBSTallySharedMemory(const char *path);
+void disableOBSTallySharedMemory(void);
+
+// Publishes a new snapshot.  Does nothing if shared memory is not enabled.
+void publishOBSTallySnapshot(const OBSTallySharedScene *scenes, size_t count);
+
+
+#pragma mark - Reader (used by other processes)
+
+typedef struct OBSTallyReader OBSTallyReader;
+
+OBSTallyReader *openOBSTallyReader(const char *path);
+void closeOBSTallyReader(OBSTallyReader *reader);
+
+// Copies a consistent snapshot.  Only the first sceneCount entries of
+// snapshot->scenes are filled in.  Returns false if the file has not been
+// initialized by a writer.
+bool readOBSTallySnapshot(OBSTallyReader *reader, OBSTallySnapshot *snapshot);
+
+// Returns the generation of the current snapshot without copying it.
+uint64_t getOBSTallyGeneration(OBSTallyReader *reader);
+
+// Sleeps until the generation differs from lastGeneration or the timeout
+// (in milliseconds; negative waits forever) expires.  Returns true if the
+// generation changed.
+bool waitForOBSTallyChange(OBSTallyReader *reader, uint64_t lastGeneration,
+                           int timeoutMilliseconds);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif  // __TALLY_SHM_H__
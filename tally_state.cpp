@@ -0,0 +1,158 @@
+#include "tally_state.h"
+
+#pragma mark - SceneNameTable class methods
+
+uint32_t SceneNameTable::Intern(const std::string &name) {
+  auto iterator = this->sceneIDs.find(name);
+  if (iterator != this->sceneIDs.end()) {
+    return iterator->second;
+  }
+  uint32_t sceneID = (uint32_t)this->names.size();
+  this->names.push_back(name);
+  this->sceneIDs[name] = sceneID;
+  return sceneID;
+}
+
+bool SceneNameTable::Lookup(const std::string &name, uint32_t *sceneID) {
+  auto iterator = this->sceneIDs.find(name);
+  if (iterator == this->sceneIDs.end()) {
+    return false;
+  }
+  *sceneID = iterator->second;
+  return true;
+}
+
+const char *SceneNameTable::Name(uint32_t sceneID) {
+  if (sceneID >= this->names.size()) {
+    return NULL;
+  }
+  return this->names[sceneID].c_str();
+}
+
+uint32_t SceneNameTable::Count(void) {
+  return (uint32_t)this->names.size();
+}
+
+
+#pragma mark - SceneBitset class methods
+
+bool SceneBitset::Test(uint32_t sceneID) {
+  size_t word = sceneID / 64;
+  if (word >= this->words.size()) {
+    return false;
+  }
+  return (this->words[word] >> (sceneID % 64)) & 1;
+}
+
+void SceneBitset::Set(uint32_t sceneID) {
+  size_t word = sceneID / 64;
+  if (word >= this->words.size()) {
+    this->words.resize(word + 1, 0);
+  }
+  this->words[word] |= (uint64_t)1 << (sceneID % 64);
+}
+
+void SceneBitset::Reset(uint32_t sceneID) {
+  size_t word = sceneID / 64;
+  if (word < this->words.size()) {
+    this->words[word] &= ~((uint64_t)1 << (sceneID % 64));
+  }
+}
+
+
+#pragma mark - TallyState class methods
+
+void TallyState::AddCandidate(uint32_t sceneID) {
+  if (this->seen.Test(sceneID)) {
+    return;
+  }
+  this->seen.Set(sceneID);
+
+  Candidate candidate;
+  candidate.sceneID = sceneID;
+  candidate.wasProgram = this->program.Test(sceneID);
+  candidate.wasPreview = this->preview.Test(sceneID);
+  this->candidates.push_back(candidate);
+}
+
+void TallyState::Update(const std::vector<uint32_t> &newProgramScenes,
+                        const std::vector<uint32_t> &newPreviewScenes,
+                        std::vector<OBSTallyChange> *changes) {
+  // Only scenes named in the old or new sets can have changed.
+  this->candidates.clear();
+  for (uint32_t sceneID : this->programScenes) this->AddCandidate(sceneID);
+  for (uint32_t sceneID : this->previewScenes) this->AddCandidate(sceneID);
+  for (uint32_t sceneID : newProgramScenes) this->AddCandidate(sceneID);
+  for (uint32_t sceneID : newPreviewScenes) this->AddCandidate(sceneID);
+
+  for (uint32_t sceneID : this->programScenes) this->program.Reset(sceneID);
+  for (uint32_t sceneID : this->previewScenes) this->preview.Reset(sceneID);
+  for (uint32_t sceneID : newProgramScenes) this->program.Set(sceneID);
+  for (uint32_t sceneID : newPreviewScenes) this->preview.Set(sceneID);
+
+  // Copy before assigning in case the caller passed our own vectors.
+  std::vector<uint32_t> programCopy(newProgramScenes);
+  std::vector<uint32_t> previewCopy(newPreviewScenes);
+  this->programScenes.swap(programCopy);
+  this->previewScenes.swap(previewCopy);
+
+  for (const Candidate &candidate : this->candidates) {
+    this->seen.Reset(candidate.sceneID);
+
+    bool isProgram = this->program.Test(candidate.sceneID);
+    bool isPreview = this->preview.Test(candidate.sceneID);
+    if (isProgram == candidate.wasProgram && isPreview == candidate.wasPreview) {
+      continue;
+    }
+
+    OBSTallyChange change;
+    change.sceneID = candidate.sceneID;
+    change.sceneName = this->names.Name(candidate.sceneID);
+    change.onProgram = isProgram;
+    change.onPreview = isPreview;
+
+    if (isProgram && !candidate.wasProgram) {
+      change.kind = kOBSTallyEnteredProgram;
+    } else if (!isProgram && !isPreview) {
+      change.kind = kOBSTallyWentInactive;
+    } else if (!isProgram) {
+      change.kind = candidate.wasProgram ? kOBSTallyLeftProgram : kOBSTallyEnteredPreview;
+    } else {
+      // Stayed on program; only the preview state changed.
+      change.kind = isPreview ? kOBSTallyEnteredPreview : kOBSTallyLeftPreview;
+    }
+    changes->push_back(change);
+  }
+}
+
+bool TallyState::IsProgram(uint32_t sceneID) {
+  return this->program.Test(sceneID);
+}
+
+bool TallyState::IsPreview(uint32_t sceneID) {
+  return this->preview.Test(sceneID);
+}
+
+const std::vector<uint32_t> &TallyState::ProgramScenes(void) {
+  return this->programScenes;
+}
+
+const std::vector<uint32_t> &TallyState::PreviewScenes(void) {
+  return this->previewScenes;
+}
+
+std::vector<std::string> TallyState::ProgramSceneNames(void) {
+  std::vector<std::string> sceneNames;
+  for (uint32_t sceneID : this->programScenes) {
+    sceneNames.push_back(this->names.Name(sceneID));
+  }
+  return sceneNames;
+}
+
+std::vector<std::string> TallyState::PreviewSceneNames(void) {
+  std::vector<std::string> sceneNames;
+  for (uint32_t sceneID : this->previewScenes) {
+    sceneNames.push_back(this->names.Name(sceneID));
+  }
+  return sceneNames;
+}
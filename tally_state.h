@@ -0,0 +1,77 @@
+#ifndef __TALLY_STATE_H__
+#define __TALLY_STATE_H__
+
+#include <deque>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gettally.h"
+
+// Maps scene names to small, stable integer IDs.  IDs are never reused, and
+// the name pointers returned by Name() stay valid for the life of the table,
+// so they can be handed to C callbacks without copying.
+class SceneNameTable {
+  public:
+    uint32_t Intern(const std::string &name);
+    bool Lookup(const std::string &name, uint32_t *sceneID);
+    const char *Name(uint32_t sceneID);
+    uint32_t Count(void);
+
+  private:
+    std::unordered_map<std::string, uint32_t> sceneIDs;
+    std::deque<std::string> names;  // Elements never move once appended.
+};
+
+// A growable bitset indexed by scene ID.
+class SceneBitset {
+  public:
+    bool Test(uint32_t sceneID);
+    void Set(uint32_t sceneID);
+    void Reset(uint32_t sceneID);
+
+  private:
+    std::vector<uint64_t> words;
+};
+
+// The program and preview scene sets.  Update() compares the old and new
+// sets and reports only the scenes whose state changed, so its cost depends
+// on the number of scenes named in the update, not on the number of scenes
+// that OBS knows about.
+class TallyState {
+  public:
+    void Update(const std::vector<uint32_t> &newProgramScenes,
+                const std::vector<uint32_t> &newPreviewScenes,
+                std::vector<OBSTallyChange> *changes);
+
+    bool IsProgram(uint32_t sceneID);
+    bool IsPreview(uint32_t sceneID);
+
+    const std::vector<uint32_t> &ProgramScenes(void);
+    const std::vector<uint32_t> &PreviewScenes(void);
+    std::vector<std::string> ProgramSceneNames(void);
+    std::vector<std::string> PreviewSceneNames(void);
+
+    SceneNameTable names;
+
+  private:
+    typedef struct {
+      uint32_t sceneID;
+      bool wasProgram;
+      bool wasPreview;
+    } Candidate;
+
+    void AddCandidate(uint32_t sceneID);
+
+    SceneBitset program;
+    SceneBitset preview;
+    std::vector<uint32_t> programScenes;
+    std::vector<uint32_t> previewScenes;
+
+    // Scratch space, kept between calls to avoid reallocating.
+    SceneBitset seen;
+    std::vector<Candidate> candidates;
+};
+
+#endif  // __TALLY_STATE_H__
@@ -0,0 +1,275 @@
+#include <atomic>
+#include <errno.h>
+#include <mutex>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trace.h"
+
+#define kTraceDefaultEventsPerThread 65536
+#define kTraceThreadNameLength 32
+
+#pragma mark - Data types
+
+// A seqlock per slot: sequence is odd while the thread writes the slot and
+// 2 * (index + 1) once event number index is in it.  The fields are relaxed
+// atomics so that a dump can read a slot while its thread overwrites it;
+// the dump checks the sequence before and after, and throws the slot away
+// if it changed.
+typedef struct {
+  std::atomic<uint64_t> sequence;
+  std::atomic<const char *> name;
+  std::atomic<uint64_t> start;
+  std::atomic<uint64_t> end;
+} TraceEvent;
+
+typedef struct {
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+} TraceEventCopy;
+
+typedef struct {
+  uint32_t threadID;  // Small and stable, for the trace viewer.
+  char threadName[kTraceThreadNameLength];
+  size_t capacity;    // A power of two.
+  std::atomic<uint64_t> head;  // Events ever recorded.
+  TraceEvent *events;
+} TraceRing;
+
+
+#pragma mark - Global variables
+
+std::atomic<bool> gTraceEnabled(false);
+
+// Rings are never freed, so a dump still shows threads that have exited.
+static std::mutex gTraceRingsMutex;
+static std::vector<TraceRing *> gTraceRings;
+static size_t gTraceEventsPerThread = kTraceDefaultEventsPerThread;
+
+static thread_local TraceRing *tTraceRing = nullptr;
+static thread_local const char *tTraceThreadName = nullptr;
+
+static char *gTraceDumpPath = nullptr;
+static std::atomic<bool> gTraceDumpRequested(false);
+
+
+#pragma mark - Recording
+
+uint64_t traceNanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void copyThreadName(TraceRing *ring, const char *name) {
+  strncpy(ring->threadName, name, sizeof(ring->threadName) - 1);
+  ring->threadName[sizeof(ring->threadName) - 1] = '\0';
+}
+
+static TraceRing *createTraceRing(void) {
+  std::lock_guard<std::mutex> guard(gTraceRingsMutex);
+
+  TraceRing *ring = new TraceRing();
+  ring->threadID = (uint32_t)gTraceRings.size() + 1;
+  ring->capacity = gTraceEventsPerThread;
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->events = new TraceEvent[ring->capacity]();
+  if (tTraceThreadName != nullptr) {
+    copyThreadName(ring, tTraceThreadName);
+  } else {
+    snprintf(ring->threadName, sizeof(ring->threadName), "Thread %u", ring->threadID);
+  }
+  gTraceRings.push_back(ring);
+  return ring;
+}
+
+void recordTraceSpan(const char *name, uint64_t startNanoseconds, uint64_t endNanoseconds) {
+  TraceRing *ring = tTraceRing;
+  if (ring == nullptr) {
+    ring = tTraceRing = createTraceRing();
+  }
+
+  // Only this thread writes the ring, so the head needs no read-modify-write.
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  TraceEvent *event = &ring->events[head & (ring->capacity - 1)];
+  event->sequence.store(2 * head + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  event->name.store(name, std::memory_order_relaxed);
+  event->start.store(startNanoseconds, std::memory_order_relaxed);
+  event->end.store(endNanoseconds, std::memory_order_relaxed);
+  event->sequence.store(2 * head + 2, std::memory_order_release);
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void setTraceThreadName(const char *name) {
+  tTraceThreadName = name;
+  if (tTraceRing != nullptr) {
+    std::lock_guard<std::mutex> guard(gTraceRingsMutex);
+    copyThreadName(tTraceRing, name);
+  }
+}
+
+
+#pragma mark - Dumping
+
+// Copies whatever the ring holds that its thread did not overwrite during
+// the copy.
+static void copyTraceRing(TraceRing *ring, std::vector<TraceEventCopy> *copies) {
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  uint64_t first = (head > ring->capacity) ? head - ring->capacity : 0;
+
+  for (uint64_t i = first; i < head; i++) {
+    TraceEvent *event = &ring->events[i & (ring->capacity - 1)];
+    uint64_t expected = 2 * i + 2;
+    if (event->sequence.load(std::memory_order_acquire) != expected) {
+      continue;  // Overwritten already, or being overwritten.
+    }
+    TraceEventCopy copy;
+    copy.name = event->name.load(std::memory_order_relaxed);
+    copy.start = event->start.load(std::memory_order_relaxed);
+    copy.end = event->end.load(std::memory_order_relaxed);
+
+    // Pairs with the writer's release fence: if any field above came from
+    // a newer event, the sequence has moved on too.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (event->sequence.load(std::memory_order_relaxed) == expected) {
+      copies->push_back(copy);
+    }
+  }
+}
+
+// Writes a JSON string, escaping what JSON requires.
+static void writeJSONString(FILE *file, const char *string) {
+  fputc('"', file);
+  for (const char *character = string; *character != '\0'; character++) {
+    unsigned char value = (unsigned char)*character;
+    if (value == '"' || value == '\\') {
+      fputc('\\', file);
+      fputc(value, file);
+    } else if (value < 0x20) {
+      fprintf(file, "\\u%04x", value);
+    } else {
+      fputc(value, file);
+    }
+  }
+  fputc('"', file);
+}
+
+bool writeOBSTrace(const char *path) {
+  std::vector<TraceRing *> rings;
+  {
+    std::lock_guard<std::mutex> guard(gTraceRingsMutex);
+    rings = gTraceRings;
+  }
+
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open trace file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  int processID = (int)getpid();
+  bool first = true;
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  std::vector<TraceEventCopy> events;
+  for (TraceRing *ring : rings) {
+    char threadName[kTraceThreadNameLength];
+    {
+      std::lock_guard<std::mutex> guard(gTraceRingsMutex);
+      memcpy(threadName, ring->threadName, sizeof(threadName));
+    }
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+            "\"args\":{\"name\":", first ? "" : ",", processID, ring->threadID);
+    writeJSONString(file, threadName);
+    fprintf(file, "}}");
+    first = false;
+
+    // Complete ("X") events, in microseconds.
+    events.clear();
+    copyTraceRing(ring, &events);
+    for (const TraceEventCopy &event : events) {
+      fprintf(file, ",\n{\"name\":");
+      writeJSONString(file, event.name);
+      fprintf(file, ",\"cat\":\"obs\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f}", processID, ring->threadID,
+              (double)event.start / 1000.0,
+              (double)(event.end - event.start) / 1000.0);
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Could not write trace file %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static void traceDumpSignalHandler(int signalNumber) {
+  gTraceDumpRequested.store(true, std::memory_order_relaxed);
+}
+
+void serviceTraceDump(void) {
+  if (!gTraceDumpRequested.load(std::memory_order_relaxed)) {
+    return;
+  }
+  gTraceDumpRequested.store(false, std::memory_order_relaxed);
+
+  // Writing a full trace takes a while; don't hold up the loop for it.
+  const char *path = gTraceDumpPath;
+  std::thread([path]() { writeOBSTrace(path); }).detach();
+}
+
+
+#pragma mark - Public API
+
+void startOBSTrace(size_t eventsPerThread) {
+  if (eventsPerThread == 0) {
+    eventsPerThread = kTraceDefaultEventsPerThread;
+  }
+  size_t capacity = 1;
+  while (capacity < eventsPerThread) {
+    capacity *= 2;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(gTraceRingsMutex);
+    gTraceEventsPerThread = capacity;
+  }
+  gTraceEnabled.store(true, std::memory_order_relaxed);
+}
+
+void stopOBSTrace(void) {
+  gTraceEnabled.store(false, std::memory_order_relaxed);
+}
+
+bool setOBSTraceDumpSignal(int signalNumber, const char *path) {
+  if (path == NULL) {
+    return false;
+  }
+  // Set once and never freed, since a dump thread may still be using it.
+  char *pathCopy = strdup(path);
+  if (pathCopy == NULL) {
+    return false;
+  }
+  gTraceDumpPath = pathCopy;
+
+  struct sigaction action;
+  bzero(&action, sizeof(action));
+  action.sa_handler = traceDumpSignalHandler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(signalNumber, &action, NULL) != 0) {
+    fprintf(stderr, "Could not handle signal %d: %s\n", signalNumber, strerror(errno));
+    return false;
+  }
+  return true;
+}
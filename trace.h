@@ -0,0 +1,60 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <atomic>
+#include <stdint.h>
+
+#include "gettally.h"
+
+// Timed spans for startOBSTrace() and writeOBSTrace().
+//
+// Each thread records into its own ring of fixed-size events, created the
+// first time that thread records anything, so recording never takes a
+// lock: it is two clock reads, three relaxed stores, and a release store
+// of the ring's head.  Once a ring is full, the oldest events are
+// overwritten.  A dump copies each ring and throws away anything the
+// owning thread overwrote while it was being copied.
+//
+// While tracing is off, a span costs one relaxed load and a branch that is
+// never taken at each end.  Names are stored by pointer, so they must be
+// string literals (or otherwise live forever).
+
+extern std::atomic<bool> gTraceEnabled;
+
+// CLOCK_MONOTONIC.
+uint64_t traceNanoseconds(void);
+
+// Records a span that has already ended.
+void recordTraceSpan(const char *name, uint64_t startNanoseconds, uint64_t endNanoseconds);
+
+// Names the calling thread in the trace.
+void setTraceThreadName(const char *name);
+
+// Writes the trace (on another thread) if the dump signal has arrived
+// since the last call.  Called once per loop pass.
+void serviceTraceDump(void);
+
+// Records the time from construction to destruction.
+class TraceSpan {
+  public:
+    explicit TraceSpan(const char *name) {
+      if (__builtin_expect(gTraceEnabled.load(std::memory_order_relaxed), false)) {
+        this->name = name;
+        this->start = traceNanoseconds();
+      }
+    }
+    ~TraceSpan(void) {
+      if (__builtin_expect(this->name != nullptr, false)) {
+        recordTraceSpan(this->name, this->start, traceNanoseconds());
+      }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+  private:
+    const char *name = nullptr;
+    uint64_t start = 0;
+};
+
+#endif  // __TRACE_H__
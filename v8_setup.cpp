@@ -1,42 +1,55 @@
 #define _GNU_SOURCE  // For asprintf
 
+#include <ctype.h>
 #include <libplatform/libplatform.h>
 #include <libwebsockets.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <limits>
 #include <map>
+#include <mutex>
 #include <set>
 #include <stdio.h>
 #include <sys/param.h>
+#include <thread>
+#include <time.h>
 #include <v8.h>
 
-// Might work on Linux.  Doesn't work in macOS.
-#undef SUPPORT_DEFLATE
-
-#if 0
-#define CBDEBUG(args...) fprintf(stderr, args)
-#define FUNCDEBUG(args...) fprintf(stderr, args)
-#define GENERALDEBUG(args...) fprintf(stderr, args)
-#define WSIDEBUG(args...) fprintf(stderr, args)
-#else
-#define CBDEBUG(args...)
-#define FUNCDEBUG(args...)
-#define GENERALDEBUG(args...)
-#define WSIDEBUG(args...)
+// permessage-deflate needs a libwebsockets built with extensions (and zlib).
+#ifndef LWS_WITHOUT_EXTENSIONS
+#define SUPPORT_DEFLATE
 #endif
 
+// Enabled at run time with setOBSLogLevel(kOBSLogDebug).
+#define CBDEBUG(args...) OBSLOG(kOBSLogDebug, args)
+#define FUNCDEBUG(args...) OBSLOG(kOBSLogDebug, args)
+#define GENERALDEBUG(args...) OBSLOG(kOBSLogDebug, args)
+#define WSIDEBUG(args...) OBSLOG(kOBSLogDebug, args)
+
+// Once per loop pass, so compiled out even so.
 #if 0
-#define VERBOSEDEBUG(args...) fprintf(stderr, args)
+#define VERBOSEDEBUG(args...) OBSLOG(kOBSLogDebug, args)
 #else
 #define VERBOSEDEBUG(args...)
 #endif
 
-// Can't figure out how to determine when this is needed, and lots
-// of websockets code expects strings, so....
-#undef SEND_AS_BINARY
-
 #ifdef USE_NODE
 #include <node/node.h>
 #endif
 
+#include "buffer_pool.h"
+#include "capture_log.h"
+#include "gettally.h"
+#include "heap_control.h"
+#include "inspector.h"
+#include "logger.h"
+#include "metrics.h"
+#include "scene_graph.h"
+#include "tally_server.h"
+#include "tally_shm.h"
+#include "tally_state.h"
+#include "trace.h"
 #include "v8_setup.h"
 
 // using namespace node;
@@ -56,19 +69,55 @@ enum {
   kConnectionStateClosed = 3
 };
 
+// Results from queueOutgoingDataItem().
+enum {
+  kSendResultQueued = 0,
+  kSendResultNoConnection = 1,
+  kSendResultRefused = 2  // Over the high watermark; see OBSSendPolicy.
+};
+
 // Stores a copy of buf.  Storage is scoped to the object.
 class WebSocketsDataItem {
   public:
     WebSocketsDataItem(uint8_t *buf, size_t length, bool isBinary);
+
+    // Allocates length bytes without filling them in, preceded by headroom
+    // bytes that are not part of the payload (LWS_PRE for outgoing frames,
+    // so that lws_write() can prepend the frame header in place).  The
+    // caller fills in GetBuf().
+    WebSocketsDataItem(size_t length, bool isBinary, size_t headroom);
     ~WebSocketsDataItem(void);
 
     size_t GetLength();
     uint8_t *GetBuf();
     bool IsBinary();
 
+    // Outgoing items with the same non-empty key may replace one another
+    // while queued (kOBSSendPolicyCoalesce).  For incoming items, the key
+    // is the event type of an obs-websocket event that only reports the
+    // latest state, so an older one can be dropped in favor of a newer one.
+    std::string coalesceKey;
+
+    // Incoming obs-websocket events (op 5) may be dropped under
+    // kOBSReceivePolicyDropOldest.  Request responses never are.
+    bool isEvent = false;
+
+    // When an incoming item was read off the socket, for the metrics.
+    uint64_t receivedAt = 0;
+
+    // Transfers ownership of the buffer (allocated with bufferPoolAllocate)
+    // to the caller, leaving the item empty.
+    uint8_t *ReleaseBuf();
+
+    // Items are created and destroyed once per message, so they come from
+    // the buffer pools too.
+    static void *operator new(size_t size) { return bufferPoolAllocate(size); }
+    static void operator delete(void *item) { bufferPoolFree(item); }
+
   private:
     uint8_t *rawBuf = NULL;
     size_t rawLength = 0;
+    size_t rawHeadroom = 0;
     bool rawIsBinary = false;
 };
 
@@ -80,14 +129,29 @@ typedef struct websocketsDataItemChain {
 class DataProvider {
   public:
     DataProvider(const char *name);
+    ~DataProvider(void);
     void addPendingData(WebSocketsDataItem *item);
     bool getPendingData(WebSocketsDataItem **returnItem);
-    uint32_t PendingBytes(void);
+
+    // Deletes the newest queued item with the same coalesce key and queues
+    // item at the end, so that it still follows everything that arrived
+    // before it.  Returns false (leaving item untouched) if nothing matches.
+    bool replacePendingData(WebSocketsDataItem *item);
+
+    // Unlinks and returns the oldest queued event (see
+    // WebSocketsDataItem::isEvent), or NULL if there is none.
+    WebSocketsDataItem *removeOldestEvent(void);
+
+    size_t PendingBytes(void);
+    size_t PendingCount(void);
     void SetWSI(struct lws *wsi);
     const char *name;
   private:
     std::recursive_mutex mutex;
     websocketsDataItemChain_t *firstItem = NULL;
+    websocketsDataItemChain_t *lastItem = NULL;
+    size_t pendingBytes = 0;
+    size_t pendingCount = 0;
     struct lws *wsi = nullptr;
 };
 
@@ -105,8 +169,6 @@ class WebSocketsContextData {
 
     v8::Isolate *isolate;
 
-    bool isBinary = false;
-
     bool shouldCloseConnection = false;
     bool connectionDidOpen = false;
     bool connectionDidClose = false;
@@ -115,6 +177,40 @@ class WebSocketsContextData {
     std::string *activeProtocolName = nullptr;
     const struct lws_protocols *protocols;
 
+    // Sec-WebSocket-Extensions from the server's handshake response.
+    std::string negotiatedExtensions;
+
+    // Outgoing backpressure.  Once the queue reaches highWatermark, a drain
+    // event fires when it falls back to lowWatermark.
+    size_t highWatermark;
+    size_t lowWatermark;
+    OBSSendPolicy sendPolicy;
+    bool aboveHighWatermark = false;
+    bool needsDrainEvent = false;
+
+    // Incoming overload handling.  receivePaused is true while lws is told
+    // to stop reading from the socket.
+    OBSReceiveLimits receiveLimits;
+    bool receivePaused = false;
+
+    // A message lws handed over in pieces (longer than the receive buffer,
+    // or sent as several frames), collected until its last piece arrives.
+    std::vector<uint8_t> partialMessage;
+    bool partialMessageIsBinary = false;
+
+    // Keepalive.  A ping is due every keepaliveInterval microseconds (0 for
+    // never); the connection is dropped once maxMissedPongs pings in a row
+    // go unanswered.
+    uint64_t keepaliveInterval;
+    uint32_t maxMissedPongs;
+    uint64_t nextPingTime = 0;
+    uint32_t missedPongs = 0;
+    bool awaitingPong = false;
+    bool needsPing = false;
+    OBSKeepaliveStatistics keepalive = {};
+
+    OBSConnectionCounters *metrics = nullptr;
+
     int connectionState = kConnectionStateConnecting;
     int codeNumber = 0;
     std::string *reason = nullptr;
@@ -123,18 +219,216 @@ class WebSocketsContextData {
     struct lws *wsi = nullptr;
 };
 
+typedef struct {
+  std::string requestType;
+  std::string requestDataJSON;  // Empty if the request takes no data.
+  OBSRequestCallback callback;
+  void *context;
+  bool completed;
+} OBSBatchRequest;
+
+struct OBSRequestBatch {
+  uint32_t batchID = 0;
+  OBSBatchExecutionType executionType = kOBSBatchExecutionSerialRealtime;
+  bool haltOnFailure = false;
+  std::vector<OBSBatchRequest> requests;
+};
+
+typedef enum {
+  kOBSCommandSendFrame,
+  kOBSCommandSendBatch,
+  kOBSCommandClose,
+  kOBSCommandReconnect,
+  kOBSCommandStartCPUProfile,
+  kOBSCommandStopCPUProfile,
+  kOBSCommandWriteHeapSnapshot
+} OBSCommandKind;
+
+// A command submitted from another thread.  Whatever can be prepared off
+// the loop thread (the outgoing frame, the batch) is prepared before the
+// command is queued.
+typedef struct OBSCommand {
+  OBSCommandKind kind;
+  WebSocketsDataItem *frame;
+  OBSRequestBatch *batch;
+  char *path;  // For profiles and snapshots; freed with the command.
+  uint32_t samplingInterval;
+  struct OBSCommand *next;
+} OBSCommand;
+
+// What setOBSRuntimeProfile() changes.  The rest go through the public
+// setters, so that later calls to those can override them.
+typedef struct {
+  const char *v8Flags;         // NULL for none.  Set before V8 starts.
+  int platformThreads;         // V8 worker threads; 0 for one per core.
+  int receiveBufferSize;       // lws rx_buffer_size.
+  OBSHeapLimits heapLimits;
+  uint32_t memoryPressureMilliseconds;
+  OBSReceiveLimits receiveLimits;
+  size_t highWatermark;
+  size_t lowWatermark;
+  int compressionWindowBits;   // Both directions.
+  int compressionMemoryLevel;
+} RuntimeProfileSettings;
+
+struct TallyWorker;
+struct ConnectionRef;
+
+// Everything one OBS connection needs: an isolate, the WebSocket
+// connections its scripts open, and the tally state.  gDefaultInstance is
+// the one runOBSTally() runs; obsTallyCreate() makes the rest.  Only the
+// thread running an instance touches it (and tInstance points to it while
+// it does), apart from tornDown.
+struct OBSTallyInstance {
+  bool isDefault = false;  // Reports through gettally.c, not callbacks.
+  std::string URL;
+  std::string password;
+  OBSTallyCallbacks callbacks = {};
+  TallyWorker *worker = nullptr;
+
+  v8::Isolate *isolate = nullptr;
+  v8::ArrayBuffer::Allocator *arrayBufferAllocator = nullptr;
+  v8::Global<v8::Context> context;
+  HeapControlState *heapControl = nullptr;
+
+  std::recursive_mutex connectionMutex;
+  std::map<uint32_t, WebSocketsContextData *> connectionData;
+  std::set<ConnectionRef *> connectionRefs;  // Every one lws still holds.
+
+  TallyState tallyState;
+  SceneGraph sceneGraph;
+  int sceneGraphLoads = 0;  // Reloads in progress; source tally waits for them.
+  std::map<uint32_t, OBSRequestBatch *> pendingRequestBatches;
+  uint32_t nextBatchID = 0;
+
+  // Scene changes waiting out the coalescing window.  While
+  // hasPendingScenes is true, the pending lists are the newest state and
+  // tallyState is what the callbacks last reported.
+  bool hasPendingScenes = false;
+  uint64_t pendingScenesDeadline = 0;
+  std::vector<uint32_t> pendingProgramScenes;
+  std::vector<uint32_t> pendingPreviewScenes;
+  uint64_t suppressedSceneStates = 0;
+
+  // When the message being handed to JavaScript was received (0 outside of
+  // sendPendingDataToClient()), and when the oldest message behind the
+  // pending scenes was, so that commitScenes() can record tally latency.
+  uint64_t dispatchingReceiveTime = 0;
+  uint64_t pendingScenesReceiveTime = 0;
+
+  // The connection gettally.js uses to talk to OBS (-1 if none), and whether
+  // it has been identified, so that raw frames are only sent once they are
+  // allowed.
+  int64_t OBSConnectionID = -1;
+  bool OBSConnectionIdentified = false;
+
+  bool needsReconnect = true;
+  bool reconnectSuspended = false;  // Closed by submitOBSClose().
+  bool reconnectImmediately = false;
+  bool firstTry = true;
+  uint64_t nextReconnectTime = 0;  // While waiting between retries.
+
+  bool tornDown = false;  // Guarded by the worker's mutex.
+};
+
+// What lws holds for each connection (as its opaque user data), since the
+// connections of every instance on a worker share one context.  If the
+// instance goes away first, instance is cleared, and the callback frees
+// the reference once lws destroys the connection.
+struct ConnectionRef {
+  OBSTallyInstance *instance;
+  uint32_t connectionID;
+};
+
+// A thread that runs instances: one of the pool behind obsTallyCreate(),
+// or gLoopWorker, the thread that calls v8_runLoopCallback().  Only that
+// thread touches instances and wakeupTimer; mutex guards the queues.
+struct TallyWorker {
+  char name[32] = "";
+  std::atomic<struct lws_context *> context{nullptr};  // Created on first use.
+  std::vector<OBSTallyInstance *> instances;
+  lws_sorted_usec_list_t wakeupTimer = {};
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<OBSTallyInstance *> arriving;
+  std::vector<OBSTallyInstance *> leaving;
+
+  size_t load = 0;  // Instances assigned.  Guarded by gWorkersMutex.
+};
+
 
 #pragma mark - Global variables
 
+// For the default instance.
 static char *gOBSWebSocketURL;
 static char *gPassword;
-static bool gNeedsReconnect = true;
-static std::recursive_mutex connection_mutex;
-static std::map<uint32_t, WebSocketsContextData *> connectionData;
+
+// The instance runOBSTally() runs, and the thread it runs on.  tInstance
+// is the instance the current thread is running, if any.
+static std::atomic<OBSTallyInstance *> gDefaultInstance(nullptr);
+static TallyWorker gLoopWorker;
+static thread_local OBSTallyInstance *tInstance = nullptr;
+
+// The pool behind obsTallyCreate().  Workers start as they are needed and
+// run until the process exits.
+static std::mutex gWorkersMutex;
+static int gWorkerThreadCount = 0;  // 0 for one per core, up to four.
+static std::vector<TallyWorker *> gWorkers;
+
+// The first worker to run a pass also services the metrics server and the
+// trace dump signal.
+static std::atomic<TallyWorker *> gServiceWorker(nullptr);
+
+// Process-wide, since the metrics and the capture are keyed by it.
+static std::atomic<uint32_t> gNextConnectionID(0);
+
 static std::unique_ptr<v8::Platform> platform;
-static v8::Local<v8::ObjectTemplate> globals;
-static std::vector<std::string> gProgramScenes;
-static std::vector<std::string> gPreviewScenes;
+static OBSCompressionOptions gCompressionOptions = { true, 15, 15, false, false, 6, 8 };
+static std::string gDeflateOffer;
+static size_t gDefaultHighWatermark = 4 * 1024 * 1024;
+static size_t gDefaultLowWatermark = 1024 * 1024;
+static OBSSendPolicy gDefaultSendPolicy = kOBSSendPolicyReject;
+
+// Guards gDefaultReceiveLimits and the receive and keepalive statistics,
+// which every thread running an instance updates.  Taken after an
+// instance's connectionMutex, never before.
+static std::mutex gStatisticsMutex;
+static OBSReceiveLimits gDefaultReceiveLimits = {
+  16 * 1024 * 1024, 4096, 4 * 1024 * 1024, 1024, kOBSReceivePolicyPause
+};
+static OBSReceiveStatistics gReceiveStatistics;
+static OBSRuntimeProfile gRuntimeProfile = kOBSRuntimeProfileDefault;
+static int gReceiveBufferSize = 65536;  // lws rx_buffer_size per connection.
+
+// Indexed by OBSRuntimeProfile.  The young generation holds two
+// semi-spaces and a large-object space of the same size, hence 3 MB for
+// 1 MB semi-spaces.
+static const RuntimeProfileSettings kRuntimeProfiles[] = {
+  { NULL, 0, 65536, { 0, 0, 0, 0 }, 5000,
+    { 16 * 1024 * 1024, 4096, 4 * 1024 * 1024, 1024, kOBSReceivePolicyPause },
+    4 * 1024 * 1024, 1024 * 1024, 15, 8 },
+  { "--jitless --lite-mode --optimize-for-size", 1, 4096,
+    { 8 * 1024 * 1024, 32 * 1024 * 1024, 3 * 1024 * 1024, 3 * 1024 * 1024 }, 1000,
+    { 1024 * 1024, 256, 256 * 1024, 64, kOBSReceivePolicyPause },
+    256 * 1024, 64 * 1024, 10, 4 }
+};
+static uint64_t gDefaultKeepaliveInterval = 2000000;  // Microseconds.
+static uint32_t gDefaultMaxMissedPongs = 3;
+static OBSKeepaliveStatistics gKeepaliveStatistics;
+
+// Set from any thread; each instance keeps its own pending scenes.
+static std::atomic<uint32_t> gCoalescingWindowMicroseconds(0);
+
+// Commands from other threads, for the default instance, newest first.
+// Producers push with a compare-and-swap; the run loop takes the whole list
+// at once.
+static std::atomic<OBSCommand *> gSubmittedCommands(nullptr);
+
+// The context lws_service() is currently blocked in, so that a submitting
+// thread can wake it with lws_cancel_service().  Client contexts are never
+// destroyed while the process runs, so a stale pointer is harmless.
+static std::atomic<struct lws_context *> gServicingContext(nullptr);
 
 
 #pragma mark - Function prototypes
@@ -144,12 +438,16 @@ extern "C" {
   extern void _setSceneIsProgram(const char *sceneName);
   extern void _setSceneIsPreview(const char *sceneName, bool alsoOnProgram);
   extern void _setSceneIsInactive(const char *sceneName);
+  extern void _setSourceTally(const char *sourceName, bool onProgram, bool onPreview);
+  extern void _reportTallyDiff(const OBSTallyChange *changes, size_t count);
+  extern void _loadOBSTallyScripts(void);
 }
 
 void callConnectionDidOpen(int connectionID, v8::Isolate *isolate);
 void callConnectionDidClose(int connectionID, v8::Isolate *isolate, int codeNumber,
                             std::string *reason);
 void callHasConnectionError(int connectionID, v8::Isolate *isolate);
+void callConnectionDidDrain(int connectionID, v8::Isolate *isolate);
 void sendPendingDataToClient(int connectionID, v8::Isolate *isolate);
 void setPreviewToProgram(const v8::FunctionCallbackInfo<v8::Value>& args);
 void retryAfterTimeout(const v8::FunctionCallbackInfo<v8::Value>& args);
@@ -161,9 +459,27 @@ int websocketLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, void
 void setProgramScene(const v8::FunctionCallbackInfo<v8::Value>& args);
 void setPreviewScene(const v8::FunctionCallbackInfo<v8::Value>& args);
 void reconnectOBS(v8::Isolate *isolate);
-void updateScenes(std::vector<std::string> newPreviewScenes, std::vector<std::string> newProgramScenes);
+void updateScenes(const std::vector<uint32_t> &newPreviewScenes,
+                  const std::vector<uint32_t> &newProgramScenes);
+void commitScenes(const std::vector<uint32_t> &newPreviewScenes,
+                  const std::vector<uint32_t> &newProgramScenes, uint64_t receiveTime);
+void flushCoalescedScenes(void);
+uint64_t monotonicMicroseconds(void);
+void publishTallySnapshot(void);
 void PasswordGetter(v8::Local<v8::String> property,
               const v8::PropertyCallbackInfo<v8::Value>& info);
+void completeNativeBatchRequest(const v8::FunctionCallbackInfo<v8::Value>& args);
+void finishNativeRequestBatch(const v8::FunctionCallbackInfo<v8::Value>& args);
+void failOBSRequestBatch(OBSRequestBatch *batch, const char *comment);
+void setSceneItems(const v8::FunctionCallbackInfo<v8::Value>& args);
+void addSceneItem(const v8::FunctionCallbackInfo<v8::Value>& args);
+void removeSceneItem(const v8::FunctionCallbackInfo<v8::Value>& args);
+void setSceneItemEnabled(const v8::FunctionCallbackInfo<v8::Value>& args);
+void removeSceneFromGraph(const v8::FunctionCallbackInfo<v8::Value>& args);
+void renameSceneInGraph(const v8::FunctionCallbackInfo<v8::Value>& args);
+void clearSceneGraph(const v8::FunctionCallbackInfo<v8::Value>& args);
+void finishSceneGraphLoad(const v8::FunctionCallbackInfo<v8::Value>& args);
+void flushSceneGraph(void);
 
 v8::MaybeLocal<v8::Module> resolveCallback(v8::Local<v8::Context> context,
                                            v8::Local<v8::String> specifier,
@@ -175,93 +491,226 @@ void connectWebSocket(const v8::FunctionCallbackInfo<v8::Value>& args);
 void sendWebSocketData(const v8::FunctionCallbackInfo<v8::Value>& args);
 void closeWebSocket(const v8::FunctionCallbackInfo<v8::Value>& args);
 void getWebSocketBufferedAmount(const v8::FunctionCallbackInfo<v8::Value>& args);
+void setWebSocketSendLimits(const v8::FunctionCallbackInfo<v8::Value>& args);
+void setWebSocketReceiveLimits(const v8::FunctionCallbackInfo<v8::Value>& args);
 void getWebSocketExtensions(const v8::FunctionCallbackInfo<v8::Value>& args);
 void setWebSocketBinaryType(const v8::FunctionCallbackInfo<v8::Value>& args);
 void getWebSocketConnectionState(const v8::FunctionCallbackInfo<v8::Value>& args);
 void getWebSocketActiveProtocol(const v8::FunctionCallbackInfo<v8::Value>& args);
-bool connectWebSocket(std::string URL, struct lws_protocols *protocols,
-                      uint32_t connectionID);
+bool connectWebSocket(std::string URL, uint32_t connectionID);
 struct lws_protocols *createProtocols(std::vector<std::string> protocols);
-
-uint32_t connectionIDForWSI(struct lws *wsi);
+struct lws_context *workerContext(TallyWorker *worker);
+int connectionLWSCallback(struct lws *wsi, enum lws_callback_reasons reason,
+                          uint32_t connectionID, void *in, size_t length);
+void receiveIncomingDataItem(WebSocketsContextData *dataProviderGroup, struct lws *wsi,
+                             WebSocketsDataItem *item);
+void resumeReceivingIfDrained(WebSocketsContextData *dataProviderGroup);
+bool validReceiveLimits(const OBSReceiveLimits *limits);
+const struct lws_extension *supportedExtensions(void);
+void applyCompressionLevel(struct lws *wsi);
+void setOBSConnection(const v8::FunctionCallbackInfo<v8::Value>& args);
+void requestConnectionClose(uint32_t connectionID);
+void runSubmittedCommands(v8::Isolate *isolate);
+void setWebSocketKeepalive(const v8::FunctionCallbackInfo<v8::Value>& args);
+void getWebSocketRoundTripStatistics(const v8::FunctionCallbackInfo<v8::Value>& args);
+void serviceKeepalive(WebSocketsContextData *dataProviderGroup, uint64_t now);
+void sampleHeapIfDue(v8::Isolate *isolate);
+void shedLoadForHeapLimit(v8::Isolate *isolate);
+void recordRoundTrip(WebSocketsContextData *dataProviderGroup, uint64_t roundTrip);
+void captureClose(uint32_t connectionID, WebSocketsContextData *dataProviderGroup);
+void traceGCPrologue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags);
+void traceGCEpilogue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags);
+void runScriptSource(const char *scriptName, char *scriptString, bool isStatic);
+void runWorkerPass(TallyWorker *worker);
 
 
 #pragma mark - Main V8 integration
 
-void *v8_setup(void) {
-  v8::V8::InitializeICUDefaultLocation("viscaptz");
-  v8::V8::InitializeExternalStartupData("viscaptz");
+// Once per process, however many isolates there are.
+static void initializeV8(void) {
+  static std::once_flag initialized;
+
+  std::call_once(initialized, [] {
+    const RuntimeProfileSettings *profile = &kRuntimeProfiles[gRuntimeProfile];
+
+    v8::V8::InitializeICUDefaultLocation("viscaptz");
+    v8::V8::InitializeExternalStartupData("viscaptz");
+    if (profile->v8Flags != NULL) {
+      v8::V8::SetFlagsFromString(profile->v8Flags);
+    }
 
 #ifdef USE_NODE
-  std::unique_ptr<node::MultiIsolatePlatform> platform =
-      node::MultiIsolatePlatform::Create(4);
-  v8::V8::InitializePlatform(platform.get());
+    std::unique_ptr<node::MultiIsolatePlatform> platform =
+        node::MultiIsolatePlatform::Create(4);
+    v8::V8::InitializePlatform(platform.get());
 #else
-  platform = v8::platform::NewDefaultPlatform();
-  v8::V8::InitializePlatform(platform.get());
+    // Idle tasks only run when serviceIdleGC() says the loop is quiet.
+    platform = v8::platform::NewDefaultPlatform(profile->platformThreads,
+                                                v8::platform::IdleTaskSupport::kEnabled);
+    v8::V8::InitializePlatform(platform.get());
 
 #endif
-  v8::V8::Initialize();
+    v8::V8::Initialize();
+  });
+}
 
+// Creates the instance's isolate and a context with the natives in it, on
+// the thread that will run the instance.
+static v8::Isolate *newInstanceIsolate(OBSTallyInstance *instance) {
   v8::Isolate::CreateParams create_params;
-  create_params.array_buffer_allocator =
-      v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+  create_params.array_buffer_allocator = new PooledArrayBufferAllocator();
+  applyHeapLimits(&create_params.constraints);
 
-  v8::Isolate *gIsolate = v8::Isolate::New(create_params);
-  gIsolate->Enter();
+  v8::Isolate *isolate = v8::Isolate::New(create_params);
+  instance->isolate = isolate;
+  instance->arrayBufferAllocator = create_params.array_buffer_allocator;
 
-  v8::Isolate::Scope isolate_scope(gIsolate);
+  isolate->AddGCPrologueCallback(traceGCPrologue);
+  isolate->AddGCEpilogueCallback(traceGCEpilogue);
+  instance->heapControl = installHeapCallbacks(isolate);
+
+  v8::Isolate::Scope isolate_scope(isolate);
 
   // Create a stack-allocated handle scope.
-  v8::HandleScope handle_scope(gIsolate);
+  v8::HandleScope handle_scope(isolate);
 
-  globals = v8::ObjectTemplate::New(gIsolate);
+  v8::Local<v8::ObjectTemplate> globals = v8::ObjectTemplate::New(isolate);
 
-  globals->SetAccessor(v8::String::NewFromUtf8(gIsolate, "obsPassword", v8::NewStringType::kNormal).ToLocalChecked(),
+  globals->SetAccessor(v8::String::NewFromUtf8(isolate, "obsPassword", v8::NewStringType::kNormal).ToLocalChecked(),
                        PasswordGetter, nullptr);
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "setProgramScene").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, setProgramScene));
+  globals->Set(v8::String::NewFromUtf8(isolate, "setProgramScene").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setProgramScene));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "setPreviewScene").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setPreviewScene));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "setPreviewScene").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, setPreviewScene));
+  globals->Set(v8::String::NewFromUtf8(isolate, "setPreviewToProgram").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setPreviewToProgram));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "setPreviewToProgram").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, setPreviewToProgram));
+  globals->Set(v8::String::NewFromUtf8(isolate, "logMessage").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, logMessage));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "logMessage").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, logMessage));
+  globals->Set(v8::String::NewFromUtf8(isolate, "connectWebSocket").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, connectWebSocket));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "connectWebSocket").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, connectWebSocket));
+  globals->Set(v8::String::NewFromUtf8(isolate, "sendWebSocketData").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, sendWebSocketData));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "sendWebSocketData").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, sendWebSocketData));
+  globals->Set(v8::String::NewFromUtf8(isolate, "closeWebSocket").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, closeWebSocket));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "closeWebSocket").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, closeWebSocket));
+  globals->Set(v8::String::NewFromUtf8(isolate, "getWebSocketBufferedAmount").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, getWebSocketBufferedAmount));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "getWebSocketBufferedAmount").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, getWebSocketBufferedAmount));
+  globals->Set(v8::String::NewFromUtf8(isolate, "setWebSocketSendLimits").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setWebSocketSendLimits));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "getWebSocketExtensions").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, getWebSocketExtensions));
+  globals->Set(v8::String::NewFromUtf8(isolate, "setWebSocketReceiveLimits").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setWebSocketReceiveLimits));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "setWebSocketBinaryType").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, setWebSocketBinaryType));
+  globals->Set(v8::String::NewFromUtf8(isolate, "setWebSocketKeepalive").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setWebSocketKeepalive));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "getWebSocketConnectionState").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, getWebSocketConnectionState));
+  globals->Set(v8::String::NewFromUtf8(isolate, "getWebSocketRoundTripStatistics").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, getWebSocketRoundTripStatistics));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "getWebSocketActiveProtocol").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, getWebSocketActiveProtocol));
+  globals->Set(v8::String::NewFromUtf8(isolate, "getWebSocketExtensions").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, getWebSocketExtensions));
 
-  globals->Set(v8::String::NewFromUtf8(gIsolate, "retryAfterTimeout").ToLocalChecked(),
-               v8::FunctionTemplate::New(gIsolate, retryAfterTimeout));
+  globals->Set(v8::String::NewFromUtf8(isolate, "setWebSocketBinaryType").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setWebSocketBinaryType));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "getWebSocketConnectionState").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, getWebSocketConnectionState));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "getWebSocketActiveProtocol").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, getWebSocketActiveProtocol));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "retryAfterTimeout").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, retryAfterTimeout));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "setOBSConnection").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setOBSConnection));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "completeNativeBatchRequest").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, completeNativeBatchRequest));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "finishNativeRequestBatch").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, finishNativeRequestBatch));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "setSceneItems").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setSceneItems));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "addSceneItem").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, addSceneItem));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "removeSceneItem").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, removeSceneItem));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "setSceneItemEnabled").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, setSceneItemEnabled));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "removeSceneFromGraph").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, removeSceneFromGraph));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "renameSceneInGraph").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, renameSceneInGraph));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "clearSceneGraph").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, clearSceneGraph));
+
+  globals->Set(v8::String::NewFromUtf8(isolate, "finishSceneGraphLoad").ToLocalChecked(),
+               v8::FunctionTemplate::New(isolate, finishSceneGraphLoad));
 
   // Create a new context.
-  v8::Local<v8::Context> context = v8::Context::New(gIsolate, nullptr, globals);
+  v8::Local<v8::Context> context = v8::Context::New(isolate, nullptr, globals);
+  instance->context.Reset(isolate, context);
+
+  return isolate;
+}
+
+// Runs an instance on the current thread: its isolate and context are
+// entered, and tInstance points to it.
+class InstanceScope {
+  public:
+    explicit InstanceScope(OBSTallyInstance *instance)
+        : isolateScope(instance->isolate), handleScope(instance->isolate),
+          contextScope(instance->context.Get(instance->isolate)), previous(tInstance) {
+      tInstance = instance;
+    }
+    ~InstanceScope(void) { tInstance = this->previous; }
+
+  private:
+    v8::Isolate::Scope isolateScope;
+    v8::HandleScope handleScope;
+    v8::Context::Scope contextScope;
+    OBSTallyInstance *previous;
+};
+
+// Sets up the default instance on the calling thread, which keeps its
+// isolate and context entered from then on.
+void *v8_setup(void) {
+  initializeV8();
+
+  OBSTallyInstance *instance = new OBSTallyInstance();
+  instance->isDefault = true;
+  instance->URL = (gOBSWebSocketURL != NULL) ? gOBSWebSocketURL : "";
+  instance->password = (gPassword != NULL) ? gPassword : "";
+  instance->worker = &gLoopWorker;
+  gLoopWorker.instances.push_back(instance);
+  gDefaultInstance.store(instance);
+  tInstance = instance;
+
+  v8::Isolate *gIsolate = newInstanceIsolate(instance);
+  gIsolate->Enter();
+
+  setTraceThreadName("V8 loop");
+
+  v8::HandleScope handle_scope(gIsolate);
+  v8::Local<v8::Context> context = instance->context.Get(gIsolate);
   context->Enter();
+  createInspector(gIsolate, context);
 
   return (void *)gIsolate;
 }
@@ -277,38 +726,121 @@ void setOBSPassword(char *password) {
 void v8_runLoopCallback(void *isolateVoid) {
   VERBOSEDEBUG("@@@ v8_runLoopCallback\n");
 
-  v8::Isolate *isolate = (v8::Isolate *)isolateVoid;
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
+  TraceSpan span("v8_runLoopCallback");
+  runWorkerPass(&gLoopWorker);
+}
 
-  std::vector<int32_t> connectionIDsToDelete;
+// Rounded up, and 0 once the deadline has passed.
+static int millisecondsUntil(uint64_t deadline, uint64_t now) {
+  uint64_t remaining = (deadline > now) ? deadline - now : 0;
+  return (int)MIN((remaining + 999) / 1000, (uint64_t)std::numeric_limits<int>::max());
+}
+
+// Asks for the keepalive pings that are due, and returns how long (in
+// milliseconds) the current instance can wait for network events.
+static int prepareInstancePass(void) {
+  OBSTallyInstance *instance = tInstance;
+  std::lock_guard<std::recursive_mutex> guard(instance->connectionMutex);
+  uint64_t now = monotonicMicroseconds();
+  int waitTime = 500;
+
+  for (std::pair<int32_t, WebSocketsContextData *> element : instance->connectionData) {
+    // Ask for a writable callback now, so a ping that is due goes out in
+    // this pass.
+    serviceKeepalive(element.second, now);
+  }
 
-  int connectionCount = MAX(connectionData.size(), 1);
-  int contextWaitTime = MAX(500 / connectionCount, 1);
+  if (instance->hasPendingScenes) {
+    // Don't sleep past the end of the coalescing window.
+    waitTime = MIN(waitTime, millisecondsUntil(instance->pendingScenesDeadline, now));
+  }
+  if (instance->connectionData.size() == 0 && instance->needsReconnect) {
+    // Nor past the next attempt to connect (0 for right away).
+    waitTime = MIN(waitTime, millisecondsUntil(instance->nextReconnectTime, now));
+  }
+  return waitTime;
+}
 
-  for (std::pair<int32_t, WebSocketsContextData *> element :
-       connectionData) {
-    int32_t connectionID = element.first;
-    WebSocketsContextData *connection = element.second;
+// Does nothing; scheduling it ends the wait in lws_service().
+static void endWorkerWait(lws_sorted_usec_list_t *timer) {
+}
 
-    if (connection->wsi != nullptr) {
-      struct lws_context *context = lws_get_context(connection->wsi);
-      GENERALDEBUG("Waiting for events (%d milliseconds)\n", contextWaitTime);
-      lws_service(context, contextWaitTime);
-      GENERALDEBUG("Done waiting for events\n");
-    } else {
-      VERBOSEDEBUG("Connection %d ignored because wsi is NULL\n", connectionID);
+// Waits up to waitTime milliseconds (not at all for 0) for network events
+// on every connection of the worker's instances, which lws then hands to
+// websocketLWSCallback().  libwebsockets 4 ignores the timeout passed to
+// lws_service() and sleeps until its next scheduled event, so the wait is
+// scheduled as one.
+static void serviceWorkerContext(TallyWorker *worker, int waitTime) {
+  struct lws_context *context = workerContext(worker);
+  if (context == nullptr) {
+    return;
+  }
+  if (waitTime > 0) {
+    lws_sul_schedule(context, 0, &worker->wakeupTimer, endWorkerWait,
+                     (lws_usec_t)waitTime * LWS_US_PER_MS);
+  }
+
+  // Only the default instance runs submitted commands.
+  bool runsCommands = (worker == &gLoopWorker);
+  if (runsCommands) {
+    gServicingContext.store(context, std::memory_order_seq_cst);
+    if (gSubmittedCommands.load(std::memory_order_seq_cst) != nullptr) {
+      // Submitted before the store above, so nobody woke this context.
+      lws_cancel_service(context);
     }
+  }
+
+  GENERALDEBUG("Waiting for events (%d milliseconds)\n", waitTime);
+  {
+    TraceSpan serviceSpan("lws_service");
+    lws_service(context, (waitTime > 0) ? waitTime : -1);
+  }
+  GENERALDEBUG("Done waiting for events\n");
+
+  if (runsCommands) {
+    gServicingContext.store(nullptr, std::memory_order_relaxed);
+  }
+  lws_sul_cancel(&worker->wakeupTimer);
+}
+
+// Hands whatever arrived for the current instance to JavaScript, and does
+// the rest of the instance's once-per-pass work.
+static void finishInstancePass(void) {
+  OBSTallyInstance *instance = tInstance;
+  v8::Isolate *isolate = instance->isolate;
+  std::lock_guard<std::recursive_mutex> guard(instance->connectionMutex);
+
+  std::vector<int32_t> connectionIDsToDelete;
+  bool busy = false;  // Anything handed to JavaScript this pass.
+
+  for (std::pair<int32_t, WebSocketsContextData *> element : instance->connectionData) {
+    int32_t connectionID = element.first;
+    WebSocketsContextData *connection = element.second;
 
     if (connection->connectionDidOpen) {
       connection->connectionDidOpen = false;
       callConnectionDidOpen(connectionID, isolate);
     }
 
-    if (connection->incomingData.PendingBytes() > 0) {
+    if (connection->needsDrainEvent) {
+      connection->needsDrainEvent = false;
+      callConnectionDidDrain(connectionID, isolate);
+    }
+
+    // Count rather than bytes, so that empty messages are still delivered.
+    if (connection->incomingData.PendingCount() > 0) {
+      busy = true;
       GENERALDEBUG("@@@ Sending data to client.\n");
       sendPendingDataToClient(connectionID, isolate);
       GENERALDEBUG("@@@ Done.\n");
     }
+    resumeReceivingIfDrained(connection);
+    flushCoalescedScenes();
+    setQueueDepths(connection->metrics,
+                   connection->incomingData.PendingCount(),
+                   connection->incomingData.PendingBytes(),
+                   connection->outgoingData.PendingCount(),
+                   connection->outgoingData.PendingBytes());
 
     if (connection->hasConnectionError) {
       GENERALDEBUG("Has connection error.\n");
@@ -325,40 +857,186 @@ void v8_runLoopCallback(void *isolateVoid) {
     }
   }
   for (int32_t connectionID : connectionIDsToDelete) {
-    connectionData.erase(connectionID);
+    instance->connectionData.erase(connectionID);
+    removeConnectionMetrics(connectionID);
+  }
+
+  flushCoalescedScenes();
+  if (instance->isDefault) {
+    serviceTallyServer();
+    serviceInspector();
+    runSubmittedCommands(isolate);
+    sampleHeapIfDue(isolate);
   }
-  if (connectionData.size() == 0 && gNeedsReconnect) {
+  if (takeHeapLimitEvent(instance->heapControl)) {
+    shedLoadForHeapLimit(isolate);
+  }
+  serviceIdleGC(instance->heapControl, platform.get(), isolate, monotonicMicroseconds(),
+                busy || instance->hasPendingScenes);
+
+  if (instance->connectionData.size() == 0 && instance->needsReconnect) {
     reconnectOBS(isolate);
   }
 }
 
+// One pass over the worker's instances: ask for the pings that are due,
+// wait once for network events on the shared context, then let each
+// instance handle whatever arrived.
+void runWorkerPass(TallyWorker *worker) {
+  uint64_t startTime = monotonicMicroseconds();
+  int waitTime = 500;
+
+  for (OBSTallyInstance *instance : worker->instances) {
+    InstanceScope scope(instance);
+    waitTime = MIN(waitTime, prepareInstancePass());
+  }
+  serviceWorkerContext(worker, waitTime);
+  for (OBSTallyInstance *instance : worker->instances) {
+    InstanceScope scope(instance);
+    finishInstancePass();
+  }
+
+  TallyWorker *serviceWorker = nullptr;
+  if (gServiceWorker.compare_exchange_strong(serviceWorker, worker) ||
+      serviceWorker == worker) {
+    serviceMetricsServer();
+    serviceTraceDump();
+  }
+  recordLoopIteration(monotonicMicroseconds() - startTime);
+}
+
+// Copies V8's heap statistics into the metrics every few seconds.
+void sampleHeapIfDue(v8::Isolate *isolate) {
+  uint64_t now = monotonicMicroseconds();
+  if (!heapSampleDue(now)) {
+    return;
+  }
+  TraceSpan span("sampleHeap");
+  v8::HeapStatistics statistics;
+  isolate->GetHeapStatistics(&statistics);
+
+  OBSHeapMetrics heap;
+  heap.totalHeapSize = statistics.total_heap_size();
+  heap.usedHeapSize = statistics.used_heap_size();
+  heap.heapSizeLimit = statistics.heap_size_limit();
+  heap.externalMemory = statistics.external_memory();
+  heap.mallocedMemory = statistics.malloced_memory();
+  heap.peakMallocedMemory = statistics.peak_malloced_memory();
+  heap.nativeContexts = statistics.number_of_native_contexts();
+  heap.detachedContexts = statistics.number_of_detached_contexts();
+  heap.sampledAt = now;
+  recordOBSHeapMetrics(&heap);
+}
+
+// Garbage collections show up in the trace as spans of their own.  V8 does
+// not nest them, so one start time per thread is enough.
+static thread_local uint64_t gGCStartTime = 0;
+
+void traceGCPrologue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags) {
+  gGCStartTime = gTraceEnabled.load(std::memory_order_relaxed) ? traceNanoseconds() : 0;
+}
+
+void traceGCEpilogue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags) {
+  if (gGCStartTime == 0) {
+    return;
+  }
+  const char *name;
+  switch (type) {
+    case v8::kGCTypeScavenge:
+      name = "GC (scavenge)";
+      break;
+    case v8::kGCTypeMarkSweepCompact:
+      name = "GC (mark-sweep-compact)";
+      break;
+    case v8::kGCTypeIncrementalMarking:
+      name = "GC (incremental marking)";
+      break;
+    case v8::kGCTypeProcessWeakCallbacks:
+      name = "GC (weak callbacks)";
+      break;
+    default:
+      name = "GC";
+      break;
+  }
+  recordTraceSpan(name, gGCStartTime, traceNanoseconds());
+  gGCStartTime = 0;
+}
+
 void runScript(char *scriptString) {
+  runNamedScript(NULL, scriptString);
+}
+
+// The name shows up in the inspector and in CPU profiles.
+void runNamedScript(const char *scriptName, char *scriptString) {
+  runScriptSource(scriptName, scriptString, false);
+}
+
+void runStaticScript(const char *scriptName, char *scriptString) {
+  runScriptSource(scriptName, scriptString, true);
+}
+
+// A script compiled into the library, which V8 reads where it is.
+class StaticScriptResource : public v8::String::ExternalOneByteStringResource {
+  public:
+    StaticScriptResource(const char *buf, size_t length) : rawBuf(buf), rawLength(length) {}
+    const char *data() const override { return rawBuf; }
+    size_t length() const override { return rawLength; }
+
+  private:
+    const char *rawBuf;
+    size_t rawLength;
+};
+
+static bool isASCII(const char *string, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if ((uint8_t)string[i] >= 0x80) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void runScriptSource(const char *scriptName, char *scriptString, bool isStatic) {
   auto isolate = v8::Isolate::GetCurrent();
 
   // Create a stack-allocated handle scope.
   v8::HandleScope handle_scope(isolate);
 
   v8::Local<v8::Context> context = isolate->GetCurrentContext();  // v8::Context::New(isolate, nullptr, globals);
-  context->Enter();
 
   // Enter the context for compiling and running scripts.
   v8::Context::Scope context_scope(context);
 
-  // Create a string containing the JavaScript source code.
+  // Create a string containing the JavaScript source code.  In the
+  // low-memory profile, a static script is not copied into the heap; an
+  // external one-byte string has to be Latin-1, so that is only done for
+  // ASCII.
   // printf("%s\n", scriptString);
-  v8::Local<v8::String> source =
-      v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), scriptString,
-                              v8::NewStringType::kNormal, strlen(scriptString))
-          .ToLocalChecked();
+  size_t length = strlen(scriptString);
+  v8::Local<v8::String> source;
+  if (isStatic && gRuntimeProfile == kOBSRuntimeProfileLowMemory &&
+      isASCII(scriptString, length)) {
+    source = v8::String::NewExternalOneByte(
+        isolate, new StaticScriptResource(scriptString, length)).ToLocalChecked();
+  } else {
+    source = v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), scriptString,
+                                     v8::NewStringType::kNormal, length)
+        .ToLocalChecked();
+  }
 
   // Compile the source code.
+  v8::ScriptOrigin origin(
+      isolate,
+      v8::String::NewFromUtf8(isolate, (scriptName != NULL) ? scriptName : "").ToLocalChecked());
   v8::Local<v8::Script> script =
-      v8::Script::Compile(context, source).ToLocalChecked();
+      v8::Script::Compile(context, source, &origin).ToLocalChecked();
   // Run the script to get the result.
   v8::Local<v8::Value> result = script->Run(context).ToLocalChecked();
   // Convert the result to an UTF8 string and print it.
-  v8::String::Utf8Value utf8(v8::Isolate::GetCurrent(), result);
-  printf("%s\n", *utf8);
+  if (__atomic_load_n(&gOBSLogLevel, __ATOMIC_RELAXED) <= kOBSLogDebug) {
+    v8::String::Utf8Value utf8(v8::Isolate::GetCurrent(), result);
+    logOBSText(kOBSLogDebug, *utf8, utf8.length());
+  }
 }
 
 bool runScriptAsModule(char *moduleName, char *scriptString) {
@@ -368,7 +1046,6 @@ bool runScriptAsModule(char *moduleName, char *scriptString) {
   v8::HandleScope handle_scope(isolate);
 
   v8::Local<v8::Context> context = isolate->GetCurrentContext();
-  context->Enter();
 
   // Enter the context for compiling and running scripts.
   v8::Context::Scope context_scope(context);
@@ -399,21 +1076,21 @@ bool runScriptAsModule(char *moduleName, char *scriptString) {
 
   v8::Local<v8::Module> verifiedModule;
   if (!loadedModule.ToLocal(&verifiedModule)) {
-    fprintf(stderr, "Error loading module!\n");
+    OBSLOG(kOBSLogError, "Error loading module!\n");
     return false;
   }
 
   v8::Maybe<bool> instantiationResult =
       verifiedModule->InstantiateModule(context, resolveCallback);
   if (instantiationResult.IsNothing()) {
-    fprintf(stderr, "Unable to instantiate module.\n");
+    OBSLOG(kOBSLogError, "Unable to instantiate module.\n");
     return false;
   }
 
   // Run the module to get the result.
   v8::Local<v8::Value> result;
   if (!verifiedModule->Evaluate(context).ToLocal(&result)) {
-    fprintf(stderr, "Module evaluation failed.\n");
+    OBSLOG(kOBSLogError, "Module evaluation failed.\n");
     return false;
   }
 
@@ -421,8 +1098,10 @@ bool runScriptAsModule(char *moduleName, char *scriptString) {
   // v8::Local<v8::Value> result = script->Run(context).ToLocalChecked();
 
   // Convert the result to a UTF8 string and print it.
-  v8::String::Utf8Value utf8(v8::Isolate::GetCurrent(), result);
-  printf("%s\n", *utf8);
+  if (__atomic_load_n(&gOBSLogLevel, __ATOMIC_RELAXED) <= kOBSLogDebug) {
+    v8::String::Utf8Value utf8(v8::Isolate::GetCurrent(), result);
+    logOBSText(kOBSLogDebug, *utf8, utf8.length());
+  }
 
   return true;
 }
@@ -448,12 +1127,18 @@ void v8_teardown(void) {
 
 #pragma mark - Calls from JavaScript into C++ (and support functions)
 
+// Unlike connectionData[], doesn't leave a NULL entry behind for an
+// unknown ID.
+static WebSocketsContextData *findConnection(uint32_t connectionID) {
+  auto iterator = tInstance->connectionData.find(connectionID);
+  return (iterator != tInstance->connectionData.end()) ? iterator->second : nullptr;
+}
+
 // Open a socket.
 // connectWebSocket(this, URL, protocols)
 void connectWebSocket(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Isolate *isolate = args.GetIsolate();
   v8::HandleScope scope(isolate);
-  static uint32_t newConnectionIdentifier = 0;
 
   FUNCDEBUG("connectWebSocket called.\n");
 
@@ -477,18 +1162,26 @@ void connectWebSocket(const v8::FunctionCallbackInfo<v8::Value>& args) {
     protocolStringsStdArray.push_back(protocolString);
   }
 
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
+  uint32_t connectionID = gNextConnectionID.fetch_add(1, std::memory_order_relaxed);
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
   struct lws_protocols *protocols = createProtocols(protocolStringsStdArray);
-  connectionData[newConnectionIdentifier] =
+  tInstance->connectionData[connectionID] =
       new WebSocketsContextData(persistentObject, protocols, isolate);
-  bool success = connectWebSocket(URL, protocols, newConnectionIdentifier);
+  tInstance->connectionData[connectionID]->metrics = addConnectionMetrics(connectionID);
+  bool success = connectWebSocket(URL, connectionID);
 
-  args.GetReturnValue().Set(newConnectionIdentifier++);
+  args.GetReturnValue().Set(connectionID);
 }
 
-bool sendWebSocketData(uint32_t connectionID, uint8_t *data, uint64_t length, bool isUTF8);
+int queueOutgoingDataItem(uint32_t connectionID, WebSocketsDataItem *item);
 
-// sendWebSocketData(this.internal_connection_id, data);
+// sendWebSocketData(this.internal_connection_id, data, coalesceKey);
+//
+// Accepts a string, an ArrayBuffer, any ArrayBufferView (typed arrays and
+// DataView), or a plain array of byte values.  The payload is copied
+// exactly once, straight into an outgoing frame buffer with LWS_PRE bytes
+// of headroom.  coalesceKey is optional.  Returns false if the connection
+// is gone, and throws if the send policy refuses the message.
 void sendWebSocketData(const v8::FunctionCallbackInfo<v8::Value>& args) {
 
   FUNCDEBUG("Called sendWebSocketData\n");
@@ -498,29 +1191,61 @@ void sendWebSocketData(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
   uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
 
-  // In theory, we need to support String, ArrayBuffer, Blob, TypedArray,
-  // and DataView objects as the data object (args[1]).
-  //
-  // For now, support strings and byte arrays.  Nothing else.  Eventually,
-  // we will convert everything else to one of those forms on the JavaScript
-  // side.
-  bool retval = true;
-  if (args[1]->IsString()) { 
-    v8::String::Utf8Value protocolStringUTF8(v8::Isolate::GetCurrent(), args[1]->ToString(context).ToLocalChecked());
-    std::string protocolString(*protocolStringUTF8);
-    retval = sendWebSocketData(connectionID, (uint8_t *)protocolString.c_str(), protocolString.length(), true);
+  WebSocketsDataItem *item = nullptr;
+  if (args[1]->IsString()) {
+    v8::Local<v8::String> string = v8::Local<v8::String>::Cast(args[1]);
+    size_t length = string->Utf8Length(isolate);
+    item = new WebSocketsDataItem(length, false, LWS_PRE);
+    string->WriteUtf8(isolate, (char *)item->GetBuf(), (int)length, nullptr,
+                      v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+  } else if (args[1]->IsArrayBufferView()) {
+    v8::Local<v8::ArrayBufferView> view = v8::Local<v8::ArrayBufferView>::Cast(args[1]);
+    size_t length = view->ByteLength();
+    item = new WebSocketsDataItem(length, true, LWS_PRE);
+    if (view->HasBuffer()) {
+      // Hold a reference to the backing store so that it can't go away
+      // while we copy out of it.
+      std::shared_ptr<v8::BackingStore> backingStore = view->Buffer()->GetBackingStore();
+      memcpy(item->GetBuf(), (uint8_t *)backingStore->Data() + view->ByteOffset(), length);
+    } else {
+      // Small typed arrays can live on the V8 heap with no backing store;
+      // asking for Buffer() would move them off-heap first.
+      view->CopyContents(item->GetBuf(), length);
+    }
+  } else if (args[1]->IsArrayBuffer()) {
+    v8::Local<v8::ArrayBuffer> arrayBuffer = v8::Local<v8::ArrayBuffer>::Cast(args[1]);
+    std::shared_ptr<v8::BackingStore> backingStore = arrayBuffer->GetBackingStore();
+    size_t length = backingStore->ByteLength();
+    item = new WebSocketsDataItem(length, true, LWS_PRE);
+    memcpy(item->GetBuf(), backingStore->Data(), length);
   } else if (args[1]->IsArray()) {
+    // Slow path, kept for older callers: one boxed value per byte.
     v8::Handle<v8::Array> byteArray = v8::Handle<v8::Array>::Cast(args[1]);
 
-    uint8_t *data = (uint8_t *)malloc(byteArray->Length());
+    item = new WebSocketsDataItem(byteArray->Length(), true, LWS_PRE);
+    uint8_t *data = item->GetBuf();
     for (int i = 0; i < byteArray->Length(); i++) {
       v8::Handle<v8::Uint32> byteValue = v8::Handle<v8::Uint32>::Cast(byteArray->Get(context, i).ToLocalChecked());
       data[i] = byteValue->Uint32Value(context).ToChecked() & 0xff;
     }
-    retval = sendWebSocketData(connectionID, data, byteArray->Length(), false);
-    free(data);
+  } else {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: Unsupported data type").ToLocalChecked()));
+    return;
+  }
+
+  if (args.Length() > 2 && args[2]->IsString()) {
+    v8::String::Utf8Value coalesceKey(isolate, args[2]);
+    item->coalesceKey = *coalesceKey;
+  }
+
+  int result = queueOutgoingDataItem(connectionID, item);
+  if (result == kSendResultRefused) {
+    isolate->ThrowException(v8::Exception::Error(
+        v8::String::NewFromUtf8(isolate, "Send queue is full").ToLocalChecked()));
+    return;
   }
-  args.GetReturnValue().Set(retval);
+  args.GetReturnValue().Set(result == kSendResultQueued);
 }
 
 // closeWebSocket(this.internal_connection_id);
@@ -532,10 +1257,14 @@ void closeWebSocket(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
   uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
 
+  requestConnectionClose(connectionID);
+}
+
+void requestConnectionClose(uint32_t connectionID) {
   setConnectionState(connectionID, kConnectionStateClosing);
 
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
   if (dataProviderGroup != nullptr) {
     dataProviderGroup->shouldCloseConnection = true;
   }
@@ -548,17 +1277,109 @@ void getWebSocketBufferedAmount(const v8::FunctionCallbackInfo<v8::Value>& args)
   v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
   uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
 
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
-  uint32_t bufferCount = 0;
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  double bufferCount = 0;
 
   if (dataProviderGroup != nullptr) {
-    bufferCount = dataProviderGroup->outgoingData.PendingBytes();
+    bufferCount = (double)dataProviderGroup->outgoingData.PendingBytes();
   }
 
   args.GetReturnValue().Set(bufferCount);
 }
 
+// setWebSocketSendLimits(connectionID, highWatermark, lowWatermark, policy)
+// policy is "queue", "reject", or "coalesce".  Returns false if the values
+// are invalid.
+void setWebSocketSendLimits(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
+  uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
+  double highWatermark = args[1]->NumberValue(context).FromMaybe(-1);
+  double lowWatermark = args[2]->NumberValue(context).FromMaybe(-1);
+  v8::String::Utf8Value policyV8(isolate, args[3]);
+  std::string policyString(*policyV8 ? *policyV8 : "");
+
+  OBSSendPolicy policy;
+  if (policyString == "queue") {
+    policy = kOBSSendPolicyQueue;
+  } else if (policyString == "reject") {
+    policy = kOBSSendPolicyReject;
+  } else if (policyString == "coalesce") {
+    policy = kOBSSendPolicyCoalesce;
+  } else {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  if (!(highWatermark > 0) || !(lowWatermark >= 0) || lowWatermark > highWatermark) {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  dataProviderGroup->highWatermark = (size_t)highWatermark;
+  dataProviderGroup->lowWatermark = (size_t)lowWatermark;
+  dataProviderGroup->sendPolicy = policy;
+  args.GetReturnValue().Set(true);
+}
+
+// setWebSocketReceiveLimits(connectionID, maxBytes, maxMessages, resumeBytes,
+//                           resumeMessages, policy)
+// policy is "pause", "drop-oldest", or "coalesce".  Returns false if the
+// values are invalid.
+void setWebSocketReceiveLimits(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
+  uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
+  v8::String::Utf8Value policyV8(isolate, args[5]);
+  std::string policyString(*policyV8 ? *policyV8 : "");
+
+  double values[4];
+  for (int i = 0; i < 4; i++) {
+    values[i] = args[i + 1]->NumberValue(context).FromMaybe(-1);
+    if (!(values[i] >= 0)) {
+      args.GetReturnValue().Set(false);
+      return;
+    }
+  }
+
+  OBSReceiveLimits limits;
+  limits.maxBytes = (size_t)values[0];
+  limits.maxMessages = (size_t)values[1];
+  limits.resumeBytes = (size_t)values[2];
+  limits.resumeMessages = (size_t)values[3];
+  if (policyString == "pause") {
+    limits.policy = kOBSReceivePolicyPause;
+  } else if (policyString == "drop-oldest") {
+    limits.policy = kOBSReceivePolicyDropOldest;
+  } else if (policyString == "coalesce") {
+    limits.policy = kOBSReceivePolicyCoalesce;
+  } else {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  if (!validReceiveLimits(&limits)) {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  dataProviderGroup->receiveLimits = limits;
+  args.GetReturnValue().Set(true);
+}
+
 // getWebSocketExtensions()
 void getWebSocketExtensions(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Isolate *isolate = args.GetIsolate();
@@ -567,19 +1388,21 @@ void getWebSocketExtensions(const v8::FunctionCallbackInfo<v8::Value>& args) {
   uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
 
 
-  v8::Local<v8::Array> array = v8::Local<v8::Array>::New(isolate, v8::Array::New(isolate));
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  std::string extensions;
 
-#ifdef SUPPORT_DEFLATE
-  array->Set(context, v8::Number::New(isolate, 0),
-             v8::String::NewFromUtf8(isolate, "permessage-deflate").ToLocalChecked()).Check();
-  array->Set(context, v8::Number::New(isolate, 1),
-                 v8::String::NewFromUtf8(isolate, "deflate-frame").ToLocalChecked()).Check();
-#endif
+  if (dataProviderGroup != nullptr) {
+    extensions = dataProviderGroup->negotiatedExtensions;
+  }
 
-  args.GetReturnValue().Set(array);
+  args.GetReturnValue().Set(v8::String::NewFromUtf8(isolate, extensions.c_str()).ToLocalChecked());
 }
 
-// setWebSocketBinaryType(typeString)
+// setWebSocketBinaryType(connectionID, typeString)
+// Binary messages always arrive from native code as an ArrayBuffer that
+// wraps the receive buffer; websocket.js wraps that in a Blob when asked
+// to.  This just validates the type.  Returns false if it is unsupported.
 void setWebSocketBinaryType(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Isolate *isolate = args.GetIsolate();
   v8::Local<v8::Context> context = isolate->GetCurrentContext();
@@ -589,13 +1412,13 @@ void setWebSocketBinaryType(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::String::Utf8Value binaryTypeStringV8(v8::Isolate::GetCurrent(), args[1]->ToString(context).ToLocalChecked());
   std::string binaryTypeString(*binaryTypeStringV8);
 
-  // Update with data:
-  // uint32_t connectionID
-  // string binaryTypeString
-
-  // @@@
-  FUNCDEBUG("Got setWebSocketBinaryType (unsupported)\n");
-  exit(1);
+  if (binaryTypeString != "blob" && binaryTypeString != "arraybuffer") {
+    FUNCDEBUG("Ignoring unsupported binaryType %s for connection %u\n",
+              binaryTypeString.c_str(), connectionID);
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  args.GetReturnValue().Set(true);
 }
 
 void getWebSocketActiveProtocol(const v8::FunctionCallbackInfo<v8::Value>& args) {
@@ -603,10 +1426,11 @@ void getWebSocketActiveProtocol(const v8::FunctionCallbackInfo<v8::Value>& args)
   v8::Local<v8::Context> context = isolate->GetCurrentContext();
   v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
   uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
 
-  bool isValid = (dataProviderGroup->activeProtocolName != NULL);
+  bool isValid = (dataProviderGroup != nullptr &&
+                  dataProviderGroup->activeProtocolName != NULL);
   if (isValid) {
     GENERALDEBUG("In getWebSocketActiveProtocol: protocol is %s\n",
                  dataProviderGroup->activeProtocolName->c_str());
@@ -625,22 +1449,6 @@ char *mallocString(std::string string) {
   return buf;
 }
 
-#ifdef SUPPORT_DEFLATE
-static const struct lws_extension supportedExtensions[] = {
-	{
-		"permessage-deflate",
-		lws_extension_callback_pm_deflate,
-		"permessage-deflate; client_no_context_takeover"
-	},
-	{
-		"deflate-frame",
-		lws_extension_callback_pm_deflate,
-		"deflate_frame"
-	},
-	{ NULL, NULL, NULL /* terminator */ }
-};
-#endif
-
 struct lws_protocols *createProtocols(std::vector<std::string> protocols) {
   size_t count = protocols.size();
   struct lws_protocols *data = (struct lws_protocols *)malloc(sizeof(struct lws_protocols) * (count + 1));
@@ -650,7 +1458,7 @@ struct lws_protocols *createProtocols(std::vector<std::string> protocols) {
     data[i].name = mallocString(protocols[i]);
     data[i].callback = websocketLWSCallback;
     data[i].per_session_data_size = 0;
-    data[i].rx_buffer_size = 65536;
+    data[i].rx_buffer_size = gReceiveBufferSize;
     data[i].id = 0;
     data[i].user = NULL,
     data[i].tx_packet_size = 0;
@@ -661,33 +1469,52 @@ struct lws_protocols *createProtocols(std::vector<std::string> protocols) {
   return data;
 };
 
-bool connectWebSocket(std::string URL, struct lws_protocols *protocols,
-                      uint32_t connectionID) {
+// One client context per worker thread, shared by every connection of its
+// instances.  They all bind to this one protocol; the subprotocols that
+// JavaScript asked for stay with each connection (see
+// requestedProtocolName()).
+struct lws_context *createClientContext(void) {
+  // supportedExtensions() builds an offer that every context shares.
+  static std::mutex creationMutex;
+  std::lock_guard<std::mutex> guard(creationMutex);
+
   struct lws_context_creation_info info;
 
   bzero(&info, sizeof(info));
 
-  info.protocols = protocols;
-
-  uint32_t *connectionIDRef = (uint32_t *)malloc(sizeof(uint32_t));
-  *connectionIDRef = connectionID;
-
-  info.user = connectionIDRef;
+  info.protocols = createProtocols(std::vector<std::string>(1, "obs-tally-client"));
   info.uid = -1;
   info.gid = -1;
-#ifdef SUPPORT_DEFLATE
-  info.extensions = supportedExtensions;
-#endif
+  info.extensions = supportedExtensions();
   info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
   info.options |= LWS_SERVER_OPTION_H2_JUST_FIX_WINDOW_UPDATE_OVERFLOW;
 
   struct lws_context *context = lws_create_context(&info);
+  if (context == nullptr) {
+    OBSLOG(kOBSLogError, "Unable to create a libwebsockets context.\n");
+  }
+  return context;
+}
+
+// Created on the worker's own thread, the first time it is needed.
+struct lws_context *workerContext(TallyWorker *worker) {
+  struct lws_context *context = worker->context.load(std::memory_order_acquire);
+  if (context == nullptr) {
+    context = createClientContext();
+    worker->context.store(context, std::memory_order_release);
+  }
+  return context;
+}
+
+bool connectWebSocket(std::string URL, uint32_t connectionID) {
+  struct lws_context *context = workerContext(tInstance->worker);
+  if (context == nullptr) {
+    return false;
+  }
 
   struct lws_client_connect_info connectInfo;
   bzero(&connectInfo, sizeof(connectInfo));
 
-  connectInfo.opaque_user_data = (void *)connectionIDRef;
-
   const char *URLProtocol = NULL, *URLPath = NULL;
   char *tempURL = mallocString(URL);
 
@@ -722,6 +1549,12 @@ bool connectWebSocket(std::string URL, struct lws_protocols *protocols,
   connectInfo.method = NULL; // "RAW";
   // connectInfo.protocol = mallocString(protocols[0]);
 
+  ConnectionRef *connectionRef = new ConnectionRef();
+  connectionRef->instance = tInstance;
+  connectionRef->connectionID = connectionID;
+  tInstance->connectionRefs.insert(connectionRef);
+  connectInfo.opaque_user_data = (void *)connectionRef;
+
   lws_client_connect_via_info(&connectInfo);
 
 // lws_set_opaque_user_data
@@ -731,23 +1564,55 @@ bool connectWebSocket(std::string URL, struct lws_protocols *protocols,
   return true;
 }
 
-bool sendWebSocketData(uint32_t connectionID, uint8_t *data, uint64_t length, bool isUTF8) {
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
-
-  WebSocketsDataItem *item = new WebSocketsDataItem(data, length, !isUTF8);
+// Takes ownership of item, applying the connection's send policy.  Returns
+// one of the kSendResult constants.
+int queueOutgoingDataItem(uint32_t connectionID, WebSocketsDataItem *item) {
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
 
   if (dataProviderGroup == nullptr) {
-    fprintf(stderr, "No provider group.  Failing.\n");
-    return false;
+    OBSLOG(kOBSLogError, "No provider group.  Failing.\n");
+    delete item;
+    return kSendResultNoConnection;
   }
-  dataProviderGroup->outgoingData.addPendingData(item);
-  return true;
+  DataProvider &outgoingData = dataProviderGroup->outgoingData;
+
+  size_t newPendingBytes = outgoingData.PendingBytes() + item->GetLength();
+  if (newPendingBytes >= dataProviderGroup->highWatermark) {
+    // Whatever happens to this message, tell JavaScript when there is
+    // room again.
+    dataProviderGroup->aboveHighWatermark = true;
+
+    if (dataProviderGroup->sendPolicy == kOBSSendPolicyCoalesce &&
+        !item->coalesceKey.empty() && outgoingData.replacePendingData(item)) {
+      return kSendResultQueued;
+    }
+    // A message bigger than the limit still goes out on an empty queue;
+    // otherwise it could never be sent at all.
+    if (dataProviderGroup->sendPolicy != kOBSSendPolicyQueue &&
+        newPendingBytes > dataProviderGroup->highWatermark &&
+        outgoingData.PendingCount() > 0) {
+      delete item;
+      countSendRefusal(dataProviderGroup->metrics);
+      return kSendResultRefused;
+    }
+  }
+  outgoingData.addPendingData(item);
+  return kSendResultQueued;
+}
+
+void setOBSSendLimits(size_t highWatermark, size_t lowWatermark, OBSSendPolicy policy) {
+  gDefaultHighWatermark = highWatermark;
+  gDefaultLowWatermark = MIN(lowWatermark, highWatermark);
+  gDefaultSendPolicy = policy;
 }
 
 void setConnectionState(uint32_t connectionID, int state) {
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
   dataProviderGroup->connectionState = state;
 }
 
@@ -757,8 +1622,8 @@ void getWebSocketConnectionState(const v8::FunctionCallbackInfo<v8::Value>& args
   v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
   uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
 
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
   if (dataProviderGroup == nullptr) {
     args.GetReturnValue().Set(kConnectionStateClosed);
   } else {
@@ -766,10 +1631,21 @@ void getWebSocketConnectionState(const v8::FunctionCallbackInfo<v8::Value>& args
   }
 }
 
+// logMessage(message[, level]), where level is an OBSLogLevel (info if
+// omitted).
 void logMessage(const v8::FunctionCallbackInfo<v8::Value>& args) {
-  v8::String::Utf8Value messageV8(v8::Isolate::GetCurrent(), args[0]);
-  std::string messageString(*messageV8);
-  fprintf(stderr, "%s\n", messageString.c_str());
+  v8::Isolate *isolate = args.GetIsolate();
+  int level = kOBSLogInfo;
+  if (args.Length() > 1 && args[1]->IsInt32()) {
+    level = args[1]->Int32Value(isolate->GetCurrentContext()).ToChecked();
+    level = MAX(kOBSLogDebug, MIN(level, kOBSLogError));
+  }
+  // Skip the string conversion when nobody will see it.
+  if (level < __atomic_load_n(&gOBSLogLevel, __ATOMIC_RELAXED)) {
+    return;
+  }
+  v8::String::Utf8Value messageV8(isolate, args[0]);
+  logOBSText((OBSLogLevel)level, *messageV8, messageV8.length());
 }
 
 void PasswordGetter(v8::Local<v8::String> property,
@@ -779,62 +1655,229 @@ void PasswordGetter(v8::Local<v8::String> property,
   
   v8::HandleScope handle_scope(isolate);
   v8::Local<v8::String> passwordV8String =
-      v8::String::NewFromUtf8(isolate, gPassword).ToLocalChecked();
+      v8::String::NewFromUtf8(isolate, tInstance->password.c_str()).ToLocalChecked();
   info.GetReturnValue().Set(passwordV8String);
 }
 
-void updateScenes(std::vector<std::string> newPreviewScenes, std::vector<std::string> newProgramScenes) {
-  std::set<std::string> inactiveScenes;
+uint64_t monotonicMicroseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000ull + (uint64_t)now.tv_nsec / 1000ull;
+}
 
-  GENERALDEBUG("In updateScenes\n");
+// The program and preview scenes as of the latest update, whether or not
+// the callbacks have heard about it yet.
+static const std::vector<uint32_t> &latestProgramScenes(void) {
+  return tInstance->hasPendingScenes ? tInstance->pendingProgramScenes : tInstance->tallyState.ProgramScenes();
+}
+
+static const std::vector<uint32_t> &latestPreviewScenes(void) {
+  return tInstance->hasPendingScenes ? tInstance->pendingPreviewScenes : tInstance->tallyState.PreviewScenes();
+}
+
+// Records a new program/preview state.  With no coalescing window, it is
+// reported at once.  Otherwise, the first change starts the window, later
+// changes replace the pending state, and flushCoalescedScenes() reports
+// the net difference once the window closes.  A burst that ends where it
+// started reports nothing at all.
+void updateScenes(const std::vector<uint32_t> &newPreviewScenes,
+                  const std::vector<uint32_t> &newProgramScenes) {
+  uint32_t coalescingWindow = gCoalescingWindowMicroseconds.load(std::memory_order_relaxed);
+  if (coalescingWindow == 0) {
+    commitScenes(newPreviewScenes, newProgramScenes, tInstance->dispatchingReceiveTime);
+    return;
+  }
+
+  // Copy first; the arguments may be the pending lists themselves.
+  std::vector<uint32_t> previewScenes(newPreviewScenes);
+  std::vector<uint32_t> programScenes(newProgramScenes);
+  if (tInstance->hasPendingScenes) {
+    tInstance->suppressedSceneStates++;
+  } else {
+    tInstance->hasPendingScenes = true;
+    tInstance->pendingScenesDeadline = monotonicMicroseconds() + coalescingWindow;
+    tInstance->pendingScenesReceiveTime = tInstance->dispatchingReceiveTime;
+  }
+  tInstance->pendingPreviewScenes.swap(previewScenes);
+  tInstance->pendingProgramScenes.swap(programScenes);
+}
+
+// Also flushes early once the window has been set to 0.
+void flushCoalescedScenes(void) {
+  if (!tInstance->hasPendingScenes ||
+      (gCoalescingWindowMicroseconds.load(std::memory_order_relaxed) != 0 &&
+       monotonicMicroseconds() < tInstance->pendingScenesDeadline)) {
+    return;
+  }
+  tInstance->hasPendingScenes = false;
+  commitScenes(tInstance->pendingPreviewScenes, tInstance->pendingProgramScenes, tInstance->pendingScenesReceiveTime);
+}
+
+void setOBSTallyCoalescingWindow(uint32_t microseconds) {
+  gCoalescingWindowMicroseconds.store(microseconds, std::memory_order_relaxed);
+}
 
-  // Mark all of the old preview and program scenes as possibly inactive.
-  for (std::string scene : gPreviewScenes) {
-    inactiveScenes.insert(scene);
+uint64_t getOBSTallySuppressedStates(void) {
+  OBSTallyInstance *instance = gDefaultInstance.load();
+  return (instance != nullptr) ? instance->suppressedSceneStates : 0;
+}
+
+// The default instance reports through gettally.c (and so through the
+// callback thread, if it is running); the others call their own callbacks.
+static void reportSceneIsProgram(const char *sceneName) {
+  OBSTallyInstance *instance = tInstance;
+  if (instance->isDefault) {
+    _setSceneIsProgram(sceneName);
+  } else if (instance->callbacks.program != NULL) {
+    instance->callbacks.program(instance, sceneName, instance->callbacks.context);
+  }
+}
+
+static void reportSceneIsPreview(const char *sceneName, bool alsoOnProgram) {
+  OBSTallyInstance *instance = tInstance;
+  if (instance->isDefault) {
+    _setSceneIsPreview(sceneName, alsoOnProgram);
+  } else if (instance->callbacks.preview != NULL) {
+    instance->callbacks.preview(instance, sceneName, alsoOnProgram, instance->callbacks.context);
+  }
+}
+
+static void reportSceneIsInactive(const char *sceneName) {
+  OBSTallyInstance *instance = tInstance;
+  if (instance->isDefault) {
+    _setSceneIsInactive(sceneName);
+  } else if (instance->callbacks.inactive != NULL) {
+    instance->callbacks.inactive(instance, sceneName, instance->callbacks.context);
   }
-  for (std::string scene : gProgramScenes) {
-    inactiveScenes.insert(scene);
+}
+
+static void reportSourceTally(const char *sourceName, bool onProgram, bool onPreview) {
+  OBSTallyInstance *instance = tInstance;
+  if (instance->isDefault) {
+    _setSourceTally(sourceName, onProgram, onPreview);
+  } else if (instance->callbacks.source != NULL) {
+    instance->callbacks.source(instance, sourceName, onProgram, onPreview,
+                               instance->callbacks.context);
+  }
+}
+
+static void reportTallyDiff(const OBSTallyChange *changes, size_t count) {
+  OBSTallyInstance *instance = tInstance;
+  if (instance->isDefault) {
+    _reportTallyDiff(changes, count);
+  } else if (instance->callbacks.tallyDiff != NULL) {
+    instance->callbacks.tallyDiff(instance, changes, count, instance->callbacks.context);
   }
+}
+
+// Reports the difference between the last reported state and this one to
+// every consumer.  receiveTime is when the message that caused the change
+// arrived, or 0 if no message did.
+void commitScenes(const std::vector<uint32_t> &newPreviewScenes,
+                  const std::vector<uint32_t> &newProgramScenes, uint64_t receiveTime) {
+  static thread_local std::vector<OBSTallyChange> changes;
+
+  GENERALDEBUG("In commitScenes\n");
 
-  // Remove any new preview and program scenes so that they won't be marked as inactive,
-  // and notify the main code that the scenes are active.
-  for (std::string scene : newProgramScenes) {
-    inactiveScenes.erase(scene);
-    _setSceneIsProgram(scene.c_str());
+  TraceSpan span("commitScenes");
+  changes.clear();
+  tInstance->tallyState.Update(newProgramScenes, newPreviewScenes, &changes);
+  if (changes.size() == 0) {
+    return;
   }
 
-  for (std::string scene : newPreviewScenes) {
-    inactiveScenes.erase(scene);
-    bool isProgram = false;
+  {
+    TraceSpan callbackSpan("tally diff callback");
+    reportTallyDiff(changes.data(), changes.size());
+  }
+  if (tInstance->isDefault) {
+    broadcastTallyChanges(changes.data(), changes.size());
+  }
 
-    // Flag any preview scenes that are also on the program output.
-    auto ret = std::find(newProgramScenes.begin(), newProgramScenes.end(), scene);
-    if (ret != newProgramScenes.end()) {
-      isProgram = true;
+  // The per-scene callbacks get the new state of every scene that changed,
+  // in the same order as before: program, then preview, then inactive.
+  {
+    TraceSpan callbackSpan("tally callbacks");
+    for (const OBSTallyChange &change : changes) {
+      if (change.onProgram) {
+        reportSceneIsProgram(change.sceneName);
+      }
+    }
+    for (const OBSTallyChange &change : changes) {
+      if (change.onPreview) {
+        reportSceneIsPreview(change.sceneName, change.onProgram);
+      }
+    }
+    for (const OBSTallyChange &change : changes) {
+      if (!change.onProgram && !change.onPreview) {
+        reportSceneIsInactive(change.sceneName);
+      }
     }
-    _setSceneIsPreview(scene.c_str(), isProgram);
   }
+  if (receiveTime != 0) {
+    recordTallyLatency(monotonicMicroseconds() - receiveTime);
+  }
+
+  if (tInstance->isDefault) {
+    publishTallySnapshot();
+  }
+
+  tInstance->sceneGraph.SetRootScenes(kSceneGraphProgram, tInstance->tallyState.ProgramSceneNames());
+  tInstance->sceneGraph.SetRootScenes(kSceneGraphPreview, tInstance->tallyState.PreviewSceneNames());
+  flushSceneGraph();
+}
 
-  // Notify the main code that any previously active scenes are no longer active.
-  for (std::string scene : inactiveScenes) {
-    _setSceneIsInactive(scene.c_str());
+// Copies the state of every known scene into the shared-memory snapshot
+// (if enabled) for other processes to read.
+void publishTallySnapshot(void) {
+  static std::vector<OBSTallySharedScene> scenes;
+
+  uint32_t sceneCount = tInstance->tallyState.names.Count();
+  scenes.resize(sceneCount);
+  for (uint32_t sceneID = 0; sceneID < sceneCount; sceneID++) {
+    OBSTallySharedScene &scene = scenes[sceneID];
+    bzero(&scene, sizeof(scene));
+    scene.sceneID = sceneID;
+    scene.state = (tInstance->tallyState.IsProgram(sceneID) ? kOBSTallySharedProgram : 0) |
+                  (tInstance->tallyState.IsPreview(sceneID) ? kOBSTallySharedPreview : 0);
+    strncpy(scene.name, tInstance->tallyState.names.Name(sceneID), sizeof(scene.name) - 1);
   }
+  publishOBSTallySnapshot(scenes.data(), scenes.size());
+}
+
+const char *getOBSSceneName(uint32_t sceneID) {
+  return obsTallyGetSceneName(gDefaultInstance.load(), sceneID);
+}
 
-  gPreviewScenes = newPreviewScenes;
-  gProgramScenes = newProgramScenes;
+const char *obsTallyGetSceneName(OBSTallyInstance *instance, uint32_t sceneID) {
+  return (instance != NULL) ? instance->tallyState.names.Name(sceneID) : NULL;
 }
 
 void reconnectOBS(v8::Isolate *isolate) {
-  static bool firstTry = true;
+  OBSTallyInstance *instance = tInstance;
+  uint64_t now = monotonicMicroseconds();
+
+  // Wait 5 seconds between retries, without holding up the other instances
+  // on this thread.
+  if (!instance->firstTry && !instance->reconnectImmediately) {
+    if (instance->nextReconnectTime == 0) {
+      instance->nextReconnectTime = now + 5000000;
+    }
+    if (now < instance->nextReconnectTime) {
+      return;
+    }
+  }
+  instance->nextReconnectTime = 0;
+
+  TraceSpan span("reconnectOBS");
 
   GENERALDEBUG("Connecting to OBS.\n");
 
-  if (firstTry) {
-    firstTry = false;
-  } else {
-    // Wait 5 seconds between retries.
-    usleep(5000000);
+  if (!instance->firstTry) {
+    countReconnect();
   }
+  instance->firstTry = false;
+  instance->reconnectImmediately = false;
 
   v8::HandleScope handle_scope(isolate);
 
@@ -847,7 +1890,7 @@ void reconnectOBS(v8::Isolate *isolate) {
   v8::Local<v8::Function> function = v8::Local<v8::Function>::Cast(functionAsValue);
 
   v8::Local<v8::String> OBSWebSocketURLV8 =
-      v8::String::NewFromUtf8(isolate, gOBSWebSocketURL).ToLocalChecked();
+      v8::String::NewFromUtf8(isolate, instance->URL.c_str()).ToLocalChecked();
   v8::Local<v8::Value> args[1];
   args[0] = OBSWebSocketURLV8;
 
@@ -855,16 +1898,32 @@ void reconnectOBS(v8::Isolate *isolate) {
 }
 
 void retryAfterTimeout(const v8::FunctionCallbackInfo<v8::Value>& args) {
-  gNeedsReconnect = true;
+  if (!tInstance->reconnectSuspended) {
+    tInstance->needsReconnect = true;
+  }
+}
+
+// setOBSConnection(connectionID, identified)
+//
+// Called by gettally.js as the OBS connection opens, is identified, and
+// closes (connectionID -1), so that submitted frames know where to go.
+void setOBSConnection(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  tInstance->OBSConnectionID = (int64_t)args[0]->NumberValue(context).FromMaybe(-1);
+  tInstance->OBSConnectionIdentified = tInstance->OBSConnectionID >= 0 && args[1]->BooleanValue(isolate);
 }
 
 void setPreviewToProgram(const v8::FunctionCallbackInfo<v8::Value>& args) {
-  for (int i = 0; i < gPreviewScenes.size(); i++) {
-    std::string scene = gPreviewScenes[i];
-    gProgramScenes.push_back(scene);
-    _setSceneIsProgram(scene.c_str());
+  std::vector<uint32_t> newProgramScenes(latestProgramScenes());
+  for (uint32_t sceneID : latestPreviewScenes()) {
+    if (std::find(newProgramScenes.begin(), newProgramScenes.end(), sceneID) ==
+        newProgramScenes.end()) {
+      newProgramScenes.push_back(sceneID);
+    }
   }
-  gPreviewScenes.clear();
+  updateScenes(std::vector<uint32_t>(), newProgramScenes);
 }
 
 void setProgramScene(const v8::FunctionCallbackInfo<v8::Value>& args) {
@@ -879,16 +1938,11 @@ void setProgramScene(const v8::FunctionCallbackInfo<v8::Value>& args) {
     return;
   }
 
-  v8::Local<v8::Context> context = isolate->GetCurrentContext();
-
-  std::vector<std::string> newProgramScenes;
-
   v8::Local<v8::Value> element = v8::Handle<v8::String>::Cast(args[0]);
   v8::String::Utf8Value programSceneUTF8(v8::Isolate::GetCurrent(), element);
-  std::string programSceneCPPString(*programSceneUTF8);
-  newProgramScenes.push_back(programSceneCPPString);
+  std::vector<uint32_t> newProgramScenes(1, tInstance->tallyState.names.Intern(*programSceneUTF8));
 
-  updateScenes(gPreviewScenes, newProgramScenes);
+  updateScenes(latestPreviewScenes(), newProgramScenes);
 }
 
 void setPreviewScene(const v8::FunctionCallbackInfo<v8::Value>& args) {
@@ -903,16 +1957,229 @@ void setPreviewScene(const v8::FunctionCallbackInfo<v8::Value>& args) {
     return;
   }
 
+  v8::Local<v8::Value> element = v8::Handle<v8::String>::Cast(args[0]);
+  v8::String::Utf8Value previewSceneUTF8(v8::Isolate::GetCurrent(), element);
+  std::vector<uint32_t> newPreviewScenes(1, tInstance->tallyState.names.Intern(*previewSceneUTF8));
+
+  updateScenes(newPreviewScenes, latestProgramScenes());
+}
+
+
+#pragma mark - Scene graph
+
+// Reads one scene item ({sceneItemId, sourceName, sceneItemEnabled}) as
+// returned by GetSceneItemList.  Items without an enabled flag (for example,
+// from SceneItemCreated) are assumed to be enabled, which is how OBS creates
+// them.
+bool sceneGraphItemFromV8(v8::Isolate *isolate, v8::Local<v8::Context> context,
+                          v8::Local<v8::Value> value, SceneGraphItem *item) {
+  if (!value->IsObject()) {
+    return false;
+  }
+  v8::Local<v8::Object> object = v8::Local<v8::Object>::Cast(value);
+
+  v8::Local<v8::Value> sceneItemID =
+      object->Get(context, v8::String::NewFromUtf8(isolate, "sceneItemId").ToLocalChecked()).ToLocalChecked();
+  v8::Local<v8::Value> sourceName =
+      object->Get(context, v8::String::NewFromUtf8(isolate, "sourceName").ToLocalChecked()).ToLocalChecked();
+  v8::Local<v8::Value> enabled =
+      object->Get(context, v8::String::NewFromUtf8(isolate, "sceneItemEnabled").ToLocalChecked()).ToLocalChecked();
+
+  if (!sceneItemID->IsNumber() || !sourceName->IsString()) {
+    return false;
+  }
+
+  v8::String::Utf8Value sourceNameUTF8(isolate, sourceName);
+  item->sceneItemID = sceneItemID->IntegerValue(context).ToChecked();
+  item->sourceName = std::string(*sourceNameUTF8);
+  item->enabled = enabled->IsBoolean() ? enabled->BooleanValue(isolate) : true;
+  return true;
+}
+
+// Held off while the graph is being reloaded, so that a half-loaded graph
+// never reports nested sources as inactive.
+void flushSceneGraph(void) {
+  if (tInstance->sceneGraphLoads > 0) {
+    return;
+  }
+  tInstance->sceneGraph.Flush([](const std::string &sourceName, bool onProgram, bool onPreview) {
+    reportSourceTally(sourceName.c_str(), onProgram, onPreview);
+  });
+}
+
+// setSceneItems(sceneName, sceneItems)
+void setSceneItems(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
   v8::Local<v8::Context> context = isolate->GetCurrentContext();
 
-  std::vector<std::string> newPreviewScenes;
+  if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsArray()) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: Scene name and item array expected").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value sceneNameUTF8(isolate, args[0]);
+  v8::Local<v8::Array> itemArray = v8::Local<v8::Array>::Cast(args[1]);
 
-  v8::Local<v8::Value> element = v8::Handle<v8::String>::Cast(args[0]);
-  v8::String::Utf8Value previewSceneUTF8(v8::Isolate::GetCurrent(), element);
-  std::string previewSceneCPPString(*previewSceneUTF8);
-  newPreviewScenes.push_back(previewSceneCPPString);
+  std::vector<SceneGraphItem> items;
+  for (uint32_t i = 0; i < itemArray->Length(); i++) {
+    SceneGraphItem item;
+    if (sceneGraphItemFromV8(isolate, context, itemArray->Get(context, i).ToLocalChecked(), &item)) {
+      items.push_back(item);
+    }
+  }
+
+  tInstance->sceneGraph.SetSceneItems(std::string(*sceneNameUTF8), items);
+  flushSceneGraph();
+}
+
+// addSceneItem(sceneName, sceneItem)
+void addSceneItem(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  SceneGraphItem item;
+  if (args.Length() != 2 || !args[0]->IsString() ||
+      !sceneGraphItemFromV8(isolate, context, args[1], &item)) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: Scene name and item expected").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value sceneNameUTF8(isolate, args[0]);
+  tInstance->sceneGraph.AddSceneItem(std::string(*sceneNameUTF8), item);
+  flushSceneGraph();
+}
+
+// removeSceneItem(sceneName, sceneItemId)
+void removeSceneItem(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsNumber()) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: Scene name and item ID expected").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value sceneNameUTF8(isolate, args[0]);
+  tInstance->sceneGraph.RemoveSceneItem(std::string(*sceneNameUTF8),
+                              args[1]->IntegerValue(context).ToChecked());
+  flushSceneGraph();
+}
+
+// setSceneItemEnabled(sceneName, sceneItemId, enabled)
+void setSceneItemEnabled(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  if (args.Length() != 3 || !args[0]->IsString() || !args[1]->IsNumber()) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: Scene name, item ID, and state expected").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value sceneNameUTF8(isolate, args[0]);
+  tInstance->sceneGraph.SetSceneItemEnabled(std::string(*sceneNameUTF8),
+                                  args[1]->IntegerValue(context).ToChecked(),
+                                  args[2]->BooleanValue(isolate));
+  flushSceneGraph();
+}
+
+// removeSceneFromGraph(sceneName)
+void removeSceneFromGraph(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+
+  if (args.Length() != 1 || !args[0]->IsString()) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: String expected").ToLocalChecked()));
+    return;
+  }
+
+  v8::String::Utf8Value sceneNameUTF8(isolate, args[0]);
+  tInstance->sceneGraph.RemoveScene(std::string(*sceneNameUTF8));
+  flushSceneGraph();
+}
+
+// renameSceneInGraph(oldSceneName, sceneName)
+void renameSceneInGraph(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+
+  if (args.Length() != 2 || !args[0]->IsString() || !args[1]->IsString()) {
+    isolate->ThrowException(v8::Exception::TypeError(
+        v8::String::NewFromUtf8(isolate, "Error: Old and new scene names expected").ToLocalChecked()));
+    return;
+  }
 
-  updateScenes(newPreviewScenes, gProgramScenes);
+  v8::String::Utf8Value oldNameUTF8(isolate, args[0]);
+  v8::String::Utf8Value newNameUTF8(isolate, args[1]);
+  tInstance->sceneGraph.RenameScene(std::string(*oldNameUTF8), std::string(*newNameUTF8));
+
+  // OBS doesn't send a scene change for a renamed program or preview scene,
+  // so the scene tally (and with it the graph's roots) follows here.
+  uint32_t oldSceneID;
+  if (tInstance->tallyState.names.Lookup(*oldNameUTF8, &oldSceneID)) {
+    uint32_t newSceneID = tInstance->tallyState.names.Intern(*newNameUTF8);
+    std::vector<uint32_t> newProgramScenes(latestProgramScenes());
+    std::vector<uint32_t> newPreviewScenes(latestPreviewScenes());
+    bool renamed = false;
+    for (std::vector<uint32_t> *scenes : { &newProgramScenes, &newPreviewScenes }) {
+      for (uint32_t &sceneID : *scenes) {
+        if (sceneID == oldSceneID) {
+          sceneID = newSceneID;
+          renamed = true;
+        }
+      }
+    }
+    if (renamed) {
+      updateScenes(newPreviewScenes, newProgramScenes);
+    }
+  }
+  flushSceneGraph();
+}
+
+// clearSceneGraph()
+// Starts a reload.  Source tally is held until the matching
+// finishSceneGraphLoad(), and then only what changed is reported.
+void clearSceneGraph(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  tInstance->sceneGraph.Clear();
+  tInstance->sceneGraph.SetRootScenes(kSceneGraphProgram, tInstance->tallyState.ProgramSceneNames());
+  tInstance->sceneGraph.SetRootScenes(kSceneGraphPreview, tInstance->tallyState.PreviewSceneNames());
+  tInstance->sceneGraphLoads++;
+}
+
+// finishSceneGraphLoad()
+// Called once per clearSceneGraph(), whether or not the reload succeeded.
+void finishSceneGraphLoad(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  if (tInstance->sceneGraphLoads > 0) {
+    tInstance->sceneGraphLoads--;
+  }
+  flushSceneGraph();
+}
+
+bool getOBSSourceTally(const char *sourceName, bool *onProgram, bool *onPreview) {
+  OBSTallyInstance *instance = gDefaultInstance.load();
+  std::string name(sourceName);
+  bool program = false;
+  bool preview = false;
+  if (instance != nullptr) {
+    program = instance->sceneGraph.IsOnOutput(name, kSceneGraphProgram);
+    preview = instance->sceneGraph.IsOnOutput(name, kSceneGraphPreview);
+  }
+
+  if (onProgram != nullptr) {
+    *onProgram = program;
+  }
+  if (onPreview != nullptr) {
+    *onPreview = preview;
+  }
+  return program || preview;
 }
 
 
@@ -920,19 +2187,23 @@ void setPreviewScene(const v8::FunctionCallbackInfo<v8::Value>& args) {
 
 void callConnectionError(uint32_t connectionID) {
   // Call didReceiveError on object.
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
   if (dataProviderGroup != nullptr) {
     dataProviderGroup->hasConnectionError = true;
   } else {
-    fprintf(stderr, "Can't report connection error (NULL dataProviderGroup)\n");
+    OBSLOG(kOBSLogError, "Can't report connection error (NULL dataProviderGroup)\n");
   }
 }
 
 void callConnectionDidOpen(int connectionID, v8::Isolate *isolate) {
+  TraceSpan span("_didOpen");
   v8::HandleScope handle_scope(isolate);
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
 
   v8::Local<v8::String> methodName =
       v8::String::NewFromUtf8(isolate, "_didOpen").ToLocalChecked();
@@ -947,9 +2218,13 @@ void callConnectionDidOpen(int connectionID, v8::Isolate *isolate) {
 
 void callConnectionDidClose(int connectionID, v8::Isolate *isolate, int codeNumber,
                             std::string *reason) {
+  TraceSpan span("_connectionDidClose");
   v8::HandleScope handle_scope(isolate);
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
 
   v8::Local<v8::String> methodName =
       v8::String::NewFromUtf8(isolate, "_connectionDidClose").ToLocalChecked();
@@ -978,9 +2253,13 @@ void callConnectionDidClose(int connectionID, v8::Isolate *isolate, int codeNumb
 }
 
 void callHasConnectionError(int connectionID, v8::Isolate *isolate) {
+  TraceSpan span("_didReceiveError");
   v8::HandleScope handle_scope(isolate);
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
 
   v8::Local<v8::String> methodName =
       v8::String::NewFromUtf8(isolate, "_didReceiveError").ToLocalChecked();
@@ -993,10 +2272,34 @@ void callHasConnectionError(int connectionID, v8::Isolate *isolate) {
   v8::Local<v8::Value> result = method->Call(context, localObject, 0, nullptr).ToLocalChecked();
 }
 
+void callConnectionDidDrain(int connectionID, v8::Isolate *isolate) {
+  TraceSpan span("_connectionDidDrain");
+  v8::HandleScope handle_scope(isolate);
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
+
+  v8::Local<v8::String> methodName =
+      v8::String::NewFromUtf8(isolate, "_connectionDidDrain").ToLocalChecked();
+
+  v8::Persistent<v8::Object> *object = dataProviderGroup->jsObject;
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Local<v8::Function> method = v8::Local<v8::Function>::Cast(object->Get(isolate)->Get(context, methodName).ToLocalChecked());
+
+  v8::Local<v8::Object> localObject = v8::Local<v8::Object>::New(isolate, *object);
+  v8::Local<v8::Value> result = method->Call(context, localObject, 0, nullptr).ToLocalChecked();
+}
+
 void sendPendingDataToClient(int connectionID, v8::Isolate *isolate) {
+  TraceSpan span("sendPendingDataToClient");
   v8::HandleScope handle_scope(isolate);
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
 
   v8::Local<v8::String> methodName =
       v8::String::NewFromUtf8(isolate, "_connectionDidReceiveData").ToLocalChecked();
@@ -1007,119 +2310,586 @@ void sendPendingDataToClient(int connectionID, v8::Isolate *isolate) {
 
   WebSocketsDataItem *dataItem;
   while (dataProviderGroup->incomingData.getPendingData(&dataItem)) {
+    TraceSpan messageSpan("_connectionDidReceiveData");
+    v8::Local<v8::Value> args[1];
 
-    uint8_t *buf = dataItem->GetBuf();
-    size_t length = dataItem->GetLength();
-
-#ifdef SEND_AS_BINARY
-    v8::Local<v8::ArrayBuffer> dataArray =
-        v8::Local<v8::ArrayBuffer>::New(isolate, v8::ArrayBuffer::New(isolate, length));
-
-    for (size_t i = 0; i < length; i++) {
-      dataArray->Set(context, v8::Number::New(isolate, i),
-                 v8::Integer::New(isolate, buf[i])).Check();
+    if (dataItem->IsBinary()) {
+      // Hand the receive buffer to V8 as-is.  The backing store returns it
+      // to the pool when the ArrayBuffer is garbage collected.
+      size_t length = dataItem->GetLength();
+      uint8_t *buf = dataItem->ReleaseBuf();
+      std::unique_ptr<v8::BackingStore> backingStore =
+          v8::ArrayBuffer::NewBackingStore(buf, length, bufferPoolBackingStoreDeleter,
+                                           nullptr);
+      args[0] = v8::ArrayBuffer::New(isolate, std::move(backingStore));
+    } else {
+      args[0] = v8::String::NewFromUtf8(isolate, (const char *)dataItem->GetBuf(),
+                                        v8::NewStringType::kNormal,
+                                        (int)dataItem->GetLength()).ToLocalChecked();
     }
-#else
-    // char *dataCString = malloc(length + 1);
-    // bcopy(buf, dataCString);
-    // buf[length] '\0';
-
-    v8::Local<v8::String> dataString =
-        v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), (const char *)buf,
-                                v8::NewStringType::kNormal, length)
-            .ToLocalChecked();
-#endif
-
-    v8::Local<v8::Value> args[1];
-#ifdef SEND_AS_BINARY
-    args[0] = dataArray;
-#else
-    args[0] = dataString;
-#endif
+    uint64_t receivedAt = dataItem->receivedAt;
+    delete dataItem;
 
     v8::Local<v8::Object> localObject = v8::Local<v8::Object>::New(isolate, *object);
+    uint64_t startTime = monotonicMicroseconds();
+    tInstance->dispatchingReceiveTime = receivedAt;
     v8::Local<v8::Value> result = method->Call(context, localObject, 1, args).ToLocalChecked();
+    tInstance->dispatchingReceiveTime = 0;
+    recordJSDispatch(monotonicMicroseconds() - startTime);
   }
 }
 
 
-#pragma mark LibWebSockets handling
+#pragma mark - Request batches
 
-int websocketLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t length) {
-  uint32_t connectionID = connectionIDForWSI(wsi);
+OBSRequestBatch *createOBSRequestBatch(OBSBatchExecutionType executionType,
+                                       bool haltOnFailure) {
+  OBSRequestBatch *batch = new OBSRequestBatch();
+  batch->executionType = executionType;
+  batch->haltOnFailure = haltOnFailure;
+  return batch;
+}
+
+bool addOBSBatchRequest(OBSRequestBatch *batch, const char *requestType,
+                        const char *requestDataJSON,
+                        OBSRequestCallback callback, void *context) {
+  if (batch == nullptr || requestType == nullptr) {
+    return false;
+  }
+  OBSBatchRequest request;
+  request.requestType = requestType;
+  request.requestDataJSON = requestDataJSON ? requestDataJSON : "";
+  request.callback = callback;
+  request.context = context;
+  request.completed = false;
+  batch->requests.push_back(request);
+  return true;
+}
 
-  std::lock_guard<std::recursive_mutex> guard(connection_mutex);
-  WebSocketsContextData *dataProviderGroup = connectionData[connectionID];
+void discardOBSRequestBatch(OBSRequestBatch *batch) {
+  delete batch;
+}
 
-  if (dataProviderGroup == nullptr) {
-    GENERALDEBUG("Closing connection because data provider group is NULL.\n");
-    return -1;
+// Reports failure for every request that has not yet been answered, then
+// frees the batch.
+void failOBSRequestBatch(OBSRequestBatch *batch, const char *comment) {
+  for (OBSBatchRequest &request : batch->requests) {
+    if (!request.completed && request.callback != nullptr) {
+      request.completed = true;
+      request.callback(request.requestType.c_str(), false, -1, comment, NULL,
+                       request.context);
+    }
   }
-  if (wsi) {
-    WSIDEBUG("Will set WSI to 0x%p\n", wsi);
-    dataProviderGroup->SetWSI(wsi);
+  delete batch;
+}
+
+bool sendOBSRequestBatch(OBSRequestBatch *batch) {
+  if (batch == nullptr) {
+    return false;
   }
 
-  switch (reason) {
-    case LWS_CALLBACK_WSI_CREATE:
-      CBDEBUG("@@@ Got callback LWS_CALLBACK_WSI_CREATE\n");
-      dataProviderGroup->SetWSI(wsi);
-      break;
-    case LWS_CALLBACK_WSI_DESTROY:
-      CBDEBUG("@@@ Got callback LWS_CALLBACK_WSI_DESTROY\n");
-      dataProviderGroup->SetWSI(nullptr);
-      break;
-    case LWS_CALLBACK_CLIENT_ESTABLISHED:
-      CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_ESTABLISHED\n");
-    case LWS_CALLBACK_RAW_CONNECTED:
-      CBDEBUG("@@@ Got callback LWS_CALLBACK_RAW_CONNECTED\n");
-      setConnectionState(connectionID, kConnectionStateConnected);
-      dataProviderGroup->connectionDidOpen = true;
-      if (dataProviderGroup->activeProtocolName != NULL) {
-        break;
+  v8::Isolate *isolate = v8::Isolate::GetCurrent();
+  if (isolate == nullptr || tInstance == nullptr) {
+    failOBSRequestBatch(batch, "V8 is not running");
+    return false;
+  }
+
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::TryCatch tryCatch(isolate);
+
+  v8::Local<v8::Array> requests = v8::Array::New(isolate, (int)batch->requests.size());
+  for (size_t i = 0; i < batch->requests.size(); i++) {
+    OBSBatchRequest &request = batch->requests[i];
+    v8::Local<v8::Object> requestObject = v8::Object::New(isolate);
+
+    requestObject->Set(context,
+        v8::String::NewFromUtf8(isolate, "requestType").ToLocalChecked(),
+        v8::String::NewFromUtf8(isolate, request.requestType.c_str()).ToLocalChecked()).Check();
+
+    if (!request.requestDataJSON.empty()) {
+      v8::Local<v8::Value> requestData;
+      v8::Local<v8::String> JSONString =
+          v8::String::NewFromUtf8(isolate, request.requestDataJSON.c_str()).ToLocalChecked();
+      if (!v8::JSON::Parse(context, JSONString).ToLocal(&requestData)) {
+        OBSLOG(kOBSLogError, "Invalid requestData JSON for %s.\n", request.requestType.c_str());
+        failOBSRequestBatch(batch, "Invalid requestData JSON");
+        return false;
       }
-      // Fall through and set the active protocol.
-    case LWS_CALLBACK_CLIENT_HTTP_BIND_PROTOCOL:
-    case LWS_CALLBACK_WS_CLIENT_BIND_PROTOCOL:
-      CBDEBUG("@@@ Got callback LWS_CALLBACK_WS_CLIENT_BIND_PROTOCOL\n");
-    case LWS_CALLBACK_RAW_SKT_BIND_PROTOCOL:
-    {
-      CBDEBUG("@@@ Got callback LWS_CALLBACK_RAW_SKT_BIND_PROTOCOL\n");
-      const struct lws_protocols *protocol = lws_get_protocol(wsi);
-      dataProviderGroup->activeProtocolName = new std::string(protocol->name);
-      break;
+      requestObject->Set(context,
+          v8::String::NewFromUtf8(isolate, "requestData").ToLocalChecked(),
+          requestData).Check();
     }
-    case LWS_CALLBACK_WS_PEER_INITIATED_CLOSE:
-    {
-      uint16_t *value = (uint16_t *)in;
-      dataProviderGroup->codeNumber = htons(*value);
+    requests->Set(context, (uint32_t)i, requestObject).Check();
+  }
 
-      if (length > 2) {
-        char *tempString = (char *)malloc(length - 1);
-        bcopy((void *)((uint8_t *)in + 2), tempString, length - 2);
-        tempString[length - 2] = '\0';
-        dataProviderGroup->reason = new std::string(tempString);
+  batch->batchID = tInstance->nextBatchID++;
+  tInstance->pendingRequestBatches[batch->batchID] = batch;
+
+  v8::Local<v8::String> functionName =
+      v8::String::NewFromUtf8(isolate, "sendNativeRequestBatch").ToLocalChecked();
+  v8::Local<v8::Object> global = context->Global();
+  v8::Local<v8::Value> functionAsValue = global->Get(context, functionName).ToLocalChecked();
+  v8::Local<v8::Function> function = v8::Local<v8::Function>::Cast(functionAsValue);
+
+  v8::Local<v8::Value> args[4];
+  args[0] = v8::Integer::NewFromUnsigned(isolate, batch->batchID);
+  args[1] = v8::Integer::New(isolate, batch->executionType);
+  args[2] = v8::Boolean::New(isolate, batch->haltOnFailure);
+  args[3] = requests;
+
+  uint32_t batchID = batch->batchID;
+  v8::Local<v8::Value> result;
+  if (!function->Call(context, global, 4, args).ToLocal(&result)) {
+    // The script never got far enough to take ownership of the batch.
+    auto iterator = tInstance->pendingRequestBatches.find(batchID);
+    if (iterator != tInstance->pendingRequestBatches.end()) {
+      tInstance->pendingRequestBatches.erase(iterator);
+      failOBSRequestBatch(batch, "Exception while sending batch");
+    }
+    return false;
+  }
+  return result->BooleanValue(isolate);
+}
+
+// completeNativeBatchRequest(batchID, index, succeeded, code, comment, responseDataJSON)
+void completeNativeBatchRequest(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+  uint32_t batchID = args[0]->Uint32Value(context).ToChecked();
+  uint32_t index = args[1]->Uint32Value(context).ToChecked();
+  bool succeeded = args[2]->BooleanValue(isolate);
+  int32_t code = args[3]->Int32Value(context).FromMaybe(-1);
+
+  auto iterator = tInstance->pendingRequestBatches.find(batchID);
+  if (iterator == tInstance->pendingRequestBatches.end() ||
+      index >= iterator->second->requests.size()) {
+    return;
+  }
+  OBSBatchRequest &request = iterator->second->requests[index];
+  if (request.completed) {
+    return;
+  }
+  request.completed = true;
+  if (request.callback == nullptr) {
+    return;
+  }
+
+  v8::String::Utf8Value commentUTF8(isolate, args[4]);
+  bool hasResponseData = args.Length() > 5 && args[5]->IsString();
+  v8::String::Utf8Value responseDataUTF8(isolate, args[5]);
+
+  request.callback(request.requestType.c_str(), succeeded, code,
+                   *commentUTF8 ? *commentUTF8 : "",
+                   hasResponseData ? *responseDataUTF8 : NULL,
+                   request.context);
+}
+
+// finishNativeRequestBatch(batchID)
+void finishNativeRequestBatch(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  uint32_t batchID = args[0]->Uint32Value(context).ToChecked();
+
+  auto iterator = tInstance->pendingRequestBatches.find(batchID);
+  if (iterator == tInstance->pendingRequestBatches.end()) {
+    return;
+  }
+  OBSRequestBatch *batch = iterator->second;
+  tInstance->pendingRequestBatches.erase(iterator);
+  failOBSRequestBatch(batch, "Request not executed");
+}
+
+
+#pragma mark - Commands from other threads
+
+static bool submitOBSCommand(OBSCommand *command) {
+  OBSCommand *head = gSubmittedCommands.load(std::memory_order_relaxed);
+  do {
+    command->next = head;
+  } while (!gSubmittedCommands.compare_exchange_weak(head, command,
+                                                     std::memory_order_seq_cst,
+                                                     std::memory_order_relaxed));
+
+  struct lws_context *context = gServicingContext.load(std::memory_order_seq_cst);
+  if (context != nullptr) {
+    lws_cancel_service(context);
+  }
+  return true;
+}
+
+static OBSCommand *newOBSCommand(OBSCommandKind kind) {
+  OBSCommand *command = new OBSCommand();
+  command->kind = kind;
+  command->frame = nullptr;
+  command->batch = nullptr;
+  command->path = nullptr;
+  command->samplingInterval = 0;
+  command->next = nullptr;
+  return command;
+}
+
+bool submitOBSRawFrame(const char *text, size_t length) {
+  if (text == nullptr) {
+    return false;
+  }
+  OBSCommand *command = newOBSCommand(kOBSCommandSendFrame);
+  command->frame = new WebSocketsDataItem(length, false, LWS_PRE);
+  memcpy(command->frame->GetBuf(), text, length);
+  return submitOBSCommand(command);
+}
+
+bool submitOBSRequestBatch(OBSRequestBatch *batch) {
+  if (batch == nullptr) {
+    return false;
+  }
+  OBSCommand *command = newOBSCommand(kOBSCommandSendBatch);
+  command->batch = batch;
+  return submitOBSCommand(command);
+}
+
+bool submitOBSRequest(const char *requestType, const char *requestDataJSON,
+                      OBSRequestCallback callback, void *context) {
+  OBSRequestBatch *batch = createOBSRequestBatch(kOBSBatchExecutionSerialRealtime, false);
+  if (!addOBSBatchRequest(batch, requestType, requestDataJSON, callback, context)) {
+    discardOBSRequestBatch(batch);
+    return false;
+  }
+  return submitOBSRequestBatch(batch);
+}
+
+bool submitOBSClose(void) {
+  return submitOBSCommand(newOBSCommand(kOBSCommandClose));
+}
+
+bool submitOBSReconnect(void) {
+  return submitOBSCommand(newOBSCommand(kOBSCommandReconnect));
+}
+
+bool startOBSCPUProfile(uint32_t samplingIntervalMicroseconds) {
+  OBSCommand *command = newOBSCommand(kOBSCommandStartCPUProfile);
+  command->samplingInterval = samplingIntervalMicroseconds;
+  return submitOBSCommand(command);
+}
+
+static bool submitOBSPathCommand(OBSCommandKind kind, const char *path) {
+  if (path == nullptr) {
+    return false;
+  }
+  OBSCommand *command = newOBSCommand(kind);
+  command->path = strdup(path);
+  if (command->path == nullptr) {
+    delete command;
+    return false;
+  }
+  return submitOBSCommand(command);
+}
+
+bool stopOBSCPUProfile(const char *path) {
+  return submitOBSPathCommand(kOBSCommandStopCPUProfile, path);
+}
+
+bool writeOBSHeapSnapshot(const char *path) {
+  return submitOBSPathCommand(kOBSCommandWriteHeapSnapshot, path);
+}
+
+static void closeAllConnections(void) {
+  std::vector<std::pair<uint32_t, WebSocketsContextData *>> connections;
+  for (std::pair<uint32_t, WebSocketsContextData *> element : tInstance->connectionData) {
+    if (element.second != nullptr) {
+      connections.push_back(element);
+    }
+  }
+  for (std::pair<uint32_t, WebSocketsContextData *> element : connections) {
+    requestConnectionClose(element.first);
+    WebSocketsContextData *dataProviderGroup = element.second;
+    if (dataProviderGroup->wsi != nullptr) {
+      // Any callback will do; this makes sure one comes soon.
+      lws_callback_on_writable(dataProviderGroup->wsi);
+    }
+  }
+}
+
+// The V8 heap came close to its limit.  Drop the queued events (the
+// reconnect fetches the current scenes anyway) and reopen the connection,
+// so that whatever obs-websocket.js was holding can be collected.
+void shedLoadForHeapLimit(v8::Isolate *isolate) {
+  OBSLOG(kOBSLogError, "V8 heap is near its limit; dropping queued events and reconnecting.\n");
+  for (std::pair<uint32_t, WebSocketsContextData *> element : tInstance->connectionData) {
+    WebSocketsContextData *dataProviderGroup = element.second;
+    WebSocketsDataItem *event;
+    while ((event = dataProviderGroup->incomingData.removeOldestEvent()) != nullptr) {
+      {
+        std::lock_guard<std::mutex> guard(gStatisticsMutex);
+        gReceiveStatistics.droppedMessages++;
+        gReceiveStatistics.droppedBytes += event->GetLength();
+      }
+      countReceiveDrop(dataProviderGroup->metrics);
+      delete event;
+    }
+  }
+  if (!tInstance->reconnectSuspended) {
+    tInstance->needsReconnect = true;
+    tInstance->reconnectImmediately = true;
+    closeAllConnections();
+  }
+  recoverFromHeapLimit(tInstance->heapControl, isolate);
+}
+
+static void runOBSCommand(OBSCommand *command) {
+  switch (command->kind) {
+    case kOBSCommandSendFrame:
+      if (tInstance->OBSConnectionID < 0 || !tInstance->OBSConnectionIdentified) {
+        OBSLOG(kOBSLogWarning, "Dropping submitted frame: OBS is not connected.\n");
+        delete command->frame;
+      } else if (queueOutgoingDataItem((uint32_t)tInstance->OBSConnectionID, command->frame) !=
+                 kSendResultQueued) {
+        OBSLOG(kOBSLogWarning, "Dropping submitted frame: send queue is full.\n");
+      }
+      break;
+    case kOBSCommandSendBatch:
+      // Failures are reported through the request callbacks.
+      sendOBSRequestBatch(command->batch);
+      break;
+    case kOBSCommandClose:
+      tInstance->reconnectSuspended = true;
+      tInstance->needsReconnect = false;
+      closeAllConnections();
+      break;
+    case kOBSCommandReconnect:
+      tInstance->reconnectSuspended = false;
+      tInstance->needsReconnect = true;
+      tInstance->reconnectImmediately = true;
+      closeAllConnections();
+      break;
+    case kOBSCommandStartCPUProfile:
+      startCPUProfile(v8::Isolate::GetCurrent(), command->samplingInterval);
+      break;
+    case kOBSCommandStopCPUProfile:
+      stopCPUProfile(v8::Isolate::GetCurrent(), command->path);
+      break;
+    case kOBSCommandWriteHeapSnapshot:
+      writeHeapSnapshot(v8::Isolate::GetCurrent(), command->path);
+      break;
+  }
+  free(command->path);
+  delete command;
+}
+
+// Runs everything submitted since the last call, oldest first.
+void runSubmittedCommands(v8::Isolate *isolate) {
+  OBSCommand *command = gSubmittedCommands.exchange(nullptr, std::memory_order_acquire);
+  if (command == nullptr) {
+    return;
+  }
+  TraceSpan span("runSubmittedCommands");
+
+  OBSCommand *oldestFirst = nullptr;
+  while (command != nullptr) {
+    OBSCommand *next = command->next;
+    command->next = oldestFirst;
+    oldestFirst = command;
+    command = next;
+  }
+
+  v8::HandleScope handle_scope(isolate);
+  while (oldestFirst != nullptr) {
+    OBSCommand *next = oldestFirst->next;
+    runOBSCommand(oldestFirst);
+    oldestFirst = next;
+  }
+}
+
+
+#pragma mark LibWebSockets handling
+
+// Every worker's context calls this.  The connection's ConnectionRef says
+// which instance it belongs to; that instance is made current for the
+// duration of the callback.
+int websocketLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t length) {
+  if (reason == LWS_CALLBACK_EVENT_WAIT_CANCELLED) {
+    // Woken by submitOBSCommand() or wakeWorker().  The wsi is the
+    // context's internal one, not a connection's, so don't record it.
+    return 0;
+  }
+
+  ConnectionRef *connectionRef = (ConnectionRef *)lws_get_opaque_user_data(wsi);
+  if (connectionRef == nullptr) {
+    return 0;
+  }
+  if (connectionRef->instance == nullptr) {
+    // The instance has been destroyed; let the socket go.
+    if (reason == LWS_CALLBACK_WSI_DESTROY) {
+      lws_set_opaque_user_data(wsi, NULL);
+      delete connectionRef;
+      return 0;
+    }
+    return -1;
+  }
+
+  OBSTallyInstance *previousInstance = tInstance;
+  tInstance = connectionRef->instance;
+  int result = connectionLWSCallback(wsi, reason, connectionRef->connectionID, in, length);
+  tInstance = previousInstance;
+
+  if (reason == LWS_CALLBACK_WSI_DESTROY) {
+    connectionRef->instance->connectionRefs.erase(connectionRef);
+    lws_set_opaque_user_data(wsi, NULL);
+    delete connectionRef;
+  }
+  return result;
+}
+
+// The subprotocol JavaScript asked for.  Every connection binds to the
+// worker context's single protocol, so lws_get_protocol() can't say.
+static const char *requestedProtocolName(WebSocketsContextData *dataProviderGroup) {
+  if (dataProviderGroup->protocols == nullptr || dataProviderGroup->protocols[0].name == nullptr) {
+    return "";
+  }
+  return dataProviderGroup->protocols[0].name;
+}
+
+static void setActiveProtocolName(WebSocketsContextData *dataProviderGroup, const char *name) {
+  delete dataProviderGroup->activeProtocolName;
+  dataProviderGroup->activeProtocolName = new std::string(name);
+}
+
+int connectionLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, uint32_t connectionID,
+                          void *in, size_t length) {
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+
+  if (dataProviderGroup == nullptr) {
+    GENERALDEBUG("Closing connection because data provider group is NULL.\n");
+    return -1;
+  }
+  if (wsi) {
+    WSIDEBUG("Will set WSI to 0x%p\n", wsi);
+    dataProviderGroup->SetWSI(wsi);
+  }
+
+  switch (reason) {
+    case LWS_CALLBACK_WSI_CREATE:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_WSI_CREATE\n");
+      dataProviderGroup->SetWSI(wsi);
+      break;
+    case LWS_CALLBACK_WSI_DESTROY:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_WSI_DESTROY\n");
+      dataProviderGroup->SetWSI(nullptr);
+      break;
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_ESTABLISHED\n");
+      applyCompressionLevel(wsi);
+      {
+        const char *protocolName = (dataProviderGroup->activeProtocolName != NULL) ?
+            dataProviderGroup->activeProtocolName->c_str() : requestedProtocolName(dataProviderGroup);
+        captureOBSFrame(kOBSCaptureOpened, connectionID, 0, protocolName, strlen(protocolName));
+      }
+    case LWS_CALLBACK_RAW_CONNECTED:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_RAW_CONNECTED\n");
+      setConnectionState(connectionID, kConnectionStateConnected);
+      dataProviderGroup->connectionDidOpen = true;
+      if (dataProviderGroup->activeProtocolName != NULL) {
+        break;
+      }
+      // Fall through and set the active protocol.
+    case LWS_CALLBACK_CLIENT_HTTP_BIND_PROTOCOL:
+    case LWS_CALLBACK_WS_CLIENT_BIND_PROTOCOL:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_WS_CLIENT_BIND_PROTOCOL\n");
+    case LWS_CALLBACK_RAW_SKT_BIND_PROTOCOL:
+    {
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_RAW_SKT_BIND_PROTOCOL\n");
+      // For WebSocket connections, replaced by the server's choice before
+      // the connection opens.
+      setActiveProtocolName(dataProviderGroup, requestedProtocolName(dataProviderGroup));
+      break;
+    }
+    case LWS_CALLBACK_WS_PEER_INITIATED_CLOSE:
+    {
+      uint16_t *value = (uint16_t *)in;
+      dataProviderGroup->codeNumber = htons(*value);
+
+      if (length > 2) {
+        char *tempString = (char *)malloc(length - 1);
+        bcopy((void *)((uint8_t *)in + 2), tempString, length - 2);
+        tempString[length - 2] = '\0';
+        dataProviderGroup->reason = new std::string(tempString);
         free(tempString);
       }
       // Fall through.
     }
     case LWS_CALLBACK_CLOSED:
       CBDEBUG("@@@ Got callback LWS_CALLBACK_CLOSED\n");
+    case LWS_CALLBACK_CLIENT_CLOSED:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_CLOSED\n");
     case LWS_CALLBACK_RAW_CLOSE:
       CBDEBUG("@@@ Got callback LWS_CALLBACK_RAW_CLOSED\n");
+      if (!dataProviderGroup->connectionDidClose) {
+        captureClose(connectionID, dataProviderGroup);
+      }
       setConnectionState(connectionID, kConnectionStateClosed);
       dataProviderGroup->connectionDidClose = true;
       break;
     case LWS_CALLBACK_CLIENT_RECEIVE:
     {
       CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_RECEIVE\n");
-      WebSocketsDataItem *item = new WebSocketsDataItem((uint8_t *)in, length, true);
+      captureOBSFrame(kOBSCaptureReceived, connectionID,
+                      (lws_frame_is_binary(wsi) ? kOBSCaptureBinary : 0) |
+                      (lws_is_first_fragment(wsi) ? kOBSCaptureFirstFragment : 0) |
+                      (lws_is_final_fragment(wsi) ? kOBSCaptureFinalFragment : 0),
+                      in, length);
+      countFrameReceived(dataProviderGroup->metrics, length);
+
+      // lws hands over at most rx_buffer_size bytes at a time, and a
+      // message may span several frames; JavaScript only sees whole ones.
+      std::vector<uint8_t> &partialMessage = dataProviderGroup->partialMessage;
+      bool isLastPiece = lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0;
+      if (partialMessage.empty()) {
+        dataProviderGroup->partialMessageIsBinary = lws_frame_is_binary(wsi);
+      }
+      if (!isLastPiece || !partialMessage.empty()) {
+        if (partialMessage.size() + length > dataProviderGroup->receiveLimits.maxBytes) {
+          OBSLOG(kOBSLogError, "Closing connection %u: message over %zu bytes.\n",
+                 connectionID, dataProviderGroup->receiveLimits.maxBytes);
+          return -1;
+        }
+        partialMessage.insert(partialMessage.end(), (uint8_t *)in, (uint8_t *)in + length);
+        if (!isLastPiece) {
+          break;
+        }
+      }
+
+      WebSocketsDataItem *item;
+      if (partialMessage.empty()) {
+        item = new WebSocketsDataItem((uint8_t *)in, length, lws_frame_is_binary(wsi));
+      } else {
+        item = new WebSocketsDataItem(partialMessage.data(), partialMessage.size(),
+                                      dataProviderGroup->partialMessageIsBinary);
+        std::vector<uint8_t>().swap(partialMessage);  // Give back the memory.
+      }
+      item->receivedAt = monotonicMicroseconds();
       CBDEBUG("@@@ Mid-callback.\n");
-      dataProviderGroup->incomingData.addPendingData(item);
+      receiveIncomingDataItem(dataProviderGroup, wsi, item);
       CBDEBUG("@@@ Leaving callback.\n");
 
       break;
     }
+    case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_RECEIVE_PONG\n");
+      // Any pong shows the peer is alive, but only ours carry a send time.
+      dataProviderGroup->awaitingPong = false;
+      dataProviderGroup->missedPongs = 0;
+      if (length == sizeof(uint64_t)) {
+        uint64_t sendTime;
+        memcpy(&sendTime, in, sizeof(sendTime));
+        uint64_t now = monotonicMicroseconds();
+        if (sendTime <= now) {
+          recordRoundTrip(dataProviderGroup, now - sendTime);
+        }
+      }
+      break;
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
       CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_CONNECTION_ERROR\n");
 
@@ -1139,38 +2909,65 @@ int websocketLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, void
     case LWS_CALLBACK_CLIENT_WRITEABLE:
     {
       CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_WRITEABLE\n");
+      if (dataProviderGroup->needsPing) {
+        // The payload is the send time, echoed back in the pong.
+        uint8_t pingFrame[LWS_PRE + sizeof(uint64_t)];
+        uint64_t sendTime = monotonicMicroseconds();
+        memcpy(pingFrame + LWS_PRE, &sendTime, sizeof(sendTime));
+
+        dataProviderGroup->needsPing = false;
+        if (lws_write(wsi, pingFrame + LWS_PRE, sizeof(sendTime), LWS_WRITE_PING) < 0) {
+          CBDEBUG("Closing connection because of ping failure.\n");
+          return -1;
+        }
+        dataProviderGroup->keepalive.pingsSent++;
+        {
+          std::lock_guard<std::mutex> statisticsGuard(gStatisticsMutex);
+          gKeepaliveStatistics.pingsSent++;
+        }
+
+        if (dataProviderGroup->outgoingData.PendingCount() > 0) {
+          lws_callback_on_writable(wsi);
+        }
+        break;
+      }
+
       WebSocketsDataItem *item = NULL;
       if (dataProviderGroup->outgoingData.getPendingData(&item)) {
-        size_t bytesWritten = (int)lws_write(wsi, (unsigned char *)item->GetBuf(),
-                                item->GetLength(),
-                                item->IsBinary() ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
-          if (bytesWritten < 0) {
-            CBDEBUG("Closing connection because of write failure.\n");
-            return -1;
-          } else if (bytesWritten < item->GetLength()) {
-            lwsl_err("Partial write LWS_CALLBACK_CLIENT_WRITEABLE\n");
-          }
+        // Outgoing items have LWS_PRE bytes of headroom in front of GetBuf().
+        int bytesWritten = lws_write(wsi, (unsigned char *)item->GetBuf(),
+                                     item->GetLength(),
+                                     item->IsBinary() ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+        size_t itemLength = item->GetLength();
+        if (bytesWritten >= 0) {
+          captureOBSFrame(kOBSCaptureSent, connectionID,
+                          item->IsBinary() ? kOBSCaptureBinary : 0,
+                          item->GetBuf(), itemLength);
+          countFrameSent(dataProviderGroup->metrics, itemLength);
+        }
+        delete item;
+
+        if (bytesWritten < 0) {
+          CBDEBUG("Closing connection because of write failure.\n");
+          return -1;
+        } else if ((size_t)bytesWritten < itemLength) {
+          lwsl_err("Partial write LWS_CALLBACK_CLIENT_WRITEABLE\n");
+        }
+        size_t pendingBytes = dataProviderGroup->outgoingData.PendingBytes();
+        if (dataProviderGroup->aboveHighWatermark &&
+            pendingBytes <= dataProviderGroup->lowWatermark) {
+          dataProviderGroup->aboveHighWatermark = false;
+          dataProviderGroup->needsDrainEvent = true;
+        }
+        if (dataProviderGroup->outgoingData.PendingCount() > 0) {
+          lws_callback_on_writable(wsi);
+        }
       }
       break;
     }
     case LWS_CALLBACK_CLIENT_CONFIRM_EXTENSION_SUPPORTED:
       CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_CONFIRM_EXTENSION_SUPPORTED\n");
-#ifdef SUPPORT_DEFLATE
-      if ((strcmp((const char *)in, "deflate-stream") == 0) &&
-        deny_deflate) {
-          lwsl_notice("denied deflate-stream extension\n");
-          CBDEBUG("Extension deflate-stream detected.  Returning 1.\n");
-          return 1;
-      }
-      if ((strcmp((const char *)in, "x-webkit-deflate-frame") == 0)) {
-        CBDEBUG("Extension x-webkit-deflate-frame detected.  Returning 1.\n");
-        return 1;
-      }
-      if ((strcmp((const char *)in, "deflate-frame") == 0)) {
-        CBDEBUG("Extension deflate-frame detected.  Returning 1.\n");
-        return 1;
-      }
-#endif
+      // supportedExtensions() only lists what we want to offer.
       return 0;
     case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_CLIENT_VERIFY_CERTS:
       // If certs don't verify on their own, let them fail.
@@ -1203,8 +3000,30 @@ int websocketLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, void
         CBDEBUG("Ignoring callback LWS_CALLBACK_VHOST_CERT_AGING\n");
         break;
     case LWS_CALLBACK_CLIENT_FILTER_PRE_ESTABLISH:
-        CBDEBUG("Ignoring callback LWS_CALLBACK_CLIENT_FILTER_PRE_ESTABLISH\n");
-        break;
+    {
+      // The response headers are only available until the connection is
+      // established, so keep the negotiated extensions and subprotocol for
+      // later.
+      CBDEBUG("@@@ Got callback LWS_CALLBACK_CLIENT_FILTER_PRE_ESTABLISH\n");
+      int headerLength = lws_hdr_total_length(wsi, WSI_TOKEN_EXTENSIONS);
+      if (headerLength > 0) {
+        std::string extensions(headerLength + 1, '\0');
+        lws_hdr_copy(wsi, &extensions[0], headerLength + 1, WSI_TOKEN_EXTENSIONS);
+        extensions.resize(strlen(extensions.c_str()));
+        dataProviderGroup->negotiatedExtensions = extensions;
+      }
+
+      // No Sec-WebSocket-Protocol header means the server picked none.
+      std::string protocol;
+      headerLength = lws_hdr_total_length(wsi, WSI_TOKEN_PROTOCOL);
+      if (headerLength > 0) {
+        protocol.assign(headerLength + 1, '\0');
+        lws_hdr_copy(wsi, &protocol[0], headerLength + 1, WSI_TOKEN_PROTOCOL);
+        protocol.resize(strlen(protocol.c_str()));
+      }
+      setActiveProtocolName(dataProviderGroup, protocol.c_str());
+      break;
+    }
     default:
         CBDEBUG("Ignoring callback %d\n", reason);
         break;
@@ -1220,10 +3039,677 @@ int websocketLWSCallback(struct lws *wsi, enum lws_callback_reasons reason, void
 // Ignoring callback 61
 // Ignoring callback 72 LWS_CALLBACK_VHOST_CERT_AGING
 
-uint32_t connectionIDForWSI(struct lws *wsi) {
-  struct lws_context *context = lws_get_context(wsi);
-  uint32_t *connectionIDRef = (uint32_t *)lws_context_user(context);
-  return *connectionIDRef;
+// Records the close the way it came off the wire: a big-endian code, then
+// the reason.
+void captureClose(uint32_t connectionID, WebSocketsContextData *dataProviderGroup) {
+  std::string payload;
+  payload.push_back((char)((dataProviderGroup->codeNumber >> 8) & 0xff));
+  payload.push_back((char)(dataProviderGroup->codeNumber & 0xff));
+  if (dataProviderGroup->reason != nullptr) {
+    payload += *dataProviderGroup->reason;
+  }
+  captureOBSFrame(kOBSCaptureClosed, connectionID, 0, payload.data(), payload.size());
+}
+
+
+#pragma mark - Incoming flow control
+
+// Events whose payload is the complete new state, so that only the newest
+// one in the queue matters.
+static const char *kLatestStateEventTypes[] = {
+  "CurrentProgramSceneChanged",
+  "CurrentPreviewSceneChanged",
+  "CurrentSceneTransitionChanged",
+  "StudioModeStateChanged",
+  "InputVolumeMeters",
+  NULL
+};
+
+// Pulls the top-level "op" and d.eventType out of an obs-websocket JSON
+// message without parsing the whole thing.  Returns false for anything that
+// does not look like one (including fragments of larger messages).
+static bool classifyOBSMessage(const char *text, size_t length, int *op,
+                               std::string *eventType) {
+  int depth = 0;
+  size_t i = 0;
+  *op = -1;
+  eventType->clear();
+
+  while (i < length) {
+    char character = text[i];
+    if (character == '{' || character == '[') {
+      depth++;
+      i++;
+      continue;
+    } else if (character == '}' || character == ']') {
+      depth--;
+      i++;
+      continue;
+    } else if (character != '"') {
+      i++;
+      continue;
+    }
+
+    size_t start = ++i;
+    while (i < length && text[i] != '"') {
+      i += (text[i] == '\\') ? 2 : 1;
+    }
+    if (i >= length) {
+      return false;
+    }
+    size_t keyLength = i++ - start;
+
+    // Only strings followed by a colon are keys.
+    size_t j = i;
+    while (j < length && isspace((unsigned char)text[j])) j++;
+    if (j >= length || text[j] != ':') {
+      continue;
+    }
+    j++;
+    while (j < length && isspace((unsigned char)text[j])) j++;
+
+    if (depth == 1 && keyLength == 2 && memcmp(text + start, "op", 2) == 0) {
+      int value = 0;
+      bool sawDigit = false;
+      while (j < length && isdigit((unsigned char)text[j])) {
+        value = value * 10 + (text[j++] - '0');
+        sawDigit = true;
+      }
+      if (sawDigit) {
+        *op = value;
+      }
+    } else if (depth == 2 && keyLength == 9 && memcmp(text + start, "eventType", 9) == 0 &&
+               j < length && text[j] == '"') {
+      size_t valueStart = j + 1;
+      size_t valueEnd = valueStart;
+      while (valueEnd < length && text[valueEnd] != '"') {
+        valueEnd += (text[valueEnd] == '\\') ? 2 : 1;
+      }
+      if (valueEnd < length) {
+        eventType->assign(text + valueStart, valueEnd - valueStart);
+      }
+    }
+    i = j;
+  }
+  return *op >= 0;
+}
+
+static bool overReceiveLimits(WebSocketsContextData *dataProviderGroup) {
+  DataProvider &incomingData = dataProviderGroup->incomingData;
+  return incomingData.PendingBytes() > dataProviderGroup->receiveLimits.maxBytes ||
+         incomingData.PendingCount() > dataProviderGroup->receiveLimits.maxMessages;
+}
+
+// Queues an incoming message, applying the connection's overload policy.
+// The message has already been read off the socket, so it is always kept;
+// the policy decides what makes room for it.
+void receiveIncomingDataItem(WebSocketsContextData *dataProviderGroup, struct lws *wsi,
+                             WebSocketsDataItem *item) {
+  DataProvider &incomingData = dataProviderGroup->incomingData;
+  OBSReceivePolicy policy = dataProviderGroup->receiveLimits.policy;
+
+  if (!item->IsBinary() && policy != kOBSReceivePolicyPause) {
+    int op;
+    std::string eventType;
+    if (classifyOBSMessage((const char *)item->GetBuf(), item->GetLength(), &op, &eventType) &&
+        op == 5) {
+      item->isEvent = true;
+      for (int i = 0; kLatestStateEventTypes[i] != NULL; i++) {
+        if (eventType == kLatestStateEventTypes[i]) {
+          item->coalesceKey = eventType;
+          break;
+        }
+      }
+    }
+  }
+
+  if (policy == kOBSReceivePolicyCoalesce && !item->coalesceKey.empty() &&
+      overReceiveLimits(dataProviderGroup)) {
+    size_t replacedBytes = incomingData.PendingBytes();
+    if (incomingData.replacePendingData(item)) {
+      std::lock_guard<std::mutex> guard(gStatisticsMutex);
+      gReceiveStatistics.coalescedMessages++;
+      countReceiveDrop(dataProviderGroup->metrics);
+      gReceiveStatistics.droppedBytes += replacedBytes + item->GetLength() -
+                                         incomingData.PendingBytes();
+      return;
+    }
+  }
+
+  incomingData.addPendingData(item);
+
+  if (policy == kOBSReceivePolicyDropOldest) {
+    while (overReceiveLimits(dataProviderGroup)) {
+      WebSocketsDataItem *oldest = incomingData.removeOldestEvent();
+      if (oldest == nullptr) {
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> guard(gStatisticsMutex);
+        gReceiveStatistics.droppedMessages++;
+        gReceiveStatistics.droppedBytes += oldest->GetLength();
+      }
+      countReceiveDrop(dataProviderGroup->metrics);
+      delete oldest;
+    }
+  }
+
+  // Anything the policy could not make room for stops the socket instead,
+  // so nothing more is lost.
+  if (!dataProviderGroup->receivePaused && overReceiveLimits(dataProviderGroup)) {
+    dataProviderGroup->receivePaused = true;
+    {
+      std::lock_guard<std::mutex> guard(gStatisticsMutex);
+      gReceiveStatistics.pauses++;
+    }
+    lws_rx_flow_control(wsi, 0);
+  }
+}
+
+void resumeReceivingIfDrained(WebSocketsContextData *dataProviderGroup) {
+  if (!dataProviderGroup->receivePaused || dataProviderGroup->wsi == nullptr) {
+    return;
+  }
+  DataProvider &incomingData = dataProviderGroup->incomingData;
+  if (incomingData.PendingBytes() <= dataProviderGroup->receiveLimits.resumeBytes &&
+      incomingData.PendingCount() <= dataProviderGroup->receiveLimits.resumeMessages) {
+    dataProviderGroup->receivePaused = false;
+    lws_rx_flow_control(dataProviderGroup->wsi, 1);
+  }
+}
+
+bool validReceiveLimits(const OBSReceiveLimits *limits) {
+  return limits->maxBytes > 0 && limits->maxMessages > 0 &&
+         limits->resumeBytes <= limits->maxBytes &&
+         limits->resumeMessages <= limits->maxMessages &&
+         limits->policy >= kOBSReceivePolicyPause &&
+         limits->policy <= kOBSReceivePolicyCoalesce;
+}
+
+bool setOBSReceiveLimits(const OBSReceiveLimits *limits) {
+  if (!validReceiveLimits(limits)) {
+    OBSLOG(kOBSLogError, "Invalid receive limits.\n");
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(gStatisticsMutex);
+  gDefaultReceiveLimits = *limits;
+  return true;
+}
+
+void getOBSReceiveStatistics(OBSReceiveStatistics *statistics) {
+  std::lock_guard<std::mutex> guard(gStatisticsMutex);
+  *statistics = gReceiveStatistics;
+}
+
+
+#pragma mark - Keepalive
+
+// Called once per pass of the run loop.  Each time a ping is due, the
+// previous one counts as missed if no pong has arrived since.
+void serviceKeepalive(WebSocketsContextData *dataProviderGroup, uint64_t now) {
+  if (dataProviderGroup->keepaliveInterval == 0 || dataProviderGroup->wsi == nullptr ||
+      dataProviderGroup->connectionState != kConnectionStateConnected ||
+      dataProviderGroup->shouldCloseConnection) {
+    return;
+  }
+  if (dataProviderGroup->nextPingTime == 0) {
+    dataProviderGroup->nextPingTime = now + dataProviderGroup->keepaliveInterval;
+    return;
+  }
+  if (now < dataProviderGroup->nextPingTime) {
+    return;
+  }
+  dataProviderGroup->nextPingTime = now + dataProviderGroup->keepaliveInterval;
+
+  if (dataProviderGroup->awaitingPong &&
+      ++dataProviderGroup->missedPongs >= dataProviderGroup->maxMissedPongs) {
+    OBSLOG(kOBSLogWarning, "No pong for %u pings; dropping connection.\n",
+            dataProviderGroup->missedPongs);
+    dataProviderGroup->keepalive.timeouts++;
+    {
+      std::lock_guard<std::mutex> guard(gStatisticsMutex);
+      gKeepaliveStatistics.timeouts++;
+    }
+
+    // A dead link would never finish a close handshake, so kill the socket
+    // outright.  The close callback then takes the usual reconnect path.
+    dataProviderGroup->codeNumber = 1006;
+    if (dataProviderGroup->reason == nullptr) {
+      dataProviderGroup->reason = new std::string("Keepalive timeout");
+    }
+    dataProviderGroup->shouldCloseConnection = true;
+    lws_set_timeout(dataProviderGroup->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+    return;
+  }
+
+  dataProviderGroup->awaitingPong = true;
+  dataProviderGroup->needsPing = true;
+  lws_callback_on_writable(dataProviderGroup->wsi);
+}
+
+static void addRoundTrip(OBSKeepaliveStatistics *statistics, uint64_t roundTrip) {
+  int bucket = 0;
+  while (bucket < kOBSRoundTripHistogramBuckets - 1 &&
+         roundTrip >= ((uint64_t)kOBSRoundTripHistogramBase << bucket)) {
+    bucket++;
+  }
+  statistics->histogram[bucket]++;
+
+  if (statistics->pongsReceived == 0) {
+    statistics->minRoundTrip = roundTrip;
+    statistics->maxRoundTrip = roundTrip;
+    statistics->smoothedRoundTrip = roundTrip;
+  } else {
+    statistics->minRoundTrip = MIN(statistics->minRoundTrip, roundTrip);
+    statistics->maxRoundTrip = MAX(statistics->maxRoundTrip, roundTrip);
+    // Same smoothing as TCP's SRTT (RFC 6298): 7/8 old, 1/8 new.
+    statistics->smoothedRoundTrip = (7 * statistics->smoothedRoundTrip + roundTrip) / 8;
+  }
+  statistics->lastRoundTrip = roundTrip;
+  statistics->totalRoundTrip += roundTrip;
+  statistics->pongsReceived++;
+}
+
+void recordRoundTrip(WebSocketsContextData *dataProviderGroup, uint64_t roundTrip) {
+  addRoundTrip(&dataProviderGroup->keepalive, roundTrip);
+  std::lock_guard<std::mutex> guard(gStatisticsMutex);
+  addRoundTrip(&gKeepaliveStatistics, roundTrip);
+}
+
+bool setOBSKeepalive(uint32_t intervalMilliseconds, uint32_t maxMissedPongs) {
+  if (intervalMilliseconds != 0 && maxMissedPongs == 0) {
+    return false;
+  }
+  gDefaultKeepaliveInterval = (uint64_t)intervalMilliseconds * 1000;
+  gDefaultMaxMissedPongs = maxMissedPongs;
+  return true;
+}
+
+void getOBSKeepaliveStatistics(OBSKeepaliveStatistics *statistics) {
+  std::lock_guard<std::mutex> guard(gStatisticsMutex);
+  *statistics = gKeepaliveStatistics;
+}
+
+// setWebSocketKeepalive(connectionID, intervalMilliseconds, maxMissedPongs)
+// Returns false if the values are invalid or the connection is gone.
+void setWebSocketKeepalive(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
+  uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
+
+  double interval = args[1]->NumberValue(context).FromMaybe(-1);
+  double maxMissedPongs = args[2]->NumberValue(context).FromMaybe(-1);
+  if (!(interval >= 0) || !(maxMissedPongs >= 0) || interval > UINT32_MAX ||
+      maxMissedPongs > UINT32_MAX || (interval > 0 && maxMissedPongs < 1)) {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    args.GetReturnValue().Set(false);
+    return;
+  }
+  dataProviderGroup->keepaliveInterval = (uint64_t)interval * 1000;
+  dataProviderGroup->maxMissedPongs = (uint32_t)maxMissedPongs;
+  dataProviderGroup->nextPingTime = 0;
+  args.GetReturnValue().Set(true);
+}
+
+static void setNumberProperty(v8::Isolate *isolate, v8::Local<v8::Object> object,
+                              const char *name, double value) {
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  object->Set(context, v8::String::NewFromUtf8(isolate, name).ToLocalChecked(),
+              v8::Number::New(isolate, value)).Check();
+}
+
+// getWebSocketRoundTripStatistics(connectionID)
+// Returns the connection's keepalive statistics, with times in
+// milliseconds, or undefined if the connection is gone.
+void getWebSocketRoundTripStatistics(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate *isolate = args.GetIsolate();
+  v8::HandleScope scope(isolate);
+  v8::Local<v8::Context> context = isolate->GetCurrentContext();
+  v8::Handle<v8::Uint32> connectionIDV8 = v8::Handle<v8::Uint32>::Cast(args[0]);
+  uint32_t connectionID = connectionIDV8->Uint32Value(context).ToChecked();
+
+  std::lock_guard<std::recursive_mutex> guard(tInstance->connectionMutex);
+  WebSocketsContextData *dataProviderGroup = findConnection(connectionID);
+  if (dataProviderGroup == nullptr) {
+    return;
+  }
+  const OBSKeepaliveStatistics &keepalive = dataProviderGroup->keepalive;
+  bool hasSamples = keepalive.pongsReceived > 0;
+  double noSample = std::numeric_limits<double>::quiet_NaN();
+
+  v8::Local<v8::Object> result = v8::Object::New(isolate);
+  setNumberProperty(isolate, result, "pingsSent", (double)keepalive.pingsSent);
+  setNumberProperty(isolate, result, "pongsReceived", (double)keepalive.pongsReceived);
+  setNumberProperty(isolate, result, "missedPongs", (double)dataProviderGroup->missedPongs);
+  setNumberProperty(isolate, result, "last",
+                    hasSamples ? keepalive.lastRoundTrip / 1000.0 : noSample);
+  setNumberProperty(isolate, result, "smoothed",
+                    hasSamples ? keepalive.smoothedRoundTrip / 1000.0 : noSample);
+  setNumberProperty(isolate, result, "min",
+                    hasSamples ? keepalive.minRoundTrip / 1000.0 : noSample);
+  setNumberProperty(isolate, result, "max",
+                    hasSamples ? keepalive.maxRoundTrip / 1000.0 : noSample);
+  setNumberProperty(isolate, result, "mean",
+                    hasSamples ? keepalive.totalRoundTrip / 1000.0 / keepalive.pongsReceived
+                               : noSample);
+
+  // One entry per bucket: { upperBound (ms, Infinity for the last), count }.
+  v8::Local<v8::Array> histogram = v8::Array::New(isolate, kOBSRoundTripHistogramBuckets);
+  for (int i = 0; i < kOBSRoundTripHistogramBuckets; i++) {
+    v8::Local<v8::Object> bucket = v8::Object::New(isolate);
+    double upperBound = (i == kOBSRoundTripHistogramBuckets - 1) ?
+        std::numeric_limits<double>::infinity() :
+        ((uint64_t)kOBSRoundTripHistogramBase << i) / 1000.0;
+    setNumberProperty(isolate, bucket, "upperBound", upperBound);
+    setNumberProperty(isolate, bucket, "count", (double)keepalive.histogram[i]);
+    histogram->Set(context, (uint32_t)i, bucket).Check();
+  }
+  result->Set(context, v8::String::NewFromUtf8(isolate, "histogram").ToLocalChecked(),
+              histogram).Check();
+
+  args.GetReturnValue().Set(result);
+}
+
+
+#pragma mark - Compression
+
+void getDefaultOBSCompressionOptions(OBSCompressionOptions *options) {
+  options->enabled = true;
+  options->clientMaxWindowBits = 15;
+  options->serverMaxWindowBits = 15;
+  options->clientNoContextTakeover = false;
+  options->serverNoContextTakeover = false;
+  options->compressionLevel = 6;
+  options->memoryLevel = 8;
+}
+
+bool setOBSCompressionOptions(const OBSCompressionOptions *options) {
+  // zlib silently turns an 8-bit deflate window into 9 bits, which breaks
+  // peers that took the 8 literally, so 9 is the smallest we allow.
+  if (options->clientMaxWindowBits < 9 || options->clientMaxWindowBits > 15 ||
+      options->serverMaxWindowBits < 9 || options->serverMaxWindowBits > 15 ||
+      options->compressionLevel < 1 || options->compressionLevel > 9 ||
+      options->memoryLevel < 1 || options->memoryLevel > 9) {
+    OBSLOG(kOBSLogError, "Invalid compression options.\n");
+    return false;
+  }
+#ifndef SUPPORT_DEFLATE
+  if (options->enabled) {
+    OBSLOG(kOBSLogError, "libwebsockets was built without extension support.\n");
+    return false;
+  }
+#endif
+
+  gCompressionOptions = *options;
+  gDeflateOffer.clear();  // Rebuilt on the next connection.
+  return true;
+}
+
+// Returns the extension list for a new lws context, or NULL if compression
+// is off.  The offer string lists every parameter we want; lws parses the
+// server's reply and adopts whatever it accepted.
+const struct lws_extension *supportedExtensions(void) {
+#ifdef SUPPORT_DEFLATE
+  static struct lws_extension extensions[2];
+
+  if (!gCompressionOptions.enabled) {
+    return NULL;
+  }
+  if (gDeflateOffer.empty()) {
+    gDeflateOffer = "permessage-deflate";
+    if (gCompressionOptions.clientNoContextTakeover) {
+      gDeflateOffer += "; client_no_context_takeover";
+    }
+    if (gCompressionOptions.serverNoContextTakeover) {
+      gDeflateOffer += "; server_no_context_takeover";
+    }
+    if (gCompressionOptions.serverMaxWindowBits < 15) {
+      gDeflateOffer += "; server_max_window_bits=" +
+          std::to_string(gCompressionOptions.serverMaxWindowBits);
+    }
+    // A bare client_max_window_bits tells the server that it may limit our
+    // window; a value tells it that we already do.
+    gDeflateOffer += "; client_max_window_bits";
+    if (gCompressionOptions.clientMaxWindowBits < 15) {
+      gDeflateOffer += "=" + std::to_string(gCompressionOptions.clientMaxWindowBits);
+    }
+  }
+
+  extensions[0] = { "permessage-deflate", lws_extension_callback_pm_deflate,
+                    gDeflateOffer.c_str() };
+  extensions[1] = { NULL, NULL, NULL /* terminator */ };
+  return extensions;
+#else
+  return NULL;
+#endif
+}
+
+// The handshake cannot carry zlib's level and memory settings, so set them
+// once the extension is active.  The compressor is created lazily on the
+// first send, so this is early enough.
+void applyCompressionLevel(struct lws *wsi) {
+#ifdef SUPPORT_DEFLATE
+  if (!gCompressionOptions.enabled) {
+    return;
+  }
+  std::string level = std::to_string(gCompressionOptions.compressionLevel);
+  std::string memoryLevel = std::to_string(gCompressionOptions.memoryLevel);
+  lws_set_extension_option(wsi, "permessage-deflate", "compression_level", level.c_str());
+  lws_set_extension_option(wsi, "permessage-deflate", "mem_level", memoryLevel.c_str());
+#endif
+}
+
+
+#pragma mark - Instances
+
+bool setOBSTallyWorkerThreads(int count) {
+  std::lock_guard<std::mutex> guard(gWorkersMutex);
+  if (count < 0 || !gWorkers.empty()) {
+    return false;
+  }
+  gWorkerThreadCount = count;
+  return true;
+}
+
+// Ends the worker's wait, whether on its queues or in lws_service().
+static void wakeWorker(TallyWorker *worker) {
+  worker->changed.notify_all();
+  struct lws_context *context = worker->context.load(std::memory_order_acquire);
+  if (context != nullptr) {
+    lws_cancel_service(context);
+  }
+}
+
+static void setUpInstance(OBSTallyInstance *instance) {
+  newInstanceIsolate(instance);
+  {
+    InstanceScope scope(instance);
+    _loadOBSTallyScripts();
+  }
+  instance->worker->instances.push_back(instance);
+}
+
+// Frees everything the worker's thread holds for the instance.  Its
+// sockets are killed; lws frees their ConnectionRefs once it gets to them.
+static void tearDownInstance(OBSTallyInstance *instance) {
+  std::vector<OBSTallyInstance *> &instances = instance->worker->instances;
+  instances.erase(std::remove(instances.begin(), instances.end(), instance), instances.end());
+
+  {
+    InstanceScope scope(instance);
+    std::lock_guard<std::recursive_mutex> guard(instance->connectionMutex);
+
+    for (std::pair<uint32_t, WebSocketsContextData *> element : instance->connectionData) {
+      WebSocketsContextData *connection = element.second;
+      if (connection->wsi != nullptr) {
+        lws_set_timeout(connection->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+      }
+      if (connection->jsObject != nullptr) {
+        connection->jsObject->Reset();
+      }
+      removeConnectionMetrics(element.first);
+      delete connection;
+    }
+    instance->connectionData.clear();
+
+    for (ConnectionRef *connectionRef : instance->connectionRefs) {
+      connectionRef->instance = nullptr;
+    }
+    instance->connectionRefs.clear();
+
+    for (std::pair<uint32_t, OBSRequestBatch *> element : instance->pendingRequestBatches) {
+      failOBSRequestBatch(element.second, "Instance destroyed");
+    }
+    instance->pendingRequestBatches.clear();
+  }
+
+  instance->context.Reset();
+  instance->isolate->Dispose();
+  freeHeapControlState(instance->heapControl);
+  delete instance->arrayBufferAllocator;
+}
+
+static void runTallyWorker(TallyWorker *worker) {
+  setTraceThreadName(worker->name);
+
+  // Up front, so that wakeWorker() can always reach it.
+  workerContext(worker);
+
+  while (true) {
+    std::vector<OBSTallyInstance *> arriving;
+    std::vector<OBSTallyInstance *> leaving;
+    {
+      std::unique_lock<std::mutex> lock(worker->mutex);
+
+      // An idle worker sleeps, unless it services the metrics server.
+      worker->changed.wait(lock, [worker] {
+        return !worker->instances.empty() || !worker->arriving.empty() ||
+               !worker->leaving.empty() || gServiceWorker.load() == worker;
+      });
+      arriving.swap(worker->arriving);
+      leaving.swap(worker->leaving);
+    }
+
+    for (OBSTallyInstance *instance : arriving) {
+      setUpInstance(instance);
+    }
+    for (OBSTallyInstance *instance : leaving) {
+      tearDownInstance(instance);
+
+      std::lock_guard<std::mutex> guard(worker->mutex);
+      instance->tornDown = true;
+      worker->changed.notify_all();
+    }
+
+    TraceSpan span("worker pass");
+    runWorkerPass(worker);
+  }
+}
+
+// Starts another worker while the pool is below its size and every worker
+// has an instance; otherwise picks the one with the fewest.
+static TallyWorker *leastLoadedWorker(void) {
+  std::lock_guard<std::mutex> guard(gWorkersMutex);
+
+  size_t threadCount = (size_t)gWorkerThreadCount;
+  if (threadCount == 0) {
+    threadCount = MIN(MAX(std::thread::hardware_concurrency(), 1u), 4u);
+  }
+
+  TallyWorker *leastLoaded = nullptr;
+  for (TallyWorker *worker : gWorkers) {
+    if (leastLoaded == nullptr || worker->load < leastLoaded->load) {
+      leastLoaded = worker;
+    }
+  }
+  if (gWorkers.size() < threadCount && (leastLoaded == nullptr || leastLoaded->load > 0)) {
+    leastLoaded = new TallyWorker();
+    snprintf(leastLoaded->name, sizeof(leastLoaded->name), "OBS worker %zu",
+             gWorkers.size() + 1);
+    gWorkers.push_back(leastLoaded);
+    std::thread(runTallyWorker, leastLoaded).detach();
+  }
+  leastLoaded->load++;
+  return leastLoaded;
+}
+
+OBSTallyInstance *obsTallyCreate(const char *URL, const char *password,
+                                 const OBSTallyCallbacks *callbacks) {
+  if (URL == NULL) {
+    OBSLOG(kOBSLogError, "obsTallyCreate() needs a URL.\n");
+    return NULL;
+  }
+  initializeV8();
+
+  OBSTallyInstance *instance = new OBSTallyInstance();
+  instance->URL = URL;
+  instance->password = (password != NULL) ? password : "";
+  if (callbacks != NULL) {
+    instance->callbacks = *callbacks;
+  }
+
+  TallyWorker *worker = leastLoadedWorker();
+  instance->worker = worker;
+  {
+    std::lock_guard<std::mutex> guard(worker->mutex);
+    worker->arriving.push_back(instance);
+  }
+  wakeWorker(worker);
+  return instance;
+}
+
+void obsTallyDestroy(OBSTallyInstance *instance) {
+  if (instance == NULL || instance->isDefault) {
+    return;
+  }
+  TallyWorker *worker = instance->worker;
+  {
+    std::lock_guard<std::mutex> guard(worker->mutex);
+    worker->leaving.push_back(instance);
+  }
+  wakeWorker(worker);
+  {
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    worker->changed.wait(lock, [instance] { return instance->tornDown; });
+  }
+  {
+    std::lock_guard<std::mutex> guard(gWorkersMutex);
+    worker->load--;
+  }
+  delete instance;
+}
+
+
+#pragma mark - Runtime profile
+
+bool setOBSRuntimeProfile(OBSRuntimeProfile profile) {
+  if (profile != kOBSRuntimeProfileDefault && profile != kOBSRuntimeProfileLowMemory) {
+    OBSLOG(kOBSLogError, "Unknown runtime profile %d.\n", (int)profile);
+    return false;
+  }
+  const RuntimeProfileSettings *settings = &kRuntimeProfiles[profile];
+
+  gRuntimeProfile = profile;
+  gReceiveBufferSize = settings->receiveBufferSize;
+  setOBSHeapLimits(&settings->heapLimits);
+  setOBSIdleGC(20, 2, settings->memoryPressureMilliseconds);
+  setOBSReceiveLimits(&settings->receiveLimits);
+  setOBSSendLimits(settings->highWatermark, settings->lowWatermark, gDefaultSendPolicy);
+
+  // Directly, since setOBSCompressionOptions() refuses any change while
+  // compression is on in a libwebsockets built without extensions.
+  gCompressionOptions.clientMaxWindowBits = settings->compressionWindowBits;
+  gCompressionOptions.serverMaxWindowBits = settings->compressionWindowBits;
+  gCompressionOptions.memoryLevel = settings->compressionMemoryLevel;
+  gDeflateOffer.clear();
+  return true;
 }
 
 
@@ -1233,6 +3719,14 @@ DataProvider::DataProvider(const char *name) {
   this->name = name;
 }
 
+// Frees anything still queued when the connection goes away.
+DataProvider::~DataProvider(void) {
+  WebSocketsDataItem *item;
+  while (this->getPendingData(&item)) {
+    delete item;
+  }
+}
+
 void DataProvider::SetWSI(struct lws *wsi) {
   WSIDEBUG("DataProvider: Setting WSI to 0x%p for 0x%p\n", wsi, this);
   this->wsi = wsi;
@@ -1242,22 +3736,21 @@ void DataProvider::addPendingData(WebSocketsDataItem *item) {
   std::lock_guard<std::recursive_mutex> guard(this->mutex);
 
   websocketsDataItemChain_t *chainItem =
-      (websocketsDataItemChain_t *)malloc(sizeof(websocketsDataItemChain_t));
+      (websocketsDataItemChain_t *)bufferPoolAllocate(sizeof(websocketsDataItemChain_t));
   chainItem->item = item;
   chainItem->next = nullptr;
 
-  if (this->firstItem == nullptr) {
+  if (this->lastItem == nullptr) {
     this->firstItem = chainItem;
   } else {
-    websocketsDataItemChain_t *position = this->firstItem;
-    while (position && position->next) {
-      position = position->next;
-    }
-    position->next = chainItem;
+    this->lastItem->next = chainItem;
   }
+  this->lastItem = chainItem;
+  this->pendingBytes += item->GetLength();
+  this->pendingCount++;
 
-  GENERALDEBUG("Appended to provider %s.  Queue length now %d\n",
-               this->name, this->PendingBytes());
+  GENERALDEBUG("Appended to provider %s.  Queue length now %zu\n",
+               this->name, this->pendingBytes);
 
   if (this->wsi != nullptr) {
     GENERALDEBUG("Requesting callback on writable.\n");
@@ -1276,21 +3769,88 @@ bool DataProvider::getPendingData(WebSocketsDataItem **returnItem) {
   }
   *returnItem = chainItem->item;
   this->firstItem = chainItem->next;
+  if (this->firstItem == nullptr) {
+    this->lastItem = nullptr;
+  }
+  this->pendingBytes -= chainItem->item->GetLength();
+  this->pendingCount--;
+
+  bufferPoolFree(chainItem);
+
+  return true;
+}
 
-  free(chainItem);
+bool DataProvider::replacePendingData(WebSocketsDataItem *item) {
+  std::lock_guard<std::recursive_mutex> guard(this->mutex);
+
+  websocketsDataItemChain_t *match = nullptr;
+  websocketsDataItemChain_t *matchPrevious = nullptr;
+  websocketsDataItemChain_t *previous = nullptr;
+  for (websocketsDataItemChain_t *chainItem = this->firstItem; chainItem;
+       previous = chainItem, chainItem = chainItem->next) {
+    if (chainItem->item->coalesceKey == item->coalesceKey) {
+      match = chainItem;
+      matchPrevious = previous;
+    }
+  }
+  if (match == nullptr) {
+    return false;
+  }
+
+  // Move the node to the tail.
+  if (match != this->lastItem) {
+    if (matchPrevious == nullptr) {
+      this->firstItem = match->next;
+    } else {
+      matchPrevious->next = match->next;
+    }
+    match->next = nullptr;
+    this->lastItem->next = match;
+    this->lastItem = match;
+  }
 
+  this->pendingBytes -= match->item->GetLength();
+  this->pendingBytes += item->GetLength();
+  delete match->item;
+  match->item = item;
   return true;
 }
 
-uint32_t DataProvider::PendingBytes(void) {
+WebSocketsDataItem *DataProvider::removeOldestEvent(void) {
   std::lock_guard<std::recursive_mutex> guard(this->mutex);
 
-  uint32_t pendingBytes = 0;
-  for (websocketsDataItemChain_t *chainItem = this->firstItem; chainItem; chainItem = chainItem->next) {
-    pendingBytes = chainItem->item->GetLength();
+  websocketsDataItemChain_t *previous = nullptr;
+  for (websocketsDataItemChain_t *chainItem = this->firstItem; chainItem;
+       previous = chainItem, chainItem = chainItem->next) {
+    if (!chainItem->item->isEvent) {
+      continue;
+    }
+    if (previous == nullptr) {
+      this->firstItem = chainItem->next;
+    } else {
+      previous->next = chainItem->next;
+    }
+    if (this->lastItem == chainItem) {
+      this->lastItem = previous;
+    }
+
+    WebSocketsDataItem *item = chainItem->item;
+    this->pendingBytes -= item->GetLength();
+    this->pendingCount--;
+    bufferPoolFree(chainItem);
+    return item;
   }
+  return nullptr;
+}
 
-  return pendingBytes;
+size_t DataProvider::PendingBytes(void) {
+  std::lock_guard<std::recursive_mutex> guard(this->mutex);
+  return this->pendingBytes;
+}
+
+size_t DataProvider::PendingCount(void) {
+  std::lock_guard<std::recursive_mutex> guard(this->mutex);
+  return this->pendingCount;
 }
 
 
@@ -1301,7 +3861,15 @@ size_t WebSocketsDataItem::GetLength() {
 }
 
 uint8_t * WebSocketsDataItem::GetBuf() {
-  return this->rawBuf;
+  return this->rawBuf + this->rawHeadroom;
+}
+
+// Only valid for items without headroom (incoming data).
+uint8_t * WebSocketsDataItem::ReleaseBuf() {
+  uint8_t *buf = this->rawBuf;
+  this->rawBuf = NULL;
+  this->rawLength = 0;
+  return buf;
 }
 
 bool WebSocketsDataItem::IsBinary() {
@@ -1310,15 +3878,22 @@ bool WebSocketsDataItem::IsBinary() {
 
 WebSocketsDataItem::WebSocketsDataItem(uint8_t *buf, size_t length, bool isBinary) {
 
-  this->rawBuf = (uint8_t *)malloc(length);
+  this->rawBuf = (uint8_t *)bufferPoolAllocate(length);
   this->rawLength = length;
   this->rawIsBinary = isBinary;
 
   bcopy(buf, this->rawBuf, length);
 }
 
+WebSocketsDataItem::WebSocketsDataItem(size_t length, bool isBinary, size_t headroom) {
+  this->rawBuf = (uint8_t *)bufferPoolAllocate(headroom + length);
+  this->rawLength = length;
+  this->rawHeadroom = headroom;
+  this->rawIsBinary = isBinary;
+}
+
 WebSocketsDataItem::~WebSocketsDataItem(void) {
-  free(this->rawBuf);
+  bufferPoolFree(this->rawBuf);
 }
 
 
@@ -1330,6 +3905,15 @@ WebSocketsContextData::WebSocketsContextData(v8::Persistent<v8::Object> *jsObjec
   this->jsObject = jsObject;
   this->protocols = protocols;
   this->isolate = isolate;
+  this->highWatermark = gDefaultHighWatermark;
+  this->lowWatermark = gDefaultLowWatermark;
+  this->sendPolicy = gDefaultSendPolicy;
+  {
+    std::lock_guard<std::mutex> guard(gStatisticsMutex);
+    this->receiveLimits = gDefaultReceiveLimits;
+  }
+  this->keepaliveInterval = gDefaultKeepaliveInterval;
+  this->maxMissedPongs = gDefaultMaxMissedPongs;
 }
 
 WebSocketsContextData::~WebSocketsContextData(void) {
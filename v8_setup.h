@@ -7,6 +7,8 @@ void setOBSURL(char *URL);
 void setOBSPassword(char *password);
 void *v8_setup(void);  // Returns isolate cast to void pointer.
 void runScript(char *scriptString);
+void runNamedScript(const char *scriptName, char *scriptString);
+void runStaticScript(const char *scriptName, char *scriptString);  // Built-in scripts.
 bool runScriptAsModule(char *moduleName, char *scriptString);
 void v8_runLoopCallback(void *isolate);
 void v8_teardown(void);
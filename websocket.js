@@ -1,12 +1,27 @@
 
 var WebSocket_enable_debugging = false;
 
+// Levels match OBSLogLevel.
+const kLogDebug = 0;
+const kLogInfo = 1;
+const kLogWarning = 2;
+const kLogError = 3;
+
 const console = {
+  debug: (message) => {
+    logMessage(message, kLogDebug);
+  },
   log: (message) => {
-    logMessage(message);
+    logMessage(message, kLogInfo);
+  },
+  info: (message) => {
+    logMessage(message, kLogInfo);
+  },
+  warn: (message) => {
+    logMessage(message, kLogWarning);
   },
   error: (message) => {
-    logMessage(message);
+    logMessage(message, kLogError);
   }
 }
 
@@ -22,6 +37,58 @@ class Event {
   }
 }
 
+// Just enough of Blob for binary WebSocket messages.  Parts may be
+// ArrayBuffers, typed arrays, DataViews, or other Blobs.
+class Blob {
+  constructor(parts = [], options = {}) {
+    var length = 0;
+    var views = new Array();
+    for (const part of parts) {
+      var view;
+      if (part instanceof ArrayBuffer) {
+        view = new Uint8Array(part);
+      } else if (ArrayBuffer.isView(part)) {
+        view = new Uint8Array(part.buffer, part.byteOffset, part.byteLength);
+      } else if (part instanceof Blob) {
+        view = part.internal_bytes;
+      } else {
+        throw new TypeError("Unsupported Blob part");
+      }
+      views.push(view);
+      length += view.byteLength;
+    }
+
+    if (views.length == 1) {
+      // Share the caller's storage rather than copying it.
+      this.internal_bytes = views[0];
+    } else {
+      this.internal_bytes = new Uint8Array(length);
+      var offset = 0;
+      for (const view of views) {
+        this.internal_bytes.set(view, offset);
+        offset += view.byteLength;
+      }
+    }
+    this.type = options.type ? String(options.type).toLowerCase() : "";
+  }
+
+  get size() {
+    return this.internal_bytes.byteLength;
+  }
+
+  arrayBuffer() {
+    const bytes = this.internal_bytes;
+    if (bytes.byteOffset == 0 && bytes.byteLength == bytes.buffer.byteLength) {
+      return Promise.resolve(bytes.buffer);
+    }
+    return Promise.resolve(bytes.slice().buffer);
+  }
+
+  slice(start = 0, end = this.size, contentType = "") {
+    return new Blob([this.internal_bytes.subarray(start, end)], { type: contentType });
+  }
+}
+
 class WebSocket {
   constructor(url, protocols = "websocket") {
     if (WebSocket_enable_debugging) logMessage("Constructor called.\n");
@@ -62,11 +129,13 @@ class WebSocket {
     this.messageEventListeners = new Array();
     this.closeEventListeners = new Array();
     this.errorEventListeners = new Array();
+    this.drainEventListeners = new Array();
 
     this.openHandler = undefined;
     this.messageHandler = undefined;
     this.errorHandler = undefined;
     this.closeHandler = undefined;
+    this.drainHandler = undefined;
   }
 
   get onopen() {
@@ -131,6 +200,17 @@ class WebSocket {
     this.messageHandler = handler;
   }
 
+  // Non-standard: fires when the outgoing queue falls back to its low
+  // watermark after reaching its high watermark.  See setSendLimits().
+  get ondrain() {
+    return this.drainHandler;
+  }
+
+  set ondrain(handler) {
+    if (WebSocket_enable_debugging) logMessage("@@@ set ondrain called");
+    this.drainHandler = handler;
+  }
+
   set onOpen(handler) {
     if (WebSocket_enable_debugging) logMessage("@@@ set onOpen called");
     this.openHandler = handler;
@@ -143,15 +223,17 @@ class WebSocket {
 
   callHandlers(handler, eventListeners, event) {
     if (handler) handler(event);
-    for (var listener in eventListeners) {
+    for (const listener of eventListeners) {
       listener(event);
     }
   }
 
   addEventListener(type, callback, options) {
     if (WebSocket_enable_debugging) logMessage("@@@ addEventListener called");
-    var newcallback = callback;
-    assert(!options.once, "One-shot event listeners are NOT supported.");
+    if (options && options.once) {
+      logMessage("One-shot event listeners are not supported.", kLogWarning);
+      return;
+    }
     if (type == "open") {
       this.openEventListeners.push(callback);
     } else if (type == "message") {
@@ -160,19 +242,23 @@ class WebSocket {
       this.errorEventListeners.push(callback);
     } else if (type == "close") {
       this.closeEventListeners.push(callback);
+    } else if (type == "drain") {
+      this.drainEventListeners.push(callback);
     }
   }
 
   removeEventListener(type, callback, options) {
     if (WebSocket_enable_debugging) logMessage("@@@ removeEventListener called");
     if (type == "open") {
-      this.openEventListeners.words.filter(value => value != callback);
+      this.openEventListeners = this.openEventListeners.filter(value => value != callback);
     } else if (type == "message") {
-      this.messageEventListeners.filter(value => value != callback);
+      this.messageEventListeners = this.messageEventListeners.filter(value => value != callback);
     } else if (type == "error") {
-      this.errorEventListeners.filter(value => value != callback);
+      this.errorEventListeners = this.errorEventListeners.filter(value => value != callback);
     } else if (type == "close") {
-      this.closeEventListeners.filter(value => value != callback);
+      this.closeEventListeners = this.closeEventListeners.filter(value => value != callback);
+    } else if (type == "drain") {
+      this.drainEventListeners = this.drainEventListeners.filter(value => value != callback);
     }
   }
 
@@ -186,10 +272,15 @@ class WebSocket {
         this.callHandlers(this.errorHandler, this.errorEventListeners, event);
     } else if (event.type == "close") {
         this.callHandlers(this.closeHandler, this.closeEventListeners, event);
+    } else if (event.type == "drain") {
+        this.callHandlers(this.drainHandler, this.drainEventListeners, event);
     }
   }
 
-  send(data) {
+  // options.coalesceKey (non-standard) lets the "coalesce" send policy
+  // replace an older queued message with the same key.  Throws if the send
+  // policy refuses the message; wait for a drain event and try again.
+  send(data, options = {}) {
     if (WebSocket_enable_debugging) logMessage("@@@ send called with payload: " + data);
     if (this.readyState == this.CONNECTING) {
       exception = new DOMException();
@@ -199,7 +290,49 @@ class WebSocket {
       throw exception;
       return;
     }
-    sendWebSocketData(this.internal_connection_id, data);
+    sendWebSocketData(this.internal_connection_id, data, options.coalesceKey);
+  }
+
+  // Non-standard.  policy is "queue", "reject", or "coalesce".
+  setSendLimits(highWatermark, lowWatermark, policy) {
+    if (!setWebSocketSendLimits(this.internal_connection_id, highWatermark,
+                                lowWatermark, policy)) {
+      throw new RangeError("Invalid send limits");
+    }
+  }
+
+  // Non-standard.  Caps the messages waiting for JavaScript to handle them.
+  // policy is "pause" (stop reading until the queue falls to the resume
+  // limits), "drop-oldest" (discard the oldest events, never responses), or
+  // "coalesce" (keep only the newest of each state-change event).
+  setReceiveLimits(maxBytes, maxMessages, resumeBytes, resumeMessages, policy) {
+    if (!setWebSocketReceiveLimits(this.internal_connection_id, maxBytes, maxMessages,
+                                   resumeBytes, resumeMessages, policy)) {
+      throw new RangeError("Invalid receive limits");
+    }
+  }
+
+  // Non-standard.  Sends a ping every intervalMilliseconds (0 for never) and
+  // drops the connection after maxMissedPongs unanswered pings in a row.
+  setKeepalive(intervalMilliseconds, maxMissedPongs) {
+    if (!setWebSocketKeepalive(this.internal_connection_id, intervalMilliseconds,
+                               maxMissedPongs)) {
+      throw new RangeError("Invalid keepalive settings");
+    }
+  }
+
+  // Non-standard.  Ping round-trip times in milliseconds: last, smoothed,
+  // min, max, and mean (NaN until the first pong), plus pingsSent,
+  // pongsReceived, missedPongs, and a histogram of { upperBound, count }
+  // buckets.  Undefined once the connection is gone.
+  getRoundTripStatistics() {
+    return getWebSocketRoundTripStatistics(this.internal_connection_id);
+  }
+
+  // Non-standard.  The smoothed round-trip time in milliseconds, or NaN.
+  get roundTripTime() {
+    var statistics = getWebSocketRoundTripStatistics(this.internal_connection_id);
+    return statistics ? statistics.smoothed : NaN;
   }
 
   close(code, reason) {
@@ -209,6 +342,9 @@ class WebSocket {
 
   _connectionDidReceiveData(data) {
     if (WebSocket_enable_debugging) logMessage("@@@ _connectionDidReceiveData called");
+    if ((data instanceof ArrayBuffer) && this.internal_binary_type == "blob") {
+      data = new Blob([data]);
+    }
     this._deliverMessage(data, this.url);
   }
 
@@ -224,6 +360,15 @@ class WebSocket {
     this.callHandlers(this.closeHandler, this.closeEventListeners, event);
   }
 
+  _connectionDidDrain() {
+    if (WebSocket_enable_debugging) logMessage("_connectionDidDrain called");
+
+    var event = new Event("drain");
+    event.bufferedAmount = this.bufferedAmount;
+    event.lastEventId = this.lastEventID++;
+    this.callHandlers(this.drainHandler, this.drainEventListeners, event);
+  }
+
   _didReceiveError() {
     if (WebSocket_enable_debugging) logMessage("_didReceiveError called");
 
@@ -267,8 +412,10 @@ class WebSocket {
 
   set binaryType(newBinaryType) {
     if (WebSocket_enable_debugging) logMessage("set binaryType called");
-    this.internal_binary_type = newBinaryType;
-    setWebSocketBinaryType(this.internal_connection_id, newBinaryType);
+    // Per the spec, unsupported values are ignored.
+    if (setWebSocketBinaryType(this.internal_connection_id, newBinaryType)) {
+      this.internal_binary_type = newBinaryType;
+    }
   }
 
   get bufferedAmount() {
@@ -284,7 +431,7 @@ class WebSocket {
   get protocol() {
     if (WebSocket_enable_debugging) logMessage("get protocol called.");
     var protocol = getWebSocketActiveProtocol(this.internal_connection_id);
-    logMessage("get protocol called.  Returning "+protocol);
+    logMessage("get protocol called.  Returning "+protocol, kLogDebug);
     return protocol;
   }
 }